@@ -659,6 +659,22 @@
  *                         dav_find_attr().
  * 20200705.2 (2.5.1-dev)  Add dav_liveprop_elem structure and
  *                         DAV_PROP_ELEMENT key.
+ * 20200705.3 (2.5.1-dev)  Add enable_io_uring to core_server_config.
+ * 20200705.4 (2.5.1-dev)  Add ap_acquire_buffer(), ap_release_buffer() and
+ *                         ap_buffer_bucket_create().
+ * 20200705.5 (2.5.1-dev)  Add ap_setup_merge_cache().
+ * 20200705.6 (2.5.1-dev)  Add sec_url_trie to core_server_config and
+ *                         ap_setup_location_trie().
+ * 20200705.7 (2.5.1-dev)  Add ap_vhost_lookup_name().
+ * 20200705.8 (2.5.1-dev)  Add ap_request_var_id(), ap_request_table_get()
+ *                         and var_memo to core_request_config.
+ * 20200705.9 (2.5.1-dev)  Add ap_header_id_e, ap_request_header_in()
+ *                         and ap_request_table_index().
+ * 20200705.10 (2.5.1-dev) Add idle to proxy_conn_pool and cp_hits, cp_misses,
+ *                         cp_created and cp_reaped to proxy_worker_shared.
+ * 20200705.11 (2.5.1-dev) Add proxy hooks take_backend and park_backend.
+ * 20200705.12 (2.5.1-dev) Add ap_proxy_suspend_request() and
+ *                         ap_proxy_post_suspended_request() to mod_proxy.h.
  */
 
 #define MODULE_MAGIC_COOKIE 0x41503235UL /* "AP25" */
@@ -666,7 +682,7 @@
 #ifndef MODULE_MAGIC_NUMBER_MAJOR
 #define MODULE_MAGIC_NUMBER_MAJOR 20200705
 #endif
-#define MODULE_MAGIC_NUMBER_MINOR 2             /* 0...n */
+#define MODULE_MAGIC_NUMBER_MINOR 12            /* 0...n */
 
 /**
  * Determine if the server's current MODULE_MAGIC_NUMBER is at least a
@@ -440,6 +440,9 @@ typedef struct {
     /** Should addition of charset= be suppressed for this request?
      */
     int suppress_charset;
+
+    /** The memo of ap_request_table_get() */
+    struct ap_request_var_memo *var_memo;
 } core_request_config;
 
 /* Standard entries that are guaranteed to be accessible via
@@ -770,6 +773,10 @@ typedef struct {
     apr_int32_t  flush_max_pipelined;
     unsigned int strict_host_check;
     unsigned int merge_slashes;
+    /** Use io_uring for the core output filter's writes (EnableIOUring) */
+    unsigned int enable_io_uring;
+    /** Prefix trie of the plain sec_url sections, see ap_location_walk() */
+    struct ap_location_trie *sec_url_trie;
 } core_server_config;
 
 /* for AddOutputFiltersByType in core.c */
@@ -227,6 +227,135 @@ AP_DECLARE(void) ap_clear_auth_internal(void);
  */
 AP_DECLARE(void) ap_setup_auth_internal(apr_pool_t *ptemp);
 
+/**
+ * Setup the cache of merged per-directory configurations used by the
+ * directory, location, file and if walks (MergeConfigCache), for the
+ * configuration sections of all the servers.  The cache is dropped with
+ * pconf, thus on restart.
+ * @param pconf The configuration pool
+ * @param s The main server
+ * @param size The maximum number of merges to cache, 0 to disable
+ */
+AP_DECLARE(void) ap_setup_merge_cache(apr_pool_t *pconf, server_rec *s,
+                                      int size);
+
+/**
+ * Compile the <Location > sections of all the servers into the prefix
+ * tries used by ap_location_walk(), for those with many sections.
+ * @param pconf The configuration pool
+ * @param s The main server
+ */
+AP_DECLARE(void) ap_setup_location_trie(apr_pool_t *pconf, server_rec *s);
+
+/**
+ * The ids of ap_request_var_id() reserved for well known HTTP header
+ * names, which need not be registered and can be used at any time.
+ */
+typedef enum {
+    AP_HEADER_ACCEPT = 0,
+    AP_HEADER_ACCEPT_CHARSET,
+    AP_HEADER_ACCEPT_ENCODING,
+    AP_HEADER_ACCEPT_LANGUAGE,
+    AP_HEADER_ACCEPT_RANGES,
+    AP_HEADER_AGE,
+    AP_HEADER_ALLOW,
+    AP_HEADER_AUTHORIZATION,
+    AP_HEADER_CACHE_CONTROL,
+    AP_HEADER_CONNECTION,
+    AP_HEADER_CONTENT_DISPOSITION,
+    AP_HEADER_CONTENT_ENCODING,
+    AP_HEADER_CONTENT_LANGUAGE,
+    AP_HEADER_CONTENT_LENGTH,
+    AP_HEADER_CONTENT_LOCATION,
+    AP_HEADER_CONTENT_RANGE,
+    AP_HEADER_CONTENT_TYPE,
+    AP_HEADER_COOKIE,
+    AP_HEADER_DATE,
+    AP_HEADER_ETAG,
+    AP_HEADER_EXPECT,
+    AP_HEADER_EXPIRES,
+    AP_HEADER_FORWARDED,
+    AP_HEADER_HOST,
+    AP_HEADER_IF_MATCH,
+    AP_HEADER_IF_MODIFIED_SINCE,
+    AP_HEADER_IF_NONE_MATCH,
+    AP_HEADER_IF_RANGE,
+    AP_HEADER_IF_UNMODIFIED_SINCE,
+    AP_HEADER_KEEP_ALIVE,
+    AP_HEADER_LAST_MODIFIED,
+    AP_HEADER_LOCATION,
+    AP_HEADER_MAX_FORWARDS,
+    AP_HEADER_ORIGIN,
+    AP_HEADER_PRAGMA,
+    AP_HEADER_PROXY_AUTHENTICATE,
+    AP_HEADER_PROXY_AUTHORIZATION,
+    AP_HEADER_RANGE,
+    AP_HEADER_REFERER,
+    AP_HEADER_RETRY_AFTER,
+    AP_HEADER_SERVER,
+    AP_HEADER_SET_COOKIE,
+    AP_HEADER_TE,
+    AP_HEADER_TRAILER,
+    AP_HEADER_TRANSFER_ENCODING,
+    AP_HEADER_UPGRADE,
+    AP_HEADER_USER_AGENT,
+    AP_HEADER_VARY,
+    AP_HEADER_VIA,
+    AP_HEADER_WWW_AUTHENTICATE,
+    AP_HEADER_X_FORWARDED_FOR,
+    AP_HEADER_X_FORWARDED_HOST,
+    AP_HEADER_X_FORWARDED_PROTO,
+    AP_HEADER_X_REQUESTED_WITH,
+    AP_HEADER__COUNT
+} ap_header_id_e;
+
+/**
+ * Intern the name of a request variable (e.g. a header or environment
+ * variable name) for ap_request_table_get().  The names are compared
+ * case insensitively, like apr_table_get() does.
+ * @param name The variable name
+ * @return The id of name, or -1 if name was not registered at config
+ *         time (new ids are not created once the MPM runs).
+ * @note The well known header names have their ap_header_id_e.
+ */
+AP_DECLARE(int) ap_request_var_id(const char *name);
+
+/**
+ * Get the value of a variable from one of the request's tables (e.g.
+ * r->headers_in, r->subprocess_env or r->notes), like apr_table_get()
+ * but memoized per request.  The memo is revalidated on each call, so
+ * changes to the table since the last lookup are accounted for.
+ * @param r The current request
+ * @param t The table to look in
+ * @param id The id of key from ap_request_var_id(), when -1 this is
+ *           apr_table_get(t, key)
+ * @param key The variable name
+ * @return The (first) value of key in t, or NULL
+ */
+AP_DECLARE(const char *) ap_request_table_get(request_rec *r,
+                                              const apr_table_t *t,
+                                              int id, const char *key);
+
+/**
+ * Get the value of a well known header from r->headers_in, using
+ * ap_request_table_get().
+ * @param r The current request
+ * @param id The header
+ * @return The (first) value of the header, or NULL
+ */
+AP_DECLARE(const char *) ap_request_header_in(request_rec *r,
+                                              ap_header_id_e id);
+
+/**
+ * Index one of the request's tables (typically r->headers_in once read)
+ * for ap_request_table_get(), which then finds any variable of t or its
+ * absence in O(1).  The index is rebuilt in one pass over t by the first
+ * lookup after any change to t.
+ * @param r The current request
+ * @param t The table to index
+ */
+AP_DECLARE(void) ap_request_table_index(request_rec *r, const apr_table_t *t);
+
 /**
  * Register an authentication or authorization provider with the global
  * provider pool.
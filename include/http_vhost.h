@@ -86,6 +86,19 @@ AP_DECLARE(int) ap_vhost_iterate_given_conn(conn_rec *conn,
                                             ap_vhost_iterate_conn_cb func_cb,
                                             void* baton);
 
+/**
+ * Find the Name Based Virtual Host on this connection whose ServerName or
+ * ServerAlias matches the given name, i.e. the first one for which
+ * ap_vhost_iterate_given_conn() would see a match.
+ * @param conn The current connection
+ * @param name The host name to look for
+ * @return The matching server, or NULL if there is none.
+ * @note Unlike ap_vhost_iterate_given_conn(), this does not walk all the
+ *       virtual hosts when there are many of them sharing the address.
+ */
+AP_DECLARE(server_rec *) ap_vhost_lookup_name(conn_rec *conn,
+                                              const char *name);
+
 /**
  * given an ip address only, give our best guess as to what vhost it is
  * @param conn The current connection
@@ -321,6 +321,38 @@ AP_DECLARE(apr_bucket_brigade *) ap_acquire_brigade(conn_rec *c);
  */
 AP_DECLARE(void) ap_release_brigade(conn_rec *c, apr_bucket_brigade *bb);
 
+/**
+ * Acquire a fixed size buffer from the connection's spare ones, for an
+ * output filter to produce its data in place and pass them down with
+ * ap_buffer_bucket_create().  Unlike transient buckets, these need no
+ * copy when the next filters (e.g. the core output filter on EAGAIN) set
+ * them aside.
+ * @param c The connection
+ * @param size Where to store the size of the buffer
+ * @return The buffer
+ */
+AP_DECLARE(char *) ap_acquire_buffer(conn_rec *c, apr_size_t *size);
+
+/**
+ * Release a buffer acquired with ap_acquire_buffer() and not passed in a
+ * bucket.  A buffer acquired by another connection is refused: an error
+ * is logged and the buffer is leaked.
+ * @param c The connection
+ * @param buf The buffer
+ */
+AP_DECLARE(void) ap_release_buffer(conn_rec *c, char *buf);
+
+/**
+ * Create a (heap) bucket for the data written in a buffer acquired with
+ * ap_acquire_buffer(), the buffer is released when the bucket is destroyed.
+ * @param c The connection
+ * @param buf The buffer
+ * @param len The length of the data
+ * @return The bucket
+ */
+AP_DECLARE(apr_bucket *) ap_buffer_bucket_create(conn_rec *c, char *buf,
+                                                 apr_size_t len);
+
 /**
  * Get the current bucket brigade from the next filter on the filter
  * stack.  The filter returns an apr_status_t value.  If the bottom-most
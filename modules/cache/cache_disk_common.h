@@ -60,6 +60,8 @@ typedef struct {
     /* Does this cached request have a body? */
     unsigned int has_body:1;
     unsigned int header_only:1;
+    /* Is the body still being written (CacheStreamingFill)? */
+    unsigned int in_progress:1;
     /* The parsed cache control header */
     cache_control_t control;
 } disk_cache_info_t;
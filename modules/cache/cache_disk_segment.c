@@ -0,0 +1,1766 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_shm.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_core.h"
+#include "http_main.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+
+#include "mod_cache.h"
+#include "mod_cache_disk.h"
+
+/*
+ * The segment store of mod_cache_disk (CacheEnable segment).
+ *
+ * Rather than a header and a data file per entity, the entities are
+ * appended as records to a ring of CacheSegmentCount segment files of
+ * CacheSegmentSize bytes in the CacheSegmentRoot directory.  When the
+ * segment being appended to is full, the oldest one is recycled (removed
+ * and created anew) and becomes the current one, so the disk usage is
+ * bounded and expired or replaced records go away with their segment,
+ * without htcacheclean.
+ *
+ * The records are found with an index in shared memory, created by the
+ * parent and inherited by the children, which maps the hash of the keys
+ * to their segment, offset and length.  The index is split into shards
+ * with their own lock, each shard into sets of CACHE_SEGMENT_WAYS slots;
+ * when a set is full the slot of the oldest segment is replaced.  Each
+ * segment has a generation, bumped when it is recycled, recorded in the
+ * slots and the records, so that the slots of a recycled segment are
+ * simply ignored.  Neither the index nor the segments survive a restart:
+ * each startup (or restart) has its own nonce in the names of its segment
+ * files, so that the children of the previous generation, which may still
+ * run after a graceful restart, only ever touch their own files.
+ *
+ * A hit is one open of the segment file and one read of the record's
+ * headers, the body being sent from the segment (with sendfile if
+ * enabled).  The stores are queued to a writer thread in each child,
+ * which appends the records with the segment files kept open, out of
+ * the request threads.
+ *
+ * A record:
+ *   cache_segment_record_t
+ *   key [key_len]
+ *   r->headers_out (delimited by CRLF)
+ *   CRLF
+ *   r->headers_in (delimited by CRLF)
+ *   CRLF
+ *   body [body_len]
+ * or, under the key without the Vary bits:
+ *   cache_segment_record_t (type CACHE_SEGMENT_VARY)
+ *   key [key_len]
+ *   apr_array_t vary_headers (delimited by CRLF)
+ */
+
+extern module AP_MODULE_DECLARE_DATA cache_disk_module;
+
+#define CACHE_SEGMENT_MAGIC 0x43534547 /* "CSEG" */
+#define CACHE_SEGMENT_ENTITY 1
+#define CACHE_SEGMENT_VARY 2
+
+typedef struct {
+    apr_uint32_t magic;
+    /* The generation of the segment it was written to. */
+    apr_uint32_t gen;
+    apr_uint32_t type;
+    apr_uint32_t key_len;
+    apr_uint32_t hdrs_len;
+    apr_uint32_t body_len;
+    /* The HTTP status code returned for this response.  */
+    int status;
+    /* Miscellaneous time values. */
+    apr_time_t date;
+    apr_time_t expire;
+    apr_time_t request_time;
+    apr_time_t response_time;
+    /* Does this cached request have a body? */
+    unsigned int header_only:1;
+    /* The parsed cache control header */
+    cache_control_t control;
+} cache_segment_record_t;
+
+/* The shared state of a segment */
+typedef struct {
+    apr_uint32_t gen;
+    apr_uint32_t tail;          /* where the next record goes */
+} cache_segment_t;
+
+/* The shared header, followed by the segments then the index */
+typedef struct {
+    apr_uint32_t current;       /* the segment appended to */
+    apr_uint32_t nsets;         /* per shard */
+    apr_uint32_t nonce;         /* of this generation, in the file names */
+} cache_segment_hdr_t;
+
+typedef struct {
+    apr_uint64_t hash;          /* 0 when free */
+    apr_uint32_t seg;
+    apr_uint32_t gen;
+    apr_uint32_t offset;
+    apr_uint32_t len;           /* of the whole record */
+} cache_segment_slot_t;
+
+#define CACHE_SEGMENT_SHARDS 16
+#define CACHE_SEGMENT_WAYS 8
+/* To size the index from the size of the store */
+#define CACHE_SEGMENT_AVG_RECORD 8192
+
+/*
+ * A store for the writer, allocated with the record (but the body) in
+ * the same malloc()ed block.
+ */
+typedef struct cache_segment_job_t {
+    struct cache_segment_job_t *next;
+    apr_uint64_t hash;
+    char *record;
+    apr_size_t record_len;
+    char *body;                 /* malloc()ed, owned by the job */
+    apr_size_t body_len;
+    /* or the body of the revalidated record, when src_len */
+    apr_uint32_t src_seg;
+    apr_uint32_t src_gen;
+    apr_uint32_t src_offset;
+    apr_uint32_t src_len;
+} cache_segment_job_t;
+
+/*
+ * cache_segment_object_t
+ * Pointed to by cache_object_t::vobj
+ */
+typedef struct cache_segment_object_t
+{
+    char *record;               /* the record to store, but the body */
+    apr_size_t record_len;
+    char *vary;                 /* the Vary record to store, if any */
+    apr_size_t vary_len;
+    char *body;                 /* the body to store, malloc()ed */
+    apr_size_t body_len;
+    apr_size_t body_size;
+    apr_size_t body_max;
+    apr_table_t *headers_in;    /* Input headers to save */
+    apr_table_t *headers_out;   /* Output headers to save */
+    cache_segment_record_t rec; /* Header information. */
+
+    const char *name;           /* Requested URI without vary bits */
+    const char *key;            /* URI with Vary bits (if present) */
+
+    /* The record found by open_entity() */
+    apr_file_t *fd;
+    cache_segment_slot_t slot;
+    apr_uint32_t body_offset;
+
+    unsigned int newbody :1;    /* whether a new body is present */
+    unsigned int done :1;       /* Is the attempt to cache complete? */
+    unsigned int failed :1;     /* Should the entry not be stored? */
+} cache_segment_object_t;
+
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_SEGMENT_COUNT 16
+#define MAX_SEGMENT_SIZE 0x40000000
+#define MAX_SEGMENT_COUNT 4096
+
+/* Global configuration (CacheSegmentRoot, CacheSegmentSize,
+ * CacheSegmentCount), and the store.
+ */
+static const char *cache_segment_root = NULL;
+static apr_uint32_t cache_segment_size = DEFAULT_SEGMENT_SIZE;
+static apr_uint32_t cache_segment_count = DEFAULT_SEGMENT_COUNT;
+static const char * const cache_segment_id = "cache-segment";
+static apr_shm_t *cache_segment_shm = NULL;
+static cache_segment_hdr_t *segment_hdr = NULL;
+static cache_segment_t *segments = NULL;
+static cache_segment_slot_t *segment_slots = NULL;
+/* One per shard, then the one for recycling */
+static apr_global_mutex_t *segment_mutexes[CACHE_SEGMENT_SHARDS + 1];
+
+/* The writer of the child, the segment files it keeps open and the
+ * generation they were opened for are only used by the writer thread.
+ */
+static apr_pool_t *writer_pool = NULL;
+static apr_file_t **writer_fds = NULL;
+static apr_uint32_t *writer_gens = NULL;
+#if APR_HAS_THREADS
+static apr_thread_t *writer_thread = NULL;
+static apr_thread_mutex_t *writer_mutex = NULL;
+static apr_thread_cond_t *writer_cond = NULL;
+static cache_segment_job_t *writer_head = NULL, *writer_tail = NULL;
+static apr_size_t writer_pending = 0;
+static int writer_stop = 0;
+#endif
+
+/*
+ * Local static functions
+ */
+
+static apr_status_t read_array(request_rec *r, apr_array_header_t *arr,
+        unsigned char *buffer, apr_size_t buffer_len, apr_size_t *slider)
+{
+    apr_size_t val = *slider;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == '\r') {
+            if (val == *slider) {
+                (*slider)++;
+                return APR_SUCCESS;
+            }
+            *((const char **) apr_array_push(arr)) = apr_pstrndup(r->pool,
+                    (const char *) buffer + val, *slider - val);
+            (*slider)++;
+            if (buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            val = *slider;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_array(apr_array_header_t *arr, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    const char **elts;
+
+    elts = (const char **) arr->elts;
+
+    for (i = 0; i < arr->nelts; i++) {
+        apr_size_t e_len = strlen(elts[i]);
+        if (e_len + 3 >= buffer_len - *slider) {
+            return APR_EOF;
+        }
+        len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                buffer ? buffer_len - *slider : 0, "%s" CRLF, elts[i]);
+        *slider += len;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t read_table(cache_handle_t *handle, request_rec *r,
+        apr_table_t *table, unsigned char *buffer, apr_size_t buffer_len,
+        apr_size_t *slider)
+{
+    apr_size_t key = *slider, colon = 0, len = 0;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == ':') {
+            if (!colon) {
+                colon = *slider;
+            }
+            (*slider)++;
+        }
+        else if (buffer[*slider] == '\r') {
+            len = colon;
+            if (key == *slider) {
+                (*slider)++;
+                if (buffer[*slider] == '\n') {
+                    (*slider)++;
+                }
+                return APR_SUCCESS;
+            }
+            if (!colon || buffer[colon++] != ':') {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10322)
+                        "Premature end of cache headers.");
+                return APR_EGENERAL;
+            }
+            /* Do not go past the \r from above as apr_isspace('\r') is true */
+            while (apr_isspace(buffer[colon]) && (colon < *slider)) {
+                colon++;
+            }
+            apr_table_addn(table, apr_pstrmemdup(r->pool, (const char *) buffer
+                    + key, len - key), apr_pstrmemdup(r->pool,
+                    (const char *) buffer + colon, *slider - colon));
+            (*slider)++;
+            if (buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            key = *slider;
+            colon = 0;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_table(apr_table_t *table, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    apr_table_entry_t *elts;
+
+    elts = (apr_table_entry_t *) apr_table_elts(table)->elts;
+    for (i = 0; i < apr_table_elts(table)->nelts; ++i) {
+        if (elts[i].key != NULL) {
+            apr_size_t key_len = strlen(elts[i].key);
+            apr_size_t val_len = strlen(elts[i].val);
+            if (key_len + val_len + 5 >= buffer_len - *slider) {
+                return APR_EOF;
+            }
+            len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                    buffer ? buffer_len - *slider : 0, "%s: %s" CRLF,
+                    elts[i].key, elts[i].val);
+            *slider += len;
+        }
+    }
+    if (3 >= buffer_len - *slider) {
+        return APR_EOF;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
+                             apr_array_header_t *varray, const char *oldkey)
+{
+    struct iovec *iov;
+    int i, k;
+    int nvec;
+    const char *header;
+    const char **elts;
+
+    nvec = (varray->nelts * 2) + 1;
+    iov = apr_palloc(p, sizeof(struct iovec) * nvec);
+    elts = (const char **) varray->elts;
+
+    /* See mod_cache_socache regarding case insensitive values (TODO). */
+    for (i = 0, k = 0; i < varray->nelts; i++) {
+        header = apr_table_get(headers, elts[i]);
+        if (!header) {
+            header = "";
+        }
+        iov[k].iov_base = (char*) elts[i];
+        iov[k].iov_len = strlen(elts[i]);
+        k++;
+        iov[k].iov_base = (char*) header;
+        iov[k].iov_len = strlen(header);
+        k++;
+    }
+    iov[k].iov_base = (char*) oldkey;
+    iov[k].iov_len = strlen(oldkey);
+    k++;
+
+    return apr_pstrcatv(p, iov, k, NULL);
+}
+
+static int array_alphasort(const void *fn1, const void *fn2)
+{
+    return strcmp(*(char**) fn1, *(char**) fn2);
+}
+
+static void tokens_to_array(apr_pool_t *p, const char *data,
+        apr_array_header_t *arr)
+{
+    char *token;
+
+    while ((token = ap_get_list_item(p, &data)) != NULL) {
+        *((const char **) apr_array_push(arr)) = token;
+    }
+
+    /* Sort it so that "Vary: A, B" and "Vary: B, A" are stored the same. */
+    qsort((void *) arr->elts, arr->nelts, sizeof(char *), array_alphasort);
+}
+
+/*
+ * The index
+ */
+
+static apr_uint64_t segment_hash(const char *key)
+{
+    /* FNV-1a, 0 is a free slot */
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= APR_UINT64_C(1099511628211);
+    }
+    return hash ? hash : 1;
+}
+
+static apr_status_t segment_lock(apr_global_mutex_t *mutex, server_rec *s)
+{
+    apr_status_t rv = apr_global_mutex_lock(mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10323)
+                     "could not acquire %s lock", cache_segment_id);
+    }
+    return rv;
+}
+
+static void segment_unlock(apr_global_mutex_t *mutex, server_rec *s)
+{
+    apr_status_t rv = apr_global_mutex_unlock(mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10324)
+                     "could not release %s lock", cache_segment_id);
+    }
+}
+
+static APR_INLINE unsigned int shard_of(apr_uint64_t hash)
+{
+    return (unsigned int)(hash % CACHE_SEGMENT_SHARDS);
+}
+
+static APR_INLINE cache_segment_slot_t *set_of(apr_uint64_t hash)
+{
+    apr_uint64_t set = (hash / CACHE_SEGMENT_SHARDS) % segment_hdr->nsets;
+
+    return segment_slots + ((apr_uint64_t)shard_of(hash) * segment_hdr->nsets
+                            + set) * CACHE_SEGMENT_WAYS;
+}
+
+/* Whether the slot refers to a record of a segment not recycled since */
+static APR_INLINE int slot_live(const cache_segment_slot_t *slot)
+{
+    return slot->hash
+           && apr_atomic_read32(&segments[slot->seg].gen) == slot->gen;
+}
+
+static apr_status_t index_find(server_rec *s, apr_uint64_t hash,
+                               cache_segment_slot_t *found)
+{
+    apr_global_mutex_t *mutex = segment_mutexes[shard_of(hash)];
+    cache_segment_slot_t *set = set_of(hash);
+    apr_status_t rv;
+    int i;
+
+    if ((rv = segment_lock(mutex, s)) != APR_SUCCESS) {
+        return rv;
+    }
+    rv = APR_NOTFOUND;
+    for (i = 0; i < CACHE_SEGMENT_WAYS; ++i) {
+        if (set[i].hash == hash && slot_live(&set[i])) {
+            *found = set[i];
+            rv = APR_SUCCESS;
+            break;
+        }
+    }
+    segment_unlock(mutex, s);
+
+    return rv;
+}
+
+static void index_insert(server_rec *s, const cache_segment_slot_t *slot)
+{
+    apr_global_mutex_t *mutex = segment_mutexes[shard_of(slot->hash)];
+    cache_segment_slot_t *set = set_of(slot->hash), *victim = NULL;
+    apr_uint32_t current, age, oldest = 0;
+    int i;
+
+    if (segment_lock(mutex, s) != APR_SUCCESS) {
+        return;
+    }
+    current = apr_atomic_read32(&segment_hdr->current);
+    for (i = 0; i < CACHE_SEGMENT_WAYS; ++i) {
+        if (set[i].hash == slot->hash) {
+            victim = &set[i];
+            break;
+        }
+        /* a free slot is the oldest, otherwise the farthest segment
+         * behind the current one
+         */
+        if (!slot_live(&set[i])) {
+            age = cache_segment_count;
+        }
+        else {
+            age = (current + cache_segment_count - set[i].seg)
+                  % cache_segment_count;
+        }
+        if (!victim || age > oldest) {
+            victim = &set[i];
+            oldest = age;
+        }
+    }
+    *victim = *slot;
+    segment_unlock(mutex, s);
+}
+
+static void index_remove(server_rec *s, apr_uint64_t hash)
+{
+    apr_global_mutex_t *mutex = segment_mutexes[shard_of(hash)];
+    cache_segment_slot_t *set = set_of(hash);
+    int i;
+
+    if (segment_lock(mutex, s) != APR_SUCCESS) {
+        return;
+    }
+    for (i = 0; i < CACHE_SEGMENT_WAYS; ++i) {
+        if (set[i].hash == hash) {
+            set[i].hash = 0;
+        }
+    }
+    segment_unlock(mutex, s);
+}
+
+/*
+ * The segments
+ */
+
+#define SEGMENT_PREFIX "segment."
+
+static const char *segment_path(apr_pool_t *p, apr_uint32_t seg)
+{
+    return apr_psprintf(p, "%s/" SEGMENT_PREFIX "%08x.%04u",
+                        cache_segment_root, segment_hdr->nonce, seg);
+}
+
+/* Remove the segment files of the previous runs, but those of the given
+ * generation (whose children may still be using them).
+ */
+static void segment_remove_stale(apr_pool_t *p, apr_uint32_t keep)
+{
+    const char *prefix = apr_psprintf(p, SEGMENT_PREFIX "%08x.", keep);
+    apr_size_t plen = strlen(SEGMENT_PREFIX);
+    apr_finfo_t finfo;
+    apr_dir_t *dir;
+    apr_status_t rv;
+
+    if (apr_dir_open(&dir, cache_segment_root, p) != APR_SUCCESS) {
+        return;
+    }
+    for (;;) {
+        rv = apr_dir_read(&finfo, APR_FINFO_NAME, dir);
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+            break;
+        }
+        if (strncmp(finfo.name, SEGMENT_PREFIX, plen) != 0
+                || (keep && strncmp(finfo.name, prefix,
+                                    strlen(prefix)) == 0)) {
+            continue;
+        }
+        apr_file_remove(apr_pstrcat(p, cache_segment_root, "/", finfo.name,
+                                    NULL), p);
+    }
+    apr_dir_close(dir);
+}
+
+/* Recycle the oldest segment to append to it, unless another process
+ * did it already since we found the current segment full.
+ */
+static void segment_recycle(server_rec *s, apr_uint32_t full)
+{
+    apr_global_mutex_t *mutex = segment_mutexes[CACHE_SEGMENT_SHARDS];
+    apr_uint32_t next;
+    apr_file_t *fd;
+    apr_pool_t *p;
+    const char *path;
+    apr_status_t rv;
+
+    if (segment_lock(mutex, s) != APR_SUCCESS) {
+        return;
+    }
+    if (apr_atomic_read32(&segment_hdr->current) == full) {
+        next = (full + 1) % cache_segment_count;
+
+        /* Bumped first, so that opening the file and then checking the
+         * generation tells whether it's the one of the generation.
+         */
+        apr_atomic_inc32(&segments[next].gen);
+
+        apr_pool_create(&p, writer_pool);
+        path = segment_path(p, next);
+        apr_file_remove(path, p);
+        rv = apr_file_open(&fd, path, APR_CREATE | APR_WRITE | APR_TRUNCATE
+                                      | APR_BINARY, APR_OS_DEFAULT, p);
+        if (rv == APR_SUCCESS) {
+            apr_file_close(fd);
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10325)
+                         "could not create cache segment %s", path);
+        }
+        apr_pool_destroy(p);
+
+        apr_atomic_set32(&segments[next].tail, 0);
+        apr_atomic_set32(&segment_hdr->current, next);
+
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10326)
+                     "recycled cache segment %u", next);
+    }
+    segment_unlock(mutex, s);
+}
+
+/* The writer's file of the given generation of a segment, APR_EAGAIN if
+ * it's been recycled meanwhile.
+ */
+static apr_status_t writer_fd(apr_uint32_t seg, apr_uint32_t gen,
+                              apr_file_t **fd)
+{
+    apr_status_t rv;
+
+    if (writer_fds[seg] && writer_gens[seg] == gen) {
+        *fd = writer_fds[seg];
+        return APR_SUCCESS;
+    }
+    if (writer_fds[seg]) {
+        apr_file_close(writer_fds[seg]);
+        writer_fds[seg] = NULL;
+    }
+
+    rv = apr_file_open(fd, segment_path(writer_pool, seg),
+                       APR_CREATE | APR_READ | APR_WRITE | APR_BINARY,
+                       APR_OS_DEFAULT, writer_pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    if (apr_atomic_read32(&segments[seg].gen) != gen) {
+        apr_file_close(*fd);
+        return APR_EAGAIN;
+    }
+    writer_fds[seg] = *fd;
+    writer_gens[seg] = gen;
+
+    return APR_SUCCESS;
+}
+
+/* Reserve len bytes at the end of the current segment, recycling as
+ * needed, and get the writer's file for them.
+ */
+static apr_status_t segment_reserve(server_rec *s, apr_uint32_t len,
+                                    cache_segment_slot_t *slot,
+                                    apr_file_t **fd)
+{
+    apr_uint32_t tries, current, gen, tail;
+    apr_status_t rv;
+
+    for (tries = 0; tries <= cache_segment_count + 1; ++tries) {
+        current = apr_atomic_read32(&segment_hdr->current);
+        gen = apr_atomic_read32(&segments[current].gen);
+
+        rv = writer_fd(current, gen, fd);
+        if (APR_STATUS_IS_EAGAIN(rv)) {
+            continue;
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        do {
+            tail = apr_atomic_read32(&segments[current].tail);
+            if (tail > cache_segment_size - len) {
+                break;
+            }
+        } while (apr_atomic_cas32(&segments[current].tail, tail + len,
+                                  tail) != tail);
+
+        if (tail <= cache_segment_size - len) {
+            slot->seg = current;
+            slot->gen = gen;
+            slot->offset = tail;
+            slot->len = len;
+            return APR_SUCCESS;
+        }
+
+        segment_recycle(s, current);
+    }
+
+    return APR_ENOSPC;
+}
+
+/* Append the record of a job, and index it */
+static apr_status_t segment_write(server_rec *s, cache_segment_job_t *job)
+{
+    cache_segment_record_t *rec = (cache_segment_record_t *)job->record;
+    cache_segment_slot_t slot;
+    struct iovec iov[2];
+    apr_size_t amt;
+    apr_off_t offset;
+    apr_file_t *fd;
+    apr_status_t rv;
+
+    /* Copy the body of a revalidated record, if still there */
+    if (job->src_len) {
+        rv = writer_fd(job->src_seg, job->src_gen, &fd);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        job->body = ap_malloc(job->src_len);
+        job->body_len = job->src_len;
+        offset = job->src_offset;
+        rv = apr_file_seek(fd, APR_SET, &offset);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_read_full(fd, job->body, job->body_len, NULL);
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    rv = segment_reserve(s, (apr_uint32_t)(job->record_len + job->body_len),
+                         &slot, &fd);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    rec->gen = slot.gen;
+
+    iov[0].iov_base = job->record;
+    iov[0].iov_len = job->record_len;
+    iov[1].iov_base = job->body;
+    iov[1].iov_len = job->body_len;
+    offset = slot.offset;
+    rv = apr_file_seek(fd, APR_SET, &offset);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_writev_full(fd, iov, job->body_len ? 2 : 1, &amt);
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* Readers may find it only now that it's complete */
+    slot.hash = job->hash;
+    index_insert(s, &slot);
+
+    return APR_SUCCESS;
+}
+
+static void job_free(cache_segment_job_t *job)
+{
+    free(job->body);
+    free(job);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC segment_writer(apr_thread_t *thd, void *data)
+{
+    server_rec *s = data;
+    cache_segment_job_t *job;
+    apr_size_t len;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(writer_mutex);
+    for (;;) {
+        while (!writer_head && !writer_stop) {
+            apr_thread_cond_wait(writer_cond, writer_mutex);
+        }
+        if (writer_stop) {
+            break;
+        }
+        job = writer_head;
+        writer_head = job->next;
+        if (!writer_head) {
+            writer_tail = NULL;
+        }
+        len = job->record_len + job->src_len + job->body_len;
+        apr_thread_mutex_unlock(writer_mutex);
+
+        rv = segment_write(s, job);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10327)
+                         "could not write record to the cache segments");
+        }
+
+        apr_thread_mutex_lock(writer_mutex);
+        writer_pending -= len;
+        job_free(job);
+    }
+    apr_thread_mutex_unlock(writer_mutex);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t writer_cleanup(void *dummy)
+{
+    cache_segment_job_t *job;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(writer_mutex);
+    writer_stop = 1;
+    apr_thread_cond_signal(writer_cond);
+    apr_thread_mutex_unlock(writer_mutex);
+    apr_thread_join(&rv, writer_thread);
+    writer_thread = NULL;
+
+    /* Not written, the stores are lost with the index anyway */
+    while ((job = writer_head)) {
+        writer_head = job->next;
+        job_free(job);
+    }
+    writer_tail = NULL;
+
+    return APR_SUCCESS;
+}
+#endif
+
+/* Hand a job over to the writer, which owns it from now on */
+static apr_status_t segment_queue(request_rec *r, cache_segment_job_t *job)
+{
+#if APR_HAS_THREADS
+    apr_size_t len = job->record_len + job->src_len + job->body_len;
+
+    apr_thread_mutex_lock(writer_mutex);
+    if (writer_stop || writer_pending + len > cache_segment_size) {
+        apr_thread_mutex_unlock(writer_mutex);
+        job_free(job);
+        return APR_EAGAIN;
+    }
+    job->next = NULL;
+    if (writer_tail) {
+        writer_tail->next = job;
+    }
+    else {
+        writer_head = job;
+    }
+    writer_tail = job;
+    writer_pending += len;
+    apr_thread_cond_signal(writer_cond);
+    apr_thread_mutex_unlock(writer_mutex);
+
+    return APR_SUCCESS;
+#else
+    apr_status_t rv = segment_write(r->server, job);
+    job_free(job);
+    return rv;
+#endif
+}
+
+static cache_segment_job_t *job_create(const char *key, const char *record,
+                                       apr_size_t record_len)
+{
+    cache_segment_job_t *job = ap_calloc(1, sizeof(*job) + record_len);
+
+    job->hash = segment_hash(key);
+    job->record = (char *)(job + 1);
+    memcpy(job->record, record, record_len);
+    job->record_len = record_len;
+
+    return job;
+}
+
+/* Open the record of a key, read it but the body */
+static apr_status_t segment_fetch(request_rec *r, const char *key,
+                                  cache_segment_slot_t *slot,
+                                  cache_segment_record_t *rec,
+                                  unsigned char **data, apr_file_t **fd)
+{
+#ifdef APR_SENDFILE_ENABLED
+    core_dir_config *coreconf = ap_get_core_module_config(r->per_dir_config);
+#endif
+    apr_size_t key_len = strlen(key), len;
+    apr_off_t offset;
+    apr_status_t rv;
+    int flags;
+
+    rv = index_find(r->server, segment_hash(key), slot);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    flags = APR_READ | APR_BINARY;
+#ifdef APR_SENDFILE_ENABLED
+    /* When we are in the quick handler we don't have the per-directory
+     * configuration, so this check only takes the global setting of
+     * the EnableSendFile directive into account.
+     */
+    flags |= AP_SENDFILE_ENABLED(coreconf->enable_sendfile);
+#endif
+    rv = apr_file_open(fd, segment_path(r->pool, slot->seg), flags, 0,
+                       r->pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    offset = slot->offset;
+    rv = apr_file_seek(*fd, APR_SET, &offset);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_read_full(*fd, rec, sizeof(*rec), NULL);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_close(*fd);
+        return rv;
+    }
+
+    /* The segment may have been recycled since we looked it up */
+    if (rec->magic != CACHE_SEGMENT_MAGIC || rec->gen != slot->gen
+            || rec->key_len != key_len
+            || (apr_uint64_t)sizeof(*rec) + rec->key_len + rec->hdrs_len
+               + rec->body_len != slot->len) {
+        apr_file_close(*fd);
+        return APR_NOTFOUND;
+    }
+
+    len = rec->key_len + rec->hdrs_len;
+    *data = apr_palloc(r->pool, len + 1);
+    rv = apr_file_read_full(*fd, *data, len, NULL);
+    if (rv != APR_SUCCESS) {
+        apr_file_close(*fd);
+        return rv;
+    }
+    (*data)[len] = '\0';
+    if (memcmp(*data, key, key_len)) {
+        apr_file_close(*fd);
+        return APR_NOTFOUND;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t sobj_free_body(void *baton)
+{
+    cache_segment_object_t *sobj = baton;
+
+    free(sobj->body);
+    sobj->body = NULL;
+    return APR_SUCCESS;
+}
+
+/* The limit of a record, so that a segment holds a few at least */
+static APR_INLINE apr_size_t segment_max_record(void)
+{
+    return cache_segment_size / 4;
+}
+
+/*
+ * Hook and mod_cache callback functions
+ */
+static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
+        apr_off_t len, apr_bucket_brigade *bb)
+{
+    disk_cache_dir_conf *dconf =
+            ap_get_module_config(r->per_dir_config, &cache_disk_module);
+    cache_object_t *obj;
+    cache_segment_object_t *sobj;
+    apr_off_t max;
+
+    if (!segment_hdr) {
+        return DECLINED;
+    }
+
+    /* we don't support caching of range requests (yet) */
+    if (r->status == HTTP_PARTIAL_CONTENT) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10328)
+                "URL %s partial content response not cached",
+                key);
+        return DECLINED;
+    }
+
+    /* Note, len is -1 if unknown so don't trust it too hard */
+    max = dconf->maxfs;
+    if (max > (apr_off_t)segment_max_record()) {
+        max = (apr_off_t)segment_max_record();
+    }
+    if (len > max) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10329)
+                "URL %s failed the size check "
+                "(%" APR_OFF_T_FMT " > %" APR_OFF_T_FMT ")",
+                key, len, max);
+        return DECLINED;
+    }
+    if (len >= 0 && len < dconf->minfs) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10330)
+                "URL %s failed the size check "
+                "(%" APR_OFF_T_FMT " < %" APR_OFF_T_FMT ")",
+                key, len, dconf->minfs);
+        return DECLINED;
+    }
+
+    /* Allocate and initialize cache_object_t and cache_segment_object_t */
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->vobj = sobj = apr_pcalloc(r->pool, sizeof(*sobj));
+
+    obj->key = apr_pstrdup(r->pool, key);
+    sobj->key = obj->key;
+    sobj->name = obj->key;
+    sobj->body_max = (apr_size_t)max;
+    sobj->body_size = len > 0 ? (apr_size_t)len : 0;
+    apr_pool_cleanup_register(r->pool, sobj, sobj_free_body,
+                              apr_pool_cleanup_null);
+
+    return OK;
+}
+
+static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
+{
+    cache_segment_record_t rec;
+    cache_segment_slot_t slot;
+    apr_size_t slider, data_len;
+    unsigned char *data;
+    const char *nkey;
+    apr_status_t rc;
+    cache_object_t *obj;
+    cache_info *info;
+    cache_segment_object_t *sobj;
+    apr_file_t *fd;
+
+    h->cache_obj = NULL;
+
+    if (!segment_hdr) {
+        return DECLINED;
+    }
+
+    /* attempt to retrieve the cached entry */
+    rc = segment_fetch(r, key, &slot, &rec, &data, &fd);
+    if (rc != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10331)
+                "Key not found in cache: %s", key);
+        return DECLINED;
+    }
+
+    if (rec.type == CACHE_SEGMENT_VARY) {
+        apr_array_header_t* varray;
+
+        apr_file_close(fd);
+
+        varray = apr_array_make(r->pool, 5, sizeof(char*));
+        slider = rec.key_len;
+        rc = read_array(r, varray, data, rec.key_len + rec.hdrs_len, &slider);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(10332)
+                    "Cannot parse vary record for key: %s", key);
+            return DECLINED;
+        }
+
+        nkey = regen_key(r->pool, r->headers_in, varray, key);
+
+        rc = segment_fetch(r, nkey, &slot, &rec, &data, &fd);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10333)
+                    "Key not found in cache: %s", nkey);
+            return DECLINED;
+        }
+    }
+    else {
+        nkey = key;
+    }
+    if (rec.type != CACHE_SEGMENT_ENTITY) {
+        apr_file_close(fd);
+        return DECLINED;
+    }
+
+    /* Is this a cached HEAD request? */
+    if (rec.header_only && !r->header_only) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(10334)
+                "HEAD request cached, non-HEAD requested, ignoring: %s",
+                nkey);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+
+    /* Create and init the cache object */
+    obj = apr_pcalloc(r->pool, sizeof(cache_object_t));
+    sobj = apr_pcalloc(r->pool, sizeof(cache_segment_object_t));
+    memcpy(&sobj->rec, &rec, sizeof(rec));
+    sobj->fd = fd;
+    sobj->slot = slot;
+    sobj->body_offset = slot.offset + slot.len - rec.body_len;
+
+    obj->key = nkey;
+    sobj->key = nkey;
+    sobj->name = key;
+
+    /* Store it away so we can get it later. */
+    info = &(obj->info);
+    info->status = rec.status;
+    info->date = rec.date;
+    info->expire = rec.expire;
+    info->request_time = rec.request_time;
+    info->response_time = rec.response_time;
+
+    memcpy(&info->control, &rec.control, sizeof(cache_control_t));
+
+    h->req_hdrs = apr_table_make(r->pool, 20);
+    h->resp_hdrs = apr_table_make(r->pool, 20);
+
+    /* Call routine to read the header lines/status line */
+    slider = rec.key_len;
+    data_len = rec.key_len + rec.hdrs_len;
+    if (APR_SUCCESS != read_table(h, r, h->resp_hdrs, data, data_len,
+                                  &slider)
+            || APR_SUCCESS != read_table(h, r, h->req_hdrs, data, data_len,
+                                         &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10335)
+                "Cache record for key '%s' headers unreadable, removing",
+                nkey);
+        apr_file_close(fd);
+        index_remove(r->server, segment_hash(nkey));
+        return DECLINED;
+    }
+
+    /* make the configuration stick */
+    h->cache_obj = obj;
+    obj->vobj = sobj;
+
+    return OK;
+}
+
+static int remove_entity(cache_handle_t *h)
+{
+    /* Null out the cache object pointer so next time we start from scratch */
+    h->cache_obj = NULL;
+    return OK;
+}
+
+static int remove_url(cache_handle_t *h, request_rec *r)
+{
+    cache_segment_object_t *sobj;
+
+    sobj = (cache_segment_object_t *) h->cache_obj->vobj;
+    if (!sobj) {
+        return DECLINED;
+    }
+
+    /* Remove the key from the index, the record goes with its segment */
+    index_remove(r->server, segment_hash(sobj->key));
+
+    return OK;
+}
+
+static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
+{
+    /* we recalled the headers during open_entity, so do nothing */
+    return APR_SUCCESS;
+}
+
+static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p,
+        apr_bucket_brigade *bb)
+{
+    cache_segment_object_t *sobj =
+            (cache_segment_object_t*) h->cache_obj->vobj;
+
+    if (sobj->fd && sobj->rec.body_len) {
+        apr_brigade_insert_file(bb, sobj->fd, sobj->body_offset,
+                                sobj->rec.body_len, p);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
+        cache_info *info)
+{
+    apr_size_t max = segment_max_record(), slider, key_len;
+    cache_object_t *obj = h->cache_obj;
+    cache_segment_object_t *sobj = (cache_segment_object_t*) obj->vobj;
+    cache_segment_record_t *rec;
+
+    memcpy(&h->cache_obj->info, info, sizeof(cache_info));
+
+    if (r->headers_out) {
+        sobj->headers_out = ap_cache_cacheable_headers_out(r);
+    }
+
+    if (r->headers_in) {
+        sobj->headers_in = ap_cache_cacheable_headers_in(r);
+    }
+
+    if (sobj->headers_out) {
+        const char *vary;
+
+        vary = apr_table_get(sobj->headers_out, "Vary");
+
+        if (vary) {
+            apr_array_header_t* varray;
+
+            varray = apr_array_make(r->pool, 6, sizeof(char*));
+            tokens_to_array(r->pool, vary, varray);
+
+            key_len = strlen(sobj->name);
+            slider = sizeof(*rec) + key_len;
+            if (APR_SUCCESS != store_array(varray, NULL, max, &slider)) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10336)
+                        "Vary array too large, caching aborted: %s",
+                        obj->key);
+                return APR_EGENERAL;
+            }
+            sobj->vary = apr_pcalloc(r->pool, slider + 1);
+            rec = (cache_segment_record_t *)sobj->vary;
+            rec->magic = CACHE_SEGMENT_MAGIC;
+            rec->type = CACHE_SEGMENT_VARY;
+            rec->key_len = (apr_uint32_t)key_len;
+            memcpy(sobj->vary + sizeof(*rec), sobj->name, key_len);
+            sobj->vary_len = sizeof(*rec) + key_len;
+            store_array(varray, (unsigned char *)sobj->vary, slider + 1,
+                        &sobj->vary_len);
+            rec->hdrs_len = (apr_uint32_t)(sobj->vary_len - sizeof(*rec)
+                                           - key_len);
+
+            obj->key = sobj->key = regen_key(r->pool, sobj->headers_in,
+                                             varray, sobj->name);
+        }
+    }
+
+    /* Size the record, then write it */
+    key_len = strlen(sobj->key);
+    slider = sizeof(*rec) + key_len;
+    if ((sobj->headers_out && APR_SUCCESS != store_table(sobj->headers_out,
+                                                 NULL, max, &slider))
+            || (sobj->headers_in && APR_SUCCESS != store_table(
+                                        sobj->headers_in, NULL, max,
+                                        &slider))) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10337)
+                "headers too large, caching aborted: %s", sobj->name);
+        return APR_EGENERAL;
+    }
+    /* room for store_table()'s checks and trailing NUL */
+    sobj->record_len = slider + 8;
+    sobj->record = apr_pcalloc(r->pool, sobj->record_len);
+    rec = (cache_segment_record_t *) sobj->record;
+
+    rec->magic = CACHE_SEGMENT_MAGIC;
+    rec->type = CACHE_SEGMENT_ENTITY;
+    rec->key_len = (apr_uint32_t)key_len;
+    rec->date = obj->info.date;
+    rec->expire = obj->info.expire;
+    rec->request_time = obj->info.request_time;
+    rec->response_time = obj->info.response_time;
+    rec->status = obj->info.status;
+
+    if (r->header_only && r->status != HTTP_NOT_MODIFIED) {
+        rec->header_only = 1;
+    }
+    else {
+        rec->header_only = sobj->rec.header_only;
+    }
+
+    memcpy(&rec->control, &obj->info.control, sizeof(cache_control_t));
+    memcpy(sobj->record + sizeof(*rec), sobj->key, key_len);
+    slider = sizeof(*rec) + key_len;
+
+    if (sobj->headers_out) {
+        store_table(sobj->headers_out, (unsigned char *)sobj->record,
+                    sobj->record_len, &slider);
+    }
+    if (sobj->headers_in) {
+        store_table(sobj->headers_in, (unsigned char *)sobj->record,
+                    sobj->record_len, &slider);
+    }
+    sobj->record_len = slider;
+    rec->hdrs_len = (apr_uint32_t)(slider - sizeof(*rec) - key_len);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_body(cache_handle_t *h, request_rec *r,
+        apr_bucket_brigade *in, apr_bucket_brigade *out)
+{
+    disk_cache_dir_conf *dconf =
+            ap_get_module_config(r->per_dir_config, &cache_disk_module);
+    apr_bucket *e;
+    apr_status_t rv = APR_SUCCESS;
+    cache_segment_object_t *sobj =
+            (cache_segment_object_t *) h->cache_obj->vobj;
+    int seen_eos = 0;
+
+    if (!sobj->newbody) {
+        sobj->body_len = 0;
+        sobj->newbody = 1;
+    }
+
+    while (APR_SUCCESS == rv && !APR_BRIGADE_EMPTY(in)) {
+        const char *str;
+        apr_size_t length;
+
+        e = APR_BRIGADE_FIRST(in);
+
+        /* are we done completely? if so, pass any trailing buckets right through */
+        if (sobj->done || sobj->failed) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* have we seen eos yet? */
+        if (APR_BUCKET_IS_EOS(e)) {
+            seen_eos = 1;
+            sobj->done = 1;
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* honour flush buckets, we'll get called again */
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* metadata buckets are preserved as is */
+        if (APR_BUCKET_IS_METADATA(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* read the bucket, write to the cache */
+        rv = apr_bucket_read(e, &str, &length, APR_BLOCK_READ);
+        APR_BUCKET_REMOVE(e);
+        APR_BRIGADE_INSERT_TAIL(out, e);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10338)
+                    "Error when reading bucket for URL %s",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return rv;
+        }
+
+        /* don't write empty buckets to the cache */
+        if (!length) {
+            continue;
+        }
+
+        if (length > sobj->body_max - sobj->body_len) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10339)
+                    "URL %s failed the size check "
+                    "(>%" APR_SIZE_T_FMT ")",
+                    h->cache_obj->key, sobj->body_max);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        /* The body is handed over to the writer thread on commit, so it
+         * is malloc()ed rather than allocated from the request.
+         */
+        if (!sobj->body || sobj->body_len + length > sobj->body_size) {
+            apr_size_t size = sobj->body_size ? sobj->body_size : 16384;
+
+            while (size < sobj->body_len + length) {
+                size *= 2;
+            }
+            if (size > sobj->body_max) {
+                size = sobj->body_max;
+            }
+            sobj->body = ap_realloc(sobj->body, size);
+            sobj->body_size = size;
+        }
+        memcpy(sobj->body + sobj->body_len, str, length);
+        sobj->body_len += length;
+    }
+
+    /* Was this the final bucket? If yes, perform sanity checks.
+     */
+    if (seen_eos) {
+        const char *cl_header;
+        apr_off_t cl;
+
+        if (r->connection->aborted || r->no_cache) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(10340)
+                    "Discarding body for URL %s "
+                    "because connection has been aborted.",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        if ((apr_off_t)sobj->body_len < dconf->minfs) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10341)
+                    "URL %s failed the size check "
+                    "(%" APR_SIZE_T_FMT "<%" APR_OFF_T_FMT ")",
+                    h->cache_obj->key, sobj->body_len, dconf->minfs);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        cl_header = apr_table_get(r->headers_out, "Content-Length");
+        if (cl_header && (!ap_parse_strict_length(&cl, cl_header)
+                          || cl != (apr_off_t)sobj->body_len)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10342)
+                    "URL %s didn't receive complete response, not caching",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        /* All checks were fine, we're good to go when the commit comes */
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_object_t *obj = h->cache_obj;
+    cache_segment_object_t *sobj = (cache_segment_object_t *) obj->vobj;
+    cache_segment_record_t *rec;
+    cache_segment_job_t *job;
+    apr_status_t rv;
+
+    if (sobj->failed || !sobj->record) {
+        return APR_EGENERAL;
+    }
+
+    /* Headers only updated (revalidation), keep the body we have */
+    if (!sobj->newbody && sobj->fd) {
+        job = job_create(sobj->key, sobj->record, sobj->record_len);
+        job->src_seg = sobj->slot.seg;
+        job->src_gen = sobj->slot.gen;
+        job->src_offset = sobj->body_offset;
+        job->src_len = sobj->rec.body_len;
+    }
+    else {
+        job = job_create(sobj->key, sobj->record, sobj->record_len);
+        job->body = sobj->body;
+        job->body_len = sobj->body_len;
+        sobj->body = NULL;
+    }
+    rec = (cache_segment_record_t *)job->record;
+    rec->body_len = (apr_uint32_t)(job->src_len ? job->src_len
+                                                : job->body_len);
+
+    if (job->record_len + rec->body_len > segment_max_record()) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10343)
+                "URL %s record too large for the cache segments",
+                sobj->name);
+        job_free(job);
+        return APR_EGENERAL;
+    }
+
+    if (sobj->vary) {
+        rv = segment_queue(r, job_create(sobj->name, sobj->vary,
+                                         sobj->vary_len));
+        if (rv != APR_SUCCESS) {
+            job_free(job);
+            goto fail;
+        }
+    }
+    rv = segment_queue(r, job);
+    if (rv != APR_SUCCESS) {
+        goto fail;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10344)
+            "commit_entity: Headers and body for URL %s queued for the "
+            "cache segments", sobj->name);
+
+    return APR_SUCCESS;
+
+fail:
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10345)
+            "could not queue to the cache segments, ignoring: %s",
+            sobj->key);
+
+    /* For safety, remove any existing entry on failure, just in case
+     * it could not be revalidated successfully.
+     */
+    index_remove(r->server, segment_hash(sobj->key));
+    return rv;
+}
+
+static apr_status_t invalidate_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_segment_object_t *sobj = (cache_segment_object_t *) h->cache_obj->vobj;
+
+    /* The records are immutable, drop it so that it is fetched again */
+    h->cache_obj->info.control.invalidated = 1;
+    index_remove(r->server, segment_hash(sobj->key));
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Configuration directives handlers, the segment store is global.
+ */
+const char *cache_segment_set_root(cmd_parms *cmd, void *in_struct_ptr,
+                                   const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    cache_segment_root = ap_server_root_relative(cmd->pool, arg);
+    if (!cache_segment_root) {
+        return apr_pstrcat(cmd->pool, "Invalid CacheSegmentRoot path ", arg,
+                           NULL);
+    }
+    return NULL;
+}
+
+const char *cache_segment_set_size(cmd_parms *cmd, void *in_struct_ptr,
+                                   const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || size <= 0) {
+        return "CacheSegmentSize argument must be a positive size in bytes, "
+               "with an optional K, M or G suffix";
+    }
+    switch (apr_toupper(*end)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        ++end;
+        break;
+    }
+    if (*end || size < 1024 * 1024 || size > MAX_SEGMENT_SIZE) {
+        return "CacheSegmentSize argument must be a size in bytes between "
+               "1M and 1G, with an optional K, M or G suffix";
+    }
+    cache_segment_size = (apr_uint32_t)size;
+    return NULL;
+}
+
+const char *cache_segment_set_count(cmd_parms *cmd, void *in_struct_ptr,
+                                    const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+    n = atoi(arg);
+    if (n < 2 || n > MAX_SEGMENT_COUNT) {
+        return "CacheSegmentCount argument must be a number of segments "
+               "between 2 and " APR_STRINGIFY(MAX_SEGMENT_COUNT);
+    }
+    cache_segment_count = (apr_uint32_t)n;
+    return NULL;
+}
+
+static apr_status_t destroy_store(void *data)
+{
+    if (cache_segment_shm) {
+        apr_shm_destroy(cache_segment_shm);
+        cache_segment_shm = NULL;
+    }
+    segment_hdr = NULL;
+    return APR_SUCCESS;
+}
+
+static int segment_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, cache_segment_id, NULL,
+            APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(10346)
+                "failed to register %s mutex", cache_segment_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    cache_segment_root = NULL;
+    cache_segment_size = DEFAULT_SEGMENT_SIZE;
+    cache_segment_count = DEFAULT_SEGMENT_COUNT;
+
+    return OK;
+}
+
+static int segment_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                               apr_pool_t *ptmp, server_rec *s)
+{
+    const char *data_file = NULL;
+    apr_uint32_t *prev_nonce;
+    apr_uint64_t nslots;
+    void *data;
+    apr_size_t size, nsets;
+    apr_status_t rv;
+    char *base;
+    unsigned int i;
+
+    cache_segment_shm = NULL;
+    segment_hdr = NULL;
+
+    if (!cache_segment_root
+            || ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    nslots = (apr_uint64_t)cache_segment_size * cache_segment_count
+             / CACHE_SEGMENT_AVG_RECORD;
+    nsets = (apr_size_t)(nslots / (CACHE_SEGMENT_SHARDS * CACHE_SEGMENT_WAYS));
+    if (!nsets) {
+        nsets = 1;
+    }
+    size = APR_ALIGN_DEFAULT(sizeof(cache_segment_hdr_t))
+           + APR_ALIGN_DEFAULT(cache_segment_count * sizeof(cache_segment_t))
+           + nsets * CACHE_SEGMENT_SHARDS * CACHE_SEGMENT_WAYS
+             * sizeof(cache_segment_slot_t);
+
+    /* Use anonymous shm by default, fall back on name-based. */
+    rv = apr_shm_create(&cache_segment_shm, size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        data_file = ap_runtime_dir_relative(pconf, cache_segment_id);
+        if (data_file == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10347)
+                         "Could not use anonymous shm for the %s index",
+                         cache_segment_id);
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+
+        /* For a name-based segment, remove it first in case of a
+         * previous unclean shutdown. */
+        apr_shm_remove(data_file, pconf);
+
+        rv = apr_shm_create(&cache_segment_shm, size, data_file, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10348)
+                     "Could not allocate %" APR_SIZE_T_FMT " bytes of "
+                     "shared memory for the %s index", size,
+                     cache_segment_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, NULL, destroy_store,
+                              apr_pool_cleanup_null);
+
+    base = apr_shm_baseaddr_get(cache_segment_shm);
+    memset(base, 0, size);
+    segment_hdr = (cache_segment_hdr_t *)base;
+    segment_hdr->nsets = (apr_uint32_t)nsets;
+
+    /* The nonce of the previous generation survives the (DSO) reload */
+    apr_pool_userdata_get(&data, cache_segment_id, s->process->pool);
+    prev_nonce = data;
+    if (!prev_nonce) {
+        prev_nonce = apr_pcalloc(s->process->pool, sizeof(*prev_nonce));
+        apr_pool_userdata_set(prev_nonce, cache_segment_id,
+                              apr_pool_cleanup_null, s->process->pool);
+    }
+    do {
+        ap_random_insecure_bytes(&segment_hdr->nonce,
+                                 sizeof(segment_hdr->nonce));
+    } while (!segment_hdr->nonce || segment_hdr->nonce == *prev_nonce);
+    segments = (cache_segment_t *)(base
+                   + APR_ALIGN_DEFAULT(sizeof(cache_segment_hdr_t)));
+    segment_slots = (cache_segment_slot_t *)((char *)segments
+                   + APR_ALIGN_DEFAULT(cache_segment_count
+                                       * sizeof(cache_segment_t)));
+    for (i = 0; i < cache_segment_count; ++i) {
+        segments[i].gen = 1;
+    }
+
+    /* The records of the previous runs can't be found anymore, the
+     * children create the segments anew as the server user.  Those of the
+     * generation before this one will be removed with the next one.
+     */
+    segment_remove_stale(ptmp, *prev_nonce);
+    *prev_nonce = segment_hdr->nonce;
+
+    for (i = 0; i <= CACHE_SEGMENT_SHARDS; ++i) {
+        rv = ap_global_mutex_create(&segment_mutexes[i], NULL,
+                                    cache_segment_id,
+                                    apr_psprintf(ptmp, "%u", i), s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10349)
+                         "failed to create %s mutex", cache_segment_id);
+            segment_hdr = NULL;
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10350)
+                 "%s: %u segments of %u bytes in %s, %" APR_SIZE_T_FMT
+                 " index slots", cache_segment_id, cache_segment_count,
+                 cache_segment_size, cache_segment_root,
+                 nsets * CACHE_SEGMENT_SHARDS * CACHE_SEGMENT_WAYS);
+
+    return OK;
+}
+
+static void segment_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+    unsigned int i;
+
+    if (!segment_hdr) {
+        return;
+    }
+    for (i = 0; i <= CACHE_SEGMENT_SHARDS; ++i) {
+        rv = apr_global_mutex_child_init(&segment_mutexes[i],
+                apr_global_mutex_lockfile(segment_mutexes[i]), p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10351)
+                    "failed to initialise mutex in child_init");
+        }
+    }
+
+    apr_pool_create(&writer_pool, p);
+    apr_pool_tag(writer_pool, "cache_segment_writer");
+    writer_fds = apr_pcalloc(writer_pool,
+                             cache_segment_count * sizeof(apr_file_t *));
+    writer_gens = apr_pcalloc(writer_pool,
+                              cache_segment_count * sizeof(apr_uint32_t));
+
+#if APR_HAS_THREADS
+    writer_stop = 0;
+    rv = apr_thread_mutex_create(&writer_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&writer_cond, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_create(&writer_thread, NULL, segment_writer, s, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10352)
+                     "failed to create the %s writer thread, the segment "
+                     "store is disabled in this process", cache_segment_id);
+        segment_hdr = NULL;
+        return;
+    }
+    /* Before the subpools go, the writer's included */
+    apr_pool_pre_cleanup_register(p, NULL, writer_cleanup);
+#endif
+}
+
+static const cache_provider cache_segment_provider =
+{
+    &remove_entity, &store_headers, &store_body, &recall_headers, &recall_body,
+    &create_entity, &open_entity, &remove_url, &commit_entity,
+    &invalidate_entity
+};
+
+void cache_segment_register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, CACHE_PROVIDER_GROUP, "segment", "0",
+                         &cache_segment_provider);
+    ap_hook_pre_config(segment_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(segment_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(segment_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+}
@@ -377,6 +377,81 @@ apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
 
 }
 
+/**
+ * Wait for another request filling the cache for the same key.
+ *
+ * This collapses concurrent misses for the same key: only the request
+ * holding the lock goes to the backend, the others poll the lock file
+ * (with an exponential backoff) and select the entity again when it is
+ * gone.  A lock older than CacheLockMaxAge, or which outlives our own
+ * CacheLockWait, is not waited for, the request then being let through
+ * to the backend as without CacheLockWait.
+ */
+int cache_wait_lock(cache_server_conf *conf, cache_request_rec *cache,
+        request_rec *r)
+{
+    apr_status_t status;
+    apr_interval_time_t delay = CACHE_LOCKWAIT_MIN_DELAY;
+    apr_time_t now, deadline;
+    const char *lockname;
+    apr_finfo_t finfo;
+    void *dummy;
+
+    if (!conf || !conf->lock || !conf->lockpath || conf->lockwait <= 0) {
+        return 0;
+    }
+
+    /* Cache-Control: no-cache won't be served from the cache anyway */
+    if (!ap_cache_check_no_cache(cache, r)) {
+        return 0;
+    }
+
+    status = cache_try_lock(conf, cache, r);
+    if (!APR_STATUS_IS_EEXIST(status)) {
+        /* we are first (or the lock failed), no one to wait for */
+        return 0;
+    }
+    apr_pool_userdata_get(&dummy, CACHE_LOCKNAME_KEY, r->pool);
+    lockname = (const char *)dummy;
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10314)
+            "Cache locked for url, waiting for it to be cached: %s",
+            r->unparsed_uri);
+
+    now = apr_time_now();
+    deadline = now + conf->lockwait;
+    for (;;) {
+        if (delay > deadline - now) {
+            delay = deadline - now;
+        }
+        apr_sleep(delay);
+
+        status = apr_stat(&finfo, lockname, APR_FINFO_MTIME, r->pool);
+        if (APR_STATUS_IS_ENOENT(status)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10315)
+                    "Cache lock released, selecting url again: %s",
+                    r->unparsed_uri);
+            return 1;
+        }
+        if (status != APR_SUCCESS) {
+            return 0;
+        }
+
+        now = apr_time_now();
+        if (now >= deadline || (now - finfo.mtime) > conf->lockmaxage
+                || now < finfo.mtime) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10316)
+                    "Cache lock still held, giving up waiting: %s",
+                    r->unparsed_uri);
+            return 0;
+        }
+
+        if (delay < CACHE_LOCKWAIT_MAX_DELAY) {
+            delay *= 2;
+        }
+    }
+}
+
 /**
  * Remove the cache lock, if present.
  *
@@ -98,6 +98,8 @@ extern "C" {
 #define DEFAULT_CACHE_LOCKPATH "mod_cache-lock"
 #define CACHE_LOCKNAME_KEY "mod_cache-lockname"
 #define CACHE_LOCKFILE_KEY "mod_cache-lockfile"
+#define CACHE_LOCKWAIT_MIN_DELAY apr_time_from_msec(1)
+#define CACHE_LOCKWAIT_MAX_DELAY apr_time_from_msec(50)
 #define CACHE_CTX_KEY "mod_cache-ctx"
 
 /**
@@ -125,6 +127,8 @@ typedef struct {
     apr_array_header_t *ignore_session_id;
     const char *lockpath;
     apr_time_t lockmaxage;
+    /** how long a miss waits for a concurrent fill (CacheLockWait) */
+    apr_interval_time_t lockwait;
     apr_uri_t *base_uri;
     /** ignore client's requests for uncached responses */
     unsigned int ignorecachecontrol:1;
@@ -151,6 +155,7 @@ typedef struct {
     unsigned int lock_set:1;
     unsigned int lockpath_set:1;
     unsigned int lockmaxage_set:1;
+    unsigned int lockwait_set:1;
     unsigned int x_cache_set:1;
     unsigned int x_cache_detail_set:1;
 } cache_server_conf;
@@ -283,6 +288,27 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
 apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
         request_rec *r);
 
+/**
+ * Wait for another request filling the cache for the same key.
+ *
+ * On a cache miss with CacheLockWait set, if the cache lock for the key
+ * is held by another request, wait (for at most CacheLockWait) until
+ * that request is done with the backend and releases the lock, so that
+ * the caller can serve the entity it cached rather than going to the
+ * backend as well.
+ *
+ * If the lock is free, we obtain it and return straight away, the
+ * caller being the one to fill the cache.
+ *
+ * @param conf cache_server_conf
+ * @param cache cache_request_rec
+ * @param r request_rec
+ * @return 1 ==> the lock was released, try to select the entity again,
+ *         0 ==> nothing (more) to wait for
+ */
+int cache_wait_lock(cache_server_conf *conf, cache_request_rec *cache,
+        request_rec *r);
+
 /**
  * Remove the cache lock, if present.
  *
@@ -177,6 +177,11 @@ static int cache_quick_handler(request_rec *r, int lookup)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED && !lookup && !cache->stale_handle
+            && cache_wait_lock(conf, cache, r)) {
+        /* another request just filled the cache for this url */
+        rv = cache_select(cache, r);
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
             if (!lookup) {
@@ -477,6 +482,11 @@ static int cache_handler(request_rec *r)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED && !cache->stale_handle
+            && cache_wait_lock(conf, cache, r)) {
+        /* another request just filled the cache for this url */
+        rv = cache_select(cache, r);
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
 
@@ -2031,6 +2041,7 @@ static void * create_cache_config(apr_pool_t *p, server_rec *s)
     ps->lock_set = 0;
     ps->lockpath = ap_runtime_dir_relative(p, DEFAULT_CACHE_LOCKPATH);
     ps->lockmaxage = apr_time_from_sec(DEFAULT_CACHE_MAXAGE);
+    ps->lockwait = 0; /* misses don't wait for concurrent fills */
     ps->x_cache = DEFAULT_X_CACHE;
     ps->x_cache_detail = DEFAULT_X_CACHE_DETAIL;
     return ps;
@@ -2079,6 +2090,10 @@ static void * merge_cache_config(apr_pool_t *p, void *basev, void *overridesv)
         (overrides->lockmaxage_set == 0)
         ? base->lockmaxage
         : overrides->lockmaxage;
+    ps->lockwait =
+        (overrides->lockwait_set == 0)
+        ? base->lockwait
+        : overrides->lockwait;
     ps->quick =
         (overrides->quick_set == 0)
         ? base->quick
@@ -2430,6 +2445,25 @@ static const char *set_cache_lock_maxage(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *set_cache_lock_wait(cmd_parms *parms, void *dummy,
+                                    const char *arg)
+{
+    cache_server_conf *conf;
+    apr_interval_time_t timeout;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    if (ap_timeout_parameter_parse(arg, &timeout, "s") != APR_SUCCESS
+            || timeout < 0) {
+        return "CacheLockWait value must be a positive time, in seconds "
+               "unless another unit (e.g. ms) is given";
+    }
+    conf->lockwait = timeout;
+    conf->lockwait_set = 1;
+    return NULL;
+}
+
 static const char *set_cache_x_cache(cmd_parms *parms, void *dummy, int flag)
 {
 
@@ -2585,6 +2619,9 @@ static const command_rec cache_cmds[] =
                   "DefaultRuntimeDir setting."),
     AP_INIT_TAKE1("CacheLockMaxAge", set_cache_lock_maxage, NULL, RSRC_CONF,
                   "Maximum age of any thundering herd lock."),
+    AP_INIT_TAKE1("CacheLockWait", set_cache_lock_wait, NULL, RSRC_CONF,
+                  "Maximum time a cache miss waits for the request holding "
+                  "the thundering herd lock to fill the cache."),
     AP_INIT_FLAG("CacheHeader", set_cache_x_cache, NULL, RSRC_CONF | ACCESS_CONF,
                  "Add a X-Cache header to responses. Default is off."),
     AP_INIT_FLAG("CacheDetailHeader", set_cache_x_cache_detail, NULL,
@@ -893,16 +893,228 @@ static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
 
     apr_file_close(dobj->hdrs.fd);
 
+    /* The body of an in progress entity is complete at its Content-Length */
+    if (dobj->disk_info.in_progress && dobj->disk_info.has_body) {
+        const char *cl_header = apr_table_get(h->resp_hdrs, "Content-Length");
+        apr_off_t cl;
+
+        if (!cl_header || !ap_parse_strict_length(&cl, cl_header)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10321)
+                    "In progress entity without a valid Content-Length "
+                    "in %s for %s, ignoring", dobj->hdrs.file, dobj->name);
+            return APR_EGENERAL;
+        }
+        dobj->file_size = cl;
+        dobj->stall = r->server->timeout;
+    }
+
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00720)
             "Recalled headers for URL %s", dobj->name);
     return APR_SUCCESS;
 }
 
+/*
+ * The body of an in progress entity is read by tail buckets, which follow
+ * the data file as it is written and wait (up to the server's Timeout
+ * without progress) for the data not there yet.  A data file removed
+ * while waiting means that the fill was abandoned.
+ */
+typedef struct {
+    apr_bucket_refcount refcount;
+    apr_file_t *fd;
+    apr_interval_time_t timeout;
+} disk_cache_tail_t;
+
+#define TAIL_MIN_DELAY apr_time_from_msec(1)
+#define TAIL_MAX_DELAY apr_time_from_msec(100)
+#define TAIL_MAX_LENGTH 0x40000000
+
+static const apr_bucket_type_t bucket_type_tail;
+
+static void tail_bucket_destroy(void *data)
+{
+    disk_cache_tail_t *t = data;
+
+    if (apr_bucket_shared_destroy(t)) {
+        apr_bucket_free(t);
+    }
+}
+
+static apr_status_t tail_bucket_read(apr_bucket *e, const char **str,
+                                     apr_size_t *len, apr_read_type_e block)
+{
+    disk_cache_tail_t *t = e->data;
+    apr_off_t start = e->start, offset = start;
+    apr_size_t length = e->length, n;
+    apr_interval_time_t delay = TAIL_MIN_DELAY;
+    apr_time_t now, deadline = 0;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    apr_bucket *b;
+    char *buf;
+
+    for (;;) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_NLINK,
+                               t->fd);
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_INCOMPLETE(rv)) {
+            return rv;
+        }
+        if (finfo.size > start) {
+            break;
+        }
+        if ((finfo.valid & APR_FINFO_NLINK) && !finfo.nlink) {
+            return APR_EGENERAL;
+        }
+        if (block == APR_NONBLOCK_READ) {
+            return APR_EAGAIN;
+        }
+
+        now = apr_time_now();
+        if (!deadline) {
+            deadline = now + t->timeout;
+        }
+        else if (now > deadline) {
+            return APR_TIMEUP;
+        }
+        apr_sleep(delay);
+        if (delay < TAIL_MAX_DELAY) {
+            delay *= 2;
+        }
+    }
+
+    n = APR_BUCKET_BUFF_SIZE;
+    if (n > length) {
+        n = length;
+    }
+    if ((apr_off_t)n > finfo.size - start) {
+        n = (apr_size_t)(finfo.size - start);
+    }
+
+    buf = apr_bucket_alloc(n, e->list);
+    rv = apr_file_seek(t->fd, APR_SET, &offset);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_read_full(t->fd, buf, n, &n);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_bucket_free(buf);
+        return rv;
+    }
+
+    apr_bucket_heap_make(e, buf, n, apr_bucket_free);
+    *str = buf;
+    *len = n;
+
+    /* the rest follows in a new tail bucket */
+    if (length > n) {
+        b = apr_bucket_alloc(sizeof(*b), e->list);
+        b->start = start + n;
+        b->length = length - n;
+        b->data = t;
+        b->type = &bucket_type_tail;
+        b->free = apr_bucket_free;
+        b->list = e->list;
+        APR_BUCKET_INSERT_AFTER(e, b);
+    }
+    else {
+        tail_bucket_destroy(t);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t tail_bucket_setaside(apr_bucket *e, apr_pool_t *p)
+{
+    disk_cache_tail_t *t = e->data;
+    apr_file_t *fd;
+    apr_status_t rv;
+
+    if (apr_pool_is_ancestor(apr_file_pool_get(t->fd), p)) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_file_setaside(&fd, t->fd, p);
+    if (rv == APR_SUCCESS) {
+        t->fd = fd;
+    }
+
+    return rv;
+}
+
+static const apr_bucket_type_t bucket_type_tail = {
+    "CACHE_DISK_TAIL", 5, APR_BUCKET_DATA,
+    tail_bucket_destroy,
+    tail_bucket_read,
+    tail_bucket_setaside,
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+static apr_status_t recall_tail(disk_cache_object_t *dobj, apr_pool_t *p,
+                                apr_bucket_brigade *bb)
+{
+    disk_cache_tail_t *t;
+    apr_finfo_t finfo;
+    apr_off_t offset = 0, length;
+    apr_bucket *e;
+    apr_file_t *fd;
+    apr_status_t rv;
+
+    /* what is there already is sent as usual */
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, dobj->data.fd);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    if (finfo.size > 0) {
+        offset = finfo.size < dobj->file_size ? finfo.size : dobj->file_size;
+        apr_brigade_insert_file(bb, dobj->data.fd, 0, offset, p);
+    }
+    if (offset >= dobj->file_size) {
+        return APR_SUCCESS;
+    }
+
+    /* the tail has its own descriptor, set aside independently */
+    rv = apr_file_dup(&fd, dobj->data.fd, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    t = apr_bucket_alloc(sizeof(*t), bb->bucket_alloc);
+    t->fd = fd;
+    t->timeout = dobj->stall;
+
+    length = dobj->file_size - offset;
+    e = apr_bucket_alloc(sizeof(*e), bb->bucket_alloc);
+    APR_BUCKET_INIT(e);
+    e->free = apr_bucket_free;
+    e->list = bb->bucket_alloc;
+    e = apr_bucket_shared_make(e, t, offset, length < TAIL_MAX_LENGTH
+                                             ? length : TAIL_MAX_LENGTH);
+    e->type = &bucket_type_tail;
+    APR_BRIGADE_INSERT_TAIL(bb, e);
+
+    /* split like apr_brigade_insert_file() to fit in the bucket lengths */
+    while (length > TAIL_MAX_LENGTH) {
+        apr_bucket *b;
+
+        apr_bucket_copy(e, &b);
+        b->start = e->start + e->length;
+        length -= TAIL_MAX_LENGTH;
+        b->length = length < TAIL_MAX_LENGTH ? length : TAIL_MAX_LENGTH;
+        APR_BRIGADE_INSERT_TAIL(bb, b);
+        e = b;
+    }
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p, apr_bucket_brigade *bb)
 {
     disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
 
     if (dobj->data.fd) {
+        if (dobj->disk_info.in_progress) {
+            return recall_tail(dobj, p, bb);
+        }
         apr_brigade_insert_file(bb, dobj->data.fd, 0, dobj->file_size, p);
     }
 
@@ -1075,6 +1287,7 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
     disk_info.device = dobj->disk_info.device;
     disk_info.has_body = dobj->disk_info.has_body;
     disk_info.header_only = dobj->disk_info.header_only;
+    disk_info.in_progress = dobj->disk_info.in_progress;
 
     disk_info.name_len = strlen(dobj->name);
 
@@ -1134,6 +1347,81 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
     return APR_SUCCESS;
 }
 
+static apr_status_t stream_cleanup(void *dummy)
+{
+    disk_cache_object_t *dobj = (disk_cache_object_t *)dummy;
+
+    /* the fill was abandoned, unpublish the entity (the data file goes
+     * with the temporary file cleanup)
+     */
+    if (dobj->streaming) {
+        apr_file_remove(dobj->hdrs.file, apr_pool_parent_get(dobj->data.pool));
+        dobj->streaming = 0;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * With CacheStreamingFill, the entity is published as soon as its body
+ * starts to be stored: the data file is moved in place (the writes go on
+ * through the temporary file descriptor) and the headers are committed
+ * flagged in progress, so that concurrent requests can follow the body
+ * as it is written rather than going to the backend.
+ */
+static apr_status_t stream_publish(cache_handle_t *h, request_rec *r)
+{
+    disk_cache_conf *conf = ap_get_module_config(r->server->module_config,
+                                                 &cache_disk_module);
+    disk_cache_object_t *dobj = (disk_cache_object_t *) h->cache_obj->vobj;
+    apr_status_t rv;
+
+    dobj->disk_info.in_progress = 1;
+    apr_pool_cleanup_register(dobj->data.pool, dobj, stream_cleanup,
+                              apr_pool_cleanup_null);
+
+    /* this computes the final data file name in the Vary case */
+    rv = write_headers(h, r);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = safe_file_rename(conf, dobj->data.tempfile, dobj->data.file,
+                          dobj->data.pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10317)
+                "rename tempfile to file failed:"
+                " %s -> %s", dobj->data.tempfile, dobj->data.file);
+        return rv;
+    }
+    /* removed by the temporary file cleanup if the fill is abandoned */
+    dobj->data.tempfile = apr_pstrdup(dobj->data.pool, dobj->data.file);
+
+    rv = file_cache_el_final(conf, &dobj->hdrs, r);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    dobj->streaming = 1;
+
+    rv = file_cache_el_final(conf, &dobj->vary, r);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* apr_file_mktemp() consumed the templates, the headers are written
+     * again on commit
+     */
+    dobj->hdrs.tempfile = apr_pstrcat(dobj->hdrs.pool, conf->cache_root,
+                                      AP_TEMPFILE, NULL);
+    dobj->vary.tempfile = apr_pstrcat(dobj->vary.pool, conf->cache_root,
+                                      AP_TEMPFILE, NULL);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10318)
+            "Published in progress entity for URL %s", dobj->name);
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t store_body(cache_handle_t *h, request_rec *r,
                                apr_bucket_brigade *in, apr_bucket_brigade *out)
 {
@@ -1232,6 +1520,31 @@ static apr_status_t store_body(cache_handle_t *h, request_rec *r,
                 dobj->disk_info.device = finfo.device;
                 dobj->disk_info.inode = finfo.inode;
                 dobj->disk_info.has_body = 1;
+
+                /* readers need the length to know when the body is
+                 * complete, so only entities with a Content-Length are
+                 * published early
+                 */
+                if (dconf->streaming) {
+                    const char *cl_header;
+                    apr_off_t cl;
+
+                    cl_header = apr_table_get(r->headers_out, "Content-Length");
+                    if (cl_header && ap_parse_strict_length(&cl, cl_header)
+                            && cl >= dconf->minfs && cl <= dconf->maxfs) {
+                        rv = stream_publish(h, r);
+                        if (rv != APR_SUCCESS) {
+                            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                                    APLOGNO(10319) "Could not publish in "
+                                    "progress entity for URL %s, not caching",
+                                    h->cache_obj->key);
+                            if (dobj->data.pool) {
+                                apr_pool_destroy(dobj->data.pool);
+                            }
+                            return rv;
+                        }
+                    }
+                }
             }
 
             /* write to the cache, leave if we fail */
@@ -1272,6 +1585,18 @@ static apr_status_t store_body(cache_handle_t *h, request_rec *r,
 
     }
 
+    /* make what was written so far visible to the readers */
+    if (dobj->streaming && !seen_eos) {
+        rv = apr_file_flush(dobj->data.tempfd);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10320)
+                    "Error when writing cache file for URL %s",
+                    h->cache_obj->key);
+            apr_pool_destroy(dobj->data.pool);
+            return rv;
+        }
+    }
+
     /* Was this the final bucket? If yes, close the temp file and perform
      * sanity checks.
      */
@@ -1331,6 +1656,13 @@ static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
     disk_cache_object_t *dobj = (disk_cache_object_t *) h->cache_obj->vobj;
     apr_status_t rv;
 
+    /* a streamed body is in place already, only the headers change */
+    if (dobj->streaming) {
+        dobj->streaming = 0;
+        dobj->disk_info.in_progress = 0;
+        dobj->data.tempfd = NULL;
+    }
+
     /* write the headers to disk at the last possible moment */
     rv = write_headers(h, r);
 
@@ -1409,6 +1741,8 @@ static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv)
     new->readsize_set = add->readsize_set || base->readsize_set;
     new->readtime = (add->readtime_set == 0) ? base->readtime : add->readtime;
     new->readtime_set = add->readtime_set || base->readtime_set;
+    new->streaming = (add->streaming_set == 0) ? base->streaming : add->streaming;
+    new->streaming_set = add->streaming_set || base->streaming_set;
 
     return new;
 }
@@ -1534,6 +1868,16 @@ static const char
     return NULL;
 }
 
+static const char
+*set_cache_streaming(cmd_parms *parms, void *in_struct_ptr, int flag)
+{
+    disk_cache_dir_conf *dconf = (disk_cache_dir_conf *)in_struct_ptr;
+
+    dconf->streaming = flag;
+    dconf->streaming_set = 1;
+    return NULL;
+}
+
 static const command_rec disk_cache_cmds[] =
 {
     AP_INIT_TAKE1("CacheRoot", set_cache_root, NULL, RSRC_CONF,
@@ -1550,6 +1894,14 @@ static const command_rec disk_cache_cmds[] =
                   "The maximum quantity of data to attempt to read and cache in one go"),
     AP_INIT_TAKE1("CacheReadTime", set_cache_readtime, NULL, RSRC_CONF | ACCESS_CONF,
                   "The maximum time taken to attempt to read and cache in go"),
+    AP_INIT_FLAG("CacheStreamingFill", set_cache_streaming, NULL, RSRC_CONF | ACCESS_CONF,
+                 "Allow entities to be served while they are being cached"),
+    AP_INIT_TAKE1("CacheSegmentRoot", cache_segment_set_root, NULL, RSRC_CONF,
+                  "The directory of the segment store (CacheEnable segment)"),
+    AP_INIT_TAKE1("CacheSegmentSize", cache_segment_set_size, NULL, RSRC_CONF,
+                  "The size of the segment files, 64M by default"),
+    AP_INIT_TAKE1("CacheSegmentCount", cache_segment_set_count, NULL, RSRC_CONF,
+                  "The number of segment files, 16 by default"),
     {NULL}
 };
 
@@ -1572,6 +1924,7 @@ static void disk_cache_register_hook(apr_pool_t *p)
     /* cache initializer */
     ap_register_provider(p, CACHE_PROVIDER_GROUP, "disk", "0",
                          &cache_disk_provider);
+    cache_segment_register_hook(p);
 }
 
 AP_DECLARE_MODULE(cache_disk) = {
@@ -109,6 +109,10 @@ SOURCE=.\mod_cache_disk.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\cache_disk_segment.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\build\win32\httpd.rc
 # End Source File
 # End Target
@@ -18,6 +18,7 @@
 #define MOD_CACHE_DISK_H
 
 #include "apr_file_io.h"
+#include "http_config.h"
 
 #include "cache_disk_common.h"
 
@@ -53,7 +54,9 @@ typedef struct disk_cache_object {
     apr_table_t *headers_out;    /* Output headers to save */
     apr_off_t offset;            /* Max size to set aside */
     apr_time_t timeout;          /* Max time to set aside */
+    apr_interval_time_t stall;   /* Max time to wait for an in progress body */
     unsigned int done:1;         /* Is the attempt to cache complete? */
+    unsigned int streaming:1;    /* Is the entity published while stored? */
 } disk_cache_object_t;
 
 
@@ -81,11 +84,22 @@ typedef struct {
     apr_off_t maxfs;             /* maximum file size for cached files */
     apr_off_t readsize;          /* maximum data to attempt to cache in one go */
     apr_time_t readtime;         /* maximum time taken to cache in one go */
+    int streaming;               /* publish entities while they are stored */
     unsigned int minfs_set:1;
     unsigned int maxfs_set:1;
     unsigned int readsize_set:1;
     unsigned int readtime_set:1;
+    unsigned int streaming_set:1;
 } disk_cache_dir_conf;
 
+/* The segment store (cache_disk_segment.c) */
+const char *cache_segment_set_root(cmd_parms *cmd, void *in_struct_ptr,
+                                   const char *arg);
+const char *cache_segment_set_size(cmd_parms *cmd, void *in_struct_ptr,
+                                   const char *arg);
+const char *cache_segment_set_count(cmd_parms *cmd, void *in_struct_ptr,
+                                    const char *arg);
+void cache_segment_register_hook(apr_pool_t *p);
+
 #endif /*MOD_CACHE_DISK_H*/
 
@@ -0,0 +1,1873 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_buckets.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_core.h"
+#include "http_main.h"
+#include "http_protocol.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+
+#include "mod_cache.h"
+#include "mod_status.h"
+
+#include "cache_common.h"
+
+/*
+ * mod_cache_shm: Shared Memory Based HTTP 1.1 Cache.
+ *
+ * The cache is a shared memory segment created by the parent and
+ * inherited by the children, split into shards.  Each shard has its own
+ * lock, hash table and blocks of CACHE_SHM_BLOCK_SIZE bytes, and evicts
+ * its entries with a CLOCK (second chance) hand over its blocks.
+ *
+ * An entry is a chain of blocks, the first one starting with the
+ * cache_shm_entry_t, followed by the key then the record:
+ *
+ * Format #1 (Vary):
+ *   apr_uint32_t format;
+ *   apr_time_t expire;
+ *   apr_array_t vary_headers (delimited by CRLF)
+ *
+ * Format #2:
+ *   cache_shm_info_t (first sizeof(apr_uint32_t) bytes is the format)
+ *   r->headers_out (delimited by CRLF)
+ *   CRLF
+ *   r->headers_in (delimited by CRLF)
+ *   CRLF
+ *   body
+ *
+ * Entries are reference counted: the cache holds one reference while the
+ * entry is linked in its shard, and each reader one more (taken under the
+ * shard lock, released atomically).  The last one to release the entry,
+ * be it the eviction or a reader, frees its blocks.  So the shard lock is
+ * only held to find or link entries and (de)allocate blocks, never while
+ * copying data, and the bodies are served as buckets pointing to the
+ * shared memory, which keep their entry alive until they are destroyed.
+ */
+
+module AP_MODULE_DECLARE_DATA cache_shm_module;
+
+#define CACHE_SHM_VARY_FORMAT_VERSION 1
+#define CACHE_SHM_FORMAT_VERSION 2
+
+typedef struct {
+    /* Indicates the format of the record. */
+    apr_uint32_t format;
+    /* The HTTP status code returned for this response.  */
+    int status;
+    /* Miscellaneous time values. */
+    apr_time_t date;
+    apr_time_t expire;
+    apr_time_t request_time;
+    apr_time_t response_time;
+    /* Does this cached request have a body? */
+    unsigned int header_only:1;
+    /* The parsed cache control header */
+    cache_control_t control;
+} cache_shm_info_t;
+
+#ifndef CACHE_SHM_BLOCK_SIZE
+#define CACHE_SHM_BLOCK_SIZE 1024
+#endif
+
+/*
+ * The header of the first block of an entry
+ */
+typedef struct {
+    apr_uint32_t refs;          /* the shard's (while linked) and readers' */
+    apr_uint32_t hash;
+    apr_uint32_t chain;         /* next entry in the hash bucket, block + 1 */
+    apr_uint32_t nblocks;
+    apr_uint32_t referenced;    /* CLOCK bit, set by hits */
+    apr_uint32_t key_len;       /* the key starts the data */
+    apr_uint32_t body_offset;   /* in the data */
+    apr_uint32_t len;           /* of the data */
+    apr_time_t expire;          /* when to evict it at the latest */
+} cache_shm_entry_t;
+
+#define CACHE_SHM_ENTRY_SIZE APR_ALIGN_DEFAULT(sizeof(cache_shm_entry_t))
+
+/* The states of the blocks, only the heads of the linked entries (and
+ * the abandoned ones) are considered by the CLOCK hand.
+ */
+#define CACHE_SHM_FREE      0
+#define CACHE_SHM_HEAD      1   /* head of a linked entry */
+#define CACHE_SHM_PENDING   2   /* head of an entry being written */
+#define CACHE_SHM_DEAD      3   /* head of an unlinked entry still read */
+#define CACHE_SHM_TAIL      4   /* other block of an entry */
+#define CACHE_SHM_ABANDONED 5   /* head of an entry written but not linked
+                                   (lock failure), freed by the hand */
+
+/*
+ * The shared header of a shard, followed by its hash buckets, the next
+ * block of each block (chains and free list), the state of each block,
+ * and the blocks.  Block numbers are stored + 1, 0 ending the lists.
+ */
+typedef struct {
+    apr_uint32_t nblocks;
+    apr_uint32_t nbuckets;      /* a power of 2 */
+    apr_uint32_t free;
+    apr_uint32_t nfree;
+    apr_uint32_t hand;
+    apr_uint32_t entries;
+    apr_uint64_t hits;
+    apr_uint64_t misses;
+    apr_uint64_t stores;
+    apr_uint64_t evictions;
+} cache_shm_shard_t;
+
+/* The process' view of a shard */
+typedef struct {
+    cache_shm_shard_t *hdr;
+    apr_uint32_t *buckets;
+    apr_uint32_t *next;
+    unsigned char *state;
+    char *blocks;
+    apr_global_mutex_t *mutex;
+} cache_shm_shard;
+
+/*
+ * cache_shm_object_t
+ * Pointed to by cache_object_t::vobj
+ */
+typedef struct cache_shm_object_t
+{
+    char *record;               /* the record to store, but the body */
+    apr_size_t record_len;
+    char *body;                 /* the body to store */
+    apr_size_t body_len;
+    apr_size_t body_max;
+    apr_table_t *headers_in;    /* Input headers to save */
+    apr_table_t *headers_out;   /* Output headers to save */
+    cache_shm_info_t shm_info;  /* Header information. */
+    apr_time_t expire;          /* when to expire the entry */
+
+    const char *name;           /* Requested URI without vary bits */
+    const char *key;            /* URI with Vary bits (if present) */
+
+    /* The entry found by open_entity(), pinned until the request ends */
+    cache_shm_shard *shard;
+    apr_uint32_t head;
+    apr_uint32_t body_offset;
+    apr_uint32_t len;
+
+    unsigned int newbody :1;    /* whether a new body is present */
+    unsigned int done :1;       /* Is the attempt to cache complete? */
+    unsigned int failed :1;     /* Should the entry not be stored? */
+} cache_shm_object_t;
+
+/*
+ * mod_cache_shm configuration
+ */
+#define DEFAULT_SHM_SIZE (64 * 1024 * 1024)
+#define DEFAULT_SHARDS 16
+#define MAX_SHARDS 256
+#define DEFAULT_MAX_FILE_SIZE 1024*1024
+#define DEFAULT_MAXTIME 86400
+#define DEFAULT_MINTIME 600
+
+typedef struct cache_shm_dir_conf
+{
+    apr_off_t max; /* maximum file size for cached files */
+    apr_time_t maxtime; /* maximum expiry time */
+    apr_time_t mintime; /* minimum expiry time */
+    unsigned int max_set :1;
+    unsigned int maxtime_set :1;
+    unsigned int mintime_set :1;
+} cache_shm_dir_conf;
+
+/* Global configuration (CacheShmSize, CacheShmShards), and the cache */
+static apr_size_t cache_shm_size = DEFAULT_SHM_SIZE;
+static unsigned int cache_shm_nshards = DEFAULT_SHARDS;
+static const char * const cache_shm_id = "cache-shm";
+static apr_shm_t *cache_shm = NULL;
+static cache_shm_shard *cache_shm_shards = NULL;
+
+/*
+ * Local static functions
+ */
+
+static apr_status_t read_array(request_rec *r, apr_array_header_t *arr,
+        unsigned char *buffer, apr_size_t buffer_len, apr_size_t *slider)
+{
+    apr_size_t val = *slider;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == '\r') {
+            if (val == *slider) {
+                (*slider)++;
+                return APR_SUCCESS;
+            }
+            *((const char **) apr_array_push(arr)) = apr_pstrndup(r->pool,
+                    (const char *) buffer + val, *slider - val);
+            (*slider)++;
+            if (buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            val = *slider;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_array(apr_array_header_t *arr, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    const char **elts;
+
+    elts = (const char **) arr->elts;
+
+    for (i = 0; i < arr->nelts; i++) {
+        apr_size_t e_len = strlen(elts[i]);
+        if (e_len + 3 >= buffer_len - *slider) {
+            return APR_EOF;
+        }
+        len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                buffer ? buffer_len - *slider : 0, "%s" CRLF, elts[i]);
+        *slider += len;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t read_table(cache_handle_t *handle, request_rec *r,
+        apr_table_t *table, unsigned char *buffer, apr_size_t buffer_len,
+        apr_size_t *slider)
+{
+    apr_size_t key = *slider, colon = 0, len = 0;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == ':') {
+            if (!colon) {
+                colon = *slider;
+            }
+            (*slider)++;
+        }
+        else if (buffer[*slider] == '\r') {
+            len = colon;
+            if (key == *slider) {
+                (*slider)++;
+                if (buffer[*slider] == '\n') {
+                    (*slider)++;
+                }
+                return APR_SUCCESS;
+            }
+            if (!colon || buffer[colon++] != ':') {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10282)
+                        "Premature end of cache headers.");
+                return APR_EGENERAL;
+            }
+            /* Do not go past the \r from above as apr_isspace('\r') is true */
+            while (apr_isspace(buffer[colon]) && (colon < *slider)) {
+                colon++;
+            }
+            apr_table_addn(table, apr_pstrmemdup(r->pool, (const char *) buffer
+                    + key, len - key), apr_pstrmemdup(r->pool,
+                    (const char *) buffer + colon, *slider - colon));
+            (*slider)++;
+            if (buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            key = *slider;
+            colon = 0;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_table(apr_table_t *table, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    apr_table_entry_t *elts;
+
+    elts = (apr_table_entry_t *) apr_table_elts(table)->elts;
+    for (i = 0; i < apr_table_elts(table)->nelts; ++i) {
+        if (elts[i].key != NULL) {
+            apr_size_t key_len = strlen(elts[i].key);
+            apr_size_t val_len = strlen(elts[i].val);
+            if (key_len + val_len + 5 >= buffer_len - *slider) {
+                return APR_EOF;
+            }
+            len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                    buffer ? buffer_len - *slider : 0, "%s: %s" CRLF,
+                    elts[i].key, elts[i].val);
+            *slider += len;
+        }
+    }
+    if (3 >= buffer_len - *slider) {
+        return APR_EOF;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
+                             apr_array_header_t *varray, const char *oldkey,
+                             apr_size_t *newkeylen)
+{
+    struct iovec *iov;
+    int i, k;
+    int nvec;
+    const char *header;
+    const char **elts;
+
+    nvec = (varray->nelts * 2) + 1;
+    iov = apr_palloc(p, sizeof(struct iovec) * nvec);
+    elts = (const char **) varray->elts;
+
+    /* See mod_cache_socache regarding case insensitive values (TODO). */
+    for (i = 0, k = 0; i < varray->nelts; i++) {
+        header = apr_table_get(headers, elts[i]);
+        if (!header) {
+            header = "";
+        }
+        iov[k].iov_base = (char*) elts[i];
+        iov[k].iov_len = strlen(elts[i]);
+        k++;
+        iov[k].iov_base = (char*) header;
+        iov[k].iov_len = strlen(header);
+        k++;
+    }
+    iov[k].iov_base = (char*) oldkey;
+    iov[k].iov_len = strlen(oldkey);
+    k++;
+
+    return apr_pstrcatv(p, iov, k, newkeylen);
+}
+
+static int array_alphasort(const void *fn1, const void *fn2)
+{
+    return strcmp(*(char**) fn1, *(char**) fn2);
+}
+
+static void tokens_to_array(apr_pool_t *p, const char *data,
+        apr_array_header_t *arr)
+{
+    char *token;
+
+    while ((token = ap_get_list_item(p, &data)) != NULL) {
+        *((const char **) apr_array_push(arr)) = token;
+    }
+
+    /* Sort it so that "Vary: A, B" and "Vary: B, A" are stored the same. */
+    qsort((void *) arr->elts, arr->nelts, sizeof(char *), array_alphasort);
+}
+
+/*
+ * The shards
+ */
+
+static apr_uint32_t cache_shm_hash(const char *key, apr_size_t len)
+{
+    /* FNV-1a */
+    apr_uint32_t hash = 2166136261U;
+
+    while (len--) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static APR_INLINE cache_shm_shard *shard_of(apr_uint32_t hash)
+{
+    return &cache_shm_shards[hash % cache_shm_nshards];
+}
+
+static APR_INLINE char *shard_block(const cache_shm_shard *sh, apr_uint32_t b)
+{
+    return sh->blocks + (apr_size_t)b * CACHE_SHM_BLOCK_SIZE;
+}
+
+static APR_INLINE cache_shm_entry_t *shard_entry(const cache_shm_shard *sh,
+                                                 apr_uint32_t b)
+{
+    return (cache_shm_entry_t *)shard_block(sh, b);
+}
+
+static APR_INLINE apr_uint32_t *shard_bucket(const cache_shm_shard *sh,
+                                             apr_uint32_t hash)
+{
+    return &sh->buckets[(hash / cache_shm_nshards)
+                        & (sh->hdr->nbuckets - 1)];
+}
+
+/* A position in the data of an entry, walking its blocks */
+typedef struct {
+    const cache_shm_shard *sh;
+    apr_uint32_t block;
+    apr_size_t pos;             /* in block, up to CACHE_SHM_BLOCK_SIZE */
+} entry_cursor;
+
+static void cursor_init(entry_cursor *c, const cache_shm_shard *sh,
+                        apr_uint32_t head, apr_size_t off)
+{
+    c->sh = sh;
+    c->block = head;
+    c->pos = CACHE_SHM_ENTRY_SIZE + off;
+    while (c->pos > CACHE_SHM_BLOCK_SIZE) {
+        c->block = sh->next[c->block] - 1;
+        c->pos -= CACHE_SHM_BLOCK_SIZE;
+    }
+}
+
+/* The contiguous data at the cursor, *len (at most) bytes of it, which
+ * the cursor then moves past.
+ */
+static char *cursor_next(entry_cursor *c, apr_size_t *len)
+{
+    char *data;
+
+    if (c->pos == CACHE_SHM_BLOCK_SIZE) {
+        c->block = c->sh->next[c->block] - 1;
+        c->pos = 0;
+    }
+    if (*len > CACHE_SHM_BLOCK_SIZE - c->pos) {
+        *len = CACHE_SHM_BLOCK_SIZE - c->pos;
+    }
+    data = shard_block(c->sh, c->block) + c->pos;
+    c->pos += *len;
+    return data;
+}
+
+static void entry_read(const cache_shm_shard *sh, apr_uint32_t head,
+                       apr_size_t off, char *buf, apr_size_t len)
+{
+    entry_cursor c;
+
+    cursor_init(&c, sh, head, off);
+    while (len) {
+        apr_size_t n = len;
+        const char *data = cursor_next(&c, &n);
+        memcpy(buf, data, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void entry_write(const cache_shm_shard *sh, apr_uint32_t head,
+                        apr_size_t off, const char *buf, apr_size_t len)
+{
+    entry_cursor c;
+
+    cursor_init(&c, sh, head, off);
+    while (len) {
+        apr_size_t n = len;
+        char *data = cursor_next(&c, &n);
+        memcpy(data, buf, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+static int entry_has_key(const cache_shm_shard *sh, apr_uint32_t head,
+                         const char *key, apr_size_t len)
+{
+    entry_cursor c;
+
+    cursor_init(&c, sh, head, 0);
+    while (len) {
+        apr_size_t n = len;
+        const char *data = cursor_next(&c, &n);
+        if (memcmp(data, key, n)) {
+            return 0;
+        }
+        key += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Must be called with the shard locked, or by the last reference */
+static void shard_free(cache_shm_shard *sh, apr_uint32_t head)
+{
+    cache_shm_shard_t *hdr = sh->hdr;
+    apr_uint32_t nblocks = shard_entry(sh, head)->nblocks;
+    apr_uint32_t b = head, n;
+
+    for (n = nblocks; n; --n) {
+        apr_uint32_t next = sh->next[b];
+
+        sh->state[b] = CACHE_SHM_FREE;
+        sh->next[b] = hdr->free;
+        hdr->free = b + 1;
+        b = next - 1;
+    }
+    hdr->nfree += nblocks;
+}
+
+static apr_status_t shard_lock(cache_shm_shard *sh, server_rec *s)
+{
+    apr_status_t rv = apr_global_mutex_lock(sh->mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10283)
+                     "could not acquire %s lock", cache_shm_id);
+    }
+    return rv;
+}
+
+static void shard_unlock(cache_shm_shard *sh, server_rec *s)
+{
+    apr_status_t rv = apr_global_mutex_unlock(sh->mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10284)
+                     "could not release %s lock", cache_shm_id);
+    }
+}
+
+/* Drop a reference to an entry, freeing it with the last one.  The
+ * shard's own reference is dropped with the lock held (locked), the
+ * readers' without it.
+ */
+static void shard_release(cache_shm_shard *sh, apr_uint32_t head, int locked)
+{
+    if (apr_atomic_dec32(&shard_entry(sh, head)->refs)) {
+        return;
+    }
+    if (locked) {
+        shard_free(sh, head);
+    }
+    else if (shard_lock(sh, ap_server_conf) == APR_SUCCESS) {
+        shard_free(sh, head);
+        shard_unlock(sh, ap_server_conf);
+    }
+}
+
+/* Must be called with the shard locked */
+static void shard_unlink(cache_shm_shard *sh, apr_uint32_t head)
+{
+    cache_shm_entry_t *e = shard_entry(sh, head);
+    apr_uint32_t *link = shard_bucket(sh, e->hash);
+
+    while (*link != head + 1) {
+        link = &shard_entry(sh, *link - 1)->chain;
+    }
+    *link = e->chain;
+    e->chain = 0;
+    sh->state[head] = CACHE_SHM_DEAD;
+    sh->hdr->entries--;
+    shard_release(sh, head, 1);
+}
+
+/* Must be called with the shard locked, returns the head of the entry
+ * found (pinned) + 1, or 0.
+ */
+static apr_uint32_t shard_find(cache_shm_shard *sh, apr_uint32_t hash,
+                               const char *key, apr_size_t len,
+                               apr_time_t now, int pin)
+{
+    apr_uint32_t b = *shard_bucket(sh, hash);
+
+    while (b) {
+        cache_shm_entry_t *e = shard_entry(sh, b - 1);
+
+        if (e->hash == hash && e->key_len == len
+                && entry_has_key(sh, b - 1, key, len)) {
+            if (e->expire < now) {
+                shard_unlink(sh, b - 1);
+                break;
+            }
+            if (pin) {
+                apr_atomic_inc32(&e->refs);
+                e->referenced = 1;
+                sh->hdr->hits++;
+            }
+            return b;
+        }
+        b = e->chain;
+    }
+    if (pin) {
+        sh->hdr->misses++;
+    }
+    return 0;
+}
+
+/* Unlink the next entry the CLOCK hand finds, not referenced since it
+ * last went by (or expired), or free an abandoned one.  Must be called
+ * with the shard locked.
+ */
+static int shard_evict(cache_shm_shard *sh, apr_time_t now)
+{
+    cache_shm_shard_t *hdr = sh->hdr;
+    apr_uint32_t n;
+
+    for (n = 0; n < 2 * hdr->nblocks; ++n) {
+        apr_uint32_t b = hdr->hand;
+        cache_shm_entry_t *e;
+
+        hdr->hand = (b + 1) % hdr->nblocks;
+        if (sh->state[b] == CACHE_SHM_ABANDONED) {
+            shard_free(sh, b);
+            return 1;
+        }
+        if (sh->state[b] != CACHE_SHM_HEAD) {
+            continue;
+        }
+        e = shard_entry(sh, b);
+        if (e->referenced && e->expire >= now) {
+            e->referenced = 0;
+            continue;
+        }
+        shard_unlink(sh, b);
+        hdr->evictions++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Allocate the blocks of a (pending) entry, evicting others as needed.
+ * Must be called with the shard locked, returns the head + 1, or 0.
+ */
+static apr_uint32_t shard_alloc(cache_shm_shard *sh, apr_uint32_t nblocks,
+                                apr_time_t now)
+{
+    cache_shm_shard_t *hdr = sh->hdr;
+    apr_uint32_t head, b, n;
+
+    if (nblocks > hdr->nblocks / 2) {
+        return 0;
+    }
+    while (hdr->nfree < nblocks) {
+        if (!shard_evict(sh, now)) {
+            return 0;
+        }
+    }
+
+    head = b = hdr->free - 1;
+    for (n = 1; ; ++n) {
+        sh->state[b] = CACHE_SHM_TAIL;
+        if (n == nblocks) {
+            break;
+        }
+        b = sh->next[b] - 1;
+    }
+    hdr->free = sh->next[b];
+    sh->next[b] = 0;
+    hdr->nfree -= nblocks;
+    sh->state[head] = CACHE_SHM_PENDING;
+
+    return head + 1;
+}
+
+/*
+ * Store an entry: key, then record, then the body from memory or from
+ * the (pinned) entry src.  The blocks are allocated under the lock, but
+ * the data are written without it, the entry being linked (replacing
+ * any previous one) only then.
+ */
+static apr_status_t cache_shm_store(request_rec *r, const char *key,
+                                    apr_time_t expire,
+                                    const char *record, apr_size_t record_len,
+                                    const char *body, apr_size_t body_len,
+                                    cache_shm_shard *src, apr_uint32_t src_head,
+                                    apr_uint32_t src_offset)
+{
+    apr_size_t key_len = strlen(key), len;
+    apr_uint32_t hash = cache_shm_hash(key, key_len), head, old, nblocks;
+    cache_shm_shard *sh = shard_of(hash);
+    apr_time_t now = apr_time_now();
+    cache_shm_entry_t *e = NULL;
+    apr_status_t rv;
+
+    len = key_len + record_len + body_len;
+    if (len > APR_UINT32_MAX - CACHE_SHM_ENTRY_SIZE - CACHE_SHM_BLOCK_SIZE) {
+        return APR_ENOSPC;
+    }
+    nblocks = (apr_uint32_t)((CACHE_SHM_ENTRY_SIZE + len
+                              + CACHE_SHM_BLOCK_SIZE - 1)
+                             / CACHE_SHM_BLOCK_SIZE);
+
+    if ((rv = shard_lock(sh, r->server)) != APR_SUCCESS) {
+        return rv;
+    }
+    head = shard_alloc(sh, nblocks, now);
+    if (head) {
+        e = shard_entry(sh, head - 1);
+        e->nblocks = nblocks;
+        e->refs = 1;
+        e->hash = hash;
+        e->chain = 0;
+        e->referenced = 0;
+        e->key_len = (apr_uint32_t)key_len;
+        e->body_offset = (apr_uint32_t)(key_len + record_len);
+        e->len = (apr_uint32_t)len;
+        e->expire = expire;
+    }
+    shard_unlock(sh, r->server);
+    if (!head) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10285)
+                "no room in the cache for %" APR_SIZE_T_FMT " bytes: %s",
+                len, key);
+        return APR_ENOSPC;
+    }
+    --head;
+
+    entry_write(sh, head, 0, key, key_len);
+    entry_write(sh, head, key_len, record, record_len);
+    if (body) {
+        entry_write(sh, head, key_len + record_len, body, body_len);
+    }
+    else if (src) {
+        entry_cursor c;
+        apr_size_t off = key_len + record_len;
+
+        cursor_init(&c, src, src_head, src_offset);
+        while (off < len) {
+            apr_size_t n = len - off;
+            const char *data = cursor_next(&c, &n);
+            entry_write(sh, head, off, data, n);
+            off += n;
+        }
+    }
+
+    if ((rv = shard_lock(sh, r->server)) != APR_SUCCESS) {
+        /* Can't link it, nor free it here: leave it to the CLOCK hand,
+         * which only looks at the state of the head with the lock held.
+         */
+        sh->state[head] = CACHE_SHM_ABANDONED;
+        return rv;
+    }
+    if ((old = shard_find(sh, hash, key, key_len, now, 0))) {
+        shard_unlink(sh, old - 1);
+    }
+    e->chain = *shard_bucket(sh, hash);
+    *shard_bucket(sh, hash) = head + 1;
+    sh->state[head] = CACHE_SHM_HEAD;
+    sh->hdr->entries++;
+    sh->hdr->stores++;
+    shard_unlock(sh, r->server);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t cache_shm_remove(request_rec *r, const char *key)
+{
+    apr_size_t key_len = strlen(key);
+    apr_uint32_t hash = cache_shm_hash(key, key_len), head;
+    cache_shm_shard *sh = shard_of(hash);
+    apr_status_t rv;
+
+    if ((rv = shard_lock(sh, r->server)) != APR_SUCCESS) {
+        return rv;
+    }
+    if ((head = shard_find(sh, hash, key, key_len, 0, 0))) {
+        shard_unlink(sh, head - 1);
+    }
+    shard_unlock(sh, r->server);
+
+    return head ? APR_SUCCESS : APR_NOTFOUND;
+}
+
+/* Find and pin an entry, copying its record (but the body) to the pool */
+static apr_status_t cache_shm_fetch(request_rec *r, const char *key,
+                                    cache_shm_shard **shard,
+                                    apr_uint32_t *head,
+                                    unsigned char **record,
+                                    apr_size_t *record_len)
+{
+    apr_size_t key_len = strlen(key);
+    apr_uint32_t hash = cache_shm_hash(key, key_len), b;
+    cache_shm_shard *sh = shard_of(hash);
+    cache_shm_entry_t *e;
+    apr_status_t rv;
+
+    if ((rv = shard_lock(sh, r->server)) != APR_SUCCESS) {
+        return rv;
+    }
+    b = shard_find(sh, hash, key, key_len, apr_time_now(), 1);
+    shard_unlock(sh, r->server);
+    if (!b) {
+        return APR_NOTFOUND;
+    }
+
+    e = shard_entry(sh, --b);
+    *record_len = e->body_offset - e->key_len;
+    *record = apr_palloc(r->pool, *record_len + 1);
+    entry_read(sh, b, e->key_len, (char *)*record, *record_len);
+    (*record)[*record_len] = '\0';
+    *shard = sh;
+    *head = b;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The bodies are served by buckets pointing to the blocks, each holding
+ * a reference to the entry.
+ */
+typedef struct {
+    apr_bucket_refcount refcount;
+    cache_shm_shard *shard;
+    apr_uint32_t head;
+    const char *base;
+} cache_shm_bucket_t;
+
+static void cache_shm_bucket_destroy(void *data)
+{
+    cache_shm_bucket_t *d = data;
+
+    if (apr_bucket_shared_destroy(d)) {
+        shard_release(d->shard, d->head, 0);
+        apr_bucket_free(d);
+    }
+}
+
+static apr_status_t cache_shm_bucket_read(apr_bucket *b, const char **str,
+                                          apr_size_t *len,
+                                          apr_read_type_e block)
+{
+    cache_shm_bucket_t *d = b->data;
+
+    *str = d->base + b->start;
+    *len = b->length;
+    return APR_SUCCESS;
+}
+
+static const apr_bucket_type_t cache_shm_bucket_type = {
+    "CACHE_SHM", 5, APR_BUCKET_DATA,
+    cache_shm_bucket_destroy,
+    cache_shm_bucket_read,
+    apr_bucket_setaside_noop,
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+/* The caller must hold a reference to the entry */
+static apr_bucket *cache_shm_bucket_create(cache_shm_shard *sh,
+                                           apr_uint32_t head,
+                                           const char *base, apr_size_t len,
+                                           apr_bucket_alloc_t *list)
+{
+    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
+    cache_shm_bucket_t *d = apr_bucket_alloc(sizeof(*d), list);
+
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+
+    apr_atomic_inc32(&shard_entry(sh, head)->refs);
+    d->shard = sh;
+    d->head = head;
+    d->base = base;
+
+    b = apr_bucket_shared_make(b, d, 0, len);
+    b->type = &cache_shm_bucket_type;
+    return b;
+}
+
+static apr_status_t sobj_unpin(void *baton)
+{
+    cache_shm_object_t *sobj = baton;
+
+    if (sobj->shard) {
+        shard_release(sobj->shard, sobj->head, 0);
+        sobj->shard = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Hook and mod_cache callback functions
+ */
+static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
+        apr_off_t len, apr_bucket_brigade *bb)
+{
+    cache_shm_dir_conf *dconf =
+            ap_get_module_config(r->per_dir_config, &cache_shm_module);
+    cache_object_t *obj;
+    cache_shm_object_t *sobj;
+    apr_size_t total;
+
+    if (!cache_shm_shards) {
+        return DECLINED;
+    }
+
+    /* we don't support caching of range requests (yet) */
+    if (r->status == HTTP_PARTIAL_CONTENT) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10286)
+                "URL %s partial content response not cached",
+                key);
+        return DECLINED;
+    }
+
+    /* As with mod_cache_socache, decide now whether the response may fit,
+     * to leave it to another provider otherwise.
+     */
+    if (len < 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10287)
+                "URL '%s' had no explicit size, ignoring", key);
+        return DECLINED;
+    }
+    if (len > dconf->max) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10288)
+                "URL '%s' body larger than limit, ignoring "
+                "(%" APR_OFF_T_FMT " > %" APR_OFF_T_FMT ")",
+                key, len, dconf->max);
+        return DECLINED;
+    }
+
+    /* estimate the total cached size, given current headers */
+    total = len + sizeof(cache_shm_info_t) + strlen(key);
+    if (APR_SUCCESS != store_table(r->headers_out, NULL, dconf->max, &total)
+            || APR_SUCCESS != store_table(r->headers_in, NULL, dconf->max,
+                    &total)
+            || total >= dconf->max) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10289)
+                "URL '%s' body and headers larger than limit, ignoring "
+                "(%" APR_OFF_T_FMT " > %" APR_OFF_T_FMT ")",
+                key, len, dconf->max);
+        return DECLINED;
+    }
+
+    /* Allocate and initialize cache_object_t and cache_shm_object_t */
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->vobj = sobj = apr_pcalloc(r->pool, sizeof(*sobj));
+
+    obj->key = apr_pstrdup(r->pool, key);
+    sobj->key = obj->key;
+    sobj->name = obj->key;
+    sobj->body_max = (apr_size_t)len;
+
+    return OK;
+}
+
+static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
+{
+    apr_uint32_t format;
+    apr_size_t slider, record_len;
+    unsigned char *record;
+    const char *nkey;
+    apr_status_t rc;
+    cache_object_t *obj;
+    cache_info *info;
+    cache_shm_object_t *sobj;
+    cache_shm_shard *sh;
+    cache_shm_entry_t *e;
+    apr_uint32_t head;
+
+    h->cache_obj = NULL;
+
+    if (!cache_shm_shards) {
+        return DECLINED;
+    }
+
+    /* attempt to retrieve the cached entry */
+    rc = cache_shm_fetch(r, key, &sh, &head, &record, &record_len);
+    if (rc != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10290)
+                "Key not found in cache: %s", key);
+        return DECLINED;
+    }
+    if (record_len < sizeof(format)) {
+        shard_release(sh, head, 0);
+        goto fail_key;
+    }
+
+    /* read the format from the record */
+    memcpy(&format, record, sizeof(format));
+    slider = sizeof(format);
+
+    if (format == CACHE_SHM_VARY_FORMAT_VERSION) {
+        apr_array_header_t* varray;
+
+        /* the expiry time is the entry's, skip it */
+        slider += sizeof(apr_time_t);
+
+        varray = apr_array_make(r->pool, 5, sizeof(char*));
+        rc = slider <= record_len ? read_array(r, varray, record, record_len,
+                                               &slider) : APR_EOF;
+        shard_release(sh, head, 0);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(10291)
+                    "Cannot parse vary entry for key: %s", key);
+            goto fail_key;
+        }
+
+        nkey = regen_key(r->pool, r->headers_in, varray, key, NULL);
+
+        rc = cache_shm_fetch(r, nkey, &sh, &head, &record, &record_len);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10292)
+                    "Key not found in cache: %s", nkey);
+            return DECLINED;
+        }
+        if (record_len >= sizeof(format)) {
+            memcpy(&format, record, sizeof(format));
+        }
+        else {
+            format = 0;
+        }
+    }
+    else {
+        nkey = key;
+    }
+
+    /* Create and init the cache object, which keeps the entry pinned */
+    obj = apr_pcalloc(r->pool, sizeof(cache_object_t));
+    sobj = apr_pcalloc(r->pool, sizeof(cache_shm_object_t));
+    e = shard_entry(sh, head);
+    sobj->shard = sh;
+    sobj->head = head;
+    sobj->body_offset = e->body_offset;
+    sobj->len = e->len;
+    apr_pool_cleanup_register(r->pool, sobj, sobj_unpin,
+                              apr_pool_cleanup_null);
+
+    if (format != CACHE_SHM_FORMAT_VERSION) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10293)
+                "Key '%s' found in cache has version %d, expected %d, "
+                "removing", nkey, format, CACHE_SHM_FORMAT_VERSION);
+        goto fail;
+    }
+    if (record_len < sizeof(cache_shm_info_t)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10294)
+                "Cache entry for key '%s' too short, removing", nkey);
+        goto fail;
+    }
+    memcpy(&sobj->shm_info, record, sizeof(cache_shm_info_t));
+    slider = sizeof(cache_shm_info_t);
+
+    obj->key = nkey;
+    sobj->key = nkey;
+    sobj->name = key;
+
+    /* Store it away so we can get it later. */
+    info = &(obj->info);
+    info->status = sobj->shm_info.status;
+    info->date = sobj->shm_info.date;
+    info->expire = sobj->shm_info.expire;
+    info->request_time = sobj->shm_info.request_time;
+    info->response_time = sobj->shm_info.response_time;
+
+    memcpy(&info->control, &sobj->shm_info.control, sizeof(cache_control_t));
+
+    /* Is this a cached HEAD request? */
+    if (sobj->shm_info.header_only && !r->header_only) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(10295)
+                "HEAD request cached, non-HEAD requested, ignoring: %s",
+                sobj->key);
+        return DECLINED;
+    }
+
+    h->req_hdrs = apr_table_make(r->pool, 20);
+    h->resp_hdrs = apr_table_make(r->pool, 20);
+
+    /* Call routine to read the header lines/status line */
+    if (APR_SUCCESS != read_table(h, r, h->resp_hdrs, record, record_len,
+            &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10296)
+                "Cache entry for key '%s' response headers unreadable, "
+                "removing", nkey);
+        goto fail;
+    }
+    if (APR_SUCCESS != read_table(h, r, h->req_hdrs, record, record_len,
+            &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10297)
+                "Cache entry for key '%s' request headers unreadable, "
+                "removing", nkey);
+        goto fail;
+    }
+
+    /* make the configuration stick */
+    h->cache_obj = obj;
+    obj->vobj = sobj;
+
+    return OK;
+
+fail:
+    cache_shm_remove(r, nkey);
+    return DECLINED;
+
+fail_key:
+    cache_shm_remove(r, key);
+    return DECLINED;
+}
+
+static int remove_entity(cache_handle_t *h)
+{
+    /* Null out the cache object pointer so next time we start from scratch.
+     * The entry (if any) stays pinned until the end of the request, for
+     * the buckets recalled from it already.
+     */
+    h->cache_obj = NULL;
+    return OK;
+}
+
+static int remove_url(cache_handle_t *h, request_rec *r)
+{
+    cache_shm_object_t *sobj;
+
+    sobj = (cache_shm_object_t *) h->cache_obj->vobj;
+    if (!sobj) {
+        return DECLINED;
+    }
+
+    /* Remove the key from the cache */
+    cache_shm_remove(r, sobj->key);
+
+    return OK;
+}
+
+static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
+{
+    /* we recalled the headers during open_entity, so do nothing */
+    return APR_SUCCESS;
+}
+
+static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p,
+        apr_bucket_brigade *bb)
+{
+    cache_shm_object_t *sobj = (cache_shm_object_t*) h->cache_obj->vobj;
+    entry_cursor c;
+    apr_size_t off;
+
+    if (!sobj->shard) {
+        return APR_SUCCESS;
+    }
+
+    /* One bucket per block of the body, straight from the shared memory */
+    off = sobj->body_offset;
+    cursor_init(&c, sobj->shard, sobj->head, off);
+    while (off < sobj->len) {
+        apr_size_t n = sobj->len - off;
+        const char *data = cursor_next(&c, &n);
+        apr_bucket *e = cache_shm_bucket_create(sobj->shard, sobj->head,
+                                                data, n, bb->bucket_alloc);
+
+        APR_BRIGADE_INSERT_TAIL(bb, e);
+        off += n;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
+        cache_info *info)
+{
+    cache_shm_dir_conf *dconf =
+            ap_get_module_config(r->per_dir_config, &cache_shm_module);
+    apr_size_t slider;
+    apr_status_t rv;
+    cache_object_t *obj = h->cache_obj;
+    cache_shm_object_t *sobj = (cache_shm_object_t*) obj->vobj;
+    cache_shm_info_t *shm_info;
+
+    memcpy(&h->cache_obj->info, info, sizeof(cache_info));
+
+    if (r->headers_out) {
+        sobj->headers_out = ap_cache_cacheable_headers_out(r);
+    }
+
+    if (r->headers_in) {
+        sobj->headers_in = ap_cache_cacheable_headers_in(r);
+    }
+
+    sobj->expire
+            = obj->info.expire > r->request_time + dconf->maxtime ? r->request_time
+                    + dconf->maxtime
+                    : obj->info.expire + dconf->mintime;
+
+    if (sobj->headers_out) {
+        const char *vary;
+
+        vary = apr_table_get(sobj->headers_out, "Vary");
+
+        if (vary) {
+            apr_array_header_t* varray;
+            apr_uint32_t format = CACHE_SHM_VARY_FORMAT_VERSION;
+            unsigned char *buffer;
+            apr_size_t len;
+
+            varray = apr_array_make(r->pool, 6, sizeof(char*));
+            tokens_to_array(r->pool, vary, varray);
+
+            len = sizeof(format) + sizeof(obj->info.expire);
+            if (APR_SUCCESS != store_array(varray, NULL, dconf->max, &len)) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10298)
+                        "Vary array too large, caching aborted: %s",
+                        obj->key);
+                return APR_EGENERAL;
+            }
+            buffer = apr_palloc(r->pool, len + 1);
+
+            memcpy(buffer, &format, sizeof(format));
+            slider = sizeof(format);
+            memcpy(buffer + slider, &obj->info.expire,
+                    sizeof(obj->info.expire));
+            slider += sizeof(obj->info.expire);
+            store_array(varray, buffer, len + 1, &slider);
+
+            rv = cache_shm_store(r, obj->key, sobj->expire,
+                                 (const char *)buffer, slider, NULL, 0,
+                                 NULL, 0, 0);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10299)
+                        "Vary not written to cache, ignoring: %s", obj->key);
+                return rv;
+            }
+
+            obj->key = sobj->key = regen_key(r->pool, sobj->headers_in, varray,
+                                             sobj->name, NULL);
+        }
+    }
+
+    /* Size the record, then write it */
+    slider = sizeof(cache_shm_info_t);
+    if ((sobj->headers_out && APR_SUCCESS != store_table(sobj->headers_out,
+                                                 NULL, dconf->max, &slider))
+            || (sobj->headers_in && APR_SUCCESS != store_table(
+                                        sobj->headers_in, NULL, dconf->max,
+                                        &slider))) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10300)
+                "headers too large, caching aborted: %s", sobj->name);
+        return APR_EGENERAL;
+    }
+    /* room for store_table()'s checks and trailing NUL */
+    sobj->record_len = slider + 8;
+    sobj->record = apr_palloc(r->pool, sobj->record_len);
+    shm_info = (cache_shm_info_t *) sobj->record;
+
+    shm_info->format = CACHE_SHM_FORMAT_VERSION;
+    shm_info->date = obj->info.date;
+    shm_info->expire = obj->info.expire;
+    shm_info->request_time = obj->info.request_time;
+    shm_info->response_time = obj->info.response_time;
+    shm_info->status = obj->info.status;
+
+    if (r->header_only && r->status != HTTP_NOT_MODIFIED) {
+        shm_info->header_only = 1;
+    }
+    else {
+        shm_info->header_only = sobj->shm_info.header_only;
+    }
+
+    memcpy(&shm_info->control, &obj->info.control, sizeof(cache_control_t));
+    slider = sizeof(cache_shm_info_t);
+
+    if (sobj->headers_out) {
+        store_table(sobj->headers_out, (unsigned char *)sobj->record,
+                    sobj->record_len, &slider);
+    }
+    if (sobj->headers_in) {
+        store_table(sobj->headers_in, (unsigned char *)sobj->record,
+                    sobj->record_len, &slider);
+    }
+    sobj->record_len = slider;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_body(cache_handle_t *h, request_rec *r,
+        apr_bucket_brigade *in, apr_bucket_brigade *out)
+{
+    apr_bucket *e;
+    apr_status_t rv = APR_SUCCESS;
+    cache_shm_object_t *sobj =
+            (cache_shm_object_t *) h->cache_obj->vobj;
+    int seen_eos = 0;
+
+    if (!sobj->newbody) {
+        sobj->body_len = 0;
+        sobj->body = sobj->body_max ? apr_palloc(r->pool, sobj->body_max)
+                                    : NULL;
+        sobj->newbody = 1;
+    }
+
+    while (APR_SUCCESS == rv && !APR_BRIGADE_EMPTY(in)) {
+        const char *str;
+        apr_size_t length;
+
+        e = APR_BRIGADE_FIRST(in);
+
+        /* are we done completely? if so, pass any trailing buckets right through */
+        if (sobj->done || sobj->failed) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* have we seen eos yet? */
+        if (APR_BUCKET_IS_EOS(e)) {
+            seen_eos = 1;
+            sobj->done = 1;
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* honour flush buckets, we'll get called again */
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* metadata buckets are preserved as is */
+        if (APR_BUCKET_IS_METADATA(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* read the bucket, write to the cache */
+        rv = apr_bucket_read(e, &str, &length, APR_BLOCK_READ);
+        APR_BUCKET_REMOVE(e);
+        APR_BRIGADE_INSERT_TAIL(out, e);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10301)
+                    "Error when reading bucket for URL %s",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return rv;
+        }
+
+        /* don't write empty buckets to the cache */
+        if (!length) {
+            continue;
+        }
+
+        if (length > sobj->body_max - sobj->body_len) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10302)
+                    "URL %s body larger than announced "
+                    "(%" APR_SIZE_T_FMT ")",
+                    h->cache_obj->key, sobj->body_max);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+        memcpy(sobj->body + sobj->body_len, str, length);
+        sobj->body_len += length;
+    }
+
+    /* Was this the final bucket? If yes, perform sanity checks.
+     */
+    if (seen_eos) {
+        const char *cl_header;
+        apr_off_t cl;
+
+        if (r->connection->aborted || r->no_cache) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(10303)
+                    "Discarding body for URL %s "
+                    "because connection has been aborted.",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        cl_header = apr_table_get(r->headers_out, "Content-Length");
+        if (cl_header && (!ap_parse_strict_length(&cl, cl_header)
+                          || cl != (apr_off_t)sobj->body_len)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10304)
+                    "URL %s didn't receive complete response, not caching",
+                    h->cache_obj->key);
+            sobj->failed = 1;
+            return APR_EGENERAL;
+        }
+
+        /* All checks were fine, we're good to go when the commit comes */
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_object_t *obj = h->cache_obj;
+    cache_shm_object_t *sobj = (cache_shm_object_t *) obj->vobj;
+    apr_status_t rv;
+
+    if (sobj->failed || !sobj->record) {
+        return APR_EGENERAL;
+    }
+
+    /* Headers only updated (revalidation), keep the body we have */
+    if (!sobj->newbody && sobj->shard) {
+        rv = cache_shm_store(r, sobj->key, sobj->expire, sobj->record,
+                             sobj->record_len, NULL,
+                             sobj->len - sobj->body_offset, sobj->shard,
+                             sobj->head, sobj->body_offset);
+    }
+    else {
+        rv = cache_shm_store(r, sobj->key, sobj->expire, sobj->record,
+                             sobj->record_len, sobj->body, sobj->body_len,
+                             NULL, 0, 0);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10305)
+                "could not write to cache, ignoring: %s", sobj->key);
+
+        /* For safety, remove any existing entry on failure, just in case
+         * it could not be revalidated successfully.
+         */
+        cache_shm_remove(r, sobj->key);
+        return rv;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10306)
+            "commit_entity: Headers and body for URL %s cached for maximum of %d seconds.",
+            sobj->name, (apr_uint32_t)apr_time_sec(sobj->expire - r->request_time));
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t invalidate_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_shm_object_t *sobj = (cache_shm_object_t *) h->cache_obj->vobj;
+
+    /* The entries are immutable, drop it so that it is fetched again */
+    h->cache_obj->info.control.invalidated = 1;
+    cache_shm_remove(r, sobj->key);
+
+    return APR_SUCCESS;
+}
+
+static void *create_dir_config(apr_pool_t *p, char *dummy)
+{
+    cache_shm_dir_conf *dconf = apr_pcalloc(p, sizeof(cache_shm_dir_conf));
+
+    dconf->max = DEFAULT_MAX_FILE_SIZE;
+    dconf->maxtime = apr_time_from_sec(DEFAULT_MAXTIME);
+    dconf->mintime = apr_time_from_sec(DEFAULT_MINTIME);
+
+    return dconf;
+}
+
+static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    cache_shm_dir_conf *new = apr_pcalloc(p, sizeof(cache_shm_dir_conf));
+    cache_shm_dir_conf *add = (cache_shm_dir_conf *) addv;
+    cache_shm_dir_conf *base = (cache_shm_dir_conf *) basev;
+
+    new->max = (add->max_set == 0) ? base->max : add->max;
+    new->max_set = add->max_set || base->max_set;
+    new->maxtime = (add->maxtime_set == 0) ? base->maxtime : add->maxtime;
+    new->maxtime_set = add->maxtime_set || base->maxtime_set;
+    new->mintime = (add->mintime_set == 0) ? base->mintime : add->mintime;
+    new->mintime_set = add->mintime_set || base->mintime_set;
+
+    return new;
+}
+
+/*
+ * mod_cache_shm configuration directives handlers.
+ */
+static const char *set_cache_shm_size(cmd_parms *cmd, void *in_struct_ptr,
+        const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || size <= 0) {
+        return "CacheShmSize argument must be a positive size in bytes, "
+               "with an optional K, M or G suffix";
+    }
+    switch (apr_toupper(*end)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        ++end;
+        break;
+    }
+    if (*end || size < 1024 * 1024 || (apr_uint64_t)size > APR_SIZE_MAX) {
+        return "CacheShmSize argument must be a size in bytes of at least "
+               "1M, with an optional K, M or G suffix";
+    }
+    cache_shm_size = (apr_size_t)size;
+    return NULL;
+}
+
+static const char *set_cache_shm_shards(cmd_parms *cmd, void *in_struct_ptr,
+        const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    if (err != NULL) {
+        return err;
+    }
+    n = atoi(arg);
+    if (n < 1 || n > MAX_SHARDS) {
+        return "CacheShmShards argument must be a number of shards between "
+               "1 and " APR_STRINGIFY(MAX_SHARDS);
+    }
+    cache_shm_nshards = n;
+    return NULL;
+}
+
+static const char *set_cache_max(cmd_parms *parms, void *in_struct_ptr,
+        const char *arg)
+{
+    cache_shm_dir_conf *dconf = (cache_shm_dir_conf *) in_struct_ptr;
+
+    if (apr_strtoff(&dconf->max, arg, NULL, 10) != APR_SUCCESS
+            || dconf->max < 1024 || dconf->max > APR_UINT32_MAX / 2) {
+        return "CacheShmMaxSize argument must be a integer representing "
+               "the max size of a cached entry (headers and body), at least "
+               "1024";
+    }
+    dconf->max_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_maxtime(cmd_parms *parms, void *in_struct_ptr,
+        const char *arg)
+{
+    cache_shm_dir_conf *dconf = (cache_shm_dir_conf *) in_struct_ptr;
+    apr_off_t seconds;
+
+    if (apr_strtoff(&seconds, arg, NULL, 10) != APR_SUCCESS || seconds < 0) {
+        return "CacheShmMaxTime argument must be the maximum amount of time in seconds to cache an entry.";
+    }
+    dconf->maxtime = apr_time_from_sec(seconds);
+    dconf->maxtime_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_mintime(cmd_parms *parms, void *in_struct_ptr,
+        const char *arg)
+{
+    cache_shm_dir_conf *dconf = (cache_shm_dir_conf *) in_struct_ptr;
+    apr_off_t seconds;
+
+    if (apr_strtoff(&seconds, arg, NULL, 10) != APR_SUCCESS || seconds < 0) {
+        return "CacheShmMinTime argument must be the minimum amount of time in seconds to cache an entry.";
+    }
+    dconf->mintime = apr_time_from_sec(seconds);
+    dconf->mintime_set = 1;
+    return NULL;
+}
+
+static apr_status_t destroy_cache(void *data)
+{
+    if (cache_shm) {
+        apr_shm_destroy(cache_shm);
+        cache_shm = NULL;
+    }
+    cache_shm_shards = NULL;
+    return APR_SUCCESS;
+}
+
+static int shm_status_hook(request_rec *r, int flags)
+{
+    apr_uint64_t hits = 0, misses = 0, stores = 0, evictions = 0;
+    apr_uint64_t blocks = 0, nfree = 0, entries = 0;
+    unsigned int i;
+
+    if (!cache_shm_shards) {
+        return DECLINED;
+    }
+
+    for (i = 0; i < cache_shm_nshards; ++i) {
+        cache_shm_shard *sh = &cache_shm_shards[i];
+
+        if (shard_lock(sh, r->server) != APR_SUCCESS) {
+            continue;
+        }
+        blocks += sh->hdr->nblocks;
+        nfree += sh->hdr->nfree;
+        entries += sh->hdr->entries;
+        hits += sh->hdr->hits;
+        misses += sh->hdr->misses;
+        stores += sh->hdr->stores;
+        evictions += sh->hdr->evictions;
+        shard_unlock(sh, r->server);
+    }
+
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n"
+                 "<table cellspacing=0 cellpadding=0>\n"
+                 "<tr><td bgcolor=\"#000000\">\n"
+                 "<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">"
+                 "mod_cache_shm Status:</font></b>\n"
+                 "</td></tr>\n"
+                 "<tr><td bgcolor=\"#ffffff\">\n", r);
+        ap_rprintf(r, "cache type: <b>SHM</b>, shared memory: <b>%"
+                   APR_SIZE_T_FMT "</b> bytes, shards: <b>%u</b>, "
+                   "block size: <b>%d</b> bytes<br>",
+                   cache_shm_size, cache_shm_nshards, CACHE_SHM_BLOCK_SIZE);
+        ap_rprintf(r, "blocks: <b>%" APR_UINT64_T_FMT "</b>, used: <b>%"
+                   APR_UINT64_T_FMT "</b>, entries: <b>%" APR_UINT64_T_FMT
+                   "</b><br>", blocks, blocks - nfree, entries);
+        ap_rprintf(r, "hits: <b>%" APR_UINT64_T_FMT "</b>, misses: <b>%"
+                   APR_UINT64_T_FMT "</b>, stores: <b>%" APR_UINT64_T_FMT
+                   "</b>, evictions: <b>%" APR_UINT64_T_FMT "</b><br>",
+                   hits, misses, stores, evictions);
+        ap_rputs("</td></tr>\n</table>\n", r);
+    }
+    else {
+        ap_rputs("ModCacheShmStatus\n", r);
+        ap_rprintf(r, "CacheShmBlocks: %" APR_UINT64_T_FMT "\n", blocks);
+        ap_rprintf(r, "CacheShmBlocksUsed: %" APR_UINT64_T_FMT "\n",
+                   blocks - nfree);
+        ap_rprintf(r, "CacheShmEntries: %" APR_UINT64_T_FMT "\n", entries);
+        ap_rprintf(r, "CacheShmHits: %" APR_UINT64_T_FMT "\n", hits);
+        ap_rprintf(r, "CacheShmMisses: %" APR_UINT64_T_FMT "\n", misses);
+        ap_rprintf(r, "CacheShmStores: %" APR_UINT64_T_FMT "\n", stores);
+        ap_rprintf(r, "CacheShmEvictions: %" APR_UINT64_T_FMT "\n",
+                   evictions);
+    }
+
+    return OK;
+}
+
+static void shm_status_register(apr_pool_t *p)
+{
+    APR_OPTIONAL_HOOK(ap, status_hook, shm_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+static int shm_precfg(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, cache_shm_id, NULL,
+            APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(10307)
+                "failed to register %s mutex", cache_shm_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    cache_shm_size = DEFAULT_SHM_SIZE;
+    cache_shm_nshards = DEFAULT_SHARDS;
+
+    /* Register to handle mod_status status page generation */
+    shm_status_register(pconf);
+
+    return OK;
+}
+
+/* Lay a shard out in size bytes at base, emptied */
+static apr_status_t shard_init(cache_shm_shard *sh, char *base, apr_size_t size)
+{
+    cache_shm_shard_t *hdr = (cache_shm_shard_t *)base;
+    apr_size_t off, nblocks, nbuckets = 1, i;
+
+    /* About two blocks per entry, and two buckets per entry */
+    nblocks = size / (CACHE_SHM_BLOCK_SIZE + sizeof(apr_uint32_t) + 1);
+    while (nbuckets < nblocks) {
+        nbuckets <<= 1;
+    }
+    off = APR_ALIGN_DEFAULT(sizeof(*hdr))
+          + APR_ALIGN_DEFAULT(nbuckets * sizeof(apr_uint32_t));
+    if (off + 2 * APR_ALIGN_DEFAULT(1) >= size) {
+        return APR_ENOSPC;
+    }
+    nblocks = (size - off - 2 * APR_ALIGN_DEFAULT(1))
+              / (CACHE_SHM_BLOCK_SIZE + sizeof(apr_uint32_t) + 1);
+    if (nblocks < 16 || nblocks > APR_UINT32_MAX - 1) {
+        return APR_ENOSPC;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->nblocks = (apr_uint32_t)nblocks;
+    hdr->nbuckets = (apr_uint32_t)nbuckets;
+    sh->hdr = hdr;
+    sh->buckets = (apr_uint32_t *)(base + APR_ALIGN_DEFAULT(sizeof(*hdr)));
+    sh->next = (apr_uint32_t *)(base + off);
+    off += APR_ALIGN_DEFAULT(nblocks * sizeof(apr_uint32_t));
+    sh->state = (unsigned char *)base + off;
+    off += APR_ALIGN_DEFAULT(nblocks);
+    sh->blocks = base + off;
+
+    memset(sh->buckets, 0, nbuckets * sizeof(apr_uint32_t));
+    memset(sh->state, CACHE_SHM_FREE, nblocks);
+    for (i = 0; i < nblocks; ++i) {
+        sh->next[i] = (apr_uint32_t)(i + 2 <= nblocks ? i + 2 : 0);
+    }
+    hdr->free = 1;
+    hdr->nfree = hdr->nblocks;
+
+    return APR_SUCCESS;
+}
+
+static int shm_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp, server_rec *s)
+{
+    const char *data_file = NULL;
+    apr_size_t shard_size;
+    apr_status_t rv;
+    char *base;
+    unsigned int i;
+
+    cache_shm = NULL;
+    cache_shm_shards = NULL;
+
+    /* Don't create the (possibly large) segment for the config check */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    /* Use anonymous shm by default, fall back on name-based. */
+    rv = apr_shm_create(&cache_shm, cache_shm_size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        data_file = ap_runtime_dir_relative(pconf, cache_shm_id);
+        if (data_file == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10308)
+                         "Could not use anonymous shm for the %s cache",
+                         cache_shm_id);
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+
+        /* For a name-based segment, remove it first in case of a
+         * previous unclean shutdown. */
+        apr_shm_remove(data_file, pconf);
+
+        rv = apr_shm_create(&cache_shm, cache_shm_size, data_file, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10309)
+                     "Could not allocate %" APR_SIZE_T_FMT " bytes of "
+                     "shared memory for the %s cache", cache_shm_size,
+                     cache_shm_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, NULL, destroy_cache,
+                              apr_pool_cleanup_null);
+
+    cache_shm_shards = apr_pcalloc(pconf, cache_shm_nshards
+                                          * sizeof(cache_shm_shard));
+    base = apr_shm_baseaddr_get(cache_shm);
+    shard_size = (apr_shm_size_get(cache_shm) / cache_shm_nshards)
+                 & ~(apr_size_t)(APR_ALIGN_DEFAULT(1) - 1);
+    for (i = 0; i < cache_shm_nshards; ++i) {
+        cache_shm_shard *sh = &cache_shm_shards[i];
+
+        rv = shard_init(sh, base + i * shard_size, shard_size);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10310)
+                         "CacheShmSize too small for %u shards",
+                         cache_shm_nshards);
+            cache_shm_shards = NULL;
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+        rv = ap_global_mutex_create(&sh->mutex, NULL, cache_shm_id,
+                                    apr_psprintf(ptmp, "%u", i), s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10311)
+                         "failed to create %s mutex", cache_shm_id);
+            cache_shm_shards = NULL;
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10312)
+                 "%s: %" APR_SIZE_T_FMT " bytes of shared memory in %u "
+                 "shards of %u blocks", cache_shm_id, cache_shm_size,
+                 cache_shm_nshards, cache_shm_shards[0].hdr->nblocks);
+
+    return OK;
+}
+
+static void shm_child_init(apr_pool_t *p, server_rec *s)
+{
+    unsigned int i;
+
+    if (!cache_shm_shards) {
+        return;
+    }
+    for (i = 0; i < cache_shm_nshards; ++i) {
+        apr_global_mutex_t **mutex = &cache_shm_shards[i].mutex;
+        apr_status_t rv;
+
+        rv = apr_global_mutex_child_init(mutex,
+                                         apr_global_mutex_lockfile(*mutex), p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10313)
+                    "failed to initialise mutex in child_init");
+        }
+    }
+}
+
+static const command_rec cache_shm_cmds[] =
+{
+    AP_INIT_TAKE1("CacheShmSize", set_cache_shm_size, NULL, RSRC_CONF,
+            "The size of the shared memory of the cache, in bytes"),
+    AP_INIT_TAKE1("CacheShmShards", set_cache_shm_shards, NULL, RSRC_CONF,
+            "The number of independently locked parts of the cache"),
+    AP_INIT_TAKE1("CacheShmMaxTime", set_cache_maxtime, NULL, RSRC_CONF | ACCESS_CONF,
+            "The maximum cache expiry age to cache a document in seconds"),
+    AP_INIT_TAKE1("CacheShmMinTime", set_cache_mintime, NULL, RSRC_CONF | ACCESS_CONF,
+            "The minimum cache expiry age to cache a document in seconds"),
+    AP_INIT_TAKE1("CacheShmMaxSize", set_cache_max, NULL, RSRC_CONF | ACCESS_CONF,
+            "The maximum cache entry size (headers and body) to cache a document"),
+    { NULL }
+};
+
+static const cache_provider cache_shm_provider =
+{
+    &remove_entity, &store_headers, &store_body, &recall_headers, &recall_body,
+    &create_entity, &open_entity, &remove_url, &commit_entity,
+    &invalidate_entity
+};
+
+static void cache_shm_register_hook(apr_pool_t *p)
+{
+    /* cache initializer */
+    ap_register_provider(p, CACHE_PROVIDER_GROUP, "shm", "0",
+            &cache_shm_provider);
+    ap_hook_pre_config(shm_precfg, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(shm_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(shm_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(cache_shm) = { STANDARD20_MODULE_STUFF,
+    create_dir_config,  /* create per-directory config structure */
+    merge_dir_config, /* merge per-directory config structures */
+    NULL, /* create per-server config structure */
+    NULL, /* merge per-server config structures */
+    cache_shm_cmds, /* command apr_table_t */
+    cache_shm_register_hook /* register hooks */
+};
@@ -395,6 +395,8 @@ typedef struct deflate_ctx_t
 {
     z_stream stream;
     unsigned char *buffer;
+    int buffer_size;
+    conn_rec *buffer_c; /* buffer from ap_acquire_buffer(), if not NULL */
     unsigned long crc;
     apr_bucket_brigade *bb, *proc_bb;
     int (*libz_end_func)(z_streamp);
@@ -432,12 +434,30 @@ static void consume_buffer(deflate_ctx *ctx, deflate_filter_config *c,
         ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer, len);
     }
 
-    b = apr_bucket_heap_create((char *)ctx->buffer, len, NULL,
-                               bb->bucket_alloc);
+    if (ctx->buffer_c) {
+        /* Pass the buffer itself down and continue in a new one */
+        apr_size_t size;
+        b = ap_buffer_bucket_create(ctx->buffer_c, (char *)ctx->buffer, len);
+        ctx->buffer = (unsigned char *)ap_acquire_buffer(ctx->buffer_c,
+                                                         &size);
+    }
+    else {
+        b = apr_bucket_heap_create((char *)ctx->buffer, len, NULL,
+                                   bb->bucket_alloc);
+    }
     APR_BRIGADE_INSERT_TAIL(bb, b);
 
     ctx->stream.next_out = ctx->buffer;
-    ctx->stream.avail_out = c->bufferSize;
+    ctx->stream.avail_out = ctx->buffer_size;
+}
+
+static void release_buffer(deflate_ctx *ctx)
+{
+    if (ctx->buffer_c) {
+        ap_release_buffer(ctx->buffer_c, (char *)ctx->buffer);
+        ctx->buffer_c = NULL;
+        ctx->buffer = NULL;
+    }
 }
 
 static int flush_libz_buffer(deflate_ctx *ctx, deflate_filter_config *c,
@@ -449,7 +469,7 @@ static int flush_libz_buffer(deflate_ctx *ctx, deflate_filter_config *c,
     int deflate_len;
 
     for (;;) {
-         deflate_len = c->bufferSize - ctx->stream.avail_out;
+         deflate_len = ctx->buffer_size - ctx->stream.avail_out;
          if (deflate_len > 0) {
              consume_buffer(ctx, c, deflate_len, crc, ctx->bb);
          }
@@ -488,8 +508,10 @@ static apr_status_t deflate_ctx_cleanup(void *data)
 {
     deflate_ctx *ctx = (deflate_ctx *)data;
 
-    if (ctx)
+    if (ctx) {
         ctx->libz_end_func(&ctx->stream);
+        release_buffer(ctx);
+    }
     return APR_SUCCESS;
 }
 
@@ -794,7 +816,21 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
 
         if (r->status != HTTP_NOT_MODIFIED) {
             ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
-            ctx->buffer = apr_palloc(r->pool, c->bufferSize);
+            if (c->bufferSize <= DEFAULT_BUFFERSIZE) {
+                /* Compress into the connection's output buffers which are
+                 * passed down as is, rather than copied in heap buckets.
+                 */
+                apr_size_t size;
+                ctx->buffer = (unsigned char *)ap_acquire_buffer(f->c,
+                                                                 &size);
+                ctx->buffer_c = f->c;
+                ctx->buffer_size = (size < (apr_size_t)c->bufferSize)
+                                   ? (int)size : c->bufferSize;
+            }
+            else {
+                ctx->buffer = apr_palloc(r->pool, c->bufferSize);
+                ctx->buffer_size = c->bufferSize;
+            }
             ctx->libz_end_func = deflateEnd;
 
             zRC = deflateInit2(&ctx->stream, c->compressionlevel, Z_DEFLATED,
@@ -803,6 +839,7 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
 
             if (zRC != Z_OK) {
                 deflateEnd(&ctx->stream);
+                release_buffer(ctx);
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01383)
                               "unable to init Zlib: "
                               "deflateInit2 returned %d: URL %s",
@@ -864,7 +901,7 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
 
         /* initialize deflate output buffer */
         ctx->stream.next_out = ctx->buffer;
-        ctx->stream.avail_out = c->bufferSize;
+        ctx->stream.avail_out = ctx->buffer_size;
     } else if (!ctx->filter_init) {
         /* Hmm.  We've run through the filter init before as we have a ctx,
          * but we never initialized.  We probably have a dangling ref.  Bail.
@@ -939,6 +976,7 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
             }
 
             deflateEnd(&ctx->stream);
+            release_buffer(ctx);
             /* No need for cleanup any longer */
             apr_pool_cleanup_kill(r->pool, ctx, deflate_ctx_cleanup);
 
@@ -1008,7 +1046,8 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
 
         while (ctx->stream.avail_in != 0) {
             if (ctx->stream.avail_out == 0) {
-                consume_buffer(ctx, c, c->bufferSize, NO_UPDATE_CRC, ctx->bb);
+                consume_buffer(ctx, c, ctx->buffer_size, NO_UPDATE_CRC,
+                               ctx->bb);
 
                 /* Send what we have right now to the next filter. */
                 rv = ap_pass_brigade(f->next, ctx->bb);
@@ -1180,6 +1219,7 @@ static apr_status_t deflate_in_filter(ap_filter_t *f,
             ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
             ctx->proc_bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
             ctx->buffer = apr_palloc(r->pool, c->bufferSize);
+            ctx->buffer_size = c->bufferSize;
         }
 
         do {
@@ -1585,6 +1625,7 @@ static apr_status_t inflate_out_filter(ap_filter_t *f,
         f->ctx = ctx = apr_pcalloc(f->r->pool, sizeof(*ctx));
         ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
         ctx->buffer = apr_palloc(r->pool, c->bufferSize);
+        ctx->buffer_size = c->bufferSize;
         ctx->libz_end_func = inflateEnd;
         ctx->validation_buffer = NULL;
         ctx->validation_buffer_length = 0;
@@ -100,7 +100,7 @@ static int ap_set_byterange(request_rec *r, apr_off_t clength,
         return 0;
     }
 
-    range = apr_table_get(r->headers_in, "Range");
+    range = ap_request_header_in(r, AP_HEADER_RANGE);
     if (!range || ap_cstr_casecmpn(range, "bytes=", 6) || r->status != HTTP_OK) {
         return 0;
     }
@@ -29,6 +29,10 @@
 
 APLOG_USE_MODULE(proxy_http2);
 
+/* How long a shared session blocks reading from the backend before it
+ * returns, so that requests of other connections get submitted */
+#define H2_PROXY_SHARED_POLL    apr_time_from_msec(100)
+
 typedef struct h2_proxy_stream {
     int id;
     apr_pool_t *pool;
@@ -46,6 +50,7 @@ typedef struct h2_proxy_stream {
     unsigned int waiting_on_100 : 1;
     unsigned int waiting_on_ping : 1;
     unsigned int headers_ended : 1;
+    unsigned int h2_front : 1;
     uint32_t error_code;
 
     apr_bucket_brigade *input;
@@ -281,7 +286,7 @@ static int on_frame_recv(nghttp2_session *ngh2, const nghttp2_frame *frame,
             if (r->status >= 100 && r->status < 200) {
                 /* By default, we will forward all interim responses when
                  * we are sitting on a HTTP/2 connection to the client */
-                int forward = session->h2_front;
+                int forward = stream->h2_front;
                 switch(r->status) {
                     case 100:
                         if (stream->waiting_on_100) {
@@ -742,6 +747,7 @@ h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
         session->streams = h2_proxy_ihash_create(pool, offsetof(h2_proxy_stream, id));
         session->suspended = h2_proxy_iq_create(pool, 5);
         session->done = done;
+        session->last_io = apr_time_now();
     
         session->input = apr_brigade_create(session->pool, session->c->bucket_alloc);
         session->output = apr_brigade_create(session->pool, session->c->bucket_alloc);
@@ -758,7 +764,8 @@ h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
 #endif
         
         nghttp2_option_new(&option);
-        nghttp2_option_set_peer_max_concurrent_streams(option, 100);
+        nghttp2_option_set_peer_max_concurrent_streams(option, 
+                                                       H2_PROXY_PEER_MAX_STREAMS);
         nghttp2_option_set_no_auto_window_update(option, 0);
         
         nghttp2_session_client_new2(&session->ngh2, cbs, session, option);
@@ -825,9 +832,12 @@ static apr_status_t open_stream(h2_proxy_session *session, const char *url,
     stream->standalone = standalone;
     stream->session = session;
     stream->state = H2_STREAM_ST_IDLE;
+    stream->h2_front = session->h2_front;
     
-    stream->input = apr_brigade_create(stream->pool, session->c->bucket_alloc);
-    stream->output = apr_brigade_create(stream->pool, session->c->bucket_alloc);
+    /* buckets of the request stay with its connection, a shared session
+     * is processed by the threads of other requests too */
+    stream->input = apr_brigade_create(stream->pool, r->connection->bucket_alloc);
+    stream->output = apr_brigade_create(stream->pool, r->connection->bucket_alloc);
     
     stream->req = h2_proxy_req_create(1, stream->pool, 0);
 
@@ -935,6 +945,7 @@ static apr_status_t submit_stream(h2_proxy_session *session, h2_proxy_stream *st
     if (rv > 0) {
         stream->id = rv;
         stream->state = H2_STREAM_ST_OPEN;
+        session->last_io = apr_time_now();
         h2_proxy_ihash_add(session->streams, stream);
         dispatch_event(session, H2_PROXYS_EV_STREAM_SUBMITTED, rv, NULL);
         
@@ -1036,6 +1047,7 @@ static apr_status_t h2_proxy_session_read(h2_proxy_session *session, int block,
     }
     
     if (status == APR_SUCCESS) {
+        session->last_io = apr_time_now();
         status = feed_brigade(session, session->input);
     }
     else if (APR_STATUS_IS_TIMEUP(status)) {
@@ -1089,6 +1101,19 @@ static int is_waiting_for_backend(h2_proxy_session *session)
                 && nghttp2_session_want_read(session->ngh2)));
 }
 
+static int is_wait_timed_out(h2_proxy_session *session)
+{
+    apr_interval_time_t timeout = -1;
+    apr_socket_t *socket;
+
+    /* ProxyTimeout (or the ping timeout) from the last I/O on */
+    socket = ap_get_conn_socket(session->c);
+    if (socket) {
+        apr_socket_timeout_get(socket, &timeout);
+    }
+    return timeout >= 0 && (apr_time_now() - session->last_io) >= timeout;
+}
+
 static apr_status_t check_suspended(h2_proxy_session *session)
 {
     h2_proxy_stream *stream;
@@ -1547,12 +1572,21 @@ run_loop:
                 /* we can do a blocking read with the default timeout (as
                  * configured via ProxyTimeout in our socket. There is
                  * nothing we want to send or check until we get more data
-                 * from the backend. */
-                status = h2_proxy_session_read(session, 1, 0);
+                 * from the backend. A shared session reads in slices
+                 * though, new requests may be waiting to be submitted,
+                 * and times out on its own. */
+                status = h2_proxy_session_read(session, 1, session->shared?
+                                               H2_PROXY_SHARED_POLL : 0);
                 if (status == APR_SUCCESS) {
                     have_read = 1;
                     dispatch_event(session, H2_PROXYS_EV_DATA_READ, 0, NULL);
                 }
+                else if (session->shared
+                         && (APR_STATUS_IS_TIMEUP(status)
+                             || APR_STATUS_IS_EAGAIN(status))
+                         && !is_wait_timed_out(session)) {
+                    /* nop, still waiting */
+                }
                 else {
                     dispatch_event(session, H2_PROXYS_EV_CONN_ERROR, status, NULL);
                     return status;
@@ -1641,6 +1675,57 @@ void h2_proxy_session_cancel_all(h2_proxy_session *session)
     }
 }
 
+typedef struct {
+    h2_proxy_session *session;
+    request_rec *r;
+    int found;
+} cancel_req_ctx;
+
+static int cancel_req_iter(void *udata, void *val)
+{
+    cancel_req_ctx *ctx = udata;
+    h2_proxy_stream *stream = val;
+    if (stream->r == ctx->r) {
+        nghttp2_submit_rst_stream(ctx->session->ngh2, NGHTTP2_FLAG_NONE,
+                                  stream->id, NGHTTP2_CANCEL);
+        ctx->found = 1;
+        return 0;
+    }
+    return 1;
+}
+
+apr_status_t h2_proxy_session_cancel(h2_proxy_session *session, 
+                                     request_rec *r)
+{
+    cancel_req_ctx ctx;
+
+    ctx.session = session;
+    ctx.r = r;
+    ctx.found = 0;
+    h2_proxy_ihash_iter(session->streams, cancel_req_iter, &ctx);
+    return ctx.found? APR_SUCCESS : APR_NOTFOUND;
+}
+
+int h2_proxy_session_max_streams(h2_proxy_session *session)
+{
+    uint32_t n;
+
+    if (!session->ngh2 || session->aborted
+        || (session->state != H2_PROXYS_ST_INIT 
+            && !is_accepting_streams(session))) {
+        return 0;
+    }
+    /* client stream ids are odd and end at 2^31-1, leave the session
+     * before submitting fails */
+    if (nghttp2_session_get_next_stream_id(session->ngh2) 
+        > 0x7fffffff - 2 * H2_PROXY_PEER_MAX_STREAMS) {
+        return 0;
+    }
+    n = nghttp2_session_get_remote_settings(session->ngh2, 
+                                            NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    return (n > APR_INT32_MAX)? APR_INT32_MAX : (int)n;
+}
+
 static int done_iter(void *udata, void *val)
 {
     cleanup_iter_ctx *ctx = udata;
@@ -19,6 +19,9 @@
 
 #define H2_ALEN(a)          (sizeof(a)/sizeof((a)[0]))
 
+/* Streams opened on a session before the backend announces its limit */
+#define H2_PROXY_PEER_MAX_STREAMS   100
+
 #include <nghttp2/nghttp2.h>
 
 struct h2_proxy_iqueue;
@@ -80,6 +83,7 @@ struct h2_proxy_session {
     
     unsigned int aborted : 1;
     unsigned int h2_front : 1; /* if front-end connection is HTTP/2 */
+    unsigned int shared : 1;   /* carries requests of many connections */
 
     h2_proxy_request_done *done;
     void *user_data;
@@ -95,6 +99,7 @@ struct h2_proxy_session {
     apr_size_t remote_max_concurrent;
     int last_stream_id;     /* last stream id processed by backend, or 0 */
     apr_time_t last_frame_received;
+    apr_time_t last_io;     /* last read or stream submitted */
     
     apr_bucket_brigade *input;
     apr_bucket_brigade *output;
@@ -128,6 +133,24 @@ void h2_proxy_session_cancel_all(h2_proxy_session *s);
 
 void h2_proxy_session_cleanup(h2_proxy_session *s, h2_proxy_request_done *done);
 
+/**
+ * Reset the stream of a request, it is reported done once the reset
+ * has been sent by h2_proxy_session_process().
+ * @param s the session the request was submitted to
+ * @param r the request to cancel
+ * @return APR_SUCCESS when the stream was reset, APR_NOTFOUND when the
+ *         session has no stream for r
+ */
+apr_status_t h2_proxy_session_cancel(h2_proxy_session *s, request_rec *r);
+
+/**
+ * The number of concurrent streams the session takes now, as announced
+ * by the backend in SETTINGS_MAX_CONCURRENT_STREAMS, or 0 when no new
+ * streams may be submitted anymore (shutdown, stream ids exhausted).
+ * @param s the session to check
+ */
+int h2_proxy_session_max_streams(h2_proxy_session *s);
+
 #define H2_PROXY_REQ_URL_NOTE   "h2-proxy-req-url"
 
 #endif /* h2_proxy_session_h */
@@ -16,7 +16,12 @@
  
 #include <nghttp2/nghttp2.h>
 
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
 #include <ap_mmn.h>
+#include <ap_mpm.h>
 #include <httpd.h>
 #include <mod_proxy.h>
 #include "mod_http2.h"
@@ -70,8 +75,71 @@ typedef struct h2_proxy_ctx {
     int r_done;                /* request was processed, not necessarily successfully */
     int r_may_retry;           /* request may be retried */
     h2_proxy_session *session; /* current http2 session against backend */
+
+#if APR_HAS_THREADS
+    struct h2_proxy_shared_worker *sw; /* shared sessions of the worker */
+    struct h2_proxy_shared *sh; /* shared session the request is attached to */
+    struct h2_proxy_ctx *next;  /* next request pending submission or
+                                 * cancellation */
+    const char *sni;            /* SNI when not the worker's hostname */
+    unsigned int sharing : 1;   /* request may use a shared session */
+    unsigned int queued : 1;    /* pending submission */
+    unsigned int cancelled : 1; /* stream reset, master connection gone */
+#endif
 } h2_proxy_ctx;
 
+#if APR_HAS_THREADS
+/* In threaded MPMs, the sessions against a worker can be shared by the
+ * requests of all connections in the child (opt-in, with the
+ * "proxy-h2-share" env): a request is submitted as a stream to a
+ * session with room for it, up to the backend's
+ * SETTINGS_MAX_CONCURRENT_STREAMS, before a new connection is made.
+ *
+ * A session is processed by one request's thread at a time, the
+ * driver, while the other requests attached to it wait on its cond.
+ * So their filters are only called by the driver while they are
+ * blocked, and a request is queued for submission only by its own
+ * thread once it waits (or drives). A waiting request whose master
+ * connection is gone is cancelled by the driver. When the driver's own
+ * request is done, another waiting
+ * request takes over. A session without requests stays idle (without
+ * driver) for the next one to join, one per worker, or until the
+ * worker's ttl expires.
+ *
+ * Each worker has its own lock for its sessions (in worker->context).
+ */
+typedef struct h2_proxy_shared h2_proxy_shared;
+typedef struct h2_proxy_shared_worker h2_proxy_shared_worker;
+struct h2_proxy_shared_worker {
+    apr_thread_mutex_t *mutex;
+    h2_proxy_shared *list;
+    h2_proxy_shared *free;
+};
+struct h2_proxy_shared {
+    h2_proxy_shared *next;
+    h2_proxy_shared_worker *sw;
+    proxy_worker *worker;
+    const char *sni;
+    proxy_conn_rec *p_conn;
+    h2_proxy_session *session;  /* NULL while connecting */
+    apr_thread_cond_t *cond;
+    h2_proxy_ctx *driver;       /* request processing the session */
+    h2_proxy_ctx *pending;      /* requests to submit, last queued first */
+    h2_proxy_ctx *cancels;      /* submitted requests to cancel */
+    int nctx;                   /* requests attached */
+    int max_streams;            /* requests the session takes */
+    apr_time_t idle_since;
+    unsigned int retired : 1;
+};
+
+/* How often a waiting request checks its master connection */
+#define H2_PROXY_SHARED_WAIT    apr_time_from_msec(250)
+
+/* The workers' locks and sessions come from shared_pool, under shared_mutex */
+static apr_pool_t *shared_pool;
+static apr_thread_mutex_t *shared_mutex;
+#endif
+
 static int h2_proxy_post_config(apr_pool_t *p, apr_pool_t *plog,
                                 apr_pool_t *ptemp, server_rec *s)
 {
@@ -98,6 +166,29 @@ static int h2_proxy_post_config(apr_pool_t *p, apr_pool_t *plog,
     return status;
 }
 
+static void h2_proxy_child_init(apr_pool_t *pchild, server_rec *s)
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+    int threaded = 0;
+
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        return;
+    }
+    apr_pool_create(&shared_pool, pchild);
+    apr_pool_tag(shared_pool, "proxy_http2_shared");
+    rv = apr_thread_mutex_create(&shared_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                 shared_pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10370)
+                     "could not create mutex, backend sessions "
+                     "will not be shared");
+        shared_mutex = NULL;
+    }
+#endif
+}
+
 /**
  * canonicalize the url into the request, if it is meant for us.
  * slightly modified copy from mod_http
@@ -186,19 +277,22 @@ static int proxy_http2_canon(request_rec *r, char *url)
 
 static apr_status_t add_request(h2_proxy_session *session, request_rec *r)
 {
-    h2_proxy_ctx *ctx = session->user_data;
     const char *url;
     apr_status_t status;
 
     url = apr_table_get(r->notes, H2_PROXY_REQ_URL_NOTE);
     apr_table_setn(r->notes, "proxy-source-port", apr_psprintf(r->pool, "%hu",
-                   ctx->p_conn->connection->local_addr->port));
+                   session->p_conn->connection->local_addr->port));
+    if (session->shared) {
+        /* the session takes requests from all kinds of frontends */
+        session->h2_front = is_h2? is_h2(r->connection) : 0;
+    }
     status = h2_proxy_session_submit(session, url, r, 1);
     if (status != APR_SUCCESS) {
         ap_log_cerror(APLOG_MARK, APLOG_ERR, status, r->connection, APLOGNO(03351)
                       "pass request body failed to %pI (%s) from %s (%s)",
-                      ctx->p_conn->addr, ctx->p_conn->hostname ? 
-                      ctx->p_conn->hostname: "", session->c->client_ip, 
+                      session->p_conn->addr, session->p_conn->hostname ? 
+                      session->p_conn->hostname: "", session->c->client_ip, 
                       session->c->remote_host ? session->c->remote_host: "");
     }
     return status;
@@ -221,6 +315,19 @@ static void request_done(h2_proxy_ctx *ctx, request_rec *r,
 static void session_req_done(h2_proxy_session *session, request_rec *r,
                              apr_status_t status, int touched)
 {
+#if APR_HAS_THREADS
+    if (session->shared) {
+        /* called by the driver for any request of the session */
+        h2_proxy_ctx *ctx = ap_get_module_config(r->connection->conn_config,
+                                                 &proxy_http2_module);
+        apr_thread_mutex_t *mutex = ctx->sh->sw->mutex;
+        apr_thread_mutex_lock(mutex);
+        request_done(ctx, r, status, touched);
+        apr_thread_cond_broadcast(ctx->sh->cond);
+        apr_thread_mutex_unlock(mutex);
+        return;
+    }
+#endif
     request_done(session->user_data, r, status, touched);
 }
 
@@ -284,6 +391,414 @@ out:
     return status;
 }
 
+#if APR_HAS_THREADS
+/* The shared sessions of the worker, NULL if they can't be */
+static h2_proxy_shared_worker *shared_worker_get(proxy_worker *worker)
+{
+    h2_proxy_shared_worker *sw = worker->context;
+
+    if (sw) {
+        return sw;
+    }
+
+    apr_thread_mutex_lock(shared_mutex);
+    sw = worker->context;
+    if (!sw) {
+        sw = apr_pcalloc(shared_pool, sizeof(*sw));
+        if (apr_thread_mutex_create(&sw->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                    shared_pool) == APR_SUCCESS) {
+            /* published once initialized */
+            apr_atomic_casptr((void *)&worker->context, sw, NULL);
+        }
+        else {
+            sw = NULL;
+        }
+    }
+    apr_thread_mutex_unlock(shared_mutex);
+    return sw;
+}
+
+static int shared_matches(h2_proxy_shared *sh, h2_proxy_ctx *ctx)
+{
+    return (sh->worker == ctx->worker
+            && (sh->sni == ctx->sni
+                || (sh->sni && ctx->sni && !ap_cstr_casecmp(sh->sni, ctx->sni))));
+}
+
+/* Under the worker's mutex: remove the request from a list of the session */
+static void shared_unlink(h2_proxy_ctx **pctx, h2_proxy_ctx *ctx)
+{
+    for (; *pctx; pctx = &(*pctx)->next) {
+        if (*pctx == ctx) {
+            *pctx = ctx->next;
+            break;
+        }
+    }
+    ctx->next = NULL;
+}
+
+/* Under the worker's mutex: take the session out of the lookup and fail the
+ * requests not submitted yet, so that they retry on another one.
+ */
+static void shared_retire(h2_proxy_shared *sh)
+{
+    h2_proxy_shared **psh;
+    h2_proxy_ctx *ctx;
+
+    if (sh->retired) {
+        return;
+    }
+    sh->retired = 1;
+    sh->max_streams = 0;
+    for (psh = &sh->sw->list; *psh; psh = &(*psh)->next) {
+        if (*psh == sh) {
+            *psh = sh->next;
+            break;
+        }
+    }
+    sh->next = NULL;
+    while ((ctx = sh->pending) != NULL) {
+        sh->pending = ctx->next;
+        ctx->next = NULL;
+        ctx->queued = 0;
+        ctx->r_done = 1;
+        ctx->r_status = HTTP_SERVICE_UNAVAILABLE;
+    }
+    /* the submitted ones end with the session */
+    while ((ctx = sh->cancels) != NULL) {
+        sh->cancels = ctx->next;
+        ctx->next = NULL;
+    }
+    apr_thread_cond_broadcast(sh->cond);
+}
+
+/* Under the worker's mutex: cancel the request of a waiter whose master
+ * connection is gone, by the driver if it is submitted already.
+ */
+static void shared_cancel(h2_proxy_shared *sh, h2_proxy_ctx *ctx)
+{
+    ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, ctx->owner,
+                  "eng(%s): master connection gone, cancel %s request",
+                  ctx->id, ctx->queued? "pending" : "submitted");
+    ctx->cancelled = 1;
+    if (ctx->queued) {
+        shared_unlink(&sh->pending, ctx);
+        ctx->queued = 0;
+        ctx->r_done = 1;
+        ctx->r_status = HTTP_SERVICE_UNAVAILABLE;
+    }
+    else {
+        ctx->next = sh->cancels;
+        sh->cancels = ctx;
+    }
+}
+
+/* Under the worker's mutex: recycle a retired session nobody is attached to,
+ * the caller releases the returned connection (if any) unlocked.
+ */
+static proxy_conn_rec *shared_recycle(h2_proxy_shared *sh)
+{
+    proxy_conn_rec *p_conn = sh->p_conn;
+
+    sh->p_conn = NULL;
+    sh->session = NULL;
+    sh->sni = NULL;
+    sh->next = sh->sw->free;
+    sh->sw->free = sh;
+    return p_conn;
+}
+
+static void shared_release(h2_proxy_ctx *ctx, proxy_conn_rec *p_conn)
+{
+    if (p_conn) {
+        p_conn->close = 1;
+#if AP_MODULE_MAGIC_AT_LEAST(20140207, 2)
+        proxy_run_detach_backend(ctx->r, p_conn);
+#endif
+        ap_proxy_release_connection(ctx->proxy_func, p_conn, ctx->server);
+    }
+}
+
+/* Attach the request to a session of its worker with room for another
+ * stream, or else to a new one that the request connects. Returns
+ * non-zero when an existing session takes the request.
+ */
+static int shared_join(h2_proxy_ctx *ctx)
+{
+    h2_proxy_shared_worker *sw = ctx->sw;
+    h2_proxy_shared *sh, *next;
+    proxy_conn_rec *expired = NULL;
+    apr_interval_time_t ttl = ctx->worker->s->ttl;
+    apr_time_t now = apr_time_now();
+    int joined = 0;
+
+    apr_thread_mutex_lock(sw->mutex);
+    for (sh = sw->list; sh; sh = next) {
+        next = sh->next;
+        if (!shared_matches(sh, ctx)) {
+            continue;
+        }
+        if (!sh->nctx && ttl && now - sh->idle_since > ttl) {
+            if (!expired) {
+                shared_retire(sh);
+                expired = shared_recycle(sh);
+            }
+            continue;
+        }
+        if (sh->nctx < sh->max_streams) {
+            break;
+        }
+    }
+
+    if (sh) {
+        if (!sh->nctx && sh->session) {
+            /* idle until now, check the backend is still there */
+            h2_proxy_session_setup(ctx->id, sh->p_conn, ctx->conf, 0, 30,
+                                   h2_proxy_log2((int)ctx->req_buffer_size),
+                                   session_req_done);
+        }
+        joined = 1;
+    }
+    else {
+        if (sw->free) {
+            sh = sw->free;
+            sw->free = sh->next;
+        }
+        else {
+            apr_status_t rv;
+
+            apr_thread_mutex_lock(shared_mutex);
+            sh = apr_pcalloc(shared_pool, sizeof(*sh));
+            rv = apr_thread_cond_create(&sh->cond, shared_pool);
+            apr_thread_mutex_unlock(shared_mutex);
+            if (rv != APR_SUCCESS) {
+                /* not this time */
+                apr_thread_mutex_unlock(sw->mutex);
+                shared_release(ctx, expired);
+                ctx->sharing = 0;
+                return 0;
+            }
+            sh->sw = sw;
+        }
+        /* the request connects it, others wait for that */
+        sh->worker = ctx->worker;
+        sh->sni = ctx->sni;
+        sh->driver = ctx;
+        sh->pending = NULL;
+        sh->cancels = NULL;
+        sh->nctx = 0;
+        sh->max_streams = H2_PROXY_PEER_MAX_STREAMS;
+        sh->retired = 0;
+        sh->next = sw->list;
+        sw->list = sh;
+    }
+    /* queued by shared_run() only, the driver would otherwise use the
+     * request's pools while this thread still runs */
+    ctx->sh = sh;
+    ctx->next = NULL;
+    ctx->queued = 0;
+    ctx->cancelled = 0;
+    ctx->r_done = 0;
+    sh->nctx++;
+    apr_thread_mutex_unlock(sw->mutex);
+
+    shared_release(ctx, expired);
+    if (joined) {
+        ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, ctx->owner,
+                      "eng(%s): joins shared session to %s",
+                      ctx->id, ctx->worker->s->hostname_ex);
+    }
+    return joined;
+}
+
+/* Detach the request from its shared session, retiring the session if
+ * asked to or when it is left unusable or as a surplus idle one.
+ */
+static void shared_leave(h2_proxy_ctx *ctx, int retire)
+{
+    h2_proxy_shared *sh = ctx->sh, *other;
+    proxy_conn_rec *p_conn = NULL;
+
+    apr_thread_mutex_lock(sh->sw->mutex);
+    shared_unlink(ctx->queued? &sh->pending : &sh->cancels, ctx);
+    ctx->queued = 0;
+    if (sh->driver == ctx) {
+        /* hand the session over to a request still waiting on it */
+        sh->driver = NULL;
+        apr_thread_cond_broadcast(sh->cond);
+    }
+    if (retire) {
+        shared_retire(sh);
+    }
+    if (--sh->nctx == 0) {
+        if (!sh->retired) {
+            for (other = sh->sw->list; other; other = other->next) {
+                if (other != sh && !other->nctx && shared_matches(other, ctx)) {
+                    break;
+                }
+            }
+            if (other || !sh->max_streams) {
+                shared_retire(sh);
+            }
+            else {
+                sh->idle_since = apr_time_now();
+            }
+        }
+        if (sh->retired) {
+            p_conn = shared_recycle(sh);
+        }
+    }
+    ctx->sh = NULL;
+    ctx->session = NULL;
+    apr_thread_mutex_unlock(sh->sw->mutex);
+
+    shared_release(ctx, p_conn);
+}
+
+/* Wait for the request to be done, processing the session whenever
+ * nobody else does.
+ */
+static apr_status_t shared_run(h2_proxy_ctx *ctx)
+{
+    h2_proxy_shared *sh = ctx->sh;
+    apr_thread_mutex_t *mutex = sh->sw->mutex;
+    h2_proxy_ctx *pending, *cancels, *next;
+    apr_status_t status = APR_SUCCESS;
+
+    apr_thread_mutex_lock(mutex);
+    if (!sh->retired) {
+        /* from now on this thread only waits or drives */
+        ctx->next = sh->pending;
+        sh->pending = ctx;
+        ctx->queued = 1;
+    }
+    while (!ctx->r_done) {
+        if (sh->retired) {
+            /* session gone, without news for our request */
+            ctx->r_done = 1;
+            ctx->r_status = HTTP_SERVICE_UNAVAILABLE;
+            break;
+        }
+        if (!sh->driver) {
+            sh->driver = ctx;
+            ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, ctx->owner,
+                          "eng(%s): takes over session %s",
+                          ctx->id, sh->session->id);
+        }
+        if (sh->driver != ctx) {
+            if (ctx->master->aborted && !ctx->cancelled) {
+                shared_cancel(sh, ctx);
+                continue;
+            }
+            /* timed, the driver does not notice our master going away */
+            apr_thread_cond_timedwait(sh->cond, mutex, H2_PROXY_SHARED_WAIT);
+            continue;
+        }
+
+        /* submit the requests queued since, in order */
+        for (pending = NULL; sh->pending; pending = next) {
+            next = sh->pending;
+            sh->pending = next->next;
+            next->next = pending;
+            next->queued = 0;
+        }
+        cancels = sh->cancels;
+        sh->cancels = NULL;
+        ctx->session = sh->session;
+        apr_thread_mutex_unlock(mutex);
+
+        for (; pending; pending = next) {
+            next = pending->next;
+            pending->next = NULL;
+            if (add_request(sh->session, pending->r) != APR_SUCCESS) {
+                session_req_done(sh->session, pending->r, APR_EGENERAL, 0);
+            }
+        }
+
+        /* the waiters whose master connection is gone, blocked until
+         * their request is done */
+        for (; cancels; cancels = next) {
+            next = cancels->next;
+            cancels->next = NULL;
+            if (h2_proxy_session_cancel(sh->session,
+                                        cancels->r) != APR_SUCCESS) {
+                session_req_done(sh->session, cancels->r,
+                                 APR_ECONNABORTED, 0);
+            }
+        }
+
+        if (ctx->master->aborted && !ctx->cancelled) {
+            /* master connection gone, reset our stream only */
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->owner,
+                          APLOGNO(10371) "eng(%s): master connection gone, "
+                          "cancel stream on shared session %s",
+                          ctx->id, sh->session->id);
+            ctx->cancelled = 1;
+            if (h2_proxy_session_cancel(sh->session, ctx->r) != APR_SUCCESS) {
+                session_req_done(sh->session, ctx->r, APR_ECONNABORTED, 0);
+            }
+        }
+
+        status = h2_proxy_session_process(sh->session);
+        if (status != APR_SUCCESS) {
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, ctx->owner, 
+                          APLOGNO(10372) "eng(%s): end of shared session %s", 
+                          ctx->id, sh->session->id);
+            /* the open streams end here, retried if safe to do so */
+            h2_proxy_session_cleanup(sh->session, session_req_done);
+        }
+
+        apr_thread_mutex_lock(mutex);
+        if (status != APR_SUCCESS) {
+            shared_retire(sh);
+        }
+        else {
+            sh->max_streams = h2_proxy_session_max_streams(sh->session);
+        }
+    }
+    apr_thread_mutex_unlock(mutex);
+
+    shared_leave(ctx, 0);
+    return status;
+}
+
+/* Set up the session on the connection made by the request, and run it.
+ */
+static apr_status_t shared_start(h2_proxy_ctx *ctx)
+{
+    h2_proxy_shared *sh = ctx->sh;
+    h2_proxy_session *session;
+
+    session = h2_proxy_session_setup(ctx->id, ctx->p_conn, ctx->conf,
+                                     is_h2? is_h2(ctx->owner) : 0, 30, 
+                                     h2_proxy_log2((int)ctx->req_buffer_size), 
+                                     session_req_done);
+    if (!session) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->owner, 
+                      APLOGNO(10373) "shared session unavailable");
+        shared_leave(ctx, 1);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    session->shared = 1;
+    session->user_data = NULL;
+    
+    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->owner, APLOGNO(10374)
+                  "eng(%s): run shared session %s", ctx->id, session->id);
+
+    /* the session owns the connection from now on */
+    apr_thread_mutex_lock(sh->sw->mutex);
+    sh->p_conn = ctx->p_conn;
+    sh->session = session;
+    if (ctx->sni) {
+        sh->sni = apr_pstrdup(ctx->p_conn->scpool, ctx->sni);
+    }
+    apr_thread_mutex_unlock(sh->sw->mutex);
+    ctx->p_conn = NULL;
+
+    return shared_run(ctx);
+}
+#endif /* APR_HAS_THREADS */
+
 static int proxy_http2_handler(request_rec *r, 
                                proxy_worker *worker,
                                proxy_server_conf *conf,
@@ -349,9 +864,36 @@ static int proxy_http2_handler(request_rec *r,
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, ctx->r, 
                   "H2: serving URL %s", url);
     
+#if APR_HAS_THREADS
+    /* Reverse proxied requests to a worker of its own may share sessions
+     * if asked to, unless ProxyBlock says no, which the request will then
+     * learn the usual way. */
+    if (shared_mutex && apr_table_get(r->subprocess_env, "proxy-h2-share")
+        && r->proxyreq == PROXYREQ_REVERSE && !proxyname
+        && !PROXY_WORKER_IS_GENERIC(worker)
+        && worker->s->is_address_reusable && !worker->s->disablereuse
+        && apr_uri_parse(r->pool, url, &uri) == APR_SUCCESS && uri.hostname
+        && ap_proxy_checkproxyblock(r, conf, uri.hostname,
+                                    worker->cp->addr) == OK
+        && (ctx->sw = shared_worker_get(worker)) != NULL) {
+        proxy_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
+                                                     &proxy_module);
+        ctx->sharing = 1;
+        ctx->sni = (is_ssl && dconf->preserve_host)? r->hostname : NULL;
+    }
+#endif
+
 run_connect:    
     if (ctx->master->aborted) goto cleanup;
 
+#if APR_HAS_THREADS
+    if (ctx->sharing && shared_join(ctx)) {
+        /* a session of other requests takes this one along */
+        status = shared_run(ctx);
+        goto run_done;
+    }
+#endif
+
     /* Get a proxy_conn_rec from the worker, might be a new one, might
      * be one still open from another request, or it might fail if the
      * worker is stopped or in error. */
@@ -385,6 +927,15 @@ run_connect:
     }
     
     /* Step Three: Create conn_rec for the socket we have open now. */
+#if APR_HAS_THREADS
+    if (ctx->sh) {
+        /* the shared session outlives this request, so does the
+         * connection's configuration */
+        status = ap_proxy_connection_create(ctx->proxy_func, ctx->p_conn,
+                                            ctx->owner, ctx->server);
+    }
+    else
+#endif
     status = ap_proxy_connection_create_ex(ctx->proxy_func, ctx->p_conn, ctx->r);
     if (status != OK) {
         ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, ctx->owner, APLOGNO(03353)
@@ -412,8 +963,17 @@ run_connect:
     }
 
     if (ctx->master->aborted) goto cleanup;
+#if APR_HAS_THREADS
+    if (ctx->sh) {
+        status = shared_start(ctx);
+    }
+    else
+#endif
     status = ctx_run(ctx);
 
+#if APR_HAS_THREADS
+run_done:
+#endif
     if (ctx->r_status != APR_SUCCESS && ctx->r_may_retry && !ctx->master->aborted) {
         /* Not successfully processed, but may retry, tear down old conn and start over */
         if (ctx->p_conn) {
@@ -434,6 +994,12 @@ run_connect:
     }
     
 cleanup:
+#if APR_HAS_THREADS
+    if (ctx->sh) {
+        /* failed to connect the shared session */
+        shared_leave(ctx, 1);
+    }
+#endif
     if (ctx->p_conn) {
         if (status != APR_SUCCESS) {
             /* close socket when errors happened or session shut down (EOF) */
@@ -455,6 +1021,7 @@ cleanup:
 static void register_hook(apr_pool_t *p)
 {
     ap_hook_post_config(h2_proxy_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(h2_proxy_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 
     proxy_hook_scheme_handler(proxy_http2_handler, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_canon_handler(proxy_http2_canon, NULL, NULL, APR_HOOK_FIRST);
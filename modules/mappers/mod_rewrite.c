@@ -52,12 +52,15 @@
 #include "apr_user.h"
 #include "apr_lib.h"
 #include "apr_global_mutex.h"
+#include "apr_atomic.h"
 #include "apr_dbm.h"
 #include "apr_dbd.h"
+#include "apr_mmap.h"
 #include "mod_dbd.h"
 
 #if APR_HAS_THREADS
 #include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
 #endif
 
 #define APR_WANT_MEMFUNC
@@ -74,6 +77,9 @@
 #if APR_HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
+#if APR_HAVE_SIGNAL_H
+#include <signal.h>
+#endif
 
 #include "ap_config.h"
 #include "httpd.h"
@@ -84,10 +90,13 @@
 #include "http_protocol.h"
 #include "http_vhost.h"
 #include "util_mutex.h"
+#include "ap_provider.h"
+#include "ap_slotmem.h"
 
 #include "mod_ssl.h"
 
 #include "mod_rewrite.h"
+#include "rewrite_idx_common.h"
 #include "ap_expr.h"
 
 #if APR_CHARSET_EBCDIC
@@ -184,6 +193,8 @@ static const char* really_last_key = "rewrite_really_last";
 #define MAPTYPE_RND                 (1<<4)
 #define MAPTYPE_DBD                 (1<<5)
 #define MAPTYPE_DBD_CACHE           (1<<6)
+#define MAPTYPE_IDX                 (1<<7)
+#define MAPTYPE_PRGPOOL             (1<<8)
 
 #define ENGINE_DISABLED             (1<<0)
 #define ENGINE_ENABLED              (1<<1)
@@ -219,6 +230,50 @@ static const char* really_last_key = "rewrite_really_last";
 #define REWRITE_PRG_MAP_BUF 1024
 #endif
 
+/* prgpool rewrite maps: default and max number of programs per child,
+ * default timeout of the lookups (in seconds), max length of a reply line
+ * and min lifetime of a program before it is respawned
+ */
+#ifndef REWRITE_PRGPOOL_PROCS
+#define REWRITE_PRGPOOL_PROCS 2
+#endif
+#ifndef REWRITE_PRGPOOL_MAX_PROCS
+#define REWRITE_PRGPOOL_MAX_PROCS 64
+#endif
+#ifndef REWRITE_PRGPOOL_TIMEOUT
+#define REWRITE_PRGPOOL_TIMEOUT 10
+#endif
+#ifndef REWRITE_PRGPOOL_MAX_LINE
+#define REWRITE_PRGPOOL_MAX_LINE 65536
+#endif
+#define REWRITE_PRGPOOL_RESPAWN apr_time_from_sec(1)
+
+#ifdef SIGKILL
+#define REWRITE_PRGPOOL_KILL SIGKILL
+#else
+#define REWRITE_PRGPOOL_KILL SIGTERM
+#endif
+
+/* min number of RewriteRules in a list to build a prefilter for it, and
+ * min length of the literals it uses
+ */
+#ifndef REWRITE_PREFILTER_MIN_RULES
+#define REWRITE_PREFILTER_MIN_RULES 8
+#endif
+#ifndef REWRITE_PREFILTER_MIN_LITERAL
+#define REWRITE_PREFILTER_MIN_LITERAL 2
+#endif
+
+/* default size of the shared map cache entries (key and value included),
+ * and the number of slots a key may be stored in
+ */
+#ifndef REWRITE_SHM_ENTRY_SIZE
+#define REWRITE_SHM_ENTRY_SIZE 256
+#endif
+#ifndef REWRITE_SHM_PROBES
+#define REWRITE_SHM_PROBES 8
+#endif
+
 /* for better readbility */
 #define LEFT_CURLY  '{'
 #define RIGHT_CURLY '}'
@@ -251,6 +306,55 @@ static const char* really_last_key = "rewrite_really_last";
  * +-------------------------------------------------------+
  */
 
+/* a mapped idx map file (per child) */
+typedef struct rewrite_idxmap {
+    apr_pool_t *pool;
+    const unsigned char *base;
+    apr_size_t size;
+    apr_uint32_t nbuckets;
+    apr_ino_t inode;               /* to notice when the file is replaced */
+    apr_time_t mtime;
+    apr_off_t fsize;
+    unsigned int refs;             /* lookups using it, +1 while current  */
+} rewrite_idxmap;
+
+/* a lookup waiting for the reply of a prgpool map program */
+typedef struct rewrite_prgcall {
+    struct rewrite_prgcall *next;
+    apr_uint32_t tag;              /* echoed by the program in the reply  */
+    int done;                      /* replied, or failed (value NULL)     */
+    char *value;
+    apr_pool_t *pool;              /* of the request, for the value       */
+} rewrite_prgcall;
+
+/* a program of a prgpool map (per child) */
+typedef struct {
+    apr_pool_t *pool;              /* of the running program, or NULL     */
+    apr_proc_t *proc;
+    apr_file_t *fpin;
+    apr_file_t *fpout;
+    apr_time_t started;
+    rewrite_prgcall *calls;        /* sent and not replied yet            */
+    unsigned int ncalls;
+    int spawning;                  /* a lookup is (re)starting it         */
+    int writing;                   /* a lookup is writing its request     */
+    int reading;                   /* a lookup is reading the replies     */
+    int failed;                    /* to be reaped once no longer used    */
+    char *buf;                     /* start of the next reply(ies)        */
+    apr_size_t buflen;
+    apr_size_t bufsize;
+} rewrite_prgproc;
+
+typedef struct {
+    apr_pool_t *pool;              /* thread-safe, for the programs' ones */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;
+#endif
+    rewrite_prgproc *procs;
+    apr_uint32_t tag;
+} rewrite_prgpool;
+
 typedef struct {
     const char *datafile;          /* filename for map data files         */
     const char *dbmtype;           /* dbm type for dbm map data files     */
@@ -268,6 +372,11 @@ typedef struct {
                                       NULL if only one file               */
     const char *user;              /* run RewriteMap program as this user */
     const char *group;             /* run RewriteMap program as this group */
+    unsigned int shm_map;          /* 1 + index in the shared map cache   */
+    rewrite_idxmap *idxmap;        /* current mapping of idx maps         */
+    int nprocs;                    /* number of programs of prgpool maps  */
+    apr_interval_time_t timeout;   /* timeout of prgpool maps' lookups    */
+    rewrite_prgpool *prgpool;      /* programs of prgpool maps (per child) */
 } rewritemap_entry;
 
 /* special pattern types for RewriteCond */
@@ -293,8 +402,18 @@ typedef enum {
     CONDPAT_AP_EXPR
 } pattern_type;
 
+/* the id of a %{HTTP:name} or %{ENV:name} variable in the input of a
+ * condition or the substitution of a rule (see intern_variables())
+ */
+typedef struct rewrite_varid {
+    struct rewrite_varid *next;
+    const char *pos;         /* where the variable starts in the string */
+    int id;                  /* the ap_request_var_id() of its name */
+} rewrite_varid;
+
 typedef struct {
     char           *input;   /* Input string of RewriteCond   */
+    rewrite_varid  *varids;  /* the variables in input        */
     char           *pattern; /* the RegExp pattern string     */
     ap_regex_t     *regexp;  /* the precompiled regexp        */
     ap_expr_info_t *expr;    /* the compiled ap_expr          */
@@ -314,6 +433,7 @@ typedef struct {
     char      *pattern;              /* the RegExp pattern string             */
     ap_regex_t *regexp;              /* the RegExp pattern compilation        */
     char      *output;               /* the Substitution string               */
+    rewrite_varid *varids;           /* the variables in output               */
     int        flags;                /* Flags which control the substitution  */
     char      *forced_mimetype;      /* forced MIME type of substitution      */
     char      *forced_handler;       /* forced content handler of subst.      */
@@ -325,12 +445,28 @@ typedef struct {
     char       *escapes;             /* specific backref escapes              */
 } rewriterule_entry;
 
+/* the prefilter of a list of RewriteRules (see prefilter_make()) */
+typedef struct {
+    int nrules;
+    unsigned char *always;         /* rule -> candidate whatever the URI  */
+    int *next_rule;                /* rule -> next one with its literal   */
+    unsigned int nclasses;
+    unsigned char classes[256];    /* byte -> class                       */
+    apr_uint32_t nstates;
+    apr_uint32_t *delta;           /* state * nclasses + class -> state   */
+    int *match;                    /* state -> first rule of the literal
+                                      ending there, or -1                 */
+    apr_uint32_t *dict;            /* state -> longest suffix state with
+                                      a match, or 0                       */
+} rewrite_prefilter;
+
 typedef struct {
     int           state;              /* the RewriteEngine state            */
     int           options;            /* the RewriteOption state            */
     apr_hash_t         *rewritemaps;  /* the RewriteMap entries             */
     apr_array_header_t *rewriteconds; /* the RewriteCond entries (temp.)    */
     apr_array_header_t *rewriterules; /* the RewriteRule entries            */
+    rewrite_prefilter  *prefilter;    /* of the rewriterules, if any        */
     server_rec   *server;             /* the corresponding server indicator */
     unsigned int state_set:1;
     unsigned int options_set:1;
@@ -367,6 +503,36 @@ typedef struct {
     apr_hash_t *entries;
 } cachedmap;
 
+/* the shared (RewriteMapCache) cache structures.
+ *
+ * The slots of the slotmem start with one map header per cached map,
+ * followed by the entries, an open addressed hash table.  Writers are
+ * serialized by map_cache_lock, readers don't lock: both headers and
+ * entries are protected by a sequence counter which is odd while they
+ * are being written, so readers retry or give up when it changes under
+ * them.  An entry is current if its gen matches its map's, which is
+ * bumped whenever the map's mtime changes.
+ */
+typedef struct {
+    apr_uint32_t seq;
+    apr_uint32_t gen;
+    apr_uint32_t complete;         /* whole map loaded, misses are final  */
+    apr_uint32_t mtime_hi;
+    apr_uint32_t mtime_lo;
+} shm_map_header;
+
+typedef struct {
+    apr_uint32_t seq;
+    apr_uint32_t map;              /* 1 + map index, 0 if never used     */
+    apr_uint32_t gen;
+    apr_uint32_t hash;
+    apr_uint32_t klen;
+    apr_uint32_t vlen;
+    char data[1];                  /* key then value, not terminated     */
+} shm_map_entry;
+
+#define SHM_MAP_ENTRY_DATA APR_OFFSETOF(shm_map_entry, data)
+
 /* the regex structure for the
  * substitution of backreferences
  */
@@ -414,6 +580,22 @@ static apr_hash_t *mapfunc_hash;
 /* the cache */
 static cache *cachep;
 
+/* the idx maps' mappings */
+static apr_pool_t *idxmap_pool;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *idxmap_lock;
+#endif
+
+/* the shared cache, RewriteMapCache configuration and runtime */
+static const char *map_cache_provider = NULL;
+static unsigned int map_cache_entries = 0;
+static apr_size_t map_cache_entry_size = REWRITE_SHM_ENTRY_SIZE;
+static const ap_slotmem_provider_t *map_cache_storage = NULL;
+static ap_slotmem_instance_t *map_cache_shm = NULL;
+static unsigned int map_cache_nmaps = 0;
+static apr_global_mutex_t *map_cache_lock = NULL;
+static const char *map_cache_mutex_type = "rewrite-map-cache";
+
 /* whether proxy module is available or not */
 static int proxy_available;
 
@@ -1151,6 +1333,507 @@ static int init_cache(apr_pool_t *p)
     return 1;
 }
 
+/*
+ * shared cache (RewriteMapCache)
+ */
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define map_cache_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+/* APR's atomic read-modify-writes are full barriers */
+static apr_uint32_t map_cache_fence;
+#define map_cache_rmb() ((void)apr_atomic_add32(&map_cache_fence, 0))
+#endif
+
+/* how many times a reader retries a slot which is being written to */
+#define REWRITE_SHM_RETRIES 16
+
+#define SHM_MAP_MTIME(h) \
+    ((apr_time_t)(((apr_uint64_t)(h)->mtime_hi << 32) | (h)->mtime_lo))
+
+static APR_INLINE void *map_cache_slot(unsigned int id)
+{
+    void *mem = NULL;
+
+    map_cache_storage->dptr(map_cache_shm, id, &mem);
+    return mem;
+}
+
+static APR_INLINE shm_map_entry *map_cache_entry(apr_uint32_t hash,
+                                                 unsigned int probe)
+{
+    return map_cache_slot(map_cache_nmaps
+                          + (hash + probe) % map_cache_entries);
+}
+
+/* keys often differ by their last characters only (e.g. numbers), mix
+ * them up so that they don't fill up the same slots
+ */
+static apr_uint32_t map_cache_hash(const char *key, apr_ssize_t klen)
+{
+    apr_uint32_t h = apr_hashfunc_default(key, &klen);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* lock-free copy of a map header, fails if it keeps being written to */
+static int map_cache_get_header(unsigned int map, shm_map_header *hdr)
+{
+    shm_map_header *h = map_cache_slot(map);
+    int n;
+
+    for (n = 0; n < REWRITE_SHM_RETRIES; ++n) {
+        apr_uint32_t seq = apr_atomic_read32(&h->seq);
+
+        if (seq & 1) {
+            continue;
+        }
+        map_cache_rmb();
+        memcpy(hdr, h, sizeof(*hdr));
+        map_cache_rmb();
+        if (apr_atomic_read32(&h->seq) == seq) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* map_cache_lock held */
+static void map_cache_set_header(unsigned int map, apr_time_t mtime,
+                                 int newgen, int complete)
+{
+    shm_map_header *h = map_cache_slot(map);
+
+    apr_atomic_inc32(&h->seq);
+    if (newgen) {
+        h->gen++;
+    }
+    h->mtime_hi = (apr_uint32_t)((apr_uint64_t)mtime >> 32);
+    h->mtime_lo = (apr_uint32_t)mtime;
+    h->complete = complete;
+    apr_atomic_inc32(&h->seq);
+}
+
+/* lock-free lookup of key in the given generation of map, returns a copy
+ * of the value or NULL if it's not found (or kept being written to)
+ */
+static char *map_cache_find(unsigned int map, apr_uint32_t gen,
+                            apr_uint32_t hash, const char *key,
+                            apr_size_t klen, apr_pool_t *p)
+{
+    apr_size_t room = map_cache_entry_size - SHM_MAP_ENTRY_DATA;
+    unsigned int i;
+
+    if (klen > room) {
+        return NULL;
+    }
+
+    for (i = 0; i < REWRITE_SHM_PROBES && i < map_cache_entries; ++i) {
+        shm_map_entry *e = map_cache_entry(hash, i);
+        int n;
+
+        for (n = 0; n < REWRITE_SHM_RETRIES; ++n) {
+            apr_uint32_t seq = apr_atomic_read32(&e->seq), used;
+            char *val = NULL;
+
+            if (seq & 1) {
+                continue;
+            }
+            map_cache_rmb();
+            used = e->map;
+            if (used == map + 1 && e->gen == gen && e->hash == hash
+                    && e->klen == klen && !memcmp(e->data, key, klen)) {
+                apr_size_t vlen = e->vlen;
+
+                /* vlen may be garbage if written to, checked below */
+                if (vlen <= room - klen) {
+                    val = apr_pstrmemdup(p, e->data + klen, vlen);
+                }
+            }
+            map_cache_rmb();
+            if (apr_atomic_read32(&e->seq) != seq) {
+                continue;
+            }
+            if (val) {
+                return val;
+            }
+            if (!used) {
+                /* never used, the key can't be further */
+                return NULL;
+            }
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* map_cache_lock held */
+static int map_cache_is_stale(shm_map_entry *e)
+{
+    shm_map_header *h = map_cache_slot(e->map - 1);
+
+    return e->gen != h->gen;
+}
+
+/* store key/val in the given generation of map unless it's there already
+ * (the first one wins, as in txt maps), map_cache_lock held.  Returns zero
+ * if there is no room for it in the slots of the key, where stale entries
+ * are reused first, then the ones of the other maps not completely loaded.
+ */
+static int map_cache_insert(unsigned int map, apr_uint32_t gen,
+                            apr_uint32_t hash, const char *key,
+                            apr_size_t klen, const char *val,
+                            apr_size_t vlen)
+{
+    shm_map_entry *e, *victim = NULL, *evictable = NULL;
+    unsigned int i;
+
+    if (klen + vlen > map_cache_entry_size - SHM_MAP_ENTRY_DATA) {
+        return 0;
+    }
+
+    for (i = 0; i < REWRITE_SHM_PROBES && i < map_cache_entries; ++i) {
+        e = map_cache_entry(hash, i);
+        if (!e->map) {
+            if (!victim) {
+                victim = e;
+            }
+            break;
+        }
+        if (e->map == map + 1 && e->gen == gen) {
+            if (e->hash == hash && e->klen == klen
+                    && !memcmp(e->data, key, klen)) {
+                return 1;
+            }
+        }
+        else if (map_cache_is_stale(e)) {
+            if (!victim) {
+                victim = e;
+            }
+        }
+        else if (!evictable && e->map != map + 1) {
+            shm_map_header *h = map_cache_slot(e->map - 1);
+
+            if (!h->complete) {
+                evictable = e;
+            }
+        }
+    }
+    if (!victim && !(victim = evictable)) {
+        return 0;
+    }
+
+    apr_atomic_inc32(&victim->seq);
+    victim->map = map + 1;
+    victim->gen = gen;
+    victim->hash = hash;
+    victim->klen = (apr_uint32_t)klen;
+    victim->vlen = (apr_uint32_t)vlen;
+    memcpy(victim->data, key, klen);
+    memcpy(victim->data + klen, val, vlen);
+    apr_atomic_inc32(&victim->seq);
+
+    return 1;
+}
+
+/* load a whole txt/rnd map in a new generation, map_cache_lock held, and
+ * mark it complete when everything fit so that misses need not read the
+ * file.  Parsed like lookup_map_txtfile() does.
+ */
+static void map_cache_load(server_rec *s, apr_pool_t *p,
+                           rewritemap_entry *map, apr_time_t mtime)
+{
+    unsigned int idx = map->shm_map - 1;
+    shm_map_header *h = map_cache_slot(idx);
+    char line[REWRITE_MAX_TXT_MAP_LINE + 1]; /* +1 for \0 */
+    apr_size_t nkeys = 0;
+    int complete = 1;
+    apr_file_t *fp;
+    apr_status_t rv;
+
+    map_cache_set_header(idx, mtime, 1, 0);
+
+    if ((rv = apr_file_open(&fp, map->datafile, APR_READ|APR_BUFFERED,
+                            APR_OS_DEFAULT, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10266)
+                     "mod_rewrite: can't open text RewriteMap file %s",
+                     map->datafile);
+        return;
+    }
+
+    while (apr_file_gets(line, sizeof(line), fp) == APR_SUCCESS) {
+        char *key, *val, *c;
+        apr_ssize_t klen;
+
+        /* ignore comments and lines starting with whitespaces */
+        if (*line == '#' || apr_isspace(*line)) {
+            continue;
+        }
+
+        key = c = line;
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+        if (!*c) {
+            continue;
+        }
+        klen = c - key;
+
+        /* no value? ignore */
+        while (apr_isspace(*c)) {
+            ++c;
+        }
+        if (!*c) {
+            continue;
+        }
+        val = c;
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (!map_cache_insert(idx, h->gen, map_cache_hash(key, klen),
+                              key, klen, val, c - val)) {
+            complete = 0;
+            break;
+        }
+        ++nkeys;
+    }
+    apr_file_close(fp);
+
+    if (complete) {
+        map_cache_set_header(idx, mtime, 0, 1);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10267)
+                     "RewriteMapCache: loaded %" APR_SIZE_T_FMT " keys "
+                     "from %s", nkeys, map->datafile);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10268)
+                     "RewriteMapCache: no room for %s after %" APR_SIZE_T_FMT
+                     " keys, the rest will be cached on demand (consider "
+                     "more or larger entries)", map->datafile, nkeys);
+    }
+}
+
+static char *map_cache_get(request_rec *r, rewritemap_entry *s,
+                           apr_time_t mtime, char *key)
+{
+    unsigned int idx = s->shm_map - 1;
+    apr_ssize_t klen = strlen(key);
+    shm_map_header hdr;
+    char *val;
+
+    if (!map_cache_get_header(idx, &hdr)) {
+        return NULL;
+    }
+
+    if (SHM_MAP_MTIME(&hdr) != mtime) {
+        /* A txt map changed: one process (re)loads it, the others look
+         * up the file meanwhile rather than waiting.
+         */
+        if (!(s->type & (MAPTYPE_TXT | MAPTYPE_RND))
+                || SHM_MAP_MTIME(&hdr) > mtime
+                || apr_global_mutex_trylock(map_cache_lock) != APR_SUCCESS) {
+            return NULL;
+        }
+        if (SHM_MAP_MTIME((shm_map_header *)map_cache_slot(idx)) < mtime) {
+            rewritelog(r, 5, NULL, "reloading the map file %s in the shared "
+                       "cache", s->datafile);
+            map_cache_load(r->server, r->pool, s, mtime);
+        }
+        apr_global_mutex_unlock(map_cache_lock);
+
+        if (!map_cache_get_header(idx, &hdr)
+                || SHM_MAP_MTIME(&hdr) != mtime) {
+            return NULL;
+        }
+    }
+
+    val = map_cache_find(idx, hdr.gen, map_cache_hash(key, klen),
+                         key, klen, r->pool);
+    if (!val && hdr.complete) {
+        shm_map_header *h = map_cache_slot(idx);
+
+        /* a final miss unless a reload started in the meantime */
+        map_cache_rmb();
+        if (apr_atomic_read32(&h->seq) == hdr.seq) {
+            val = apr_pstrdup(r->pool, "");
+        }
+    }
+
+    return val;
+}
+
+static void map_cache_set(rewritemap_entry *s, apr_time_t mtime,
+                          char *key, char *val)
+{
+    unsigned int idx = s->shm_map - 1;
+    apr_ssize_t klen = strlen(key);
+    shm_map_header *h;
+
+    /* never wait, caching is best effort */
+    if (apr_global_mutex_trylock(map_cache_lock) != APR_SUCCESS) {
+        return;
+    }
+
+    /* txt maps get a new generation when (re)loaded only */
+    h = map_cache_slot(idx);
+    if (SHM_MAP_MTIME(h) < mtime && !(s->type & (MAPTYPE_TXT | MAPTYPE_RND))) {
+        map_cache_set_header(idx, mtime, 1, 0);
+    }
+    if (SHM_MAP_MTIME(h) == mtime) {
+        map_cache_insert(idx, h->gen, map_cache_hash(key, klen),
+                         key, klen, val, strlen(val));
+    }
+
+    apr_global_mutex_unlock(map_cache_lock);
+}
+
+/* the maps cached in the shared cache, if any, or else in the child */
+static char *lookup_cache_value(request_rec *r, rewritemap_entry *s,
+                                apr_time_t t, char *key)
+{
+    if (s->shm_map && map_cache_shm) {
+        return map_cache_get(r, s, t, key);
+    }
+    return get_cache_value(s->cachename, t, key, r->pool);
+}
+
+static void store_cache_value(rewritemap_entry *s, apr_time_t t,
+                              char *key, char *val)
+{
+    if (s->shm_map && map_cache_shm) {
+        map_cache_set(s, t, key, val);
+    }
+    else {
+        set_cache_value(s->cachename, t, key, val);
+    }
+}
+
+static apr_status_t map_cache_remove(void *data)
+{
+    if (map_cache_lock) {
+        apr_global_mutex_destroy(map_cache_lock);
+        map_cache_lock = NULL;
+    }
+    map_cache_shm = NULL;
+    map_cache_nmaps = 0;
+    return APR_SUCCESS;
+}
+
+/* create the shared cache for the cacheable maps of all the servers, the
+ * same file (or query of the same vhost) shares the same cached map, and
+ * load the txt maps once for all the children.
+ */
+static int map_cache_create(apr_pool_t *p, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_array_header_t *maps;
+    apr_hash_t *ids;
+    server_rec *sp;
+    apr_status_t rv;
+    int i;
+
+    map_cache_storage = ap_lookup_provider(AP_SLOTMEM_PROVIDER_GROUP,
+                                           map_cache_provider,
+                                           AP_SLOTMEM_PROVIDER_VERSION);
+    if (!map_cache_storage) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(10269)
+                     "RewriteMapCache: failed to lookup provider '%s' for "
+                     "'%s', is mod_slotmem_%s loaded?", map_cache_provider,
+                     AP_SLOTMEM_PROVIDER_GROUP, map_cache_provider);
+        return !OK;
+    }
+
+    maps = apr_array_make(ptemp, 8, sizeof(rewritemap_entry *));
+    ids = apr_hash_make(ptemp);
+    for (sp = s; sp; sp = sp->next) {
+        rewrite_server_conf *conf;
+        apr_hash_index_t *hi;
+
+        conf = ap_get_module_config(sp->module_config, &rewrite_module);
+        for (hi = apr_hash_first(ptemp, conf->rewritemaps); hi;
+             hi = apr_hash_next(hi)) {
+            rewritemap_entry *map;
+            const char *id;
+            int *idx;
+            void *val;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            map = val;
+            switch (map->type) {
+            case MAPTYPE_TXT:
+            case MAPTYPE_RND:
+                id = apr_pstrcat(ptemp, "txt:", map->datafile, NULL);
+                break;
+            case MAPTYPE_DBM:
+                id = apr_pstrcat(ptemp, "dbm:", map->dbmtype, ":",
+                                 map->datafile, NULL);
+                break;
+            case MAPTYPE_DBD_CACHE:
+                /* queries are prepared per vhost */
+                id = apr_pstrcat(ptemp, "dbd:", map->cachename, NULL);
+                break;
+            default:
+                continue;
+            }
+
+            idx = apr_hash_get(ids, id, APR_HASH_KEY_STRING);
+            if (!idx) {
+                idx = apr_palloc(ptemp, sizeof(*idx));
+                *idx = maps->nelts;
+                APR_ARRAY_PUSH(maps, rewritemap_entry *) = map;
+                apr_hash_set(ids, id, APR_HASH_KEY_STRING, idx);
+            }
+            map->shm_map = *idx + 1;
+        }
+    }
+    if (!maps->nelts) {
+        return OK;
+    }
+
+    rv = map_cache_storage->create(&map_cache_shm, "rewrite-map-cache",
+                                   map_cache_entry_size,
+                                   maps->nelts + map_cache_entries, 0, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, APLOGNO(10270)
+                     "RewriteMapCache: can't create the shared cache "
+                     "(%u entries of %" APR_SIZE_T_FMT " bytes)",
+                     map_cache_entries, map_cache_entry_size);
+        map_cache_shm = NULL;
+        return !OK;
+    }
+    map_cache_nmaps = maps->nelts;
+
+    rv = ap_global_mutex_create(&map_cache_lock, NULL, map_cache_mutex_type,
+                                NULL, s, p, 0);
+    if (rv != APR_SUCCESS) {
+        map_cache_shm = NULL;
+        return !OK;
+    }
+    apr_pool_cleanup_register(p, NULL, map_cache_remove,
+                              apr_pool_cleanup_null);
+
+    /* no child yet, no need to lock */
+    for (i = 0; i < maps->nelts; ++i) {
+        rewritemap_entry *map = APR_ARRAY_IDX(maps, i, rewritemap_entry *);
+        apr_finfo_t st;
+
+        if ((map->type & (MAPTYPE_TXT | MAPTYPE_RND))
+                && apr_stat(&st, map->checkfile, APR_FINFO_MIN,
+                            ptemp) == APR_SUCCESS) {
+            map_cache_load(s, ptemp, map, st.mtime);
+        }
+    }
+
+    return OK;
+}
+
 
 /*
  * +-------------------------------------------------------+
@@ -1231,6 +1914,7 @@ static void rewrite_child_errfn(apr_pool_t *p, apr_status_t err,
 static apr_status_t rewritemap_program_child(apr_pool_t *p,
                                              const char *progname, char **argv,
                                              const char *user, const char *group,
+                                             apr_proc_t **proc,
                                              apr_file_t **fpout,
                                              apr_file_t **fpin)
 {
@@ -1264,6 +1948,10 @@ static apr_status_t rewritemap_program_child(apr_pool_t *p,
             if (fpout) {
                 (*fpout) = procnew->out;
             }
+
+            if (proc) {
+                (*proc) = procnew;
+            }
         }
     }
 
@@ -1303,7 +1991,7 @@ static apr_status_t run_rewritemap_programs(server_rec *s, apr_pool_t *p)
 
         rc = rewritemap_program_child(p, map->argv[0], map->argv,
                                       map->user, map->group,
-                                      &fpout, &fpin);
+                                      NULL, &fpout, &fpin);
         if (rc != APR_SUCCESS || fpin == NULL || fpout == NULL) {
             ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, APLOGNO(00654)
                          "mod_rewrite: could not start RewriteMap "
@@ -1386,6 +2074,193 @@ static char *lookup_map_txtfile(request_rec *r, const char *file, char *key)
     return value;
 }
 
+/* idx: maps are mapped once per child and file, the mapping is refcounted
+ * since the file can be replaced while lookups are still using it.
+ * idxmap_lock held by the callers of idxmap_open() and idxmap_unref().
+ */
+static rewrite_idxmap *idxmap_open(request_rec *r, const char *file)
+{
+    rewrite_idxmap *m;
+    apr_pool_t *p;
+    apr_file_t *fp;
+    apr_finfo_t fi;
+    apr_size_t size;
+    apr_status_t rv;
+
+    if (apr_pool_create(&p, idxmap_pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    apr_pool_tag(p, "rewrite_idxmap");
+
+    rv = apr_file_open(&fp, file, APR_READ|APR_BINARY, APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&fi, APR_FINFO_MIN|APR_FINFO_INODE, fp);
+        if (rv == APR_INCOMPLETE) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10272)
+                      "mod_rewrite: can't open idx RewriteMap file %s", file);
+        apr_pool_destroy(p);
+        return NULL;
+    }
+
+    m = apr_pcalloc(p, sizeof(*m));
+    m->pool = p;
+    m->inode = fi.inode;
+    m->mtime = fi.mtime;
+    m->fsize = fi.size;
+    m->refs = 1;
+
+    size = (apr_size_t)fi.size;
+    if ((apr_off_t)size != fi.size || size < REWRITE_IDX_HEADER_LEN) {
+        rv = APR_EINVAL;
+    }
+#if APR_HAS_MMAP
+    else {
+        apr_mmap_t *mm;
+
+        rv = apr_mmap_create(&mm, fp, 0, size, APR_MMAP_READ, p);
+        if (rv == APR_SUCCESS) {
+            m->base = mm->mm;
+        }
+    }
+#else
+    else {
+        char *buf = apr_palloc(p, size);
+
+        rv = apr_file_read_full(fp, buf, size, NULL);
+        m->base = (const unsigned char *)buf;
+    }
+#endif
+    apr_file_close(fp);
+
+    if (rv == APR_SUCCESS) {
+        if (memcmp(m->base, REWRITE_IDX_MAGIC, REWRITE_IDX_MAGIC_LEN)) {
+            rv = APR_EINVAL;
+        }
+        else {
+            m->size = size;
+            m->nbuckets = rewrite_idx_get32(m->base + REWRITE_IDX_MAGIC_LEN);
+            if (!m->nbuckets || (m->nbuckets & (m->nbuckets - 1))
+                    || m->nbuckets > (size - REWRITE_IDX_HEADER_LEN)
+                                     / REWRITE_IDX_BUCKET_LEN) {
+                rv = APR_EINVAL;
+            }
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10273)
+                      "mod_rewrite: can't map idx RewriteMap file %s "
+                      "(not made by httxt2idx?)", file);
+        apr_pool_destroy(p);
+        return NULL;
+    }
+
+    return m;
+}
+
+static void idxmap_unref(rewrite_idxmap *m)
+{
+    if (!--m->refs) {
+        apr_pool_destroy(m->pool);
+    }
+}
+
+/* the mapping of the current file, remapped if it changed */
+static rewrite_idxmap *idxmap_acquire(request_rec *r, rewritemap_entry *s,
+                                      const apr_finfo_t *st)
+{
+    rewrite_idxmap *m;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(idxmap_lock);
+#endif
+
+    m = s->idxmap;
+    if (!m || m->mtime != st->mtime || m->fsize != st->size
+            || ((st->valid & APR_FINFO_INODE) && m->inode != st->inode)) {
+        rewrite_idxmap *newm = idxmap_open(r, s->datafile);
+
+        /* keep the current one if the new file is not usable */
+        if (newm) {
+            rewritelog(r, 5, NULL, "mapped idx file %s", s->datafile);
+            if (m) {
+                idxmap_unref(m);
+            }
+            s->idxmap = m = newm;
+        }
+    }
+    if (m) {
+        m->refs++;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(idxmap_lock);
+#endif
+
+    return m;
+}
+
+static void idxmap_release(rewrite_idxmap *m)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(idxmap_lock);
+#endif
+
+    idxmap_unref(m);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(idxmap_lock);
+#endif
+}
+
+static char *lookup_map_idxfile(request_rec *r, rewritemap_entry *s,
+                                const apr_finfo_t *st, const char *key)
+{
+    rewrite_idxmap *m;
+    apr_size_t klen = strlen(key);
+    apr_uint32_t hash = rewrite_idx_hash(key, klen), mask, n;
+    char *value = NULL;
+
+    if (!(m = idxmap_acquire(r, s, st))) {
+        return NULL;
+    }
+
+    /* the records are checked against the size of the file, which is
+     * not trusted more than the text maps
+     */
+    mask = m->nbuckets - 1;
+    for (n = 0; n < m->nbuckets; ++n) {
+        const unsigned char *b = m->base + REWRITE_IDX_HEADER_LEN
+                                 + ((hash + n) & mask) * REWRITE_IDX_BUCKET_LEN;
+        apr_uint32_t off = rewrite_idx_get32(b + 4);
+        apr_uint32_t rklen, rvlen;
+
+        if (!off) {
+            break;
+        }
+        if (rewrite_idx_get32(b) != hash
+                || off > m->size - REWRITE_IDX_RECORD_LEN) {
+            continue;
+        }
+        rklen = rewrite_idx_get32(m->base + off);
+        rvlen = rewrite_idx_get32(m->base + off + 4);
+        if (rklen == klen
+                && klen <= m->size - off - REWRITE_IDX_RECORD_LEN
+                && rvlen <= m->size - off - REWRITE_IDX_RECORD_LEN - klen
+                && !memcmp(m->base + off + REWRITE_IDX_RECORD_LEN, key, klen)) {
+            value = apr_pstrmemdup(r->pool, (const char *)m->base + off
+                                   + REWRITE_IDX_RECORD_LEN + klen, rvlen);
+            break;
+        }
+    }
+
+    idxmap_release(m);
+    return value;
+}
+
 static char *lookup_map_dbmfile(request_rec *r, const char *file,
                                 const char *dbmtype, char *key)
 {
@@ -1640,6 +2515,381 @@ static char *lookup_map_program(request_rec *r, apr_file_t *fpin,
     return buf;
 }
 
+/*
+ * prgpool map programs, run by each child and multiplexed between its
+ * threads: lookups are sent as "<tag> <key>\n" lines to the least busy
+ * program, which may answer them in any order with "<tag> <value>\n"
+ * lines.  The replies are read by one of the waiting lookups at a time,
+ * which hands them to the others.  The lock of the pool protects the
+ * state of the programs and is held by the callers of the prgpool_*()
+ * functions below, but never while blocking on a program: its request
+ * line is written by one lookup at a time (proc->writing), its replies
+ * are read by one lookup at a time (proc->reading), and the programs are
+ * (re)started (proc->spawning) and reaped by the lookups with the lock
+ * released.
+ */
+#if APR_HAS_THREADS
+#define prgpool_lock(pp)       apr_thread_mutex_lock((pp)->lock)
+#define prgpool_unlock(pp)     apr_thread_mutex_unlock((pp)->lock)
+#define prgpool_wait(pp, t)    apr_thread_cond_timedwait((pp)->cond, \
+                                                         (pp)->lock, (t))
+#define prgpool_wakeup(pp)     apr_thread_cond_broadcast((pp)->cond)
+#else
+/* a single lookup at a time, always the writer and reader */
+#define prgpool_lock(pp)
+#define prgpool_unlock(pp)
+#define prgpool_wait(pp, t)
+#define prgpool_wakeup(pp)
+#endif
+
+static apr_status_t prgpool_spawn(server_rec *s, rewritemap_entry *map,
+                                  rewrite_prgproc *proc)
+{
+    apr_status_t rv;
+
+    proc->started = apr_time_now();
+
+    apr_pool_create(&proc->pool, map->prgpool->pool);
+    apr_pool_tag(proc->pool, "rewrite_prgproc");
+    rv = rewritemap_program_child(proc->pool, map->argv[0], map->argv,
+                                  NULL, NULL, &proc->proc,
+                                  &proc->fpout, &proc->fpin);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_pipe_timeout_set(proc->fpin, map->timeout);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10275)
+                     "mod_rewrite: could not start RewriteMap program %s",
+                     map->checkfile);
+        apr_pool_destroy(proc->pool);
+        proc->pool = NULL;
+        return rv;
+    }
+
+    proc->bufsize = REWRITE_PRG_MAP_BUF;
+    proc->buf = apr_palloc(proc->pool, proc->bufsize);
+    proc->buflen = 0;
+    return APR_SUCCESS;
+}
+
+/* Fails all the lookups pending on the program and kills it.  Returns its
+ * pool for the caller to reap it once unlocked, or NULL if the lookup
+ * writing to or reading from it will do it (or it is gone already).
+ */
+static apr_pool_t *prgpool_fail(rewrite_prgpool *pp, rewrite_prgproc *proc)
+{
+    rewrite_prgcall *call;
+    apr_pool_t *pool = NULL;
+
+    for (call = proc->calls; call; call = call->next) {
+        call->done = 1;
+    }
+    proc->calls = NULL;
+    proc->ncalls = 0;
+
+    if (proc->pool) {
+        if (!proc->failed) {
+            apr_proc_kill(proc->proc, REWRITE_PRGPOOL_KILL);
+        }
+        if (proc->reading || proc->writing) {
+            /* they will get EOF/EPIPE and call us again */
+            proc->failed = 1;
+        }
+        else {
+            pool = proc->pool;
+            proc->pool = NULL;
+            proc->failed = 0;
+        }
+    }
+
+    prgpool_wakeup(pp);
+    return pool;
+}
+
+/* Returns the least busy program of the map, (re)spawning one which is
+ * gone, though not more than once per REWRITE_PRGPOOL_RESPAWN each.
+ */
+static rewrite_prgproc *prgpool_get(server_rec *s, rewritemap_entry *map)
+{
+    rewrite_prgpool *pp = map->prgpool;
+    rewrite_prgproc *best = NULL, *gone = NULL;
+    apr_time_t now = 0;
+    int i;
+
+    for (i = 0; i < map->nprocs; ++i) {
+        rewrite_prgproc *proc = &pp->procs[i];
+
+        if (!proc->pool) {
+            if (!now) {
+                now = apr_time_now();
+            }
+            if (!gone && !proc->spawning
+                    && now - proc->started >= REWRITE_PRGPOOL_RESPAWN) {
+                gone = proc;
+            }
+            continue;
+        }
+        if (proc->failed) {
+            continue;
+        }
+        if (!best || proc->ncalls < best->ncalls) {
+            best = proc;
+        }
+    }
+
+    if (gone) {
+        rewrite_prgproc tmp;
+        apr_status_t rv;
+
+        /* fork()ing takes a while, let the other lookups go meanwhile */
+        memset(&tmp, 0, sizeof(tmp));
+        gone->spawning = 1;
+        gone->started = now;
+        prgpool_unlock(pp);
+        rv = prgpool_spawn(s, map, &tmp);
+        prgpool_lock(pp);
+        gone->spawning = 0;
+        if (rv == APR_SUCCESS) {
+            gone->pool = tmp.pool;
+            gone->proc = tmp.proc;
+            gone->fpin = tmp.fpin;
+            gone->fpout = tmp.fpout;
+            gone->started = tmp.started;
+            gone->buf = tmp.buf;
+            gone->buflen = tmp.buflen;
+            gone->bufsize = tmp.bufsize;
+            if (!best || best->failed || best->ncalls) {
+                best = gone;
+            }
+        }
+        if (best && (!best->pool || best->failed)) {
+            /* failed while we were spawning */
+            best = NULL;
+        }
+    }
+
+    return best;
+}
+
+/* Reads what the program replied so far, waiting for at most timeout, and
+ * completes the lookups whose reply is complete.
+ */
+static apr_status_t prgpool_read(request_rec *r, rewrite_prgpool *pp,
+                                 rewrite_prgproc *proc,
+                                 apr_interval_time_t timeout)
+{
+    apr_size_t len;
+    apr_status_t rv;
+    char *line, *end, *eol;
+
+    if (proc->buflen == proc->bufsize) {
+        char *buf;
+
+        if (proc->bufsize >= REWRITE_PRGPOOL_MAX_LINE) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10276)
+                          "mod_rewrite: reply longer than %d bytes",
+                          REWRITE_PRGPOOL_MAX_LINE);
+            return APR_ENOSPC;
+        }
+        buf = apr_palloc(proc->pool, proc->bufsize * 2);
+        memcpy(buf, proc->buf, proc->buflen);
+        proc->buf = buf;
+        proc->bufsize *= 2;
+    }
+
+    /* the buffer and fpout are the reader's, anything else is locked */
+    apr_file_pipe_timeout_set(proc->fpout, timeout);
+    len = proc->bufsize - proc->buflen;
+    prgpool_unlock(pp);
+    rv = apr_file_read(proc->fpout, proc->buf + proc->buflen, &len);
+    prgpool_lock(pp);
+    if (rv != APR_SUCCESS || proc->failed) {
+        return rv;
+    }
+    proc->buflen += len;
+
+    line = proc->buf;
+    end = proc->buf + proc->buflen;
+    while ((eol = memchr(line, '\n', end - line))) {
+        rewrite_prgcall **pcall;
+        apr_int64_t tag;
+        char *value;
+
+        len = eol - line;
+        if (len && line[len - 1] == '\r') {
+            --len;
+        }
+        line[len] = '\0';
+
+        tag = apr_strtoi64(line, &value, 10);
+        if (value == line || (*value && *value != ' ')) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10277)
+                          "mod_rewrite: bad reply \"%.*s\"",
+                          (int)(len > 64 ? 64 : len), line);
+            return APR_EGENERAL;
+        }
+        if (*value) {
+            ++value;
+        }
+
+        /* the lookup may have given up already */
+        for (pcall = &proc->calls; *pcall; pcall = &(*pcall)->next) {
+            rewrite_prgcall *call = *pcall;
+
+            if (call->tag == tag) {
+                call->value = apr_pstrdup(call->pool, value);
+                call->done = 1;
+                *pcall = call->next;
+                --proc->ncalls;
+                break;
+            }
+        }
+
+        line = eol + 1;
+    }
+
+    proc->buflen = end - line;
+    memmove(proc->buf, line, proc->buflen);
+
+    return APR_SUCCESS;
+}
+
+/* Writes the request line of the lookup, once the program is no longer
+ * written by another lookup, with the lock released while writing.
+ * Returns APR_ECONNABORTED if the program failed while waiting.
+ */
+static apr_status_t prgpool_write(request_rec *r, rewrite_prgpool *pp,
+                                  rewrite_prgproc *proc,
+                                  rewrite_prgcall *call, const char *line,
+                                  apr_time_t deadline)
+{
+    apr_status_t rv;
+
+    while (proc->writing) {
+        apr_interval_time_t left = deadline - apr_time_now();
+        if (left <= 0) {
+            return APR_TIMEUP;
+        }
+        prgpool_wait(pp, left);
+        if (call->done) {
+            return APR_ECONNABORTED;
+        }
+    }
+
+    /* fpin is the writer's, anything else is locked */
+    proc->writing = 1;
+    prgpool_unlock(pp);
+    rv = apr_file_write_full(proc->fpin, line, strlen(line), NULL);
+    prgpool_lock(pp);
+    proc->writing = 0;
+    prgpool_wakeup(pp);
+
+    return rv;
+}
+
+static char *lookup_map_prgpool(request_rec *r, rewritemap_entry *map,
+                                char *key)
+{
+    rewrite_prgpool *pp = map->prgpool;
+    rewrite_prgproc *proc;
+    rewrite_prgcall call;
+    apr_pool_t *reap = NULL;
+    apr_time_t deadline;
+    apr_status_t rv;
+    char *line;
+
+    /* see lookup_map_program() */
+    if (pp == NULL || ap_strchr(key, '\n')) {
+        return NULL;
+    }
+
+    memset(&call, 0, sizeof(call));
+    call.pool = r->pool;
+    deadline = apr_time_now() + map->timeout;
+
+    prgpool_lock(pp);
+
+    proc = prgpool_get(r->server, map);
+    if (!proc) {
+        prgpool_unlock(pp);
+        return NULL;
+    }
+
+    /* registered first, the reply may be read by another lookup before
+     * we are done writing
+     */
+    call.tag = ++pp->tag;
+    call.next = proc->calls;
+    proc->calls = &call;
+    ++proc->ncalls;
+
+    line = apr_psprintf(r->pool, "%u %s\n", call.tag, key);
+    rv = prgpool_write(r, pp, proc, &call, line, deadline);
+    if (APR_STATUS_IS_ECONNABORTED(rv)) {
+        /* failed by another lookup, the program may be a new one now */
+    }
+    else if (proc->failed) {
+        /* killed while writing */
+        reap = prgpool_fail(pp, proc);
+    }
+    else if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10278)
+                      "mod_rewrite: could not send the lookup to RewriteMap "
+                      "program %s, restarting it", map->checkfile);
+        reap = prgpool_fail(pp, proc);
+    }
+
+    while (!call.done) {
+        apr_interval_time_t left = deadline - apr_time_now();
+
+        if (left <= 0) {
+            /* the program is likely stuck, don't pile up lookups on it */
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10279)
+                          "mod_rewrite: RewriteMap program %s did not "
+                          "reply in time, restarting it", map->checkfile);
+            reap = prgpool_fail(pp, proc);
+            break;
+        }
+
+        if (proc->reading) {
+            prgpool_wait(pp, left);
+            continue;
+        }
+
+        proc->reading = 1;
+        rv = prgpool_read(r, pp, proc, left);
+        proc->reading = 0;
+        if (proc->failed) {
+            /* killed while reading */
+            reap = prgpool_fail(pp, proc);
+        }
+        else if (rv != APR_SUCCESS && !APR_STATUS_IS_TIMEUP(rv)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10280)
+                          "mod_rewrite: lost RewriteMap program %s, "
+                          "restarting it", map->checkfile);
+            reap = prgpool_fail(pp, proc);
+        }
+        else {
+            /* replies for others, or someone else's turn to read */
+            prgpool_wakeup(pp);
+        }
+    }
+
+    prgpool_unlock(pp);
+
+    if (reap) {
+        /* waits for the program to exit */
+        apr_pool_destroy(reap);
+    }
+
+    /* catch the "failed" case */
+    if (call.value && !strcasecmp(call.value, "NULL")) {
+        return NULL;
+    }
+
+    return call.value;
+}
+
 /*
  * generic map lookup
  */
@@ -1674,7 +2924,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             return NULL;
         }
 
-        value = get_cache_value(s->cachename, st.mtime, key, r->pool);
+        value = lookup_cache_value(r, s, st.mtime, key);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1683,13 +2933,13 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[txt] key=%s",
                            name, key);
-                set_cache_value(s->cachename, st.mtime, key, "");
+                store_cache_value(s, st.mtime, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "map lookup OK: map=%s[txt] key=%s -> val=%s",
                        name, key, value);
-            set_cache_value(s->cachename, st.mtime, key, value);
+            store_cache_value(s, st.mtime, key, value);
         }
         else {
             rewritelog(r, 5, NULL, "cache lookup OK: map=%s[txt] key=%s -> val=%s",
@@ -1703,6 +2953,30 @@ static char *lookup_map(request_rec *r, char *name, char *key)
 
         return *value ? value : NULL;
 
+    /*
+     * Indexed file map, not cached (mapped)
+     */
+    case MAPTYPE_IDX:
+        rv = apr_stat(&st, s->checkfile, APR_FINFO_MIN|APR_FINFO_INODE,
+                      r->pool);
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10274)
+                          "mod_rewrite: can't access idx RewriteMap file %s",
+                          s->checkfile);
+            return NULL;
+        }
+
+        value = lookup_map_idxfile(r, s, &st, key);
+        if (!value) {
+            rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[idx] key=%s",
+                       name, key);
+            return NULL;
+        }
+
+        rewritelog(r, 5, NULL, "map lookup OK: map=%s[idx] key=%s -> val=%s",
+                   name, key, value);
+        return value;
+
     /*
      * DBM file map
      */
@@ -1730,7 +3004,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             return NULL;
         }
 
-        value = get_cache_value(s->cachename, st.mtime, key, r->pool);
+        value = lookup_cache_value(r, s, st.mtime, key);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1739,14 +3013,14 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[dbm] key=%s",
                            name, key);
-                set_cache_value(s->cachename, st.mtime, key, "");
+                store_cache_value(s, st.mtime, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "map lookup OK: map=%s[dbm] key=%s -> "
                        "val=%s", name, key, value);
 
-            set_cache_value(s->cachename, st.mtime, key, value);
+            store_cache_value(s, st.mtime, key, value);
             return value;
         }
 
@@ -1774,7 +3048,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
      * SQL map with cache
      */
     case MAPTYPE_DBD_CACHE:
-        value = get_cache_value(s->cachename, 0, key, r->pool);
+        value = lookup_cache_value(r, s, 0, key);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1783,26 +3057,41 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "SQL map lookup FAILED: map %s key=%s",
                            name, key);
-                set_cache_value(s->cachename, 0, key, "");
+                store_cache_value(s, 0, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "SQL map lookup OK: map %s key=%s, val=%s",
                        name, key, value);
 
-            set_cache_value(s->cachename, 0, key, value);
+            store_cache_value(s, 0, key, value);
             return value;
         }
 
         rewritelog(r, 5, NULL, "cache lookup OK: map=%s[SQL] key=%s, val=%s",
                    name, key, value);
-        return *value ? value : NULL;
+        return *value ? value : NULL;
+
+    /*
+     * Program file map
+     */
+    case MAPTYPE_PRG:
+        value = lookup_map_program(r, s->fpin, s->fpout, key);
+        if (!value) {
+            rewritelog(r, 5, NULL, "map lookup FAILED: map=%s key=%s", name,
+                       key);
+            return NULL;
+        }
+
+        rewritelog(r, 5, NULL, "map lookup OK: map=%s key=%s -> val=%s",
+                   name, key, value);
+        return value;
 
     /*
-     * Program file map
+     * Program files map, per child
      */
-    case MAPTYPE_PRG:
-        value = lookup_map_program(r, s->fpin, s->fpout, key);
+    case MAPTYPE_PRGPOOL:
+        value = lookup_map_prgpool(r, s, key);
         if (!value) {
             rewritelog(r, 5, NULL, "map lookup FAILED: map=%s key=%s", name,
                        key);
@@ -1835,9 +3124,14 @@ static char *lookup_map(request_rec *r, char *name, char *key)
 /*
  * lookup a HTTP header and set VARY note
  */
-static const char *lookup_header(const char *name, rewrite_ctx *ctx)
+static const char *lookup_header(const char *name, int id, rewrite_ctx *ctx)
 {
-    const char *val = apr_table_get(ctx->r->headers_in, name);
+    const char *val;
+
+    if (id < 0) {
+        id = ap_request_var_id(name);
+    }
+    val = ap_request_table_get(ctx->r, ctx->r->headers_in, id, name);
 
     /* Skip the 'Vary: Host' header combination
      * as indicated in rfc7231 section-7.1.4
@@ -1872,9 +3166,10 @@ static APR_INLINE const char *la_u(rewrite_ctx *ctx)
 }
 
 /*
- * generic variable lookup
+ * generic variable lookup, id is that of the name of an HTTP: or ENV:
+ * variable when known, -1 otherwise
  */
-static char *lookup_variable(char *var, rewrite_ctx *ctx)
+static char *lookup_variable(char *var, int id, rewrite_ctx *ctx)
 {
     const char *result;
     request_rec *r = ctx->r;
@@ -1891,10 +3186,12 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
     if (var[3] == ':') {
         if (var[4] && !strncasecmp(var, "ENV", 3)) {
             var += 4;
-            result = apr_table_get(r->notes, var);
-
+            if (id < 0) {
+                id = ap_request_var_id(var);
+            }
+            result = ap_request_table_get(r, r->notes, id, var);
             if (!result) {
-                result = apr_table_get(r->subprocess_env, var);
+                result = ap_request_table_get(r, r->subprocess_env, id, var);
             }
             if (!result) {
                 result = getenv(var);
@@ -1911,14 +3208,15 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
             const char *path;
 
             if (!strncasecmp(var, "HTTP", 4)) {
-                result = lookup_header(var+5, ctx);
+                result = lookup_header(var+5, id, ctx);
             }
             else if (!strncasecmp(var, "LA-U", 4)) {
                 if (ctx->uri && subreq_ok(r)) {
                     path = ctx->perdir ? la_u(ctx) : ctx->uri;
                     rr = ap_sub_req_lookup_uri(path, r, NULL);
                     ctx->r = rr;
-                    result = apr_pstrdup(r->pool, lookup_variable(var+5, ctx));
+                    result = apr_pstrdup(r->pool,
+                                         lookup_variable(var+5, -1, ctx));
                     ctx->r = r;
                     ap_destroy_sub_req(rr);
 
@@ -1953,7 +3251,8 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
                     }
 
                     ctx->r = rr;
-                    result = apr_pstrdup(r->pool, lookup_variable(var+5, ctx));
+                    result = apr_pstrdup(r->pool,
+                                         lookup_variable(var+5, -1, ctx));
                     ctx->r = r;
                     ap_destroy_sub_req(rr);
 
@@ -2069,7 +3368,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
             case 'S':
                 if (!strcmp(var, "HTTP_HOST")) {
-                    result = lookup_header("Host", ctx);
+                    result = lookup_header("Host", AP_HEADER_HOST, ctx);
                 }
                 break;
 
@@ -2101,7 +3400,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
             case 'E':
                 if (*var == 'H' && !strcmp(var, "HTTP_ACCEPT")) {
-                    result = lookup_header("Accept", ctx);
+                    result = lookup_header("Accept", AP_HEADER_ACCEPT, ctx);
                 }
                 else if (!strcmp(var, "THE_REQUEST")) {
                     result = r->the_request;
@@ -2118,7 +3417,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
             case 'K':
                 if (!strcmp(var, "HTTP_COOKIE")) {
-                    result = lookup_header("Cookie", ctx);
+                    result = lookup_header("Cookie", AP_HEADER_COOKIE, ctx);
                 }
                 break;
 
@@ -2175,7 +3474,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
             case 'P':
                 if (!strcmp(var, "HTTP_REFERER")) {
-                    result = lookup_header("Referer", ctx);
+                    result = lookup_header("Referer", AP_HEADER_REFERER, ctx);
                 }
                 break;
 
@@ -2201,7 +3500,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
         case 14:
             if (*var == 'H' && !strcmp(var, "HTTP_FORWARDED")) {
-                result = lookup_header("Forwarded", ctx);
+                result = lookup_header("Forwarded", AP_HEADER_FORWARDED, ctx);
             }
             else if (*var == 'C' && !strcmp(var, "CONTEXT_PREFIX")) {
                 result = ap_context_prefix(r);
@@ -2218,7 +3517,8 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
             switch (var[7]) {
             case 'E':
                 if (!strcmp(var, "HTTP_USER_AGENT")) {
-                    result = lookup_header("User-Agent", ctx);
+                    result = lookup_header("User-Agent",
+                                           AP_HEADER_USER_AGENT, ctx);
                 }
                 break;
 
@@ -2253,7 +3553,7 @@ static char *lookup_variable(char *var, rewrite_ctx *ctx)
 
         case 21:
             if (!strcmp(var, "HTTP_PROXY_CONNECTION")) {
-                result = lookup_header("Proxy-Connection", ctx);
+                result = lookup_header("Proxy-Connection", -1, ctx);
             }
             else if (!strcmp(var, "CONTEXT_DOCUMENT_ROOT")) {
                 result = ap_context_document_root(r);
@@ -2322,7 +3622,8 @@ static APR_INLINE char *find_char_in_curlies(char *s, int c)
  * are interpreted by a later expansion, producing results that
  * were not intended by the administrator.
  */
-static char *do_expand(char *input, rewrite_ctx *ctx, rewriterule_entry *entry, apr_pool_t *pool)
+static char *do_expand(char *input, rewrite_ctx *ctx, rewriterule_entry *entry,
+                       const rewrite_varid *varids, apr_pool_t *pool)
 {
     result_list *result, *current;
     result_list sresult[SMALL_EXPANSION];
@@ -2388,7 +3689,17 @@ static char *do_expand(char *input, rewrite_ctx *ctx, rewriterule_entry *entry,
 
             /* variable lookup */
             else if (*p == '%') {
-                p = lookup_variable(apr_pstrmemdup(pool, p+2, endp-p-2), ctx);
+                int id = -1;
+
+                /* the variables of input interned at config time, if any */
+                while (varids && varids->pos < p) {
+                    varids = varids->next;
+                }
+                if (varids && varids->pos == p) {
+                    id = varids->id;
+                }
+                p = lookup_variable(apr_pstrmemdup(pool, p+2, endp-p-2), id,
+                                    ctx);
 
                 span = strlen(p);
                 current->len = span;
@@ -2433,10 +3744,11 @@ static char *do_expand(char *input, rewrite_ctx *ctx, rewriterule_entry *entry,
                     }
 
                     /* reuse of key variable as result */
-                    key = lookup_map(ctx->r, map, do_expand(key, ctx, entry, pool));
+                    key = lookup_map(ctx->r, map, do_expand(key, ctx, entry, NULL,
+                                                             pool));
 
                     if (!key && dflt && *dflt) {
-                        key = do_expand(dflt, ctx, entry, pool);
+                        key = do_expand(dflt, ctx, entry, NULL, pool);
                     }
 
                     if (key) {
@@ -2534,7 +3846,7 @@ static void do_expand_env(data_item *env, rewrite_ctx *ctx)
     char *name, *val;
 
     while (env) {
-        name = do_expand(env->data, ctx, NULL, ctx->r->pool);
+        name = do_expand(env->data, ctx, NULL, NULL, ctx->r->pool);
         if (*name == '!') {
             name++;
             apr_table_unset(ctx->r->subprocess_env, name);
@@ -2668,7 +3980,8 @@ static void add_cookie(request_rec *r, char *s)
 static void do_expand_cookie(data_item *cookie, rewrite_ctx *ctx)
 {
     while (cookie) {
-        add_cookie(ctx->r, do_expand(cookie->data, ctx, NULL, ctx->r->pool));
+        add_cookie(ctx->r, do_expand(cookie->data, ctx, NULL, NULL,
+                                     ctx->r->pool));
         cookie = cookie->next;
     }
 
@@ -3144,6 +4457,16 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
                                          (void *)cmd->server, a1);
     }
+    else if (strncasecmp(a2, "idx:", 4) == 0) {
+        if ((fname = ap_server_root_relative(cmd->pool, a2+4)) == NULL) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: bad path to idx map: ",
+                               a2+4, NULL);
+        }
+
+        newmap->type      = MAPTYPE_IDX;
+        newmap->datafile  = fname;
+        newmap->checkfile = fname;
+    }
     else if (strncasecmp(a2, "dbm", 3) == 0) {
         apr_status_t rv;
 
@@ -3223,6 +4546,63 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
             newmap->group = apr_strtok(NULL, ":", &tok_cntx);
         }
     }
+    else if (strncasecmp(a2, "prgpool", 7) == 0
+             && (a2[7] == ':' || a2[7] == '=')) {
+        const char *prg = a2 + 8;
+
+        newmap->nprocs  = REWRITE_PRGPOOL_PROCS;
+        newmap->timeout = apr_time_from_sec(REWRITE_PRGPOOL_TIMEOUT);
+
+        /* prgpool=<procs>[,<timeout>]:<program> */
+        if (a2[7] == '=') {
+            const char *colon = ap_strchr_c(prg, ':');
+            char *opts, *timeout;
+
+            if (!colon) {
+                return apr_pstrcat(cmd->pool, "RewriteMap: bad map:",
+                                   a2, NULL);
+            }
+            opts = apr_pstrmemdup(cmd->pool, prg, colon - prg);
+            if ((timeout = ap_strchr(opts, ',')) != NULL) {
+                *timeout++ = '\0';
+                if (ap_timeout_parameter_parse(timeout, &newmap->timeout,
+                                               "s") != APR_SUCCESS
+                        || newmap->timeout <= 0) {
+                    return apr_pstrcat(cmd->pool, "RewriteMap: bad timeout "
+                                       "for prgpool map: ", timeout, NULL);
+                }
+            }
+            if (*opts) {
+                newmap->nprocs = atoi(opts);
+                if (newmap->nprocs < 1
+                        || newmap->nprocs > REWRITE_PRGPOOL_MAX_PROCS) {
+                    return apr_psprintf(cmd->pool, "RewriteMap: the number "
+                                        "of programs of a prgpool map must "
+                                        "be between 1 and %d",
+                                        REWRITE_PRGPOOL_MAX_PROCS);
+                }
+            }
+            prg = colon + 1;
+        }
+
+        /* started by the children, after they switched user */
+        if (a3) {
+            return "RewriteMap: prgpool maps run as the user of the child "
+                   "processes, no user:group can be given";
+        }
+
+        apr_tokenize_to_argv(prg, &newmap->argv, cmd->pool);
+
+        fname = newmap->argv[0];
+        if ((newmap->argv[0] = ap_server_root_relative(cmd->pool,
+                                                       fname)) == NULL) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: bad path to prgpool "
+                               "map: ", fname, NULL);
+        }
+
+        newmap->type      = MAPTYPE_PRGPOOL;
+        newmap->checkfile = newmap->argv[0];
+    }
     else if (strncasecmp(a2, "int:", 4) == 0) {
         newmap->type      = MAPTYPE_INT;
         newmap->func      = (char *(*)(request_rec *,char *))
@@ -3258,6 +4638,50 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
     return NULL;
 }
 
+static const char *cmd_rewritemapcache(cmd_parms *cmd, void *dconf,
+                                       const char *a1, const char *a2,
+                                       const char *a3)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t n;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(a1, "off")) {
+        if (a2) {
+            return "RewriteMapCache: 'off' takes no other argument";
+        }
+        map_cache_provider = NULL;
+        return NULL;
+    }
+
+    if (!a2) {
+        return "RewriteMapCache: the number of entries is required";
+    }
+    n = apr_strtoi64(a2, &end, 10);
+    if (*end || n <= 0 || n > APR_INT32_MAX) {
+        return apr_pstrcat(cmd->pool, "RewriteMapCache: bad number of "
+                           "entries: ", a2, NULL);
+    }
+    map_cache_entries = (unsigned int)n;
+
+    if (a3) {
+        n = apr_strtoi64(a3, &end, 10);
+        if (*end || n < (apr_int64_t)SHM_MAP_ENTRY_DATA + 16 || n > 65536) {
+            return apr_psprintf(cmd->pool, "RewriteMapCache: the entry "
+                                "size must be between %d and 65536",
+                                (int)SHM_MAP_ENTRY_DATA + 16);
+        }
+        map_cache_entry_size = APR_ALIGN_DEFAULT((apr_size_t)n);
+    }
+
+    map_cache_provider = a1;
+    return NULL;
+}
+
 static const char *cmd_rewritebase(cmd_parms *cmd, void *in_dconf,
                                    const char *a1)
 {
@@ -3363,6 +4787,45 @@ static const char *cmd_rewritecond_setflag(apr_pool_t *p, void *_cfg,
     return NULL;
 }
 
+/*
+ * intern the names of the %{HTTP:name} and %{ENV:name} variables
+ * used by a rule or condition, so that their lookups are memoized
+ * (see lookup_variable()), and return their ids by position in str
+ */
+static rewrite_varid *intern_variables(apr_pool_t *p, apr_pool_t *ptemp,
+                                       const char *str)
+{
+    rewrite_varid *varids = NULL, **last = &varids;
+    const char *pos, *name, *end;
+
+    while ((str = ap_strstr_c(str, "%{")) != NULL) {
+        pos = str;
+        str += 2;
+        if (!strncasecmp(str, "HTTP:", 5)) {
+            name = str + 5;
+        }
+        else if (!strncasecmp(str, "ENV:", 4)) {
+            name = str + 4;
+        }
+        else {
+            continue;
+        }
+        for (end = name; *end && *end != '}' && *end != '%'; ++end)
+            ;
+        if (*end == '}' && end > name) {
+            rewrite_varid *v = apr_palloc(p, sizeof(*v));
+            v->next = NULL;
+            v->pos = pos;
+            v->id = ap_request_var_id(apr_pstrmemdup(ptemp, name,
+                                                     end - name));
+            *last = v;
+            last = &v->next;
+        }
+    }
+
+    return varids;
+}
+
 static const char *cmd_rewritecond(cmd_parms *cmd, void *in_dconf,
                                    const char *in_str)
 {
@@ -3397,6 +4860,7 @@ static const char *cmd_rewritecond(cmd_parms *cmd, void *in_dconf,
 
     /* arg1: the input string */
     newcond->input = a1;
+    newcond->varids = intern_variables(cmd->pool, cmd->temp_pool, a1);
 
     /* arg3: optional flags field
      * (this has to be parsed first, because we need to
@@ -3856,6 +5320,7 @@ static const char *cmd_rewriterule(cmd_parms *cmd, void *in_dconf,
 
     /* arg2: the output string */
     newrule->output = a2;
+    newrule->varids = intern_variables(cmd->pool, cmd->temp_pool, a2);
     if (*a2 == '-' && !a2[1]) {
         newrule->flags |= RULEFLAG_NOSUB;
     }
@@ -3921,7 +5386,7 @@ static int apply_rewrite_cond(rewritecond_entry *p, rewrite_ctx *ctx, apr_pool_t
     int basis;
 
     if (p->ptype != CONDPAT_AP_EXPR)
-        input = do_expand(p->input, ctx, NULL, pool);
+        input = do_expand(p->input, ctx, NULL, p->varids, pool);
 
     switch (p->ptype) {
     case CONDPAT_FILE_EXISTS:
@@ -4085,7 +5550,7 @@ static APR_INLINE void force_type_handler(rewriterule_entry *p,
     char *expanded;
 
     if (p->forced_mimetype) {
-        expanded = do_expand(p->forced_mimetype, ctx, p, ctx->r->pool);
+        expanded = do_expand(p->forced_mimetype, ctx, p, NULL, ctx->r->pool);
 
         if (*expanded) {
             ap_str_tolower(expanded);
@@ -4099,7 +5564,7 @@ static APR_INLINE void force_type_handler(rewriterule_entry *p,
     }
 
     if (p->forced_handler) {
-        expanded = do_expand(p->forced_handler, ctx, p, ctx->r->pool);
+        expanded = do_expand(p->forced_handler, ctx, p, NULL, ctx->r->pool);
 
         if (*expanded) {
             ap_str_tolower(expanded);
@@ -4113,6 +5578,351 @@ static APR_INLINE void force_type_handler(rewriterule_entry *p,
     }
 }
 
+/*
+ * The RewriteRule prefilter: the literal strings which the URI must
+ * contain for the rules' patterns to match are all searched at once by
+ * an Aho-Corasick automaton, built as a DFA over the classes of the
+ * (case folded) bytes the literals are made of, so that the rules whose
+ * literal is not found can be skipped without running their regex.
+ */
+
+/* Skips the character class at s, returns what follows or NULL */
+static const char *prefilter_skip_class(const char *s)
+{
+    ++s;
+    if (*s == '^') {
+        ++s;
+    }
+    if (*s == ']') {
+        ++s;
+    }
+    while (*s != ']') {
+        if (!*s) {
+            return NULL;
+        }
+        if (*s == '\\') {
+            if (!*++s) {
+                return NULL;
+            }
+        }
+        else if (*s == '[' && s[1] == ':') {
+            const char *end = ap_strstr_c(s + 2, ":]");
+
+            if (end) {
+                s = end + 1;
+            }
+        }
+        ++s;
+    }
+    return s + 1;
+}
+
+/* Skips the group at s, returns what follows or NULL */
+static const char *prefilter_skip_group(const char *s)
+{
+    int depth = 0;
+
+    while (*s) {
+        if (*s == '\\') {
+            if (!*++s) {
+                return NULL;
+            }
+        }
+        else if (*s == '[') {
+            if (!(s = prefilter_skip_class(s))) {
+                return NULL;
+            }
+            continue;
+        }
+        else if (*s == '(') {
+            ++depth;
+        }
+        else if (*s == ')' && !--depth) {
+            return s + 1;
+        }
+        ++s;
+    }
+    return NULL;
+}
+
+/* Skips the {n}, {n,} or {n,m} quantifier at s, returns what follows or
+ * NULL if it's not one (a literal '{' for PCRE, we don't bother).
+ */
+static const char *prefilter_skip_braces(const char *s)
+{
+    const char *start = ++s;
+
+    while (apr_isdigit(*s)) {
+        ++s;
+    }
+    if (s == start) {
+        return NULL;
+    }
+    if (*s == ',') {
+        ++s;
+        while (apr_isdigit(*s)) {
+            ++s;
+        }
+    }
+    return *s == '}' ? s + 1 : NULL;
+}
+
+/*
+ * Returns the longest string (lowercased) which a subject must contain
+ * for the pattern to match, or NULL if none is found.  This is a
+ * conservative lexer: whatever might not be a required literal ends the
+ * current one, and what could change the meaning of the rest (top-level
+ * alternatives, inline options, quoting) or is not understood makes it
+ * give up.
+ */
+static char *prefilter_literal(apr_pool_t *p, const char *pattern)
+{
+    const char *s = pattern;
+    char *cur, *best = NULL;
+    apr_size_t len = 0, bestlen = 0;
+
+    if (ap_strstr_c(pattern, "\\Q")) {
+        return NULL;
+    }
+    cur = apr_palloc(p, strlen(pattern) + 1);
+
+    while (*s) {
+        int c = (unsigned char)*s++, atom = 1;
+
+        switch (c) {
+        case '|':
+            return NULL;
+
+        case '(':
+            if (*s == '?' && !ap_strchr_c(":=!<>|#", s[1])) {
+                return NULL;
+            }
+            if (!(s = prefilter_skip_group(s - 1))) {
+                return NULL;
+            }
+            atom = 0;
+            break;
+
+        case '[':
+            if (!(s = prefilter_skip_class(s - 1))) {
+                return NULL;
+            }
+            atom = 0;
+            break;
+
+        case '.':
+        case '^':
+        case '$':
+            atom = 0;
+            break;
+
+        case ')':
+            return NULL;
+
+        case '*':
+        case '?':
+        case '{':
+            /* the previous char is optional */
+            if (c == '{' && !(s = prefilter_skip_braces(s - 1))) {
+                return NULL;
+            }
+            if (len) {
+                --len;
+            }
+            /* fall through */
+        case '+':
+            if (*s == '?' || *s == '+') {
+                ++s;
+            }
+            atom = 0;
+            break;
+
+        case '\\':
+            c = (unsigned char)*s++;
+            if (!c) {
+                return NULL;
+            }
+            if (apr_isalnum(c)) {
+                /* single char types and assertions, anything else may
+                 * consume what follows
+                 */
+                if (!ap_strchr_c("dDwWsSbBAzZGhHvVRX", c)) {
+                    return NULL;
+                }
+                atom = 0;
+            }
+            break;
+        }
+
+        if (atom) {
+            cur[len++] = apr_tolower(c);
+            continue;
+        }
+        if (len > bestlen) {
+            best = apr_pstrmemdup(p, cur, len);
+            bestlen = len;
+        }
+        len = 0;
+    }
+    if (len > bestlen) {
+        best = apr_pstrmemdup(p, cur, len);
+        bestlen = len;
+    }
+
+    return bestlen >= REWRITE_PREFILTER_MIN_LITERAL ? best : NULL;
+}
+
+static rewrite_prefilter *prefilter_make(apr_pool_t *p,
+                                         apr_array_header_t *rewriterules)
+{
+    rewriterule_entry *entries = (rewriterule_entry *)rewriterules->elts;
+    rewrite_prefilter *pf;
+    apr_hash_t *literals;
+    apr_hash_index_t *hi;
+    apr_uint32_t *fail, *queue, head, tail, state;
+    apr_size_t maxstates = 1;
+    unsigned int c, nliterals;
+    int i;
+
+    if (rewriterules->nelts < REWRITE_PREFILTER_MIN_RULES) {
+        return NULL;
+    }
+
+    pf = apr_pcalloc(p, sizeof(*pf));
+    pf->nrules = rewriterules->nelts;
+    pf->always = apr_palloc(p, pf->nrules);
+    pf->next_rule = apr_palloc(p, pf->nrules * sizeof(int));
+
+    /* the rules sharing the same literal are chained */
+    literals = apr_hash_make(p);
+    for (i = pf->nrules - 1; i >= 0; --i) {
+        char *lit = NULL;
+        int *first;
+
+        if (!(entries[i].flags & RULEFLAG_NOTMATCH)) {
+            lit = prefilter_literal(p, entries[i].pattern);
+        }
+        pf->always[i] = !lit;
+        pf->next_rule[i] = -1;
+        if (!lit) {
+            continue;
+        }
+        first = apr_hash_get(literals, lit, APR_HASH_KEY_STRING);
+        if (!first) {
+            first = apr_palloc(p, sizeof(int));
+            apr_hash_set(literals, lit, APR_HASH_KEY_STRING, first);
+            maxstates += strlen(lit);
+        }
+        else {
+            pf->next_rule[i] = *first;
+        }
+        *first = i;
+    }
+    nliterals = apr_hash_count(literals);
+    if (!nliterals) {
+        return NULL;
+    }
+
+    /* class 0 is for the bytes which are not in any literal */
+    pf->nclasses = 1;
+    for (hi = apr_hash_first(p, literals); hi; hi = apr_hash_next(hi)) {
+        const unsigned char *lit;
+
+        apr_hash_this(hi, (const void **)&lit, NULL, NULL);
+        for (; *lit; ++lit) {
+            if (!pf->classes[*lit]) {
+                pf->classes[*lit] = pf->nclasses++;
+            }
+        }
+    }
+    for (c = 0; c < 256; ++c) {
+        pf->classes[c] = pf->classes[apr_tolower(c)];
+    }
+
+    /* the trie, where 0 (the root) is also "no transition" */
+    pf->delta = apr_pcalloc(p, maxstates * pf->nclasses
+                               * sizeof(apr_uint32_t));
+    pf->match = apr_palloc(p, maxstates * sizeof(int));
+    pf->dict = apr_pcalloc(p, maxstates * sizeof(apr_uint32_t));
+    pf->match[0] = -1;
+    pf->nstates = 1;
+    for (hi = apr_hash_first(p, literals); hi; hi = apr_hash_next(hi)) {
+        const unsigned char *lit;
+        void *first;
+
+        apr_hash_this(hi, (const void **)&lit, NULL, &first);
+        for (state = 0; *lit; ++lit) {
+            apr_uint32_t *next = &pf->delta[state * pf->nclasses
+                                            + pf->classes[*lit]];
+            if (!*next) {
+                *next = pf->nstates++;
+                pf->match[*next] = -1;
+            }
+            state = *next;
+        }
+        pf->match[state] = *(int *)first;
+    }
+
+    /* breadth first, fill in the missing transitions from the failure
+     * ones, and link the states to their longest suffix with a match
+     */
+    fail = apr_pcalloc(p, pf->nstates * sizeof(apr_uint32_t));
+    queue = apr_palloc(p, pf->nstates * sizeof(apr_uint32_t));
+    head = tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        apr_uint32_t *row;
+
+        state = queue[head++];
+        row = &pf->delta[state * pf->nclasses];
+        for (c = 1; c < pf->nclasses; ++c) {
+            apr_uint32_t next = row[c];
+            apr_uint32_t down = state ? pf->delta[fail[state] * pf->nclasses
+                                                  + c] : 0;
+
+            /* children are always numbered after their parent */
+            if (next > state) {
+                fail[next] = down;
+                pf->dict[next] = pf->match[down] >= 0 ? down
+                                                      : pf->dict[down];
+                queue[tail++] = next;
+            }
+            else {
+                row[c] = down;
+            }
+        }
+    }
+
+    return pf;
+}
+
+/* Sets candidates[i] for the rules which may match subject */
+static void prefilter_scan(const rewrite_prefilter *pf, const char *subject,
+                           unsigned char *candidates)
+{
+    const unsigned char *s = (const unsigned char *)subject;
+    apr_uint32_t state = 0;
+
+    memcpy(candidates, pf->always, pf->nrules);
+    for (; *s; ++s) {
+        apr_uint32_t m;
+
+        state = pf->delta[state * pf->nclasses + pf->classes[*s]];
+        m = pf->match[state] >= 0 ? state : pf->dict[state];
+        for (; m; m = pf->dict[m]) {
+            int rule = pf->match[m];
+
+            /* the rules of a literal are marked all at once */
+            if (candidates[rule]) {
+                continue;
+            }
+            for (; rule >= 0; rule = pf->next_rule[rule]) {
+                candidates[rule] = 1;
+            }
+        }
+    }
+}
+
 /*
  * Apply a single RewriteRule
  */
@@ -4238,7 +6048,7 @@ static int apply_rewrite_rule(rewriterule_entry *p, rewrite_ctx *ctx)
 
     /* expand the result */
     if (!(p->flags & RULEFLAG_NOSUB)) {
-        newuri = do_expand(p->output, ctx, p, ctx->r->pool);
+        newuri = do_expand(p->output, ctx, p, p->varids, ctx->r->pool);
         rewritelog(r, 2, ctx->perdir, "rewrite '%s' -> '%s'", ctx->uri,
                    newuri);
     }
@@ -4366,6 +6176,7 @@ static int apply_rewrite_rule(rewriterule_entry *p, rewrite_ctx *ctx)
  * i.e. a list of rewrite rules
  */
 static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
+                              const rewrite_prefilter *prefilter,
                               char *perdir)
 {
     rewriterule_entry *entries;
@@ -4376,6 +6187,8 @@ static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
     int s;
     rewrite_ctx *ctx;
     int round = 1;
+    unsigned char *candidates = NULL;
+    const char *scanned = NULL;
     rewrite_perdir_conf *dconf = (rewrite_perdir_conf *)
                                  ap_get_module_config(r->per_dir_config,
                                                       &rewrite_module);
@@ -4413,12 +6226,28 @@ static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
         }
 
         /*
-         *  Apply the current rule.
+         *  Apply the current rule, unless the prefilter tells that its
+         *  pattern cannot match (the URI is scanned again once changed).
          */
         ctx->vary = NULL;
-        rc = apply_rewrite_rule(p, ctx);
+        if (prefilter && r->filename != scanned) {
+            if (!candidates) {
+                candidates = apr_palloc(r->pool, prefilter->nrules);
+            }
+            prefilter_scan(prefilter, r->filename, candidates);
+            scanned = r->filename;
+        }
+        if (prefilter && !candidates[i]) {
+            rewritelog(r, 3, perdir, "pattern '%s' cannot match uri '%s', "
+                       "skipped", p->pattern, r->filename);
+            rc = 0;
+        }
+        else {
+            rc = apply_rewrite_rule(p, ctx);
+        }
 
         if (rc) {
+            scanned = NULL;
 
             /* Catch looping rules with pathinfo growing unbounded */
             if ( strlen( r->filename ) > 2*r->server->limit_req_line ) {
@@ -4542,6 +6371,11 @@ static int pre_config(apr_pool_t *pconf,
 
     rewrite_lock_needed = 0; 
     ap_mutex_register(pconf, rewritemap_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+    ap_mutex_register(pconf, map_cache_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+
+    map_cache_provider = NULL;
+    map_cache_entries = 0;
+    map_cache_entry_size = REWRITE_SHM_ENTRY_SIZE;
 
     /* register int: rewritemap handlers */
     map_pfn_register = APR_RETRIEVE_OPTIONAL_FN(ap_register_rewrite_mapfunc);
@@ -4577,13 +6411,28 @@ static int post_config(apr_pool_t *p,
     }
 
     /* if we are not doing the initial config, step through the servers and
-     * open the RewriteMap prg:xxx programs,
+     * open the RewriteMap prg:xxx programs, and build the rules' prefilters
      */
     if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_CONFIG) {
-        for (; s; s = s->next) {
-            if (run_rewritemap_programs(s, p) != APR_SUCCESS) {
+        server_rec *sp;
+
+        for (sp = s; sp; sp = sp->next) {
+            rewrite_server_conf *conf;
+
+            if (run_rewritemap_programs(sp, p) != APR_SUCCESS) {
                 return HTTP_INTERNAL_SERVER_ERROR;
             }
+
+            /* the server's rules are final (merged) by now */
+            conf = ap_get_module_config(sp->module_config, &rewrite_module);
+            if (conf->state == ENGINE_ENABLED) {
+                conf->prefilter = prefilter_make(p, conf->rewriterules);
+            }
+        }
+
+        /* and create the shared map cache, if configured */
+        if (map_cache_provider && map_cache_create(p, ptemp, s) != OK) {
+            return HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 
@@ -4596,6 +6445,7 @@ static int post_config(apr_pool_t *p,
 static void init_child(apr_pool_t *p, server_rec *s)
 {
     apr_status_t rv = 0; /* get a rid of gcc warning (REWRITELOG_DISABLED) */
+    server_rec *sp;
 
     if (rewrite_mapr_lock_acquire) {
         rv = apr_global_mutex_child_init(&rewrite_mapr_lock_acquire,
@@ -4607,11 +6457,92 @@ static void init_child(apr_pool_t *p, server_rec *s)
         }
     }
 
+    if (map_cache_lock) {
+        rv = apr_global_mutex_child_init(&map_cache_lock,
+                 apr_global_mutex_lockfile(map_cache_lock), p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10271)
+                         "mod_rewrite: could not init map_cache_lock in "
+                         "child, using the child's map cache");
+            map_cache_shm = NULL;
+        }
+    }
+
     /* create the lookup cache */
     if (!init_cache(p)) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(00667)
                      "mod_rewrite: could not init map cache in child");
     }
+
+    /* and the idx maps' mappings */
+    apr_pool_create(&idxmap_pool, p);
+    apr_pool_tag(idxmap_pool, "rewrite_idxmaps");
+#if APR_HAS_THREADS
+    (void)apr_thread_mutex_create(&idxmap_lock, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+
+    /* start the prgpool maps' programs of this child */
+    for (sp = s; sp; sp = sp->next) {
+        rewrite_server_conf *conf;
+        apr_hash_index_t *hi;
+
+        conf = ap_get_module_config(sp->module_config, &rewrite_module);
+        if (conf->state == ENGINE_DISABLED) {
+            continue;
+        }
+
+        for (hi = apr_hash_first(p, conf->rewritemaps); hi;
+             hi = apr_hash_next(hi)) {
+            rewritemap_entry *map;
+            rewrite_prgpool *pp;
+#if APR_HAS_THREADS
+            apr_allocator_t *allocator;
+            apr_thread_mutex_t *mutex;
+#endif
+            void *val;
+            int i;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            map = val;
+
+            /* possibly inherited */
+            if (map->type != MAPTYPE_PRGPOOL || map->prgpool) {
+                continue;
+            }
+
+            pp = apr_pcalloc(p, sizeof(*pp));
+#if APR_HAS_THREADS
+            /* the programs' pools are created and destroyed unlocked */
+            if (apr_allocator_create(&allocator) != APR_SUCCESS) {
+                continue;
+            }
+            apr_pool_create_ex(&pp->pool, p, NULL, allocator);
+            apr_allocator_owner_set(allocator, pp->pool);
+            apr_pool_tag(pp->pool, "rewrite_prgpool");
+            if (apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT,
+                                        pp->pool) != APR_SUCCESS
+                    || apr_thread_mutex_create(&pp->lock,
+                                               APR_THREAD_MUTEX_DEFAULT,
+                                               p) != APR_SUCCESS
+                    || apr_thread_cond_create(&pp->cond, p) != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10281)
+                             "mod_rewrite: could not init RewriteMap "
+                             "program %s in child", map->checkfile);
+                continue;
+            }
+            apr_allocator_mutex_set(allocator, mutex);
+#else
+            apr_pool_create(&pp->pool, p);
+            apr_pool_tag(pp->pool, "rewrite_prgpool");
+#endif
+            pp->procs = apr_pcalloc(p, map->nprocs * sizeof(*pp->procs));
+            map->prgpool = pp;
+
+            for (i = 0; i < map->nprocs; ++i) {
+                (void)prgpool_spawn(s, map, &pp->procs[i]);
+            }
+        }
+    }
 }
 
 
@@ -4751,7 +6682,8 @@ static int hook_uri2file(request_rec *r)
         /*
          *  now apply the rules ...
          */
-        rulestatus = apply_rewrite_list(r, conf->rewriterules, NULL);
+        rulestatus = apply_rewrite_list(r, conf->rewriterules,
+                                        conf->prefilter, NULL);
         apr_table_setn(r->notes, "mod_rewrite_rewritten",
                        apr_psprintf(r->pool,"%d",rulestatus));
     }
@@ -5046,7 +6978,8 @@ static int hook_fixup(request_rec *r)
     /*
      *  now apply the rules ...
      */
-    rulestatus = apply_rewrite_list(r, dconf->rewriterules, dconf->directory);
+    rulestatus = apply_rewrite_list(r, dconf->rewriterules, NULL,
+                                    dconf->directory);
     if (rulestatus) {
         unsigned skip;
 
@@ -5369,6 +7302,9 @@ static const command_rec command_table[] = {
                      "an URL-applied regexp-pattern and a substitution URL"),
     AP_INIT_TAKE23(   "RewriteMap",      cmd_rewritemap,      NULL, RSRC_CONF,
                      "a mapname and a filename and options"),
+    AP_INIT_TAKE123( "RewriteMapCache", cmd_rewritemapcache, NULL, RSRC_CONF,
+                     "'off', or a slotmem provider (e.g. shm), the number "
+                     "of entries and optionally their size"),
     { NULL }
 };
 
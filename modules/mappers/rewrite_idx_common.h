@@ -0,0 +1,81 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file rewrite_idx_common.h
+ * @brief Format of the idx: RewriteMap files, written by httxt2idx and
+ *        read (mapped) by mod_rewrite
+ *
+ * @defgroup MOD_REWRITE_IDX idx: RewriteMap format
+ * @ingroup  MOD_REWRITE
+ * @{
+ */
+
+#ifndef REWRITE_IDX_COMMON_H
+#define REWRITE_IDX_COMMON_H
+
+#include "apr.h"
+
+/*
+ * All the numbers are 32bit little endian, offsets are from the start of
+ * the file:
+ *
+ *   +-------+----------+-------+---------------------+-----------------+
+ *   | magic | nbuckets | nkeys | buckets (nbuckets)  | records (nkeys) |
+ *   +-------+----------+-------+---------------------+-----------------+
+ *
+ * nbuckets is a power of two, a bucket is the hash of a key followed by
+ * the offset of its record, both zero for an empty bucket.  Keys are
+ * looked up from bucket (hash & (nbuckets - 1)) to the next empty bucket
+ * (linear probing).  A record is the length of the key, the length of the
+ * value, then the key and the value (not terminated).
+ */
+#define REWRITE_IDX_MAGIC       "RWIDX\r\n\001"
+#define REWRITE_IDX_MAGIC_LEN   8
+#define REWRITE_IDX_HEADER_LEN  (REWRITE_IDX_MAGIC_LEN + 8)
+#define REWRITE_IDX_BUCKET_LEN  8
+#define REWRITE_IDX_RECORD_LEN  8
+
+static APR_INLINE apr_uint32_t rewrite_idx_get32(const unsigned char *p)
+{
+    return (apr_uint32_t)p[0] | ((apr_uint32_t)p[1] << 8)
+           | ((apr_uint32_t)p[2] << 16) | ((apr_uint32_t)p[3] << 24);
+}
+
+static APR_INLINE void rewrite_idx_put32(unsigned char *p, apr_uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/* 32bit FNV-1a, part of the format */
+static APR_INLINE apr_uint32_t rewrite_idx_hash(const char *key,
+                                                apr_size_t len)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    apr_uint32_t h = 2166136261U;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+#endif /* REWRITE_IDX_COMMON_H */
+/** @} */
@@ -0,0 +1,367 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Latency aware load balancing: each worker keeps an exponentially
+ * weighted moving average (EWMA) of its response times, in microseconds,
+ * in its shared lbstatus (tagged, see BYLATENCY_TAG), and the number of
+ * requests in flight is the shared busy count already maintained by
+ * mod_proxy_balancer.  A request goes to the better of two workers picked
+ * at random amongst the eligible ones ("power of two choices"), where
+ * better means the lowest
+ *     ewma * (busy + 1) / lbfactor
+ * Picking at random keeps the children (which don't see each other's
+ * choices until they complete) from all herding onto the single fastest
+ * worker, while comparing two of them is enough to steer away from slow
+ * or loaded ones.
+ *
+ * Samples are folded into the EWMA with atomic compare-and-swaps on the
+ * shared memory, so no lock is taken besides the balancer's thread mutex
+ * the finder is already called under.
+ */
+
+#include "mod_proxy.h"
+#include "scoreboard.h"
+#include "ap_mpm.h"
+#include "apr_version.h"
+#include "apr_atomic.h"
+#include "ap_hooks.h"
+
+module AP_MODULE_DECLARE_DATA lbmethod_bylatency_module;
+
+static APR_OPTIONAL_FN_TYPE(proxy_balancer_get_best_worker)
+                            *ap_proxy_balancer_get_best_worker_fn = NULL;
+
+/* The EWMA moves by 1/2 of the difference toward slower samples and by
+ * 1/8 toward faster ones, so that a worker going bad is avoided quickly
+ * while a single fast response does not make it attractive again.
+ */
+#define BYLATENCY_UP_SHIFT      1
+#define BYLATENCY_DOWN_SHIFT    3
+
+/* Each time a sampled worker loses the comparison its EWMA decays by this
+ * fraction (as a shift), so that a worker which was slow once is probed
+ * again after a while instead of being starved forever.
+ */
+#define BYLATENCY_DECAY_SHIFT   6
+
+/* The EWMA is stored in lbstatus with this bit set, other values (as
+ * written by mod_proxy_balancer's recalc_factors() or its default status
+ * update for other lbmethods) are not ours and mean "not sampled yet".
+ * This bounds the EWMA to about 18 minutes.
+ */
+#define BYLATENCY_TAG           0x40000000u
+#define BYLATENCY_MAX           (BYLATENCY_TAG - 1)
+
+typedef struct {
+    proxy_worker *pick[2];
+    int seen;
+    apr_uint32_t rand;
+} bylatency_baton;
+
+static const proxy_balancer_method bylatency;
+
+static APR_INLINE apr_uint32_t *ewma_of(proxy_worker *worker)
+{
+    return (apr_uint32_t *)&worker->s->lbstatus;
+}
+
+/* The EWMA of a stored lbstatus, 0 if not sampled yet */
+static APR_INLINE apr_uint32_t ewma_value(apr_uint32_t status)
+{
+    return ((status & ~BYLATENCY_MAX) == BYLATENCY_TAG)
+           ? status & BYLATENCY_MAX : 0;
+}
+
+static APR_INLINE apr_uint32_t ewma_get(proxy_worker *worker)
+{
+    return ewma_value(apr_atomic_read32(ewma_of(worker)));
+}
+
+static void ewma_update(proxy_worker *worker, apr_uint32_t sample)
+{
+    apr_uint32_t *ewma = ewma_of(worker);
+    apr_uint32_t old, cur, val;
+
+    do {
+        old = apr_atomic_read32(ewma);
+        cur = ewma_value(old);
+        if (cur == 0) {
+            val = sample;
+        }
+        else if (sample > cur) {
+            val = cur + ((sample - cur) >> BYLATENCY_UP_SHIFT);
+        }
+        else {
+            val = cur - ((cur - sample) >> BYLATENCY_DOWN_SHIFT);
+        }
+        if (!val) {
+            val = 1;
+        }
+    } while (apr_atomic_cas32(ewma, val | BYLATENCY_TAG, old) != old);
+}
+
+static void ewma_decay(proxy_worker *worker)
+{
+    apr_uint32_t *ewma = ewma_of(worker);
+    apr_uint32_t old = apr_atomic_read32(ewma);
+    apr_uint32_t cur = ewma_value(old);
+
+    /* Best effort, losing a race with a sample is fine */
+    if (cur > (1 << BYLATENCY_DECAY_SHIFT)) {
+        apr_atomic_cas32(ewma, (cur - (cur >> BYLATENCY_DECAY_SHIFT))
+                               | BYLATENCY_TAG, old);
+    }
+}
+
+static APR_INLINE apr_uint32_t next_rand(bylatency_baton *b)
+{
+    /* xorshift32, seeded once per lookup */
+    b->rand ^= b->rand << 13;
+    b->rand ^= b->rand >> 17;
+    b->rand ^= b->rand << 5;
+    return b->rand;
+}
+
+/* Reservoir sampling of two workers amongst the eligible ones, which
+ * ap_proxy_balancer_get_best_worker() restricts to the first usable
+ * lbset (with its spares) or else the standbys.
+ */
+static int is_best_bylatency(proxy_worker *current, proxy_worker *prev_best,
+                             void *baton)
+{
+    bylatency_baton *b = baton;
+    int n = b->seen++;
+
+    if (n < 2) {
+        b->pick[n] = current;
+        return 1;
+    }
+    n = next_rand(b) % (apr_uint32_t)(n + 1);
+    if (n < 2) {
+        b->pick[n] = current;
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether worker a should be preferred over worker b */
+static int is_better(proxy_worker *a, proxy_worker *b)
+{
+    apr_uint32_t ewma_a = ewma_get(a), ewma_b = ewma_get(b);
+    double cost_a = (double)(a->s->busy + 1) / (a->s->lbfactor > 0
+                                                ? a->s->lbfactor : 1);
+    double cost_b = (double)(b->s->busy + 1) / (b->s->lbfactor > 0
+                                                ? b->s->lbfactor : 1);
+
+    if (ewma_a && ewma_b) {
+        cost_a *= ewma_a;
+        cost_b *= ewma_b;
+    }
+    else if (cost_a == cost_b) {
+        /* Probe the one not sampled yet */
+        return !ewma_a;
+    }
+
+    return cost_a <= cost_b;
+}
+
+static proxy_worker *find_best_bylatency(proxy_balancer *balancer,
+                                         request_rec *r)
+{
+    bylatency_baton b;
+    proxy_worker *worker;
+    apr_time_t *start;
+
+    memset(&b, 0, sizeof(b));
+    do {
+        ap_random_insecure_bytes(&b.rand, sizeof(b.rand));
+    } while (!b.rand);
+
+    if (!ap_proxy_balancer_get_best_worker_fn(balancer, r, is_best_bylatency,
+                                              &b)) {
+        return NULL;
+    }
+
+    worker = b.pick[0];
+    if (b.pick[1]) {
+        proxy_worker *other = b.pick[1];
+        if (!is_better(worker, other)) {
+            worker = other;
+            other = b.pick[0];
+        }
+        ewma_decay(other);
+    }
+
+    /* Stamp the request for post_request() to sample the latency (the last
+     * attempt wins on failover).
+     */
+    start = ap_get_module_config(r->request_config,
+                                 &lbmethod_bylatency_module);
+    if (!start) {
+        start = apr_palloc(r->pool, sizeof(*start));
+        ap_set_module_config(r->request_config, &lbmethod_bylatency_module,
+                             start);
+    }
+    *start = apr_time_now();
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                  "bylatency: selected worker \"%s\" (ewma %u, busy %"
+                  APR_SIZE_T_FMT ") out of %d", worker->s->name,
+                  ewma_get(worker), worker->s->busy, b.seen);
+
+    return worker;
+}
+
+/* Runs before mod_proxy_balancer's which stops the chain, so DECLINED
+ * in any case.  For suspended requests (asynchronous responses), it runs
+ * when they complete, see ap_proxy_post_suspended_request().
+ */
+static int bylatency_post_request(proxy_worker *worker,
+                                  proxy_balancer *balancer,
+                                  request_rec *r,
+                                  proxy_server_conf *conf)
+{
+    apr_time_t *start, elapsed, at = 0;
+    apr_uint32_t sample;
+    const char *response_time;
+
+    if (!worker || !balancer || balancer->lbmethod != &bylatency) {
+        return DECLINED;
+    }
+    start = ap_get_module_config(r->request_config,
+                                 &lbmethod_bylatency_module);
+    if (!start || !*start) {
+        /* Sticky route, not chosen by us */
+        return DECLINED;
+    }
+
+    /* Up to the response header if the scheme handler tells (see
+     * mod_proxy_http), the time taken to stream the body to the client
+     * is not the backend's.  A note older than this attempt is from a
+     * failed over one.
+     */
+    response_time = apr_table_get(r->notes, "proxy-response-time");
+    if (response_time) {
+        at = apr_atoi64(response_time);
+    }
+    if (at < *start) {
+        at = apr_time_now();
+    }
+    elapsed = at - *start;
+    *start = 0;
+    if (elapsed <= 0) {
+        sample = 1;
+    }
+    else if (elapsed >= BYLATENCY_MAX) {
+        sample = BYLATENCY_MAX;
+    }
+    else {
+        sample = (apr_uint32_t)elapsed;
+    }
+
+    /* A failing worker is usually a fast one, don't let that attract
+     * more traffic.
+     */
+    if (ap_is_HTTP_SERVER_ERROR(r->status)) {
+        apr_uint32_t ewma = ewma_get(worker);
+        if (sample < ewma) {
+            sample = (ewma <= BYLATENCY_MAX / 2) ? ewma * 2 : BYLATENCY_MAX;
+        }
+    }
+
+    ewma_update(worker, sample);
+
+    return DECLINED;
+}
+
+/* assumed to be mutex protected by caller */
+static apr_status_t reset(proxy_balancer *balancer, server_rec *s)
+{
+    int i;
+    proxy_worker **worker;
+    worker = (proxy_worker **)balancer->workers->elts;
+    for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+        (*worker)->s->lbstatus = 0;
+        (*worker)->s->busy = 0;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t age(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+/* Sticky routes must not touch lbstatus (the EWMA), unlike the default
+ * update of mod_proxy_balancer.
+ */
+static apr_status_t updatelbstatus(proxy_balancer *balancer,
+                                   proxy_worker *elected, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method bylatency =
+{
+    "bylatency",
+    &find_best_bylatency,
+    NULL,
+    &reset,
+    &age,
+    &updatelbstatus
+};
+
+/* post_config hook: */
+static int lbmethod_bylatency_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+
+    /* lbmethod_bylatency_post_config() will be called twice during startup.  So, don't
+     * set up the static data the 1st time through. */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    ap_proxy_balancer_get_best_worker_fn =
+                 APR_RETRIEVE_OPTIONAL_FN(proxy_balancer_get_best_worker);
+    if (!ap_proxy_balancer_get_best_worker_fn) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(10375)
+                     "mod_proxy must be loaded for mod_lbmethod_bylatency");
+        return !OK;
+    }
+
+    return OK;
+}
+
+static void register_hook(apr_pool_t *p)
+{
+    static const char * const aszSucc[] = { "mod_proxy_balancer.c", NULL };
+
+    ap_register_provider(p, PROXY_LBMETHOD, "bylatency", "0", &bylatency);
+    ap_hook_post_config(lbmethod_bylatency_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    proxy_hook_post_request(bylatency_post_request, NULL, aszSucc, APR_HOOK_FIRST);
+}
+
+AP_DECLARE_MODULE(lbmethod_bylatency) = {
+    STANDARD20_MODULE_STUFF,
+    NULL,       /* create per-directory config structure */
+    NULL,       /* merge per-directory config structures */
+    NULL,       /* create per-server config structure */
+    NULL,       /* merge per-server config structures */
+    NULL,       /* command apr_table_t */
+    register_hook /* register hooks */
+};
@@ -1443,6 +1443,8 @@ static int proxy_handler(request_rec *r)
         if (balancer) {
             ap_proxy_initialize_worker(worker, r->server, conf->pool);
         }
+        /* For the scheme handler to run the post_request if it suspends */
+        ap_proxy_suspend_request(worker, balancer, r, conf);
 
         if (balancer && balancer->s->max_attempts_set && !max_attempts)
             max_attempts = balancer->s->max_attempts;
@@ -1515,7 +1517,7 @@ static int proxy_handler(request_rec *r)
         AP_PROXY_RUN(r, worker, conf, url, attempts);
         access_status = proxy_run_scheme_handler(r, worker, conf,
                                                  url, NULL, 0);
-        if (access_status == OK
+        if (access_status == OK || access_status == SUSPENDED
                 || apr_table_get(r->notes, "proxy-error-override"))
             break;
         else if (access_status == HTTP_INTERNAL_SERVER_ERROR) {
@@ -1573,7 +1575,14 @@ cleanup:
      * But only do the above if access_status is not OK and not DONE, because
      * in this case r->status might contain the true status and overwriting
      * it with OK or DONE would be wrong.
+     * A SUSPENDED request is completed by the scheme handler, which calls
+     * ap_proxy_post_suspended_request() then, and r can't be touched here
+     * anymore.
      */
+    if (access_status == SUSPENDED) {
+        AP_PROXY_RUN_FINISHED(r, attempts, access_status);
+        return SUSPENDED;
+    }
     if ((access_status != OK) && (access_status != DONE)) {
         saved_status = r->status;
         r->status = access_status;
@@ -3273,6 +3282,7 @@ static int proxy_status_hook(request_rec *r, int flags)
                      "<th>Sch</th><th>Host</th><th>Stat</th>"
                      "<th>Route</th><th>Redir</th>"
                      "<th>F</th><th>Set</th><th>Acc</th><th>Busy</th><th>Wr</th><th>Rd</th>"
+                     "<th>Hit</th><th>Miss</th><th>New</th><th>Reap</th>"
                      "</tr>\n", r);
         }
         else {
@@ -3297,7 +3307,14 @@ static int proxy_status_hook(request_rec *r, int flags)
                 ap_rputs(apr_strfsize((*worker)->s->transferred, fbuf), r);
                 ap_rputs("</td><td>", r);
                 ap_rputs(apr_strfsize((*worker)->s->read, fbuf), r);
-                ap_rputs("</td>\n", r);
+                ap_rprintf(r, "</td><td>%" APR_SIZE_T_FMT "</td>",
+                           (*worker)->s->cp_hits);
+                ap_rprintf(r, "<td>%" APR_SIZE_T_FMT "</td>",
+                           (*worker)->s->cp_misses);
+                ap_rprintf(r, "<td>%" APR_SIZE_T_FMT "</td>",
+                           (*worker)->s->cp_created);
+                ap_rprintf(r, "<td>%" APR_SIZE_T_FMT "</td>\n",
+                           (*worker)->s->cp_reaped);
 
                 /* TODO: Add the rest of dynamic worker data */
                 ap_rputs("</tr>\n", r);
@@ -3319,6 +3336,18 @@ static int proxy_status_hook(request_rec *r, int flags)
                 ap_rprintf(r, "ProxyBalancer[%d]Worker[%d]Rcvd: %"
                               APR_OFF_T_FMT "K\n",
                            i, n, (*worker)->s->read >> 10);
+                ap_rprintf(r, "ProxyBalancer[%d]Worker[%d]PoolHits: %"
+                              APR_SIZE_T_FMT "\n",
+                           i, n, (*worker)->s->cp_hits);
+                ap_rprintf(r, "ProxyBalancer[%d]Worker[%d]PoolMisses: %"
+                              APR_SIZE_T_FMT "\n",
+                           i, n, (*worker)->s->cp_misses);
+                ap_rprintf(r, "ProxyBalancer[%d]Worker[%d]PoolCreated: %"
+                              APR_SIZE_T_FMT "\n",
+                           i, n, (*worker)->s->cp_created);
+                ap_rprintf(r, "ProxyBalancer[%d]Worker[%d]PoolReaped: %"
+                              APR_SIZE_T_FMT "\n",
+                           i, n, (*worker)->s->cp_reaped);
 
                 /* TODO: Add the rest of dynamic worker data */
             }
@@ -3343,6 +3372,10 @@ static int proxy_status_hook(request_rec *r, int flags)
                  "<tr><th>Acc</th><td>Number of uses</td></tr>\n"
                  "<tr><th>Wr</th><td>Number of bytes transferred</td></tr>\n"
                  "<tr><th>Rd</th><td>Number of bytes read</td></tr>\n"
+                 "<tr><th>Hit</th><td>Connections reused from the pool</td></tr>\n"
+                 "<tr><th>Miss</th><td>Connections acquired unconnected</td></tr>\n"
+                 "<tr><th>New</th><td>Connections established</td></tr>\n"
+                 "<tr><th>Reap</th><td>Idle connections closed after their ttl</td></tr>\n"
                  "</table>", r);
     }
 
@@ -3543,3 +3576,10 @@ APR_IMPLEMENT_OPTIONAL_HOOK_RUN_ALL(proxy, PROXY, int, request_status,
 APR_IMPLEMENT_OPTIONAL_HOOK_RUN_ALL(proxy, PROXY, int, detach_backend,
                                     (request_rec *r, proxy_conn_rec *backend),
                                     (r, backend), OK, DECLINED)
+APR_IMPLEMENT_OPTIONAL_HOOK_RUN_FIRST(proxy, PROXY, int, take_backend,
+                                      (const char *proxy_function,
+                                       proxy_conn_rec *conn, server_rec *s),
+                                      (proxy_function, conn, s), DECLINED)
+APR_IMPLEMENT_OPTIONAL_HOOK_RUN_FIRST(proxy, PROXY, int, park_backend,
+                                      (proxy_conn_rec *conn),
+                                      (conn), DECLINED)
@@ -108,6 +108,7 @@ typedef struct {
 typedef struct proxy_balancer  proxy_balancer;
 typedef struct proxy_worker    proxy_worker;
 typedef struct proxy_conn_pool proxy_conn_pool;
+typedef struct proxy_conn_idle proxy_conn_idle;
 typedef struct proxy_balancer_method proxy_balancer_method;
 
 /* static information about a remote proxy */
@@ -299,9 +300,10 @@ typedef struct {
 struct proxy_conn_pool {
     apr_pool_t     *pool;     /* The pool used in constructor and destructor calls */
     apr_sockaddr_t *addr;     /* Preparsed remote address info */
-    apr_reslist_t  *res;      /* Connection resource list */
+    apr_reslist_t  *res;      /* Unused (was the connection resource list) */
     proxy_conn_rec *conn;     /* Single connection for prefork mpm */
     apr_pool_t     *dns_pool; /* The pool used for worker scoped DNS resolutions */
+    proxy_conn_idle *idle;    /* Idle connections (opaque, see proxy_util.c) */
 };
 
 #define AP_VOLATILIZE_T(T, x) (*(T volatile *)&(x))
@@ -476,6 +478,10 @@ typedef struct {
     unsigned int     was_malloced:1;
     unsigned int     is_name_matchable:1;
     unsigned int     response_field_size_set:1;
+    apr_size_t      cp_hits;    /* Connections acquired already connected */
+    apr_size_t      cp_misses;  /* Connections acquired not connected */
+    apr_size_t      cp_created; /* Connections established to the backend */
+    apr_size_t      cp_reaped;  /* Idle connections closed after their ttl */
 } proxy_worker_shared;
 
 #define ALIGNED_PROXY_WORKER_SHARED_SIZE (APR_ALIGN_DEFAULT(sizeof(proxy_worker_shared)))
@@ -652,6 +658,30 @@ PROXY_DECLARE_OPTIONAL_HOOK(proxy, PROXY, int, fixups, (request_rec *r))
 PROXY_DECLARE_OPTIONAL_HOOK(proxy, PROXY, int, detach_backend,
                             (request_rec *r, proxy_conn_rec *backend))
 
+/**
+ * Let modules provide an idle connection to the origin (kept elsewhere)
+ * in place of establishing a new one.
+ * @param proxy_function The proxy scheme (for logging)
+ * @param conn The proxy representation of the backend connection, whose
+ *             socket is NULL
+ * @param s The current server
+ * @return OK if conn->sock was set to a connected socket, DECLINED otherwise
+ */
+PROXY_DECLARE_OPTIONAL_HOOK(proxy, PROXY, int, take_backend,
+                            (const char *proxy_function,
+                             proxy_conn_rec *conn, server_rec *s))
+
+/**
+ * Let modules keep an idle connection to the origin when it is released
+ * while the child already keeps smax idle ones to the worker, for it to be
+ * taken later (possibly by another process).
+ * @param conn The proxy representation of the backend connection, reusable
+ * @return OK if the socket was handed over, then closed locally,
+ *         DECLINED otherwise
+ */
+PROXY_DECLARE_OPTIONAL_HOOK(proxy, PROXY, int, park_backend,
+                            (proxy_conn_rec *conn))
+
 /**
  * pre request hook.
  * It will return the most suitable worker at the moment
@@ -983,6 +1013,35 @@ PROXY_DECLARE(int) ap_proxy_post_request(proxy_worker *worker,
                                          request_rec *r,
                                          proxy_server_conf *conf);
 
+/**
+ * Save the worker and balancer used for processing request, for
+ * ap_proxy_post_suspended_request() to run the post request cleanup should
+ * the scheme handler return SUSPENDED
+ * @param worker   worker used for processing request
+ * @param balancer balancer used for processing request
+ * @param r        current request
+ * @param conf     current proxy server configuration
+ * @note Called by mod_proxy before running the scheme handler, since a
+ * suspended request may complete in another thread before the handler
+ * returns.
+ */
+PROXY_DECLARE(void) ap_proxy_suspend_request(proxy_worker *worker,
+                                             proxy_balancer *balancer,
+                                             request_rec *r,
+                                             proxy_server_conf *conf);
+
+/**
+ * Post request worker and balancer cleanup of a suspended request
+ * @param r        current request
+ * @param status   final status of the request (OK or HTTP_XXX)
+ * @return         OK or  HTTP_XXX error
+ * @note mod_proxy does not call the post_request when the scheme handler
+ * returns SUSPENDED, so the handler must call this function once the
+ * request completes, before it is finalized.
+ */
+PROXY_DECLARE(int) ap_proxy_post_suspended_request(request_rec *r,
+                                                   int status);
+
 /**
  * Determine backend hostname and port
  * @param p       memory pool used for processing
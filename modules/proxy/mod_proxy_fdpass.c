@@ -15,10 +15,22 @@
  */
 
 #include "mod_proxy.h"
+#include "ap_listen.h"
+#include "ap_mpm.h"
+#include "mpm_common.h"
+#include "unixd.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_portable.h"
+#include "apr_signal.h"
+#include "apr_thread_proc.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifndef CMSG_DATA
 #error This module only works on unix platforms with the correct OS support
@@ -223,11 +235,1040 @@ static const proxy_fdpass_flush builtin_flush =
     NULL
 };
 
+/*
+ * The connections broker: a daemon process (forked by the parent, like
+ * mod_cgid's) where the children park their surplus idle backend
+ * connections (above the smax of the worker) by passing the sockets
+ * (SCM_RIGHTS), and take them from whichever child parked them when they
+ * have none left.  The broker never blocks on the children's channels,
+ * and the children wait for its replies BROKER_IO_TIMEOUT at most (then
+ * don't take from it for a while).  The backends thus see one bounded set
+ * of well reused connections for all the children, instead of a pool per
+ * child.
+ *
+ * The connections are parked per origin (scheme://host:port or the unix
+ * socket path), ProxyFdPassBrokerMax at most (the oldest are closed first),
+ * and handed out the most recently parked first.  The broker closes them
+ * after their ttl (ProxySet ttl=, or 60s) or as soon as the origin does.
+ * TLS and HTTP/2 connections are never parked, their state is in the child.
+ */
+#define BROKER_MSG_PARK         1
+#define BROKER_MSG_TAKE         2
+#define BROKER_MAX_KEY          PROXY_WORKER_RFC1035_NAME_SIZE
+#define BROKER_DEFAULT_MAX      16
+#define BROKER_DEFAULT_TTL      60          /* seconds */
+#define BROKER_IO_TIMEOUT       20          /* milliseconds */
+#define BROKER_SLOW_BACKOFF     1           /* seconds */
+#define BROKER_BACKLOG          128
+#define BROKER_STARTUP_ERROR    254
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct {
+    apr_uint32_t type;          /* BROKER_MSG_PARK or BROKER_MSG_TAKE */
+    apr_uint32_t ttl;           /* PARK: seconds to keep it idle */
+    apr_uint32_t klen;          /* length of the origin key following */
+} broker_msg_t;
+
+/* Global configuration (ProxyFdPassBroker*) */
+static const char *broker_sockname = NULL;
+static int broker_max = BROKER_DEFAULT_MAX;
+static struct sockaddr_un *broker_addr = NULL;
+static apr_socklen_t broker_addr_len;
+
+/* The broker process (parent side) */
+static pid_t broker_pid;
+static apr_pool_t *broker_root_pool;
+static server_rec *broker_root_server;
+static volatile sig_atomic_t broker_should_exit = 0;
+
+/* The channels to the broker (children side), reused */
+typedef struct broker_channel broker_channel;
+struct broker_channel {
+    int sd;                     /* -1 if not connected */
+    broker_channel *next;
+};
+static broker_channel *broker_channels = NULL;
+static apr_pool_t *broker_pchild = NULL;
+static apr_uint32_t broker_slow_until = 0;  /* seconds, no take before */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *broker_mutex = NULL;
+#endif
+
+static apr_status_t broker_send(int sd, const broker_msg_t *msg,
+                                const char *key, int fd)
+{
+    struct msghdr mh;
+    struct iovec vec[2];
+    union { /* union for alignment */
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    apr_ssize_t rc;
+
+    memset(&mh, 0, sizeof(mh));
+    vec[0].iov_base = (void *)msg;
+    vec[0].iov_len = sizeof(*msg);
+    vec[1].iov_base = (void *)key;
+    vec[1].iov_len = key ? msg->klen : 0;
+    mh.msg_iov = vec;
+    mh.msg_iovlen = key ? 2 : 1;
+
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        mh.msg_control = u.buf;
+        mh.msg_controllen = sizeof(u.buf);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        rc = sendmsg(sd, &mh, MSG_NOSIGNAL);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return errno;
+    }
+    if ((apr_size_t)rc != vec[0].iov_len + vec[1].iov_len) {
+        return APR_INCOMPLETE;
+    }
+    return APR_SUCCESS;
+}
+
+/* Receive len bytes, and the passed fd if any (-1 otherwise) when fd is
+ * not NULL (closed if it's NULL or the read fails).  Used by the children
+ * for the broker's replies, the broker never blocks on the channels.
+ */
+static apr_status_t broker_recv(int sd, void *buf, apr_size_t len, int *fd)
+{
+    struct msghdr mh;
+    struct iovec vec;
+    struct cmsghdr *cmsg;
+    union { /* union for alignment */
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    apr_ssize_t rc;
+    apr_status_t rv = APR_SUCCESS;
+    int passed = -1;
+
+    memset(&mh, 0, sizeof(mh));
+    vec.iov_base = buf;
+    vec.iov_len = len;
+    mh.msg_iov = &vec;
+    mh.msg_iovlen = 1;
+    mh.msg_control = u.buf;
+    mh.msg_controllen = sizeof(u.buf);
+
+    /* use MSG_WAITALL to skip loop on truncated reads */
+    do {
+        rc = recvmsg(sd, &mh, MSG_WAITALL);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        rv = errno;
+    }
+    else if (rc == 0) {
+        rv = APR_EOF;
+    }
+    else if ((apr_size_t)rc != len) {
+        rv = APR_INCOMPLETE;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (passed >= 0 && (rv != APR_SUCCESS || !fd)) {
+        close(passed);
+        passed = -1;
+    }
+    if (fd) {
+        *fd = passed;
+    }
+    return rv;
+}
+
+static void broker_io_timeout_set(int sd)
+{
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = BROKER_IO_TIMEOUT * 1000;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Broker side.
+ */
+
+typedef struct broker_origin broker_origin;
+typedef struct broker_conn broker_conn;
+
+struct broker_conn {
+    int fd;
+    apr_time_t expiry;
+    broker_origin *origin;
+    broker_conn *prev, *next;   /* most recently parked first */
+};
+
+struct broker_origin {
+    broker_conn *first, *last;
+    int count;
+};
+
+/* A child's channel, read without blocking: the messages (and the fds
+ * passed with them, in the same order) may be received in parts.
+ */
+#define BROKER_CHAN_FDS         4
+#define BROKER_CHAN_BUFSIZE     (2 * (sizeof(broker_msg_t) + BROKER_MAX_KEY))
+
+typedef struct broker_chan broker_chan;
+struct broker_chan {
+    int sd;                     /* -1 once closed */
+    int nfds;                   /* passed fds not consumed yet */
+    int fds[BROKER_CHAN_FDS];
+    apr_size_t len;             /* bytes in buf */
+    char buf[BROKER_CHAN_BUFSIZE];
+    broker_chan *next;          /* unused ones */
+};
+
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *origins;
+    broker_conn *spare;         /* unused nodes */
+    broker_chan *spare_chans;   /* unused channels */
+    apr_array_header_t *channels;
+    apr_array_header_t *pfds;
+    apr_array_header_t *parked; /* broker_conn of the pfds (after channels) */
+} broker_t;
+
+static void broker_signal_handler(int sig)
+{
+    if (sig == SIGHUP || sig == SIGTERM) {
+        broker_should_exit = 1;
+    }
+}
+
+static void broker_unlink(broker_conn *bc)
+{
+    broker_origin *origin = bc->origin;
+
+    if (bc->prev) {
+        bc->prev->next = bc->next;
+    }
+    else {
+        origin->first = bc->next;
+    }
+    if (bc->next) {
+        bc->next->prev = bc->prev;
+    }
+    else {
+        origin->last = bc->prev;
+    }
+    origin->count--;
+}
+
+static void broker_drop(broker_t *broker, broker_conn *bc)
+{
+    broker_unlink(bc);
+    close(bc->fd);
+    bc->fd = -1;
+    bc->origin = NULL;
+    bc->next = broker->spare;
+    broker->spare = bc;
+}
+
+static broker_chan *broker_chan_open(broker_t *broker, int sd)
+{
+    broker_chan *ch = broker->spare_chans;
+
+    if (ch) {
+        broker->spare_chans = ch->next;
+    }
+    else {
+        ch = apr_palloc(broker->pool, sizeof(*ch));
+    }
+    ch->sd = sd;
+    ch->nfds = 0;
+    ch->len = 0;
+    ch->next = NULL;
+    return ch;
+}
+
+static void broker_chan_close(broker_t *broker, broker_chan *ch)
+{
+    while (ch->nfds > 0) {
+        close(ch->fds[--ch->nfds]);
+    }
+    close(ch->sd);
+    ch->sd = -1;
+    ch->next = broker->spare_chans;
+    broker->spare_chans = ch;
+}
+
+/* Handle one (complete) message from a child */
+static apr_status_t broker_handle(broker_t *broker, broker_chan *ch,
+                                  broker_msg_t *msg, const char *key,
+                                  apr_time_t now)
+{
+    broker_origin *origin;
+    broker_conn *bc;
+    int fd = -1;
+
+    if (msg->type != BROKER_MSG_PARK && msg->type != BROKER_MSG_TAKE) {
+        return APR_EINVAL;
+    }
+    if (msg->type == BROKER_MSG_PARK) {
+        /* The fd comes with the first bytes of its message */
+        if (!ch->nfds) {
+            return APR_EINVAL;
+        }
+        fd = ch->fds[0];
+        if (--ch->nfds) {
+            memmove(ch->fds, ch->fds + 1, ch->nfds * sizeof(int));
+        }
+    }
+
+    origin = apr_hash_get(broker->origins, key, msg->klen);
+    if (!origin) {
+        origin = apr_pcalloc(broker->pool, sizeof(*origin));
+        apr_hash_set(broker->origins, apr_pmemdup(broker->pool, key,
+                                                  msg->klen),
+                     msg->klen, origin);
+    }
+
+    switch (msg->type) {
+    case BROKER_MSG_PARK:
+        if (origin->count >= broker_max) {
+            broker_drop(broker, origin->last);
+        }
+        if (broker->spare) {
+            bc = broker->spare;
+            broker->spare = bc->next;
+        }
+        else {
+            bc = apr_palloc(broker->pool, sizeof(*bc));
+        }
+        bc->fd = fd;
+        bc->expiry = now + apr_time_from_sec(msg->ttl ? msg->ttl
+                                                      : BROKER_DEFAULT_TTL);
+        bc->origin = origin;
+        bc->prev = NULL;
+        bc->next = origin->first;
+        if (origin->first) {
+            origin->first->prev = bc;
+        }
+        else {
+            origin->last = bc;
+        }
+        origin->first = bc;
+        origin->count++;
+        return APR_SUCCESS;
+
+    case BROKER_MSG_TAKE: {
+        /* The reply is small and the child waits for it (the channel is
+         * empty), so the non-blocking send should not fail with EAGAIN.
+         */
+        apr_status_t rv;
+
+        msg->klen = 0;
+        bc = origin->first;
+        if (!bc) {
+            return broker_send(ch->sd, msg, NULL, -1);
+        }
+        rv = broker_send(ch->sd, msg, NULL, bc->fd);
+        broker_drop(broker, bc);
+        return rv;
+    }
+
+    default:
+        return APR_EINVAL;
+    }
+}
+
+/* Read what's available on a channel, without blocking, and handle the
+ * complete messages.
+ */
+static apr_status_t broker_chan_read(broker_t *broker, broker_chan *ch,
+                                     apr_time_t now)
+{
+    struct msghdr mh;
+    struct iovec vec;
+    struct cmsghdr *cmsg;
+    union { /* union for alignment */
+        char buf[CMSG_SPACE(BROKER_CHAN_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    broker_msg_t msg;
+    apr_size_t off = 0;
+    apr_ssize_t rc;
+    apr_status_t rv = APR_SUCCESS;
+
+    memset(&mh, 0, sizeof(mh));
+    vec.iov_base = ch->buf + ch->len;
+    vec.iov_len = sizeof(ch->buf) - ch->len;
+    mh.msg_iov = &vec;
+    mh.msg_iovlen = 1;
+    mh.msg_control = u.buf;
+    mh.msg_controllen = sizeof(u.buf);
+
+    do {
+        rc = recvmsg(ch->sd, &mh, MSG_DONTWAIT);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? APR_SUCCESS
+                                                         : errno;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS) {
+            int i, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < n; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (ch->nfds < BROKER_CHAN_FDS) {
+                    ch->fds[ch->nfds++] = fd;
+                }
+                else {
+                    close(fd);
+                    rv = APR_ENOSPC;
+                }
+            }
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    if (mh.msg_flags & MSG_CTRUNC) {
+        return APR_EINVAL;
+    }
+    if (rc == 0) {
+        return APR_EOF;
+    }
+    ch->len += rc;
+
+    /* The buffer always has room for (the rest of) a message */
+    while (ch->len - off >= sizeof(msg)) {
+        apr_size_t mlen;
+
+        memcpy(&msg, ch->buf + off, sizeof(msg));
+        if (msg.klen == 0 || msg.klen > BROKER_MAX_KEY) {
+            return APR_EINVAL;
+        }
+        mlen = sizeof(msg) + msg.klen;
+        if (ch->len - off < mlen) {
+            break;
+        }
+        rv = broker_handle(broker, ch, &msg, ch->buf + off + sizeof(msg),
+                           now);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        off += mlen;
+    }
+    if (off) {
+        ch->len -= off;
+        memmove(ch->buf, ch->buf + off, ch->len);
+    }
+    return APR_SUCCESS;
+}
+
+/* (Re)build the pollfds: the listener, the channels, then the parked ones */
+static void broker_pollset(broker_t *broker, int sd)
+{
+    apr_hash_index_t *hi;
+    struct pollfd *pfd;
+    int i;
+
+    apr_array_clear(broker->pfds);
+    apr_array_clear(broker->parked);
+
+    pfd = apr_array_push(broker->pfds);
+    pfd->fd = sd;
+    pfd->events = POLLIN;
+    for (i = 0; i < broker->channels->nelts; ++i) {
+        pfd = apr_array_push(broker->pfds);
+        pfd->fd = APR_ARRAY_IDX(broker->channels, i, broker_chan *)->sd;
+        pfd->events = POLLIN;
+    }
+    for (hi = apr_hash_first(NULL, broker->origins); hi;
+         hi = apr_hash_next(hi)) {
+        broker_origin *origin = apr_hash_this_val(hi);
+        broker_conn *bc;
+
+        for (bc = origin->first; bc; bc = bc->next) {
+            /* Readable means closed (or unexpected data) */
+            pfd = apr_array_push(broker->pfds);
+            pfd->fd = bc->fd;
+            pfd->events = POLLIN;
+            APR_ARRAY_PUSH(broker->parked, broker_conn *) = bc;
+        }
+    }
+}
+
+static int broker_server(server_rec *main_server, apr_pool_t *pool)
+{
+    broker_t *broker;
+    mode_t omask;
+    int sd, rc;
+
+    apr_signal(SIGCHLD, SIG_IGN);
+    apr_signal(SIGPIPE, SIG_IGN);
+    apr_signal(SIGHUP, broker_signal_handler);
+    apr_signal(SIGTERM, broker_signal_handler);
+
+    /* Close our copy of the listening sockets */
+    ap_close_listeners();
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(10356)
+                     "Couldn't create broker unix domain socket");
+        return errno;
+    }
+
+    unlink(broker_sockname);
+    omask = umask(0077); /* so that only Apache can use socket */
+    rc = bind(sd, (struct sockaddr *)broker_addr, broker_addr_len);
+    umask(omask); /* can't fail, so can't clobber errno */
+    if (rc < 0 || listen(sd, BROKER_BACKLOG) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(10357)
+                     "Couldn't bind or listen on broker unix domain "
+                     "socket %s", broker_sockname);
+        return errno;
+    }
+    if (!geteuid()) {
+        if (chown(broker_sockname, ap_unixd_config.user_id, -1) < 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server,
+                         APLOGNO(10358) "Couldn't change owner of broker "
+                         "unix domain socket %s", broker_sockname);
+            return errno;
+        }
+    }
+
+    /* if running as root, switch to configured user/group */
+    if ((rc = ap_run_drop_privileges(pool, ap_server_conf)) != 0) {
+        return rc;
+    }
+
+    broker = apr_pcalloc(pool, sizeof(*broker));
+    broker->pool = pool;
+    broker->origins = apr_hash_make(pool);
+    broker->channels = apr_array_make(pool, 16, sizeof(broker_chan *));
+    broker->pfds = apr_array_make(pool, 64, sizeof(struct pollfd));
+    broker->parked = apr_array_make(pool, 64, sizeof(broker_conn *));
+
+    while (!broker_should_exit) {
+        struct pollfd *pfds;
+        apr_hash_index_t *hi;
+        apr_time_t now;
+        int i, n, nchannels = broker->channels->nelts;
+
+        broker_pollset(broker, sd);
+        pfds = (struct pollfd *)broker->pfds->elts;
+        n = poll(pfds, broker->pfds->nelts, 1000);
+        if (n < 0) {
+            if (errno != EINTR) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server,
+                             APLOGNO(10359) "broker poll() failed");
+                apr_sleep(apr_time_from_msec(100));
+            }
+            continue;
+        }
+        now = apr_time_now();
+
+        /* The parked connections closed by their origin first, so that
+         * none is handed out below, nor reused while still referenced.
+         */
+        for (i = 0; n > 0 && i < broker->parked->nelts; ++i) {
+            if (pfds[1 + nchannels + i].revents) {
+                broker_drop(broker, APR_ARRAY_IDX(broker->parked, i,
+                                                  broker_conn *));
+            }
+        }
+
+        /* Then the children's messages */
+        for (i = 0; n > 0 && i < nchannels; ++i) {
+            if (pfds[1 + i].revents) {
+                broker_chan *ch = APR_ARRAY_IDX(broker->channels, i,
+                                                broker_chan *);
+                apr_status_t rv = APR_EOF;
+                if (pfds[1 + i].revents & POLLIN) {
+                    rv = broker_chan_read(broker, ch, now);
+                }
+                if (rv != APR_SUCCESS) {
+                    if (rv != APR_EOF) {
+                        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, main_server,
+                                     APLOGNO(10360) "broker channel failed");
+                    }
+                    broker_chan_close(broker, ch);
+                }
+            }
+        }
+        for (i = 0; i < broker->channels->nelts;) {
+            if (APR_ARRAY_IDX(broker->channels, i, broker_chan *)->sd < 0) {
+                APR_ARRAY_IDX(broker->channels, i, broker_chan *) =
+                    APR_ARRAY_IDX(broker->channels,
+                                  broker->channels->nelts - 1, broker_chan *);
+                broker->channels->nelts--;
+            }
+            else {
+                ++i;
+            }
+        }
+
+        /* New children channels */
+        if (pfds[0].revents & POLLIN) {
+            int csd = accept(sd, NULL, NULL);
+            if (csd >= 0) {
+                fcntl(csd, F_SETFL, fcntl(csd, F_GETFL) | O_NONBLOCK);
+                APR_ARRAY_PUSH(broker->channels, broker_chan *) =
+                    broker_chan_open(broker, csd);
+            }
+            else if (errno != EINTR && errno != EAGAIN) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server,
+                             APLOGNO(10361) "Error accepting on broker "
+                             "socket");
+            }
+        }
+
+        /* Finally close the ones idle for too long */
+        for (hi = apr_hash_first(NULL, broker->origins); hi;
+             hi = apr_hash_next(hi)) {
+            broker_origin *origin = apr_hash_this_val(hi);
+            while (origin->last && origin->last->expiry <= now) {
+                broker_drop(broker, origin->last);
+            }
+        }
+    }
+
+    return -1; /* should be <= 0 to distinguish from startup errors */
+}
+
+static int broker_start(apr_pool_t *p, server_rec *main_server,
+                        apr_proc_t *procnew);
+
+#if APR_HAS_OTHER_CHILD
+static void broker_maint(int reason, void *data, apr_wait_t status)
+{
+    apr_proc_t *proc = data;
+    int mpm_state;
+
+    switch (reason) {
+        case APR_OC_REASON_DEATH:
+            apr_proc_other_child_unregister(data);
+            /* Restart the broker unless the server is stopping */
+            if (ap_mpm_query(AP_MPMQ_MPM_STATE, &mpm_state) == APR_SUCCESS
+                    && mpm_state != AP_MPMQ_STOPPING) {
+                if (status == BROKER_STARTUP_ERROR) {
+                    ap_log_error(APLOG_MARK, APLOG_CRIT, 0, ap_server_conf,
+                                 APLOGNO(10362) "proxy fdpass broker failed "
+                                 "to initialize");
+                }
+                else {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf,
+                                 APLOGNO(10363) "proxy fdpass broker died, "
+                                 "restarting");
+                    broker_start(broker_root_pool, broker_root_server, proc);
+                }
+            }
+            break;
+        case APR_OC_REASON_RESTART:
+            /* don't do anything; server is stopping or restarting */
+            apr_proc_other_child_unregister(data);
+            break;
+        case APR_OC_REASON_LOST:
+            apr_proc_other_child_unregister(data);
+            broker_start(broker_root_pool, broker_root_server, proc);
+            break;
+        case APR_OC_REASON_UNREGISTER:
+            /* pconf is cleaned up (restart or stop), the parked
+             * connections go with the broker.
+             */
+            kill(proc->pid, SIGHUP);
+            if (unlink(broker_sockname) < 0 && errno != ENOENT) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, errno, ap_server_conf,
+                             APLOGNO(10364) "Couldn't unlink broker unix "
+                             "domain socket %s", broker_sockname);
+            }
+            break;
+    }
+}
+#endif
+
+static int broker_start(apr_pool_t *p, server_rec *main_server,
+                        apr_proc_t *procnew)
+{
+    broker_should_exit = 0;
+    if ((broker_pid = fork()) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(10365)
+                     "Couldn't spawn proxy fdpass broker process");
+        return DECLINED;
+    }
+    else if (broker_pid == 0) {
+        apr_pool_t *pool;
+
+        apr_pool_create(&pool, p);
+        apr_pool_tag(pool, "proxy_fdpass_broker");
+        exit(broker_server(main_server, pool) > 0 ? BROKER_STARTUP_ERROR : -1);
+    }
+    procnew->pid = broker_pid;
+    procnew->err = procnew->in = procnew->out = NULL;
+    apr_pool_note_subprocess(p, procnew, APR_KILL_AFTER_TIMEOUT);
+#if APR_HAS_OTHER_CHILD
+    apr_proc_other_child_register(procnew, broker_maint, procnew, NULL, p);
+#endif
+    return OK;
+}
+
+/*
+ * Children side.
+ */
+
+static broker_channel *broker_channel_get(server_rec *s)
+{
+    broker_channel *ch;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(broker_mutex);
+#endif
+    ch = broker_channels;
+    if (ch) {
+        broker_channels = ch->next;
+    }
+    else {
+        ch = apr_palloc(broker_pchild, sizeof(*ch));
+        ch->sd = -1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(broker_mutex);
+#endif
+
+    if (ch->sd < 0) {
+        if ((ch->sd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+            broker_io_timeout_set(ch->sd);
+            if (connect(ch->sd, (struct sockaddr *)broker_addr,
+                        broker_addr_len) < 0) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, errno, s, APLOGNO(10366)
+                             "unable to connect to proxy fdpass broker "
+                             "at %s", broker_sockname);
+                close(ch->sd);
+                ch->sd = -1;
+            }
+        }
+    }
+    return ch;
+}
+
+static void broker_channel_put(broker_channel *ch, apr_status_t rv)
+{
+    if (rv != APR_SUCCESS && ch->sd >= 0) {
+        /* Out of sync or broken, don't reuse */
+        close(ch->sd);
+        ch->sd = -1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(broker_mutex);
+#endif
+    ch->next = broker_channels;
+    broker_channels = ch;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(broker_mutex);
+#endif
+}
+
+static apr_status_t broker_channels_cleanup(void *data)
+{
+    broker_channel *ch;
+
+    for (ch = broker_channels; ch; ch = ch->next) {
+        if (ch->sd >= 0) {
+            close(ch->sd);
+        }
+    }
+    broker_channels = NULL;
+    return APR_SUCCESS;
+}
+
+/* The origin key of a connection which can be parked, 0 otherwise */
+static apr_uint32_t broker_key(proxy_conn_rec *conn, char *key)
+{
+    proxy_worker *worker = conn->worker;
+    int len;
+
+    if (!broker_addr || !broker_pchild || conn->is_ssl || conn->forward
+            || !worker->s->is_address_reusable || worker->s->disablereuse
+            || !ap_cstr_casecmpn(worker->s->scheme, "h2", 2)) {
+        return 0;
+    }
+    if (conn->uds_path) {
+        len = apr_snprintf(key, BROKER_MAX_KEY, "%s://%s",
+                           worker->s->scheme, conn->uds_path);
+    }
+    else if (conn->hostname) {
+        len = apr_snprintf(key, BROKER_MAX_KEY, "%s://%s:%d",
+                           worker->s->scheme, conn->hostname, (int)conn->port);
+    }
+    else {
+        return 0;
+    }
+    return len > 0 && len < BROKER_MAX_KEY - 1 ? len : 0;
+}
+
+static int proxy_fdpass_take_backend(const char *proxy_function,
+                                     proxy_conn_rec *conn, server_rec *s)
+{
+    proxy_worker *worker = conn->worker;
+    proxy_server_conf *conf = ap_get_module_config(s->module_config,
+                                                   &proxy_module);
+    char key[BROKER_MAX_KEY];
+    apr_os_sock_info_t info;
+    apr_socket_t *sock;
+    broker_channel *ch;
+    broker_msg_t msg;
+    apr_status_t rv;
+    int fd = -1;
+
+    /* Don't wait for a broker which was slow to reply recently, opening a
+     * new connection is likely faster.
+     */
+    if ((apr_uint32_t)apr_time_sec(apr_time_now())
+            < apr_atomic_read32(&broker_slow_until)) {
+        return DECLINED;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    if (!(msg.klen = broker_key(conn, key))) {
+        return DECLINED;
+    }
+    ch = broker_channel_get(s);
+    if (ch->sd < 0) {
+        broker_channel_put(ch, APR_SUCCESS);
+        return DECLINED;
+    }
+    msg.type = BROKER_MSG_TAKE;
+    rv = broker_send(ch->sd, &msg, key, -1);
+    if (rv == APR_SUCCESS) {
+        rv = broker_recv(ch->sd, &msg, sizeof(msg), &fd);
+    }
+    broker_channel_put(ch, rv);
+    if (rv != APR_SUCCESS) {
+        if (APR_STATUS_IS_EAGAIN(rv)) {
+            apr_atomic_set32(&broker_slow_until,
+                             (apr_uint32_t)apr_time_sec(apr_time_now())
+                             + BROKER_SLOW_BACKOFF + 1);
+        }
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10367)
+                     "%s: taking a connection for %s from the broker "
+                     "failed", proxy_function, key);
+        return DECLINED;
+    }
+    if (fd < 0) {
+        return DECLINED;
+    }
+
+    /* The parking child's O_NONBLOCK is on the (shared) file description,
+     * while APR assumes a blocking socket here.
+     */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    memset(&info, 0, sizeof(info));
+    info.os_sock = &fd;
+    info.family = conn->uds_path ? APR_UNIX : conn->addr->family;
+    info.type = SOCK_STREAM;
+    info.protocol = conn->uds_path ? 0 : APR_PROTO_TCP;
+    rv = apr_os_sock_make(&sock, &info, conn->scpool);
+    if (rv != APR_SUCCESS) {
+        close(fd);
+        return DECLINED;
+    }
+    if (!ap_proxy_is_socket_connected(sock)) {
+        apr_socket_close(sock);
+        return DECLINED;
+    }
+
+    if (worker->s->timeout_set) {
+        apr_socket_timeout_set(sock, worker->s->timeout);
+    }
+    else if (conf->timeout_set) {
+        apr_socket_timeout_set(sock, conf->timeout);
+    }
+    else {
+        apr_socket_timeout_set(sock, s->timeout);
+    }
+    conn->connection = NULL;
+    conn->sock = sock;
+
+    ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, s,
+                 "%s: took connection for %s from the broker",
+                 proxy_function, key);
+    return OK;
+}
+
+static int proxy_fdpass_park_backend(proxy_conn_rec *conn)
+{
+    proxy_worker *worker = conn->worker;
+    char key[BROKER_MAX_KEY];
+    apr_os_sock_t fd;
+    broker_channel *ch;
+    broker_msg_t msg;
+    apr_status_t rv;
+
+    memset(&msg, 0, sizeof(msg));
+    if (!(msg.klen = broker_key(conn, key))
+            || apr_os_sock_get(&fd, conn->sock) != APR_SUCCESS
+            || !ap_proxy_is_socket_connected(conn->sock)) {
+        return DECLINED;
+    }
+    ch = broker_channel_get(ap_server_conf);
+    if (ch->sd < 0) {
+        broker_channel_put(ch, APR_SUCCESS);
+        return DECLINED;
+    }
+    msg.type = BROKER_MSG_PARK;
+    msg.ttl = worker->s->ttl > 0 ? (apr_uint32_t)apr_time_sec(worker->s->ttl)
+                                 : BROKER_DEFAULT_TTL;
+    rv = broker_send(ch->sd, &msg, key, fd);
+    broker_channel_put(ch, rv);
+
+    return rv == APR_SUCCESS ? OK : DECLINED;
+}
+
+static int proxy_fdpass_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                   apr_pool_t *ptemp)
+{
+    broker_sockname = NULL;
+    broker_max = BROKER_DEFAULT_MAX;
+    broker_addr = NULL;
+    return OK;
+}
+
+static int proxy_fdpass_post_config(apr_pool_t *p, apr_pool_t *plog,
+                                    apr_pool_t *ptemp, server_rec *s)
+{
+    const char *userdata_key = "proxy_fdpass_broker";
+    apr_proc_t *procnew;
+    void *data;
+
+    if (!broker_sockname) {
+        return OK;
+    }
+
+    apr_pool_userdata_get(&data, userdata_key, s->process->pool);
+    if (!data) {
+        procnew = apr_pcalloc(s->process->pool, sizeof(*procnew));
+        procnew->pid = -1;
+        apr_pool_userdata_set((const void *)procnew, userdata_key,
+                              apr_pool_cleanup_null, s->process->pool);
+    }
+    else {
+        procnew = data;
+    }
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    if (strlen(broker_sockname) > sizeof(broker_addr->sun_path) - 1) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10368)
+                     "ProxyFdPassBroker path %s is too long",
+                     broker_sockname);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    broker_addr_len = APR_OFFSETOF(struct sockaddr_un, sun_path)
+                      + strlen(broker_sockname);
+    broker_addr = apr_pcalloc(p, sizeof(*broker_addr));
+    broker_addr->sun_family = AF_UNIX;
+    strcpy(broker_addr->sun_path, broker_sockname);
+
+    broker_root_pool = p;
+    broker_root_server = s;
+    return broker_start(p, s, procnew);
+}
+
+static void proxy_fdpass_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    if (!broker_addr) {
+        return;
+    }
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&broker_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pchild) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10369)
+                     "could not create the proxy fdpass broker mutex, "
+                     "connections won't be parked");
+        return;
+    }
+#endif
+    broker_channels = NULL;
+    broker_pchild = pchild;
+    apr_pool_cleanup_register(pchild, NULL, broker_channels_cleanup,
+                              apr_pool_cleanup_null);
+}
+
+static const char *set_broker(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    broker_sockname = ap_runtime_dir_relative(cmd->pool, arg);
+    if (!broker_sockname) {
+        return apr_pstrcat(cmd->pool, "Invalid ProxyFdPassBroker path ",
+                           arg, NULL);
+    }
+    return NULL;
+}
+
+static const char *set_broker_max(cmd_parms *cmd, void *dummy,
+                                  const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    broker_max = atoi(arg);
+    if (broker_max < 1) {
+        return "ProxyFdPassBrokerMax must be at least 1";
+    }
+    return NULL;
+}
+
+static const command_rec proxy_fdpass_cmds[] =
+{
+    AP_INIT_TAKE1("ProxyFdPassBroker", set_broker, NULL, RSRC_CONF,
+                  "The unix socket of the broker sharing the idle backend "
+                  "connections between the children"),
+    AP_INIT_TAKE1("ProxyFdPassBrokerMax", set_broker_max, NULL, RSRC_CONF,
+                  "Maximum number of idle connections parked in the broker "
+                  "per origin"),
+    {NULL}
+};
+
 static void register_hooks(apr_pool_t *p)
 {
     ap_register_provider(p, PROXY_FDPASS_FLUSHER, "flush", "0", &builtin_flush);
     proxy_hook_scheme_handler(proxy_fdpass_handler, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_canon_handler(proxy_fdpass_canon, NULL, NULL, APR_HOOK_FIRST);
+
+    APR_OPTIONAL_HOOK(proxy, take_backend, proxy_fdpass_take_backend,
+                      NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(proxy, park_backend, proxy_fdpass_park_backend,
+                      NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_pre_config(proxy_fdpass_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(proxy_fdpass_post_config, NULL, NULL,
+                        APR_HOOK_MIDDLE);
+    ap_hook_child_init(proxy_fdpass_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(proxy_fdpass) = {
@@ -236,6 +1277,6 @@ AP_DECLARE_MODULE(proxy_fdpass) = {
     NULL,                       /* merge per-directory config structures */
     NULL,                       /* create per-server config structure */
     NULL,                       /* merge per-server config structures */
-    NULL,                       /* command apr_table_t */
+    proxy_fdpass_cmds,          /* command apr_table_t */
     register_hooks              /* register hooks */
 };
@@ -220,6 +220,7 @@ static void add_cl(apr_pool_t *p,
 typedef enum {
     PROXY_HTTP_REQ_HAVE_HEADER = 0,
 
+    PROXY_HTTP_RESPONSE_WAIT,
     PROXY_HTTP_TUNNELING
 } proxy_http_state;
 
@@ -258,6 +259,10 @@ typedef struct {
     apr_pool_t *async_pool;
     apr_interval_time_t idle_timeout;
 
+    apr_array_header_t *response_pfds;
+    apr_bucket_brigade *response_bb;
+    apr_time_t response_deadline;
+
     unsigned int can_go_async           :1,
                  expecting_100          :1,
                  do_100_continue        :1,
@@ -265,21 +270,40 @@ typedef struct {
                  force10                :1;
 } proxy_http_req_t;
 
-static void proxy_http_async_finish(proxy_http_req_t *req)
+static void proxy_http_async_finish(proxy_http_req_t *req, int status)
 { 
     conn_rec *c = req->r->connection;
+    int tunneled = (req->state == PROXY_HTTP_TUNNELING);
 
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, req->r,
                   "proxy %s: finish async", req->proto);
 
-    proxy_run_detach_backend(req->r, req->backend);
-    ap_proxy_release_connection(req->proto, req->backend, req->r->server);
+    /* The backend may have been released already with the response */
+    if (req->backend) {
+        if (status != OK) {
+            req->backend->close = 1;
+        }
+        proxy_run_detach_backend(req->r, req->backend);
+        ap_proxy_release_connection(req->proto, req->backend,
+                                    req->r->server);
+    }
+
+    /* What proxy_handler() did not when we suspended */
+    ap_proxy_post_suspended_request(req->r, status);
 
-    ap_finalize_request_protocol(req->r);
+    if (!tunneled && ap_is_HTTP_ERROR(status)) {
+        /* What ap_process_async_request() does for the handler */
+        ap_die(status, req->r);
+    }
+    else {
+        ap_finalize_request_protocol(req->r);
+    }
     ap_process_request_after_handler(req->r);
     /* don't touch req or req->r from here */
 
-    c->cs->state = CONN_STATE_LINGER;
+    if (tunneled) {
+        c->cs->state = CONN_STATE_LINGER;
+    }
     ap_mpm_resume_suspended(c);
 }
 
@@ -296,7 +320,7 @@ static void proxy_http_async_cancel_cb(void *baton)
 
     req->r->connection->keepalive = AP_CONN_CLOSE;
     req->backend->close = 1;
-    proxy_http_async_finish(req);
+    proxy_http_async_finish(req, OK);
 }
 
 /* Invoked by the event loop when data is ready on either end. 
@@ -353,8 +377,134 @@ static void proxy_http_async_cb(void *baton)
         proxy_http_async_cancel_cb(req);
     }
     else {
-        proxy_http_async_finish(req);
+        proxy_http_async_finish(req, OK);
+    }
+}
+
+static int ap_proxy_http_process_response(proxy_http_req_t *req);
+static void proxy_http_response_cb(void *baton);
+static void proxy_http_response_timeout_cb(void *baton);
+
+/* What the blocking read of the status line does when it times out */
+static int proxy_http_response_timedout(proxy_http_req_t *req)
+{
+    request_rec *r = req->r;
+
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_TIMEUP, r, APLOGNO(10353)
+                  "timeout waiting for the status line from remote "
+                  "server %s:%d", req->backend->hostname, req->backend->port);
+    apr_table_setn(r->notes, "proxy_timedout", "1");
+
+    return ap_proxyerror(r, HTTP_GATEWAY_TIME_OUT,
+                         "Error reading from remote server");
+}
+
+/* Process the response if something is readable already (including EOF or
+ * an error, reported by the usual path), otherwise have the MPM call us back
+ * when the backend connection becomes readable, up to the deadline.
+ */
+static int proxy_http_await_response(proxy_http_req_t *req)
+{
+    apr_interval_time_t timeout;
+    apr_status_t rv;
+
+    /* Not only the socket, the input filters (e.g. TLS) may hold data or
+     * have consumed what made the socket readable.
+     */
+    rv = ap_get_brigade(req->origin->input_filters, req->response_bb,
+                        AP_MODE_SPECULATIVE, APR_NONBLOCK_READ, 1);
+    apr_brigade_cleanup(req->response_bb);
+    if (!APR_STATUS_IS_EAGAIN(rv)) {
+        return ap_proxy_http_process_response(req);
+    }
+
+    timeout = req->response_deadline - apr_time_now();
+    if (timeout <= 0) {
+        return proxy_http_response_timedout(req);
+    }
+
+    if (!req->async_pool) {
+        /* See proxy_http_async_cb() */
+        apr_pool_create(&req->async_pool, req->p);
+    }
+    else {
+        apr_pool_clear(req->async_pool);
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, req->r,
+                  "proxy %s: waiting for the response asynchronously",
+                  req->proto);
+
+    rv = ap_mpm_register_poll_callback_timeout(req->async_pool,
+                                               req->response_pfds,
+                                               proxy_http_response_cb,
+                                               proxy_http_response_timeout_cb,
+                                               req, timeout);
+    if (rv != APR_SUCCESS) {
+        /* Wait in this thread then */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, req->r, APLOGNO(10354)
+                      "proxy %s: can't wait for the response asynchronously",
+                      req->proto);
+        return ap_proxy_http_process_response(req);
+    }
+
+    return SUSPENDED;
+}
+
+/* Invoked by the event loop when the backend connection is readable while
+ * waiting for the response.
+ */
+static void proxy_http_response_cb(void *baton)
+{
+    proxy_http_req_t *req = (proxy_http_req_t *)baton;
+    int status;
+
+    status = proxy_http_await_response(req);
+    if (status != SUSPENDED) {
+        proxy_http_async_finish(req, status);
+    }
+    /* else waiting again, or tunneling (rescheduled by itself) */
+}
+
+static void proxy_http_response_timeout_cb(void *baton)
+{
+    proxy_http_req_t *req = (proxy_http_req_t *)baton;
+
+    proxy_http_async_finish(req, proxy_http_response_timedout(req));
+}
+
+/* Once the request is sent, wait for the response up to ProxyAsyncDelay in
+ * this thread, and then asynchronously so that the thread can be used for
+ * other connections while the origin server is thinking.
+ */
+static int proxy_http_async_response(proxy_http_req_t *req)
+{
+    apr_interval_time_t timeout = 0;
+    apr_pollfd_t *pfd;
+    apr_int32_t nfds;
+
+    /* The timeout of the blocking read of the status line */
+    apr_socket_timeout_get(req->backend->sock, &timeout);
+    if (timeout < 0) {
+        timeout = req->r->server->timeout;
+    }
+    req->response_deadline = apr_time_now() + timeout;
+
+    req->response_bb = apr_brigade_create(req->p, req->bucket_alloc);
+    req->response_pfds = apr_array_make(req->p, 1, sizeof(apr_pollfd_t));
+    pfd = apr_array_push(req->response_pfds);
+    pfd->p = req->p;
+    pfd->desc_type = APR_POLL_SOCKET;
+    pfd->reqevents = APR_POLLIN;
+    pfd->desc.s = req->backend->sock;
+    pfd->client_data = NULL;
+
+    if (req->dconf->async_delay > 0) {
+        (void)apr_poll(pfd, 1, &nfds, req->dconf->async_delay);
     }
+
+    req->state = PROXY_HTTP_RESPONSE_WAIT;
+    return proxy_http_await_response(req);
 }
 
 /* Read what's in the client pipe. If nonblocking is set and read is EAGAIN,
@@ -1495,6 +1645,14 @@ int ap_proxy_http_process_response(proxy_http_req_t *req)
                 return r->status;
             }
 
+            /* When the (last) response header was received, for the
+             * balancers to tell the backend latency from the time taken
+             * to forward the body.
+             */
+            apr_table_setn(r->notes, "proxy-response-time",
+                           apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                        apr_time_now()));
+
             /* Now, add in the just read cookies */
             apr_table_do(addit_dammit, save_table, r->headers_out,
                          "Set-Cookie", NULL);
@@ -2366,7 +2524,12 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
         }
 
         /* Step Five: Receive the Response... Fall thru to cleanup */
-        status = ap_proxy_http_process_response(req);
+        if (req->can_go_async && !req->do_100_continue) {
+            status = proxy_http_async_response(req);
+        }
+        else {
+            status = ap_proxy_http_process_response(req);
+        }
         if (status == SUSPENDED) {
             return SUSPENDED;
         }
@@ -57,6 +57,7 @@ static void proxy_wstunnel_finish(ws_baton_t *baton)
 { 
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, baton->r, "proxy_wstunnel_finish");
     ap_proxy_release_connection(baton->scheme, baton->backend, baton->r->server);
+    ap_proxy_post_suspended_request(baton->r, OK);
     ap_finalize_request_protocol(baton->r);
     ap_lingering_close(baton->r->connection);
     ap_mpm_resume_suspended(baton->r->connection);
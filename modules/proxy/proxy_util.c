@@ -20,6 +20,9 @@
 #include "scoreboard.h"
 #include "apr_version.h"
 #include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_cond.h"
 #include "proxy_util.h"
 #include "ajp.h"
 #include "scgi.h"
@@ -1452,9 +1455,16 @@ static void socket_cleanup(proxy_conn_rec *conn)
     apr_pool_clear(conn->scpool);
 }
 
+static void conn_pool_unregister(proxy_conn_idle *idle);
+
 static apr_status_t conn_pool_cleanup(void *theworker)
 {
-    ((proxy_worker *)theworker)->cp = NULL;
+    proxy_worker *worker = theworker;
+
+    if (worker->cp && worker->cp->idle) {
+        conn_pool_unregister(worker->cp->idle);
+    }
+    worker->cp = NULL;
     return APR_SUCCESS;
 }
 
@@ -1497,6 +1507,9 @@ PROXY_DECLARE(int) ap_proxy_connection_reusable(proxy_conn_rec *conn)
     return ! (conn->close || !worker->s->is_address_reusable || worker->s->disablereuse);
 }
 
+static void conn_pool_release(proxy_conn_idle *idle, proxy_conn_rec *conn);
+static int conn_pool_is_warm(proxy_worker *worker);
+
 static apr_status_t connection_cleanup(void *theconn)
 {
     proxy_conn_rec *conn = (proxy_conn_rec *)theconn;
@@ -1539,10 +1552,17 @@ static apr_status_t connection_cleanup(void *theconn)
          */
         ap_proxy_ssl_engine(conn->connection, worker->section_config, 1);
     }
+    else if (conn->sock && conn_pool_is_warm(worker)
+                && proxy_run_park_backend(conn) == OK) {
+        /* Surplus handed over (e.g. to mod_proxy_fdpass' broker), close
+         * our copy.
+         */
+        socket_cleanup(conn);
+    }
 
-    if (worker->s->hmax && worker->cp->res) {
+    if (worker->s->hmax && worker->cp->idle) {
         conn->inreslist = 1;
-        apr_reslist_release(worker->cp->res, (void *)conn);
+        conn_pool_release(worker->cp->idle, conn);
     }
     else
     {
@@ -1587,7 +1607,7 @@ PROXY_DECLARE(apr_status_t) ap_proxy_ssl_connection_cleanup(proxy_conn_rec *conn
     return APR_SUCCESS;
 }
 
-/* reslist constructor */
+/* connection constructor */
 static apr_status_t connection_constructor(void **resource, void *params,
                                            apr_pool_t *pool)
 {
@@ -1623,21 +1643,442 @@ static apr_status_t connection_constructor(void **resource, void *params,
     return APR_SUCCESS;
 }
 
-/* reslist destructor */
-static apr_status_t connection_destructor(void *resource, void *params,
-                                          apr_pool_t *pool)
+/*
+ * The idle connections of a worker in this child, reused the most recently
+ * released first (LIFO) so that the same connections stay warm.
+ *
+ * They are kept in nodes linked in two stacks, the idle connections and the
+ * free nodes, whose heads hold the index of the top node in the low 32 bits
+ * and a tag bumped on every change in the high 32 bits (against ABA), so
+ * that acquiring and releasing a connection is a CAS on each stack (APR
+ * before 1.7 has no 64-bit atomics, the heads are 16/16 bits there).  There
+ * are as many nodes as connections allowed (hmax), hence a released
+ * connection always finds a free node.  Only creating and destroying the
+ * connections (subpools of the worker's pool), and waiting for one when
+ * hmax is reached, take the mutex.
+ *
+ * The connections idle for longer than the ttl are closed by a thread of
+ * the child (above the smax connections), see conn_pool_sweeper().
+ */
+#define PROXY_CONN_NIL 0xffff
+#define PROXY_CONN_MAX (PROXY_CONN_NIL - 1)
+#define PROXY_CONN_SWEEP_INTERVAL apr_time_from_sec(1)
+
+#if APR_VERSION_AT_LEAST(1,7,0)
+typedef apr_uint64_t proxy_conn_head;
+#define PROXY_CONN_TAG_SHIFT 32
+#define conn_head_read apr_atomic_read64
+#define conn_head_cas  apr_atomic_cas64
+#else
+typedef apr_uint32_t proxy_conn_head;
+#define PROXY_CONN_TAG_SHIFT 16
+#define conn_head_read apr_atomic_read32
+#define conn_head_cas  apr_atomic_cas32
+#endif
+#define CONN_HEAD_TOP(h) \
+    ((apr_uint32_t)((h) & (((proxy_conn_head)1 << PROXY_CONN_TAG_SHIFT) - 1)))
+#define CONN_HEAD_MAKE(old, top) \
+    (((((old) >> PROXY_CONN_TAG_SHIFT) + 1) << PROXY_CONN_TAG_SHIFT) \
+     | (proxy_conn_head)(top))
+
+typedef struct {
+    proxy_conn_rec *conn;
+    apr_time_t idle_since;
+    apr_uint32_t next;
+} proxy_conn_node;
+
+struct proxy_conn_idle {
+    proxy_worker *worker;
+    proxy_conn_node *nodes;
+    apr_uint32_t *swept;        /* nodes taken by the sweeper */
+    apr_uint32_t nnodes;
+    proxy_conn_head used;       /* head of the idle connections */
+    proxy_conn_head free;       /* head of the free nodes */
+    apr_uint32_t total;         /* connections alive */
+    apr_uint32_t warm;          /* idle connections with a socket */
+    apr_uint32_t waiters;       /* acquirers waiting for a connection */
+    apr_uint32_t sweeping;      /* the idle ones are taken by the sweeper */
+    apr_time_t next_sweep;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+    proxy_conn_idle *next_idle; /* the ones to sweep */
+};
+
+static APR_INLINE apr_uint32_t conn_stack_pop(proxy_conn_idle *idle,
+                                              proxy_conn_head *head)
+{
+    proxy_conn_head old;
+    apr_uint32_t top, next;
+
+    for (;;) {
+        old = conn_head_read(head);
+        top = CONN_HEAD_TOP(old);
+        if (top == PROXY_CONN_NIL) {
+            return PROXY_CONN_NIL;
+        }
+        /* Possibly stale if the node is popped meanwhile, but then
+         * the tag changed and the CAS fails.
+         */
+        next = apr_atomic_read32(&idle->nodes[top].next);
+        if (conn_head_cas(head, CONN_HEAD_MAKE(old, next), old) == old) {
+            return top;
+        }
+    }
+}
+
+static APR_INLINE void conn_stack_push(proxy_conn_idle *idle,
+                                       proxy_conn_head *head, apr_uint32_t i)
+{
+    proxy_conn_head old;
+
+    do {
+        old = conn_head_read(head);
+        apr_atomic_set32(&idle->nodes[i].next, CONN_HEAD_TOP(old));
+    } while (conn_head_cas(head, CONN_HEAD_MAKE(old, i), old) != old);
+}
+
+/* Wake up an acquirer waiting for a connection, if any */
+static void conn_pool_wakeup(proxy_conn_idle *idle)
+{
+#if APR_HAS_THREADS
+    if (apr_atomic_read32(&idle->waiters)) {
+        apr_thread_mutex_lock(idle->mutex);
+        apr_thread_cond_signal(idle->cond);
+        apr_thread_mutex_unlock(idle->mutex);
+    }
+#endif
+}
+
+static void conn_pool_destroy_conn(proxy_conn_idle *idle,
+                                   proxy_conn_rec *conn)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(idle->mutex);
+#endif
+    apr_pool_destroy(conn->pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(idle->mutex);
+#endif
+    apr_atomic_dec32(&idle->total);
+    conn_pool_wakeup(idle);
+}
+
+static apr_status_t conn_pool_create(proxy_worker *worker)
+{
+    proxy_conn_idle *idle;
+    apr_pool_t *p = worker->cp->pool;
+    apr_uint32_t i, n = worker->s->hmax;
+#if APR_HAS_THREADS
+    apr_status_t rv;
+#endif
+
+    if (n > PROXY_CONN_MAX) {
+        n = PROXY_CONN_MAX;
+    }
+    idle = apr_pcalloc(p, sizeof(*idle));
+    idle->worker = worker;
+    idle->nnodes = n;
+    idle->nodes = apr_pcalloc(p, n * sizeof(proxy_conn_node));
+    idle->swept = apr_palloc(p, n * sizeof(apr_uint32_t));
+    idle->used = PROXY_CONN_NIL;
+    idle->free = PROXY_CONN_NIL;
+    for (i = n; i-- > 0;) {
+        idle->nodes[i].next = CONN_HEAD_TOP(idle->free);
+        idle->free = i;
+    }
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&idle->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&idle->cond, p);
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+#endif
+
+    worker->cp->idle = idle;
+    return APR_SUCCESS;
+}
+
+static apr_status_t conn_pool_acquire(proxy_worker *worker,
+                                      proxy_conn_rec **conn)
+{
+    proxy_conn_idle *idle = worker->cp->idle;
+    apr_time_t deadline = 0;
+    apr_uint32_t i, n;
+    apr_status_t rv;
+
+    if (worker->s->acquire_set && worker->s->acquire > 0) {
+        deadline = apr_time_now() + worker->s->acquire;
+    }
+
+    for (;;) {
+        i = conn_stack_pop(idle, &idle->used);
+        if (i != PROXY_CONN_NIL) {
+            *conn = idle->nodes[i].conn;
+            if ((*conn)->sock) {
+                apr_atomic_dec32(&idle->warm);
+            }
+            conn_stack_push(idle, &idle->free, i);
+            return APR_SUCCESS;
+        }
+
+        /* None idle, create one unless at hmax or the sweeper has them
+         * (for a moment, see conn_pool_sweep()).
+         */
+        while (!apr_atomic_read32(&idle->sweeping)
+               && (n = apr_atomic_read32(&idle->total)) < idle->nnodes) {
+            if (apr_atomic_cas32(&idle->total, n + 1, n) == n) {
+#if APR_HAS_THREADS
+                apr_thread_mutex_lock(idle->mutex);
+#endif
+                rv = connection_constructor((void **)conn, worker,
+                                            worker->cp->pool);
+#if APR_HAS_THREADS
+                apr_thread_mutex_unlock(idle->mutex);
+#endif
+                if (rv != APR_SUCCESS) {
+                    apr_atomic_dec32(&idle->total);
+                }
+                return rv;
+            }
+        }
+
+        /* Wait for one to be released (or destroyed), or for the sweep */
+#if APR_HAS_THREADS
+        rv = APR_SUCCESS;
+        apr_thread_mutex_lock(idle->mutex);
+        apr_atomic_inc32(&idle->waiters);
+        if (CONN_HEAD_TOP(conn_head_read(&idle->used)) == PROXY_CONN_NIL
+                && (idle->sweeping
+                    || apr_atomic_read32(&idle->total) >= idle->nnodes)) {
+            if (deadline) {
+                apr_interval_time_t timeout = deadline - apr_time_now();
+                if (timeout > 0) {
+                    rv = apr_thread_cond_timedwait(idle->cond, idle->mutex,
+                                                   timeout);
+                }
+                else {
+                    rv = APR_TIMEUP;
+                }
+            }
+            else {
+                rv = apr_thread_cond_wait(idle->cond, idle->mutex);
+            }
+        }
+        apr_atomic_dec32(&idle->waiters);
+        apr_thread_mutex_unlock(idle->mutex);
+        if (APR_STATUS_IS_TIMEUP(rv)) {
+            return APR_EAGAIN;
+        }
+#else
+        return APR_EAGAIN;
+#endif
+    }
+}
+
+static void conn_pool_release(proxy_conn_idle *idle, proxy_conn_rec *conn)
+{
+    apr_uint32_t i = conn_stack_pop(idle, &idle->free);
+
+    if (i == PROXY_CONN_NIL) {
+        /* Not expected, there are never more connections than nodes */
+        conn_pool_destroy_conn(idle, conn);
+        return;
+    }
+    idle->nodes[i].conn = conn;
+    idle->nodes[i].idle_since = apr_time_now();
+    if (conn->sock) {
+        apr_atomic_inc32(&idle->warm);
+    }
+    conn_stack_push(idle, &idle->used, i);
+    conn_pool_wakeup(idle);
+}
+
+/* Whether this child already keeps smax idle connections to the worker
+ * (with a socket), so that a released one can be parked elsewhere (see the
+ * park_backend hook) rather than kept locally.  Without a pool (hmax = 0)
+ * the single connection is always kept.
+ */
+static int conn_pool_is_warm(proxy_worker *worker)
+{
+    proxy_conn_idle *idle = worker->cp ? worker->cp->idle : NULL;
+
+    return (worker->s->hmax && idle
+            && apr_atomic_read32(&idle->warm)
+               >= (apr_uint32_t)worker->s->smax);
+}
+
+/* Close the connections idle for longer than the ttl above the smax */
+static void conn_pool_sweep(proxy_conn_idle *idle, apr_time_t now)
+{
+    proxy_worker *worker = idle->worker;
+    apr_uint32_t i, n = 0, kept = 0, expired, total;
+
+    if (now < idle->next_sweep
+            || (total = apr_atomic_read32(&idle->total))
+               <= (apr_uint32_t)worker->s->smax) {
+        return;
+    }
+    idle->next_sweep = now + (worker->s->ttl / 2 > PROXY_CONN_SWEEP_INTERVAL
+                              ? worker->s->ttl / 2
+                              : PROXY_CONN_SWEEP_INTERVAL);
+
+    /* Take them all, the most recently used first, and give the kept ones
+     * back in the reverse order to preserve it before closing the expired
+     * ones, which are the least recently used (last).  Acquirers finding
+     * none meanwhile wait for the sweep to end rather than creating new
+     * connections.
+     */
+    apr_atomic_set32(&idle->sweeping, 1);
+    while ((i = conn_stack_pop(idle, &idle->used)) != PROXY_CONN_NIL) {
+        idle->swept[n++] = i;
+    }
+    for (kept = n; kept > 0; --kept) {
+        proxy_conn_node *node = &idle->nodes[idle->swept[kept - 1]];
+
+        if (now - node->idle_since <= worker->s->ttl
+                || total <= (apr_uint32_t)worker->s->smax) {
+            break;
+        }
+        total--;
+    }
+    expired = n - kept;
+    while (kept) {
+        conn_stack_push(idle, &idle->used, idle->swept[--kept]);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(idle->mutex);
+    apr_atomic_set32(&idle->sweeping, 0);
+    if (apr_atomic_read32(&idle->waiters)) {
+        apr_thread_cond_broadcast(idle->cond);
+    }
+    apr_thread_mutex_unlock(idle->mutex);
+#else
+    apr_atomic_set32(&idle->sweeping, 0);
+#endif
+
+    for (i = n - expired; i < n; ++i) {
+        proxy_conn_node *node = &idle->nodes[idle->swept[i]];
+
+        if (node->conn->sock) {
+            apr_atomic_dec32(&idle->warm);
+        }
+        conn_pool_destroy_conn(idle, node->conn);
+        node->conn = NULL;
+        conn_stack_push(idle, &idle->free, idle->swept[i]);
+        worker->s->cp_reaped++;
+    }
+}
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *sweeper_mutex = NULL;
+static apr_thread_cond_t *sweeper_cond = NULL;
+static apr_thread_t *sweeper_thread = NULL;
+static proxy_conn_idle *sweeper_idles = NULL;
+static int sweeper_stop = 0;
+
+static void * APR_THREAD_FUNC conn_pool_sweeper(apr_thread_t *thd,
+                                                void *data)
 {
-    proxy_worker *worker = params;
+    proxy_conn_idle *idle;
 
-    /* Destroy the pool only if not called from reslist_destroy */
-    if (worker->cp) {
-        proxy_conn_rec *conn = resource;
-        apr_pool_destroy(conn->pool);
+    apr_thread_mutex_lock(sweeper_mutex);
+    while (!sweeper_stop) {
+        apr_thread_cond_timedwait(sweeper_cond, sweeper_mutex,
+                                  PROXY_CONN_SWEEP_INTERVAL);
+        if (sweeper_stop) {
+            break;
+        }
+        for (idle = sweeper_idles; idle; idle = idle->next_idle) {
+            conn_pool_sweep(idle, apr_time_now());
+        }
     }
+    apr_thread_mutex_unlock(sweeper_mutex);
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t conn_pool_sweeper_cleanup(void *data)
+{
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(sweeper_mutex);
+    sweeper_stop = 1;
+    apr_thread_cond_signal(sweeper_cond);
+    apr_thread_mutex_unlock(sweeper_mutex);
+    apr_thread_join(&rv, sweeper_thread);
+    sweeper_thread = NULL;
+    sweeper_idles = NULL;
 
     return APR_SUCCESS;
 }
 
+static void conn_pool_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    apr_status_t rv;
+    int max_threads = 0;
+
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
+    if (max_threads <= 1) {
+        /* No connection pools (hmax == 0) */
+        return;
+    }
+
+    sweeper_stop = 0;
+    rv = apr_thread_mutex_create(&sweeper_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                 pchild);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&sweeper_cond, pchild);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_create(&sweeper_thread, NULL, conn_pool_sweeper, NULL,
+                               pchild);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10355)
+                     "can not create the connection pools sweeper thread, "
+                     "idle connections won't be closed after their ttl");
+        sweeper_mutex = NULL;
+        return;
+    }
+    apr_pool_pre_cleanup_register(pchild, NULL, conn_pool_sweeper_cleanup);
+}
+#endif
+
+static void conn_pool_register(proxy_conn_idle *idle)
+{
+#if APR_HAS_THREADS
+    if (sweeper_mutex && idle->worker->s->ttl > 0) {
+        apr_thread_mutex_lock(sweeper_mutex);
+        idle->next_idle = sweeper_idles;
+        sweeper_idles = idle;
+        apr_thread_mutex_unlock(sweeper_mutex);
+    }
+#endif
+}
+
+static void conn_pool_unregister(proxy_conn_idle *idle)
+{
+#if APR_HAS_THREADS
+    proxy_conn_idle **prev;
+
+    if (sweeper_mutex) {
+        apr_thread_mutex_lock(sweeper_mutex);
+        for (prev = &sweeper_idles; *prev; prev = &(*prev)->next_idle) {
+            if (*prev == idle) {
+                *prev = idle->next_idle;
+                break;
+            }
+        }
+        apr_thread_mutex_unlock(sweeper_mutex);
+    }
+#endif
+}
+
 /*
  * WORKER related...
  */
@@ -2108,11 +2549,10 @@ PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, ser
             }
 
             if (worker->s->hmax) {
-                rv = apr_reslist_create(&(worker->cp->res),
-                                        worker->s->min, worker->s->smax,
-                                        worker->s->hmax, worker->s->ttl,
-                                        connection_constructor, connection_destructor,
-                                        worker, worker->cp->pool);
+                rv = conn_pool_create(worker);
+                if (rv == APR_SUCCESS) {
+                    conn_pool_register(worker->cp->idle);
+                }
 
                 apr_pool_pre_cleanup_register(worker->cp->pool, worker,
                                               conn_pool_cleanup);
@@ -2121,12 +2561,6 @@ PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, ser
                     "initialized pool in child %" APR_PID_T_FMT " for (%s) min=%d max=%d smax=%d",
                      getpid(), worker->s->hostname_ex, worker->s->min,
                      worker->s->hmax, worker->s->smax);
-
-                /* Set the acquire timeout */
-                if (rv == APR_SUCCESS && worker->s->acquire_set) {
-                    apr_reslist_timeout_set(worker->cp->res, worker->s->acquire);
-                }
-
             }
             else {
                 void *conn;
@@ -2292,6 +2726,66 @@ PROXY_DECLARE(int) ap_proxy_post_request(proxy_worker *worker,
     return access_status;
 }
 
+typedef struct {
+    proxy_worker *worker;
+    proxy_balancer *balancer;
+    proxy_server_conf *conf;
+} proxy_suspended_req;
+
+#define PROXY_SUSPENDED_REQ_KEY "proxy-suspended-req"
+
+PROXY_DECLARE(void) ap_proxy_suspend_request(proxy_worker *worker,
+                                             proxy_balancer *balancer,
+                                             request_rec *r,
+                                             proxy_server_conf *conf)
+{
+    proxy_suspended_req *sreq = NULL;
+
+    apr_pool_userdata_get((void **)&sreq, PROXY_SUSPENDED_REQ_KEY, r->pool);
+    if (!sreq) {
+        sreq = apr_palloc(r->pool, sizeof(*sreq));
+        apr_pool_userdata_setn(sreq, PROXY_SUSPENDED_REQ_KEY, NULL, r->pool);
+    }
+    sreq->worker = worker;
+    sreq->balancer = balancer;
+    sreq->conf = conf;
+}
+
+PROXY_DECLARE(int) ap_proxy_post_suspended_request(request_rec *r, int status)
+{
+    proxy_suspended_req *sreq = NULL;
+    int access_status, saved_status;
+
+    apr_pool_userdata_get((void **)&sreq, PROXY_SUSPENDED_REQ_KEY, r->pool);
+    if (!sreq || !sreq->worker) {
+        /* Not (or no longer) a suspended proxy request */
+        return OK;
+    }
+
+    /* As proxy_handler() does, give post_request the final status
+     * unless it's already in r->status.
+     */
+    if (status == OK || status == DONE) {
+        access_status = ap_proxy_post_request(sreq->worker, sreq->balancer,
+                                              r, sreq->conf);
+    }
+    else {
+        saved_status = r->status;
+        r->status = status;
+        access_status = ap_proxy_post_request(sreq->worker, sreq->balancer,
+                                              r, sreq->conf);
+        if (r->status == status) {
+            r->status = saved_status;
+        }
+    }
+
+    /* Once only */
+    sreq->worker = NULL;
+    sreq->balancer = NULL;
+
+    return access_status;
+}
+
 /* DEPRECATED */
 PROXY_DECLARE(int) ap_proxy_connect_to_backend(apr_socket_t **newsock,
                                                const char *proxy_function,
@@ -2400,8 +2894,8 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
         }
     }
 
-    if (worker->s->hmax && worker->cp->res) {
-        rv = apr_reslist_acquire(worker->cp->res, (void **)conn);
+    if (worker->s->hmax && worker->cp->idle) {
+        rv = conn_pool_acquire(worker, conn);
     }
     else {
         /* create the new connection if the previous was destroyed */
@@ -2429,6 +2923,14 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
     (*conn)->close  = 0;
     (*conn)->inreslist = 0;
 
+    /* Did we get a warm connection? */
+    if ((*conn)->sock) {
+        worker->s->cp_hits++;
+    }
+    else {
+        worker->s->cp_misses++;
+    }
+
     return OK;
 }
 
@@ -3034,6 +3536,14 @@ PROXY_DECLARE(int) ap_proxy_connect_backend(const char *proxy_function,
         return DECLINED;
     }
 
+    /* None idle here (local miss), one parked elsewhere (e.g. by another
+     * child)?
+     */
+    if (rv != APR_SUCCESS
+            && proxy_run_take_backend(proxy_function, conn, s) == OK) {
+        rv = APR_SUCCESS;
+    }
+
     while (rv != APR_SUCCESS && (backend_addr || conn->uds_path)) {
 #if APR_HAVE_SYS_UN_H
         if (conn->uds_path)
@@ -3206,6 +3716,9 @@ PROXY_DECLARE(int) ap_proxy_connect_backend(const char *proxy_function,
                 }
             }
         }
+
+        /* A new connection to the backend */
+        worker->s->cp_created++;
     }
 
     if (PROXY_WORKER_IS_USABLE(worker)) {
@@ -4625,6 +5138,12 @@ PROXY_DECLARE (const char *) ap_proxy_show_hcmethod(hcmethod_t method)
 
 void proxy_util_register_hooks(apr_pool_t *p)
 {
+#if APR_HAS_THREADS
+    /* Before mod_proxy's which initializes the workers (and registers
+     * their connection pools to be swept).
+     */
+    ap_hook_child_init(conn_pool_child_init, NULL, NULL, APR_HOOK_FIRST);
+#endif
     APR_REGISTER_OPTIONAL_FN(ap_proxy_retry_worker);
     APR_REGISTER_OPTIONAL_FN(ap_proxy_clear_connection);
     APR_REGISTER_OPTIONAL_FN(proxy_balancer_get_best_worker);
@@ -2369,8 +2369,9 @@ static apr_status_t init_vhost(conn_rec *c, SSL *ssl, const char *servername)
             servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
         }
         if (servername) {
-            if (ap_vhost_iterate_given_conn(c, ssl_find_vhost,
-                                            (void *)servername)) {
+            server_rec *s = ap_vhost_lookup_name(c, servername);
+
+            if (s && ssl_find_vhost((void *)servername, c, s)) {
                 ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c, APLOGNO(02043)
                               "SSL virtual host for servername %s found",
                               servername);
@@ -2494,7 +2495,8 @@ give_up:
 /*
  * Find a (name-based) SSL virtual host where either the ServerName
  * or one of the ServerAliases matches the supplied name (to be used
- * with ap_vhost_iterate_given_conn())
+ * with ap_vhost_iterate_given_conn(), or on the server found by
+ * ap_vhost_lookup_name())
  */
 static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s)
 {
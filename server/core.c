@@ -135,6 +135,7 @@ AP_DECLARE_DATA int ap_run_mode = AP_SQ_RM_UNKNOWN;
 AP_DECLARE_DATA int ap_config_generation = 0;
 
 static const char *core_state_dir;
+static int merge_config_cache_size = 0;
 
 typedef struct {
     apr_ipsubnet_t *subnet;
@@ -510,6 +511,7 @@ static void *create_core_server_config(apr_pool_t *a, server_rec *s)
     conf->async_filter = 0;
     conf->strict_host_check= AP_CORE_CONFIG_UNSET; 
     conf->merge_slashes    = AP_CORE_CONFIG_UNSET; 
+    conf->enable_io_uring  = AP_CORE_CONFIG_UNSET;
 
     return (void *)conf;
 }
@@ -611,6 +613,7 @@ static void *merge_core_server_configs(apr_pool_t *p, void *basev, void *virtv)
 
     AP_CORE_MERGE_FLAG(strict_host_check, conf, base, virt);
     AP_CORE_MERGE_FLAG(merge_slashes, conf, base, virt);
+    AP_CORE_MERGE_FLAG(enable_io_uring, conf, base, virt);
 
     return conf;
 }
@@ -1489,6 +1492,7 @@ static apr_status_t reset_config(void *dummy)
     saved_server_config_defines = NULL;
     server_config_defined_vars = NULL;
     core_state_dir = NULL;
+    merge_config_cache_size = 0;
 
     return APR_SUCCESS;
 }
@@ -1975,6 +1979,15 @@ static const char *set_core_server_flag(cmd_parms *cmd, void *s_, int flag)
         ap_get_core_module_config(cmd->server->module_config);
     return ap_set_flag_slot(cmd, conf, flag);
 }
+static const char *set_enable_io_uring(cmd_parms *cmd, void *s_, int flag)
+{
+#ifndef HAVE_LIBURING
+    if (flag) {
+        return "EnableIOUring On requires httpd to be built with liburing";
+    }
+#endif
+    return set_core_server_flag(cmd, s_, flag);
+}
 static const char *set_override_list(cmd_parms *cmd, void *d_, int argc, char *const argv[])
 {
     core_dir_config *d = d_;
@@ -3312,6 +3325,23 @@ static const char *set_state_dir(cmd_parms *cmd, void *dummy, const char *arg)
     return NULL;
 }
 
+static const char *set_merge_config_cache(cmd_parms *cmd, void *dummy,
+                                          const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    merge_config_cache_size = atoi(arg);
+    if (merge_config_cache_size < 0) {
+        return "MergeConfigCache must be a positive number (or 0)";
+    }
+
+    return NULL;
+}
+
 static const char *set_timeout(cmd_parms *cmd, void *dummy, const char *arg)
 {
     const char *err = ap_check_cmd_context(cmd, NOT_IN_DIR_CONTEXT);
@@ -4755,6 +4785,9 @@ AP_INIT_TAKE1("DefaultRuntimeDir", set_runtime_dir, NULL, RSRC_CONF | EXEC_ON_RE
   "Common directory for run-time files (shared memory, locks, etc.)"),
 AP_INIT_TAKE1("DefaultStateDir", set_state_dir, NULL, RSRC_CONF | EXEC_ON_READ,
   "Common directory for persistent state (databases, long-lived caches, etc.)"),
+AP_INIT_TAKE1("MergeConfigCache", set_merge_config_cache, NULL, RSRC_CONF,
+  "Maximum number of merged per-directory configurations cached by each "
+  "child, 0 to disable"),
 AP_INIT_TAKE12("ErrorLog", set_errorlog,
   (void *)APR_OFFSETOF(server_rec, error_fname), RSRC_CONF,
   "The filename of the error log"),
@@ -4933,6 +4966,10 @@ AP_INIT_FLAG("MergeSlashes", set_core_server_flag,
              (void *)APR_OFFSETOF(core_server_config, merge_slashes),  
              RSRC_CONF,
              "Controls whether consecutive slashes in the URI path are merged"),
+AP_INIT_FLAG("EnableIOUring", set_enable_io_uring,
+             (void *)APR_OFFSETOF(core_server_config, enable_io_uring),
+             RSRC_CONF,
+             "Controls whether the network writes are batched with io_uring"),
 { NULL }
 };
 
@@ -5305,6 +5342,8 @@ static int core_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *pte
     set_banner(pconf);
     ap_setup_make_content_type(pconf);
     ap_setup_auth_internal(ptemp);
+    ap_setup_merge_cache(pconf, s, merge_config_cache_size);
+    ap_setup_location_trie(pconf, s);
     if (!sys_privileges) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, 0, NULL, APLOGNO(00136)
                      "Server MUST relinquish startup privileges before "
@@ -5778,9 +5817,9 @@ static int core_upgrade_handler(request_rec *r)
         return DECLINED;
     }
     
-    upgrade = apr_table_get(r->headers_in, "Upgrade");
+    upgrade = ap_request_header_in(r, AP_HEADER_UPGRADE);
     if (upgrade && *upgrade) {
-        const char *conn = apr_table_get(r->headers_in, "Connection");
+        const char *conn = ap_request_header_in(r, AP_HEADER_CONNECTION);
         if (ap_find_token(r->pool, conn, "upgrade")) {
             apr_array_header_t *offers = NULL;
             const char *err;
@@ -53,6 +53,10 @@
 
 #include "mod_so.h" /* for ap_find_loaded_module_symbol */
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #define AP_MIN_SENDFILE_BYTES           (256)
 
 /**
@@ -78,11 +82,46 @@ do { \
 #undef APLOG_MODULE_INDEX
 #define APLOG_MODULE_INDEX AP_CORE_MODULE_INDEX
 
+#ifdef HAVE_LIBURING
+/* Number of writev()s linked in a single io_uring submission, and size of
+ * the per-thread ring (which must be able to hold them all).
+ */
+#define URING_MAX_OPS 4
+#define URING_ENTRIES 8
+
+typedef struct {
+    apr_size_t vec;     /* first iovec in ctx->vec */
+    apr_size_t nvec;
+    apr_size_t nbytes;
+} core_uring_op_t;
+
+typedef struct {
+    struct io_uring ring;
+    int usable;
+    unsigned int inflight;  /* SQEs submitted but not reaped yet */
+} core_thread_ring_t;
+#endif
+
 struct core_output_filter_ctx {
     apr_bucket_brigade *empty_bb;
     apr_size_t bytes_written;
     struct iovec *vec;
     apr_size_t nvec;
+    /* Incremental iovec: when a writev() is short the iovecs left (from
+     * vec_off) are kept, along with the first bucket not in there, so that
+     * the next send_brigade_nonblocking() in the same ap_core_output_filter()
+     * call continues from there rather than walking the brigade again.
+     */
+    apr_bucket *vec_next;
+    apr_size_t vec_off;
+    apr_size_t vec_nvec;
+    apr_size_t vec_nbytes;
+#ifdef HAVE_LIBURING
+    core_thread_ring_t *ring;   /* this thread's ring when EnableIOUring */
+    core_uring_op_t ops[URING_MAX_OPS];
+    apr_size_t nops;            /* writev()s queued in ops */
+    apr_size_t vec_base;        /* where the current iovec run starts */
+#endif
 };
 
 struct core_filter_ctx {
@@ -357,6 +396,10 @@ static apr_status_t sendfile_nonblocking(apr_socket_t *s,
                                          conn_rec *c);
 #endif
 
+#ifdef HAVE_LIBURING
+static core_thread_ring_t *get_thread_ring(conn_rec *c);
+#endif
+
 /* Optional function coming from mod_logio, used for logging of output
  * traffic
  */
@@ -395,10 +438,22 @@ apr_status_t ap_core_output_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
     /* Prepend buckets set aside, if any. */
     ap_filter_reinstate_brigade(f, bb, NULL);
+    ctx->vec_next = NULL;
     if (APR_BRIGADE_EMPTY(bb)) {
         return APR_SUCCESS;
     }
 
+#ifdef HAVE_LIBURING
+    ctx->ring = NULL;
+    {
+        core_server_config *conf =
+            ap_get_core_module_config(c->base_server->module_config);
+        if (conf->enable_io_uring == AP_CORE_CONFIG_ON) {
+            ctx->ring = get_thread_ring(c);
+        }
+    }
+#endif
+
     /* Non-blocking writes on the socket in any case. */
     apr_socket_timeout_get(sock, &sock_timeout);
     apr_socket_timeout_set(sock, 0);
@@ -428,8 +483,11 @@ apr_status_t ap_core_output_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         }
     } while (rv == APR_SUCCESS && !APR_BRIGADE_EMPTY(bb));
 
-    /* Restore original socket timeout before leaving. */
+    /* Restore original socket timeout before leaving, setting aside may
+     * move the data so the iovecs can't be reused in the next call.
+     */
     apr_socket_timeout_set(sock, sock_timeout);
+    ctx->vec_next = NULL;
 
     if (rv != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(rv)) {
         /* The client has aborted the connection */
@@ -461,6 +519,14 @@ apr_status_t ap_core_output_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 #define NVEC_MAX APR_MAX_IOVEC_SIZE
 #endif
 
+#ifdef HAVE_LIBURING
+#define VEC_BASE(ctx) ((ctx)->vec_base)
+#define VEC_MAX(ctx)  ((ctx)->ring ? NVEC_MAX * URING_MAX_OPS : NVEC_MAX)
+#else
+#define VEC_BASE(ctx) 0
+#define VEC_MAX(ctx)  NVEC_MAX
+#endif
+
 static APR_INLINE int is_in_memory_bucket(apr_bucket *b)
 {
     /* These buckets' data are already in memory. */
@@ -488,6 +554,85 @@ static APR_INLINE int can_sendfile_bucket(apr_bucket *b)
 }
 #endif
 
+#ifdef HAVE_LIBURING
+static apr_status_t uring_writev_nonblocking(apr_socket_t *s,
+                                             apr_bucket_brigade *bb,
+                                             core_output_filter_ctx_t *ctx,
+                                             conn_rec *c);
+#endif
+
+/* Write the pending iovec run, or with io_uring queue it as a linked
+ * writev() and only submit the queue once it is full or when 'all' is set
+ * (before sendfile or a blocking read, and at the end of the brigade).
+ * Only batches go through the ring, a single write gains nothing from
+ * a submission plus a wait over a plain writev().
+ */
+static apr_status_t flush_iovec(apr_socket_t *s,
+                                apr_bucket_brigade *bb,
+                                core_output_filter_ctx_t *ctx,
+                                apr_size_t *nbytes,
+                                apr_size_t *nvec,
+                                int all,
+                                conn_rec *c)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+#ifdef HAVE_LIBURING
+    if (ctx->ring) {
+        if (*nvec) {
+            core_uring_op_t *op = &ctx->ops[ctx->nops++];
+            op->vec = ctx->vec_base;
+            op->nvec = *nvec;
+            op->nbytes = *nbytes;
+            ctx->vec_base += *nvec;
+            *nbytes = 0;
+            *nvec = 0;
+        }
+        if (!all && ctx->nops < URING_MAX_OPS) {
+            return APR_SUCCESS;
+        }
+        if (ctx->nops > 1) {
+            rv = uring_writev_nonblocking(s, bb, ctx, c);
+        }
+        else if (ctx->nops) {
+            /* Nothing to batch, a plain writev() is as good */
+            rv = writev_nonblocking(s, bb, ctx, ctx->ops[0].nbytes,
+                                    ctx->ops[0].nvec, c);
+        }
+        ctx->nops = 0;
+        ctx->vec_base = 0;
+        if (!ctx->ring->usable) {
+            ctx->ring = NULL;
+        }
+        return rv;
+    }
+#endif
+
+    if (*nvec) {
+        apr_size_t bytes_written = ctx->bytes_written;
+        rv = writev_nonblocking(s, bb, ctx, *nbytes, *nvec, c);
+        if (rv == APR_SUCCESS) {
+            *nbytes = 0;
+            *nvec = 0;
+        }
+        else {
+            /* What's left starts at ctx->vec_off */
+            *nbytes -= ctx->bytes_written - bytes_written;
+            *nvec -= ctx->vec_off;
+        }
+    }
+    return rv;
+}
+
+/* Whether some buckets of the brigade are referenced by the pending
+ * iovecs, and thus can't be deleted yet.
+ */
+#ifdef HAVE_LIBURING
+#define HAVE_PENDING_IOVEC(ctx, nvec) ((nvec) || (ctx)->nops)
+#else
+#define HAVE_PENDING_IOVEC(ctx, nvec) (nvec)
+#endif
+
 static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
                                              apr_bucket_brigade *bb,
                                              core_output_filter_ctx_t *ctx,
@@ -497,25 +642,40 @@ static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
     core_server_config *conf =
         ap_get_core_module_config(c->base_server->module_config);
     apr_size_t nvec = 0, nbytes = 0;
-    apr_bucket *bucket, *next;
+    apr_bucket *bucket, *next, *resume = NULL;
     const char *data;
     apr_size_t length;
 
-    for (bucket = APR_BRIGADE_FIRST(bb);
-         bucket != APR_BRIGADE_SENTINEL(bb);
-         bucket = next) {
+#ifdef HAVE_LIBURING
+    ctx->nops = 0;
+    ctx->vec_base = 0;
+#endif
+
+    bucket = APR_BRIGADE_FIRST(bb);
+    if (ctx->vec_next) {
+        /* Continue from where the previous pass stopped */
+        nvec = ctx->vec_nvec;
+        nbytes = ctx->vec_nbytes;
+        if (ctx->vec_off) {
+            memmove(ctx->vec, ctx->vec + ctx->vec_off,
+                    nvec * sizeof(struct iovec));
+        }
+        bucket = ctx->vec_next;
+        ctx->vec_next = NULL;
+    }
+
+    for (; bucket != APR_BRIGADE_SENTINEL(bb); bucket = next) {
         next = APR_BUCKET_NEXT(bucket);
 
 #if APR_HAS_SENDFILE
         if (can_sendfile_bucket(bucket)) {
-            if (nvec > 0) {
+            if (HAVE_PENDING_IOVEC(ctx, nvec)) {
                 (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 1);
-                rv = writev_nonblocking(s, bb, ctx, nbytes, nvec, c);
+                resume = bucket;
+                rv = flush_iovec(s, bb, ctx, &nbytes, &nvec, 1, c);
                 if (rv != APR_SUCCESS) {
                     goto cleanup;
                 }
-                nbytes = 0;
-                nvec = 0;
             }
             rv = sendfile_nonblocking(s, bucket, ctx, c);
             if (rv != APR_SUCCESS) {
@@ -531,13 +691,12 @@ static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
             rv = apr_bucket_read(bucket, &data, &length, APR_NONBLOCK_READ);
             if (APR_STATUS_IS_EAGAIN(rv)) {
                 /* Read would block; flush any pending data and retry. */
-                if (nvec) {
-                    rv = writev_nonblocking(s, bb, ctx, nbytes, nvec, c);
+                if (HAVE_PENDING_IOVEC(ctx, nvec)) {
+                    resume = bucket;
+                    rv = flush_iovec(s, bb, ctx, &nbytes, &nvec, 1, c);
                     if (rv != APR_SUCCESS) {
                         goto cleanup;
                     }
-                    nbytes = 0;
-                    nvec = 0;
                 }
                 (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 0);
 
@@ -558,7 +717,7 @@ static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
              * unless the latter is empty, let writev_nonblocking() cleanup the
              * brigade in order.
              */
-            if (!nvec) {
+            if (!HAVE_PENDING_IOVEC(ctx, nvec)) {
                 if (AP_BUCKET_IS_EOR(bucket)) {
                     /* Mark the request as flushed since all its
                      * buckets (preceding this EOR) have been sent.
@@ -573,36 +732,34 @@ static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
         }
 
         /* Make sure that these new data fit in our iovec. */
-        if (nvec == ctx->nvec) {
-            if (nvec == NVEC_MAX) {
-                (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 1);
-                rv = writev_nonblocking(s, bb, ctx, nbytes, nvec, c);
-                if (rv != APR_SUCCESS) {
-                    goto cleanup;
-                }
-                nbytes = 0;
-                nvec = 0;
+        if (nvec == NVEC_MAX) {
+            (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 1);
+            resume = bucket;
+            rv = flush_iovec(s, bb, ctx, &nbytes, &nvec, 0, c);
+            if (rv != APR_SUCCESS) {
+                goto cleanup;
             }
-            else {
-                struct iovec *newvec;
-                apr_size_t newn = nvec * 2;
-                if (newn < NVEC_MIN) {
-                    newn = NVEC_MIN;
-                }
-                else if (newn > NVEC_MAX) {
-                    newn = NVEC_MAX;
-                }
-                newvec = apr_palloc(c->pool, newn * sizeof(struct iovec));
-                if (nvec) {
-                    memcpy(newvec, ctx->vec, nvec * sizeof(struct iovec));
-                }
-                ctx->vec = newvec;
-                ctx->nvec = newn;
+        }
+        if (VEC_BASE(ctx) + nvec == ctx->nvec) {
+            struct iovec *newvec;
+            apr_size_t used = VEC_BASE(ctx) + nvec;
+            apr_size_t newn = used * 2;
+            if (newn < NVEC_MIN) {
+                newn = NVEC_MIN;
+            }
+            else if (newn > VEC_MAX(ctx)) {
+                newn = VEC_MAX(ctx);
+            }
+            newvec = apr_palloc(c->pool, newn * sizeof(struct iovec));
+            if (used) {
+                memcpy(newvec, ctx->vec, used * sizeof(struct iovec));
             }
+            ctx->vec = newvec;
+            ctx->nvec = newn;
         }
         nbytes += length;
-        ctx->vec[nvec].iov_base = (void *)data;
-        ctx->vec[nvec].iov_len = length;
+        ctx->vec[VEC_BASE(ctx) + nvec].iov_base = (void *)data;
+        ctx->vec[VEC_BASE(ctx) + nvec].iov_len = length;
         nvec++;
 
         /* Flush above max threshold, unless the brigade still contains in
@@ -614,19 +771,25 @@ static apr_status_t send_brigade_nonblocking(apr_socket_t *s,
                 && next != APR_BRIGADE_SENTINEL(bb)
                 && !is_in_memory_bucket(next)) {
             (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 1);
-            rv = writev_nonblocking(s, bb, ctx, nbytes, nvec, c);
+            resume = next;
+            rv = flush_iovec(s, bb, ctx, &nbytes, &nvec, 0, c);
             if (rv != APR_SUCCESS) {
                 goto cleanup;
             }
-            nbytes = 0;
-            nvec = 0;
         }
     }
-    if (nvec > 0) {
-        rv = writev_nonblocking(s, bb, ctx, nbytes, nvec, c);
+    if (HAVE_PENDING_IOVEC(ctx, nvec)) {
+        resume = APR_BRIGADE_SENTINEL(bb);
+        rv = flush_iovec(s, bb, ctx, &nbytes, &nvec, 1, c);
     }
 
 cleanup:
+    if (nvec && APR_STATUS_IS_EAGAIN(rv)) {
+        /* Short writev(), nvec iovecs are left for the next pass */
+        ctx->vec_next = resume;
+        ctx->vec_nvec = nvec;
+        ctx->vec_nbytes = nbytes;
+    }
     (void)apr_socket_opt_set(s, APR_TCP_NOPUSH, 0);
     return rv;
 }
@@ -677,6 +840,7 @@ static apr_status_t writev_nonblocking(apr_socket_t *s,
             }
         }
     } while (rv == APR_SUCCESS && bytes_written < bytes_to_write);
+    ctx->vec_off = offset;
 
     if ((ap__logio_add_bytes_out != NULL) && (bytes_written > 0)) {
         ap__logio_add_bytes_out(c, bytes_written);
@@ -724,3 +888,209 @@ static apr_status_t sendfile_nonblocking(apr_socket_t *s,
 }
 
 #endif
+
+#ifdef HAVE_LIBURING
+
+/* Reap the CQEs of the SQEs still in flight, whose iovecs must not be
+ * released (nor the ring torn down) before they complete.
+ */
+static int thread_ring_reap(core_thread_ring_t *tr, int *res)
+{
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    while (tr->inflight) {
+        ret = io_uring_wait_cqe(&tr->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (res) {
+            res[(apr_uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        }
+        io_uring_cqe_seen(&tr->ring, cqe);
+        tr->inflight--;
+    }
+    return 0;
+}
+
+static apr_status_t thread_ring_cleanup(void *data)
+{
+    core_thread_ring_t *tr = data;
+    if (tr->usable) {
+        thread_ring_reap(tr, NULL);
+        io_uring_queue_exit(&tr->ring);
+        tr->usable = 0;
+    }
+    return APR_SUCCESS;
+}
+
+/* io_uring instances are not thread-safe, each worker thread has its own,
+ * created on first use and released with the thread's pool.  Callers not
+ * running in the connection's thread (e.g. the event MPM's listener when
+ * it lingering closes) go without.
+ */
+static core_thread_ring_t *get_thread_ring(conn_rec *c)
+{
+    core_thread_ring_t *tr = NULL;
+    apr_os_thread_t *osthd = NULL;
+    int ret;
+
+    if (!c->current_thread
+            || apr_os_thread_get(&osthd, c->current_thread) != APR_SUCCESS
+            || !osthd
+            || !apr_os_thread_equal(*osthd, apr_os_thread_current())) {
+        return NULL;
+    }
+
+    apr_thread_data_get((void **)&tr, "core_output_ring", c->current_thread);
+    if (!tr) {
+        tr = apr_pcalloc(apr_thread_pool_get(c->current_thread),
+                         sizeof(*tr));
+        ret = io_uring_queue_init(URING_ENTRIES, &tr->ring, 0);
+        if (ret < 0) {
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, APR_FROM_OS_ERROR(-ret),
+                          c, APLOGNO(10263) "io_uring_queue_init() failed, "
+                          "using writev() for this thread");
+        }
+        else {
+            tr->usable = 1;
+        }
+        apr_thread_data_set(tr, "core_output_ring", thread_ring_cleanup,
+                            c->current_thread);
+    }
+    return tr->usable ? tr : NULL;
+}
+
+/* Submit the queued writev()s linked in a single io_uring_enter(); the
+ * chain stops at the first short write (the following ones complete with
+ * -ECANCELED), so what is written is always a prefix of the iovecs.
+ */
+static apr_status_t uring_writev_nonblocking(apr_socket_t *s,
+                                             apr_bucket_brigade *bb,
+                                             core_output_filter_ctx_t *ctx,
+                                             conn_rec *c)
+{
+    struct io_uring *ring = &ctx->ring->ring;
+    struct io_uring_sqe *sqe;
+    struct iovec *vec = ctx->vec;
+    int res[URING_MAX_OPS];
+    apr_size_t bytes_to_write = 0, bytes_written = 0;
+    apr_size_t i, k, n, nvec = ctx->vec_base;
+    apr_os_sock_t fd;
+    apr_status_t rv;
+    int ret;
+
+    rv = apr_os_sock_get(&fd, s);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    for (k = 0; k < ctx->nops; ++k) {
+        core_uring_op_t *op = &ctx->ops[k];
+        sqe = io_uring_get_sqe(ring);
+        ap_assert(sqe != NULL); /* URING_ENTRIES >= URING_MAX_OPS */
+        io_uring_prep_writev(sqe, fd, vec + op->vec, op->nvec, 0);
+        io_uring_sqe_set_data(sqe, (void *)(apr_uintptr_t)k);
+        if (k + 1 < ctx->nops) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        bytes_to_write += op->nbytes;
+        res[k] = -ECANCELED;
+    }
+
+    do {
+        ret = io_uring_submit(ring);
+    } while (ret == -EINTR);
+    if (ret < 0) {
+        /* Nothing in flight, but don't leave SQEs pointing to our iovecs
+         * in the ring, give up io_uring for this thread.
+         */
+        rv = APR_FROM_OS_ERROR(-ret);
+        ap_log_cerror(APLOG_MARK, APLOG_ERR, rv, c, APLOGNO(10264)
+                      "io_uring_submit() failed, using writev() "
+                      "for this thread");
+        thread_ring_cleanup(ctx->ring);
+        return rv;
+    }
+    ctx->ring->inflight = ret;
+
+    ret = thread_ring_reap(ctx->ring, res);
+    if (ret < 0) {
+        /* Can't tell what was written, fail the connection */
+        rv = APR_FROM_OS_ERROR(-ret);
+        ap_log_cerror(APLOG_MARK, APLOG_ERR, rv, c, APLOGNO(10376)
+                      "io_uring_wait_cqe() failed, using writev() "
+                      "for this thread");
+        thread_ring_cleanup(ctx->ring);
+        return rv;
+    }
+    if (io_uring_sq_ready(ring)) {
+        /* Partially submitted, the SQEs left (with -ECANCELED results,
+         * ending the written prefix like a short write below) must not
+         * be submitted later.
+         */
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c, APLOGNO(10377)
+                      "io_uring_submit() incomplete, using writev() "
+                      "for this thread");
+        thread_ring_cleanup(ctx->ring);
+    }
+
+    rv = APR_SUCCESS;
+    for (k = 0; k < ctx->nops; ++k) {
+        if (res[k] < 0) {
+            if (res[k] == -EAGAIN || res[k] == -ECANCELED) {
+                rv = APR_EAGAIN;
+            }
+            else {
+                rv = APR_FROM_OS_ERROR(-res[k]);
+            }
+            break;
+        }
+        bytes_written += res[k];
+        if ((apr_size_t)res[k] < ctx->ops[k].nbytes) {
+            rv = APR_EAGAIN;
+            break;
+        }
+    }
+
+    /* Same as writev_nonblocking(), for all the queued iovecs */
+    n = bytes_written;
+    for (i = 0; i < nvec; ) {
+        apr_bucket *bucket = APR_BRIGADE_FIRST(bb);
+        if (!bucket->length) {
+            if (AP_BUCKET_IS_EOR(bucket)) {
+                request_rec *r = ap_bucket_eor_request(bucket);
+                ap_assert(r != NULL);
+                r->flushed = 1;
+            }
+            apr_bucket_delete(bucket);
+        }
+        else if (n >= vec[i].iov_len) {
+            apr_bucket_delete(bucket);
+            n -= vec[i++].iov_len;
+        }
+        else {
+            if (n) {
+                apr_bucket_split(bucket, n);
+                apr_bucket_delete(bucket);
+            }
+            break;
+        }
+    }
+
+    if ((ap__logio_add_bytes_out != NULL) && (bytes_written > 0)) {
+        ap__logio_add_bytes_out(c, bytes_written);
+    }
+    ctx->bytes_written += bytes_written;
+
+    ap_log_cerror(APLOG_MARK, APLOG_TRACE6, rv, c,
+                  "uring_writev_nonblocking: %"APR_SIZE_T_FMT"/%"APR_SIZE_T_FMT
+                  " in %"APR_SIZE_T_FMT" writev()s",
+                  bytes_written, bytes_to_write, ctx->nops);
+    return rv;
+}
+
+#endif /* HAVE_LIBURING */
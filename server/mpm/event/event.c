@@ -73,6 +73,9 @@
 #ifdef HAVE_SYS_PROCESSOR_H
 #include <sys/processor.h>      /* for bindprocessor() */
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>              /* for sched_setaffinity() */
+#endif
 
 #if !APR_HAS_THREADS
 #error The Event MPM requires APR threads, but they are unavailable.
@@ -178,6 +181,10 @@ static int active_daemons = 0;              /* workers that still active, i.e. a
 static int max_workers = 0;                 /* MaxRequestWorkers */
 static int server_limit = 0;                /* ServerLimit */
 static int thread_limit = 0;                /* ThreadLimit */
+static int cpu_affinity = 0;                /* EventCPUAffinity */
+static int num_online_cpus = 0;             /* Cores used by EventCPUAffinity */
+static int *online_cpus = NULL;             /* Their ids, from sched_getaffinity() */
+static int work_stealing = 0;               /* EventWorkStealing */
 static int had_healthy_child = 0;
 static volatile int dying = 0;
 static volatile int workers_may_exit = 0;
@@ -490,6 +497,15 @@ static apr_socket_t **worker_sockets;
 
 static volatile apr_uint32_t listensocks_disabled;
 
+/* With EventWorkStealing the idle workers are those waiting on the queues */
+static APR_INLINE apr_uint32_t num_idle_workers(void)
+{
+    if (work_stealing) {
+        return ap_queue_num_idlers(worker_queue);
+    }
+    return ap_queue_info_num_idlers(worker_queue_info);
+}
+
 static void disable_listensocks(void)
 {
     int i;
@@ -519,7 +535,7 @@ static void enable_listensocks(void)
                  apr_atomic_read32(&lingering_count),
                  apr_atomic_read32(&clogged_count),
                  apr_atomic_read32(&suspended_count),
-                 ap_queue_info_num_idlers(worker_queue_info));
+                 num_idle_workers());
     for (i = 0; i < num_listensocks; i++)
         apr_pollset_add(event_pollset, &listener_pollfd[i]);
     /*
@@ -536,7 +552,7 @@ static APR_INLINE apr_uint32_t listeners_disabled(void)
 
 static APR_INLINE int connections_above_limit(void)
 {
-    apr_uint32_t i_count = ap_queue_info_num_idlers(worker_queue_info);
+    apr_uint32_t i_count = num_idle_workers();
     if (i_count > 0) {
         apr_uint32_t c_count = apr_atomic_read32(&connection_count);
         apr_uint32_t l_count = apr_atomic_read32(&lingering_count);
@@ -617,6 +633,9 @@ static void wakeup_listener(void)
     if (worker_queue_info) {
         ap_queue_info_term(worker_queue_info);
     }
+    if (work_stealing && worker_queue) {
+        ap_queue_interrupt_room(worker_queue);
+    }
 
     if (!listener_os_thread) {
         /* XXX there is an obscure path that this doesn't handle perfectly:
@@ -1461,7 +1480,16 @@ static void get_worker(int *have_idle_worker_p, int blocking, int *all_busy)
         return;
     }
 
-    if (blocking)
+    /* With EventWorkStealing there is no idler to reserve, the worker
+     * queues only need some room (they are bounded by ThreadsPerChild).
+     */
+    if (work_stealing) {
+        if (blocking)
+            rc = ap_queue_wait_for_room(worker_queue, all_busy);
+        else
+            rc = ap_queue_try_get_room(worker_queue);
+    }
+    else if (blocking)
         rc = ap_queue_info_wait_for_idler(worker_queue_info, all_busy);
     else
         rc = ap_queue_info_try_get_idler(worker_queue_info);
@@ -2075,7 +2103,7 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
                                  apr_atomic_read32(&connection_count));
                     ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, ap_server_conf,
                                  "Idle workers: %u",
-                                 ap_queue_info_num_idlers(worker_queue_info));
+                                 num_idle_workers());
                     workers_were_busy = 1;
                 }
                 else if (!listener_may_exit) {
@@ -2326,7 +2354,8 @@ static void *APR_THREAD_FUNC worker_thread(apr_thread_t * thd, void *dummy)
         timer_event_t *te = NULL;
         apr_pool_t *ptrans;         /* Pool for per-transaction stuff */
 
-        if (!is_idle) {
+        /* With EventWorkStealing we are counted idle by the queue */
+        if (!is_idle && !work_stealing) {
             rv = ap_queue_info_set_idle(worker_queue_info, NULL);
             if (rv != APR_SUCCESS) {
                 ap_log_error(APLOG_MARK, APLOG_EMERG, rv, ap_server_conf,
@@ -2350,8 +2379,9 @@ static void *APR_THREAD_FUNC worker_thread(apr_thread_t * thd, void *dummy)
             break;
         }
 
-        rv = ap_queue_pop_something(worker_queue, &csd, (void **)&cs,
-                                    &ptrans, &te);
+        /* With EventWorkStealing our own run queue is tried first */
+        rv = ap_queue_pop_something_ex(worker_queue, thread_slot,
+                                       &csd, (void **)&cs, &ptrans, &te);
 
         if (rv != APR_SUCCESS) {
             /* We get APR_EOF during a graceful shutdown once all the
@@ -2508,8 +2538,14 @@ static void setup_threads_runtime(void)
     apr_pool_tag(pruntime, "mpm_runtime");
 
     /* We must create the fd queues before we start up the listener
-     * and worker threads. */
-    rv = ap_queue_create(&worker_queue, threads_per_child, pruntime);
+     * and worker threads.  With EventWorkStealing each worker has its
+     * own run queue and steals from the others' when it's empty. */
+    if (threads_per_child < 2) {
+        work_stealing = 0;
+    }
+    rv = ap_queue_create_sharded(&worker_queue, threads_per_child,
+                                 work_stealing ? threads_per_child : 1,
+                                 pruntime);
     if (rv != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ALERT, rv, ap_server_conf, APLOGNO(03100)
                      "ap_queue_create() failed");
@@ -2939,6 +2975,48 @@ static void child_main(int child_num_arg, int child_bucket)
     clean_child_exit(resource_shortage ? APEXIT_CHILDSICK : 0);
 }
 
+/* With EventCPUAffinity, listeners bucket N is served by core N: the
+ * children of the bucket (and thus their listener and workers threads)
+ * run on that core only, and the bucket's SO_REUSEPORT listening sockets
+ * ask the kernel (SO_INCOMING_CPU) for the connections whose packets are
+ * received on that same core.
+ */
+static void event_bind_child_to_cpu(int bucket)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    int cpu = online_cpus[bucket % num_online_cpus];
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, errno, ap_server_conf,
+                     APLOGNO(10260) "could not bind child of listeners "
+                     "bucket %i to CPU %i", bucket, cpu);
+    }
+#endif
+}
+
+static void event_set_listeners_cpu(ap_listen_rec *lr, int bucket)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu = online_cpus[bucket % num_online_cpus];
+
+    for (; lr; lr = lr->next) {
+        apr_os_sock_t fd;
+        if (apr_os_sock_get(&fd, lr->sd) != APR_SUCCESS) {
+            continue;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+                       (void *)&cpu, sizeof(cpu)) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, errno, ap_server_conf,
+                         APLOGNO(10261) "could not set SO_INCOMING_CPU %i "
+                         "on listener %pI", cpu, lr->bind_addr);
+        }
+    }
+#endif
+}
+
 static int make_child(server_rec * s, int slot, int bucket)
 {
     int pid;
@@ -2999,6 +3077,9 @@ static int make_child(server_rec * s, int slot, int bucket)
                          ap_server_conf, APLOGNO(00482)
                          "processor unbind failed");
 #endif
+        if (cpu_affinity) {
+            event_bind_child_to_cpu(bucket);
+        }
         RAISE_SIGSTOP(MAKE_CHILD);
 
         apr_signal(SIGTERM, just_die);
@@ -3617,11 +3698,43 @@ static int event_open_logs(apr_pool_t * p, apr_pool_t * plog,
 
     if (one_process) {
         num_buckets = 1;
+        cpu_affinity = 0;
     }
     else if (retained->mpm->was_graceful) {
         /* Preserve the number of buckets on graceful restarts. */
         num_buckets = retained->mpm->num_buckets;
     }
+    if (cpu_affinity) {
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(SO_INCOMING_CPU)
+        /* The cores we may run on (taskset, cgroups' cpuset...) are not
+         * necessarily numbered 0..N-1, nor all online.
+         */
+        cpu_set_t set;
+        num_online_cpus = 0;
+        CPU_ZERO(&set);
+        if (ap_have_so_reuseport
+                && sched_getaffinity(0, sizeof(set), &set) == 0) {
+            int cpu;
+            online_cpus = apr_palloc(pconf, CPU_SETSIZE * sizeof(int));
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) {
+                    online_cpus[num_online_cpus++] = cpu;
+                }
+            }
+        }
+        if (num_online_cpus && !num_buckets) {
+            /* One listeners bucket per core */
+            num_buckets = num_online_cpus;
+        }
+#endif
+        if (!num_online_cpus) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING | level_flags, 0,
+                         (startup ? NULL : s), APLOGNO(10262)
+                         "EventCPUAffinity ignored without SO_REUSEPORT, "
+                         "SO_INCOMING_CPU and sched_setaffinity() support");
+            cpu_affinity = 0;
+        }
+    }
     if ((rv = ap_duplicate_listeners(pconf, ap_server_conf,
                                      &listen_buckets, &num_buckets))) {
         ap_log_error(APLOG_MARK, APLOG_CRIT | level_flags, rv,
@@ -3640,6 +3753,9 @@ static int event_open_logs(apr_pool_t * p, apr_pool_t * plog,
             return !OK;
         }
         all_buckets[i].listeners = listen_buckets[i];
+        if (cpu_affinity) {
+            event_set_listeners_cpu(listen_buckets[i], i);
+        }
     }
 
     if (retained->mpm->max_buckets < num_buckets) {
@@ -3760,6 +3876,10 @@ static int event_pre_config(apr_pool_t * pconf, apr_pool_t * plog,
     max_spare_threads = DEFAULT_MAX_FREE_DAEMON * DEFAULT_THREADS_PER_CHILD;
     server_limit = DEFAULT_SERVER_LIMIT;
     thread_limit = DEFAULT_THREAD_LIMIT;
+    cpu_affinity = 0;
+    num_online_cpus = 0;
+    online_cpus = NULL;
+    work_stealing = 0;
     active_daemons_limit = server_limit;
     threads_per_child = DEFAULT_THREADS_PER_CHILD;
     max_workers = active_daemons_limit * threads_per_child;
@@ -4199,6 +4319,34 @@ static const char *set_worker_factor(cmd_parms * cmd, void *dummy,
 }
 
 
+static const char *set_cpu_affinity(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    cpu_affinity = flag;
+    return NULL;
+}
+
+static const char *set_work_stealing(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+#ifndef AP_FDQUEUE_LOCKFREE
+    if (flag) {
+        return "EventWorkStealing requires httpd to be built with "
+               "--enable-lockfree-fdqueue";
+    }
+#endif
+    work_stealing = flag;
+    return NULL;
+}
+
 static const command_rec event_cmds[] = {
     LISTEN_COMMANDS,
     AP_INIT_TAKE1("StartServers", set_daemons_to_start, NULL, RSRC_CONF,
@@ -4221,6 +4369,12 @@ static const command_rec event_cmds[] = {
     AP_INIT_TAKE1("AsyncRequestWorkerFactor", set_worker_factor, NULL, RSRC_CONF,
                   "How many additional connects will be accepted per idle "
                   "worker thread"),
+    AP_INIT_FLAG("EventCPUAffinity", set_cpu_affinity, NULL, RSRC_CONF,
+                 "On to bind each listeners bucket and its children to "
+                 "one CPU core"),
+    AP_INIT_FLAG("EventWorkStealing", set_work_stealing, NULL, RSRC_CONF,
+                 "On to give each worker thread its own run queue, idle "
+                 "workers steal from the others"),
     AP_GRACEFUL_SHUTDOWN_TIMEOUT_COMMAND,
     {NULL}
 };
@@ -19,6 +19,7 @@
 #if APR_HAS_THREADS
 
 #include <apr_atomic.h>
+#include <apr_thread_proc.h>
 
 static const apr_uint32_t zero_pt = APR_UINT32_MAX/2;
 
@@ -46,6 +47,9 @@ struct fd_queue_info_t
 
 struct fd_queue_elem_t
 {
+#ifdef AP_FDQUEUE_LOCKFREE
+    apr_uint32_t volatile seq;
+#endif
     apr_socket_t *sd;
     void *sd_baton;
     apr_pool_t *p;
@@ -311,20 +315,6 @@ apr_status_t ap_queue_info_term(fd_queue_info_t *queue_info)
     return apr_thread_mutex_unlock(queue_info->idlers_mutex);
 }
 
-/**
- * Detects when the fd_queue_t is full. This utility function is expected
- * to be called from within critical sections, and is not threadsafe.
- */
-#define ap_queue_full(queue) ((queue)->nelts == (queue)->bounds)
-
-/**
- * Detects when the fd_queue_t is empty. This utility function is expected
- * to be called from within critical sections, and is not threadsafe.
- */
-#define ap_queue_empty(queue) ((queue)->nelts == 0 && \
-                               APR_RING_EMPTY(&queue->timers, \
-                                              timer_event_t, link))
-
 /**
  * Callback routine that is called to destroy this
  * fd_queue_t when its pool is destroyed.
@@ -342,6 +332,587 @@ static apr_status_t ap_queue_destroy(void *data)
     return APR_SUCCESS;
 }
 
+#ifdef AP_FDQUEUE_LOCKFREE
+
+/**
+ * Wake up one worker parked in ap_queue_pop_something(), if any.  The
+ * waiter registers itself (atomically) before re-checking the queue under
+ * the mutex, so either it sees our element or we see it waiting.
+ */
+static apr_status_t queue_wakeup(fd_queue_t *queue)
+{
+    apr_status_t rv;
+
+    if (!apr_atomic_read32(&queue->waiters)) {
+        return APR_SUCCESS;
+    }
+    if ((rv = apr_thread_mutex_lock(queue->one_big_mutex)) != APR_SUCCESS) {
+        return rv;
+    }
+    apr_thread_cond_signal(queue->not_empty);
+    return apr_thread_mutex_unlock(queue->one_big_mutex);
+}
+
+/**
+ * Same for a work stealing queue, whose workers park on their own shard:
+ * wake up the one parked on the given shard or else on the next ones, if
+ * any.  A parked worker flags its shard and counts itself in the queue's
+ * waiters before re-checking the queue under its shard's mutex, and the
+ * flag is claimed here so that successive wakeups go to different workers.
+ * Only the mutex of the woken up worker's shard is taken.
+ */
+static apr_status_t shards_wakeup(fd_queue_t *queue, unsigned int hint)
+{
+    apr_status_t rv;
+    unsigned int i;
+
+    if (!apr_atomic_read32(&queue->waiters)) {
+        return APR_SUCCESS;
+    }
+    for (i = 0; i < queue->nshards; ++i) {
+        fd_queue_t *shard = queue->shards[(hint + i) % queue->nshards];
+        if (apr_atomic_read32(&shard->waiters)
+                && apr_atomic_cas32(&shard->waiters, 0, 1) == 1) {
+            apr_atomic_dec32(&queue->waiters);
+            if ((rv = apr_thread_mutex_lock(shard->one_big_mutex))
+                    != APR_SUCCESS) {
+                return rv;
+            }
+            apr_thread_cond_signal(shard->not_empty);
+            return apr_thread_mutex_unlock(shard->one_big_mutex);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Pop the first timer, if any, returns non-zero on success.
+ */
+static int queue_pop_timer(fd_queue_t *queue, timer_event_t **te_out,
+                           apr_status_t *rv)
+{
+    timer_event_t *te = NULL;
+
+    if ((*rv = apr_thread_mutex_lock(queue->one_big_mutex)) != APR_SUCCESS) {
+        return 1;
+    }
+    if (!APR_RING_EMPTY(&queue->timers, timer_event_t, link)) {
+        te = APR_RING_FIRST(&queue->timers);
+        APR_RING_REMOVE(te, link);
+        apr_atomic_dec32(&queue->ntimers);
+    }
+    *rv = apr_thread_mutex_unlock(queue->one_big_mutex);
+    if (te) {
+        *te_out = te;
+        return 1;
+    }
+    return *rv != APR_SUCCESS;
+}
+
+/**
+ * Initialize the fd_queue_t.  The capacity is rounded up to the next
+ * power of two so that slot indexes can be masked rather than wrapped.
+ */
+apr_status_t ap_queue_create(fd_queue_t **pqueue, int capacity, apr_pool_t *p)
+{
+    apr_status_t rv;
+    fd_queue_t *queue;
+    apr_uint32_t bounds, i;
+
+    queue = apr_pcalloc(p, sizeof *queue);
+
+    if ((rv = apr_thread_mutex_create(&queue->one_big_mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      p)) != APR_SUCCESS) {
+        return rv;
+    }
+    if ((rv = apr_thread_cond_create(&queue->not_empty, p)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    APR_RING_INIT(&queue->timers, timer_event_t, link);
+
+    for (bounds = 2; bounds < (apr_uint32_t)capacity; bounds <<= 1)
+        ;
+    queue->data = apr_pcalloc(p, bounds * sizeof(fd_queue_elem_t));
+    for (i = 0; i < bounds; ++i) {
+        queue->data[i].seq = i;
+    }
+    queue->bounds = bounds;
+    queue->mask = bounds - 1;
+
+    apr_pool_cleanup_register(p, queue, ap_queue_destroy,
+                              apr_pool_cleanup_null);
+    *pqueue = queue;
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Whether the socket ring is empty, lock-free snapshot.
+ */
+static int queue_sockets_empty(fd_queue_t *queue)
+{
+    apr_uint32_t pos = apr_atomic_read32(&queue->out);
+    fd_queue_elem_t *elem = &queue->data[pos & queue->mask];
+
+    return (apr_int32_t)(apr_atomic_read32(&elem->seq) - (pos + 1)) < 0;
+}
+
+/**
+ * Try to push a socket onto the ring, APR_EAGAIN if it is full.
+ */
+static apr_status_t queue_trypush_socket(fd_queue_t *queue,
+                                         apr_socket_t *sd, void *sd_baton,
+                                         apr_pool_t *p)
+{
+    fd_queue_elem_t *elem;
+    apr_uint32_t pos, seq;
+    apr_int32_t diff;
+
+    pos = apr_atomic_read32(&queue->in);
+    for (;;) {
+        elem = &queue->data[pos & queue->mask];
+        seq = apr_atomic_read32(&elem->seq);
+        diff = (apr_int32_t)(seq - pos);
+        if (diff == 0) {
+            apr_uint32_t cur = apr_atomic_cas32(&queue->in, pos + 1, pos);
+            if (cur == pos) {
+                break;
+            }
+            pos = cur;
+        }
+        else if (diff < 0) {
+            if (pos - apr_atomic_read32(&queue->out) >= queue->bounds) {
+                return APR_EAGAIN;
+            }
+            /* a consumer has claimed this slot but not released it yet */
+            apr_thread_yield();
+            pos = apr_atomic_read32(&queue->in);
+        }
+        else {
+            pos = apr_atomic_read32(&queue->in);
+        }
+    }
+
+    elem->sd = sd;
+    elem->sd_baton = sd_baton;
+    elem->p = p;
+    /* publish the slot to consumers */
+    apr_atomic_set32(&elem->seq, pos + 1);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t queue_push_socket(fd_queue_t *queue,
+                                      apr_socket_t *sd, void *sd_baton,
+                                      apr_pool_t *p)
+{
+    apr_status_t rv;
+
+    AP_DEBUG_ASSERT(!queue->terminated);
+
+    rv = queue_trypush_socket(queue, sd, sd_baton, p);
+    if (rv != APR_SUCCESS) {
+        /* full, the caller did not reserve an idler */
+        AP_DEBUG_ASSERT(0);
+        return rv;
+    }
+
+    return queue_wakeup(queue);
+}
+
+apr_status_t ap_queue_push_timer(fd_queue_t *queue, timer_event_t *te)
+{
+    apr_status_t rv;
+
+    if ((rv = apr_thread_mutex_lock(queue->one_big_mutex)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    AP_DEBUG_ASSERT(!queue->terminated);
+
+    APR_RING_INSERT_TAIL(&queue->timers, te, timer_event_t, link);
+    apr_atomic_inc32(&queue->ntimers);
+
+    apr_thread_cond_signal(queue->not_empty);
+
+    rv = apr_thread_mutex_unlock(queue->one_big_mutex);
+    if (rv == APR_SUCCESS && queue->nshards) {
+        rv = shards_wakeup(queue, 0);
+    }
+    return rv;
+}
+
+/**
+ * Try to pop a socket off the ring, APR_EAGAIN if it is empty.
+ */
+static apr_status_t queue_trypop_socket(fd_queue_t *queue, apr_socket_t **sd,
+                                        void **sd_baton, apr_pool_t **p)
+{
+    fd_queue_elem_t *elem;
+    apr_uint32_t pos, seq;
+    apr_int32_t diff;
+
+    pos = apr_atomic_read32(&queue->out);
+    for (;;) {
+        elem = &queue->data[pos & queue->mask];
+        seq = apr_atomic_read32(&elem->seq);
+        diff = (apr_int32_t)(seq - (pos + 1));
+        if (diff == 0) {
+            apr_uint32_t cur = apr_atomic_cas32(&queue->out, pos + 1, pos);
+            if (cur == pos) {
+                break;
+            }
+            pos = cur;
+        }
+        else if (diff < 0) {
+            return APR_EAGAIN;
+        }
+        else {
+            pos = apr_atomic_read32(&queue->out);
+        }
+    }
+
+    *sd = elem->sd;
+    if (sd_baton) {
+        *sd_baton = elem->sd_baton;
+    }
+    *p = elem->p;
+#ifdef AP_DEBUG
+    elem->sd = NULL;
+    elem->p = NULL;
+#endif /* AP_DEBUG */
+    /* hand the slot back to producers, one lap ahead */
+    apr_atomic_set32(&elem->seq, pos + queue->mask + 1);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Retrieves the next available socket from the queue. If there are no
+ * sockets available, it will block until one becomes available.
+ * Once retrieved, the socket is placed into the address specified by
+ * 'sd'.
+ */
+static apr_status_t queue_pop_something(fd_queue_t *queue,
+                                        apr_socket_t **sd, void **sd_baton,
+                                        apr_pool_t **p,
+                                        timer_event_t **te_out)
+{
+    apr_status_t rv;
+    int interrupted = 0;
+
+    for (;;) {
+        /* Timers first, as the mutex based queue does */
+        if (te_out && apr_atomic_read32(&queue->ntimers)
+                && queue_pop_timer(queue, te_out, &rv)) {
+            return rv;
+        }
+
+        if (queue_trypop_socket(queue, sd, sd_baton, p) == APR_SUCCESS) {
+            if (te_out) {
+                *te_out = NULL;
+            }
+            return APR_SUCCESS;
+        }
+
+        /* Woken up (or terminated) and still nothing for us */
+        if (interrupted) {
+            return queue->terminated ? APR_EOF : APR_EINTR;
+        }
+
+        rv = apr_thread_mutex_lock(queue->one_big_mutex);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        apr_atomic_inc32(&queue->waiters);
+        if (queue_sockets_empty(queue)
+                && (!te_out || !apr_atomic_read32(&queue->ntimers))) {
+            if (!queue->terminated) {
+                apr_thread_cond_wait(queue->not_empty, queue->one_big_mutex);
+            }
+            interrupted = 1;
+        }
+        apr_atomic_dec32(&queue->waiters);
+        rv = apr_thread_mutex_unlock(queue->one_big_mutex);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+}
+
+/**
+ * Initialize a work stealing fd_queue_t: the queue itself only holds the
+ * timers, the sockets go to the shards (one per worker).  Each shard can
+ * hold its share of the capacity plus one, a push falls back to the next
+ * shard when one is full so the total is always enough.
+ */
+apr_status_t ap_queue_create_sharded(fd_queue_t **pqueue, int capacity,
+                                     int nshards, apr_pool_t *p)
+{
+    apr_status_t rv;
+    fd_queue_t *queue;
+    int i;
+
+    if (nshards < 2) {
+        return ap_queue_create(pqueue, capacity, p);
+    }
+
+    if ((rv = ap_queue_create(&queue, 1, p)) != APR_SUCCESS) {
+        return rv;
+    }
+    if ((rv = apr_thread_cond_create(&queue->not_full, p)) != APR_SUCCESS) {
+        return rv;
+    }
+    queue->capacity = capacity;
+    queue->shards = apr_pcalloc(p, nshards * sizeof(fd_queue_t *));
+    for (i = 0; i < nshards; ++i) {
+        rv = ap_queue_create(&queue->shards[i], capacity / nshards + 1, p);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    queue->nshards = nshards;
+
+    *pqueue = queue;
+    return APR_SUCCESS;
+}
+
+/**
+ * Push a new socket onto the queue.  For a work stealing queue it goes to
+ * the shard of a parked worker, which is then the one woken up, or else to
+ * the next shard in turn (a worker still running will look at all the
+ * shards before parking).
+ *
+ * precondition: ap_queue_info_wait_for_idler has already been called
+ *               to reserve an idle worker thread, or for a work stealing
+ *               queue ap_queue_{try_get,wait_for}_room() found some room
+ */
+apr_status_t ap_queue_push_socket(fd_queue_t *queue,
+                                  apr_socket_t *sd, void *sd_baton,
+                                  apr_pool_t *p)
+{
+    unsigned int i, n;
+
+    if (!queue->nshards) {
+        return queue_push_socket(queue, sd, sd_baton, p);
+    }
+
+    AP_DEBUG_ASSERT(!queue->terminated);
+
+    n = apr_atomic_inc32(&queue->next_shard) % queue->nshards;
+    if (apr_atomic_read32(&queue->waiters)) {
+        for (i = 0; i < queue->nshards; ++i) {
+            unsigned int k = (n + i) % queue->nshards;
+            if (apr_atomic_read32(&queue->shards[k]->waiters)) {
+                n = k;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < queue->nshards; ++i) {
+        fd_queue_t *shard = queue->shards[(n + i) % queue->nshards];
+        if (queue_trypush_socket(shard, sd, sd_baton, p) == APR_SUCCESS) {
+            apr_atomic_inc32(&queue->nqueued);
+            return shards_wakeup(queue, n);
+        }
+    }
+
+    /* all full, the caller did not check for room */
+    AP_DEBUG_ASSERT(0);
+    return APR_EAGAIN;
+}
+
+apr_status_t ap_queue_try_get_room(fd_queue_t *queue)
+{
+    AP_DEBUG_ASSERT(queue->nshards);
+
+    /* Only the listener pushes sockets, so the room found here can't be
+     * taken by someone else before its push.
+     */
+    if (apr_atomic_read32(&queue->nqueued) >= queue->capacity) {
+        return APR_EAGAIN;
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t ap_queue_wait_for_room(fd_queue_t *queue, int *had_to_block)
+{
+    apr_status_t rv;
+
+    if (ap_queue_try_get_room(queue) == APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+
+    if ((rv = apr_thread_mutex_lock(queue->one_big_mutex)) != APR_SUCCESS) {
+        return rv;
+    }
+    /* Flag ourself (full barrier) before re-checking, see shards_room() */
+    apr_atomic_xchg32(&queue->room_waiter, 1);
+    while (apr_atomic_read32(&queue->nqueued) >= queue->capacity
+           && !queue->room_terminated) {
+        if (had_to_block) {
+            *had_to_block = 1;
+        }
+        rv = apr_thread_cond_wait(queue->not_full, queue->one_big_mutex);
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+    }
+    apr_atomic_set32(&queue->room_waiter, 0);
+    if (rv == APR_SUCCESS && queue->room_terminated) {
+        rv = APR_EOF;
+    }
+    apr_thread_mutex_unlock(queue->one_big_mutex);
+
+    return rv;
+}
+
+apr_status_t ap_queue_interrupt_room(fd_queue_t *queue)
+{
+    apr_status_t rv;
+
+    if (!queue->nshards) {
+        return APR_SUCCESS;
+    }
+    if ((rv = apr_thread_mutex_lock(queue->one_big_mutex)) != APR_SUCCESS) {
+        return rv;
+    }
+    queue->room_terminated = 1;
+    apr_thread_cond_broadcast(queue->not_full);
+    return apr_thread_mutex_unlock(queue->one_big_mutex);
+}
+
+apr_uint32_t ap_queue_num_idlers(fd_queue_t *queue)
+{
+    apr_uint32_t idlers = apr_atomic_read32(&queue->idlers),
+                 nqueued = apr_atomic_read32(&queue->nqueued);
+
+    return (idlers > nqueued) ? idlers - nqueued : 0;
+}
+
+/**
+ * A socket was popped from a shard, wake up the listener if it's waiting
+ * for room.
+ */
+static void shards_room(fd_queue_t *queue)
+{
+    apr_atomic_dec32(&queue->nqueued);
+    if (apr_atomic_read32(&queue->room_waiter)) {
+        if (apr_thread_mutex_lock(queue->one_big_mutex) == APR_SUCCESS) {
+            apr_thread_cond_signal(queue->not_full);
+            apr_thread_mutex_unlock(queue->one_big_mutex);
+        }
+    }
+}
+
+apr_status_t ap_queue_pop_something(fd_queue_t *queue,
+                                    apr_socket_t **sd, void **sd_baton,
+                                    apr_pool_t **p, timer_event_t **te_out)
+{
+    return ap_queue_pop_something_ex(queue, 0, sd, sd_baton, p, te_out);
+}
+
+static apr_status_t shards_pop_something(fd_queue_t *queue,
+                                         unsigned int shard,
+                                         apr_socket_t **sd, void **sd_baton,
+                                         apr_pool_t **p,
+                                         timer_event_t **te_out)
+{
+    fd_queue_t *own = queue->shards[shard % queue->nshards];
+    apr_status_t rv;
+    unsigned int i;
+    int interrupted = 0;
+
+    for (;;) {
+        if (te_out && apr_atomic_read32(&queue->ntimers)
+                && queue_pop_timer(queue, te_out, &rv)) {
+            return rv;
+        }
+
+        for (i = 0; i < queue->nshards; ++i) {
+            fd_queue_t *q = queue->shards[(shard + i) % queue->nshards];
+            if (queue_trypop_socket(q, sd, sd_baton, p) == APR_SUCCESS) {
+                shards_room(queue);
+                if (te_out) {
+                    *te_out = NULL;
+                }
+                return APR_SUCCESS;
+            }
+        }
+
+        /* Woken up (or terminated) and still nothing for us */
+        if (interrupted) {
+            return queue->terminated ? APR_EOF : APR_EINTR;
+        }
+
+        /* Park on our shard, see shards_wakeup() */
+        rv = apr_thread_mutex_lock(own->one_big_mutex);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        apr_atomic_set32(&own->waiters, 1);
+        apr_atomic_inc32(&queue->waiters);
+        if (!apr_atomic_read32(&queue->nqueued)
+                && (!te_out || !apr_atomic_read32(&queue->ntimers))) {
+            if (!queue->terminated) {
+                apr_thread_cond_wait(own->not_empty, own->one_big_mutex);
+            }
+            interrupted = 1;
+        }
+        if (apr_atomic_cas32(&own->waiters, 0, 1) == 1) {
+            /* not claimed by a wakeup */
+            apr_atomic_dec32(&queue->waiters);
+        }
+        rv = apr_thread_mutex_unlock(own->one_big_mutex);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+}
+
+/**
+ * Same as ap_queue_pop_something(), but for a work stealing queue the
+ * given (local) shard is tried first, then the following ones, all
+ * lock-free.  The worker parks on its own shard when they are all empty,
+ * so each shard must be popped by a single thread.  The worker counts as
+ * idle (ap_queue_num_idlers()) meanwhile.
+ */
+apr_status_t ap_queue_pop_something_ex(fd_queue_t *queue, unsigned int shard,
+                                       apr_socket_t **sd, void **sd_baton,
+                                       apr_pool_t **p, timer_event_t **te_out)
+{
+    apr_status_t rv;
+
+    if (!queue->nshards) {
+        return queue_pop_something(queue, sd, sd_baton, p, te_out);
+    }
+
+    apr_atomic_inc32(&queue->idlers);
+    rv = shards_pop_something(queue, shard, sd, sd_baton, p, te_out);
+    apr_atomic_dec32(&queue->idlers);
+
+    return rv;
+}
+
+#else /* AP_FDQUEUE_LOCKFREE */
+
+/**
+ * Detects when the fd_queue_t is full. This utility function is expected
+ * to be called from within critical sections, and is not threadsafe.
+ */
+#define ap_queue_full(queue) ((queue)->nelts == (queue)->bounds)
+
+/**
+ * Detects when the fd_queue_t is empty. This utility function is expected
+ * to be called from within critical sections, and is not threadsafe.
+ */
+#define ap_queue_empty(queue) ((queue)->nelts == 0 && \
+                               APR_RING_EMPTY(&queue->timers, \
+                                              timer_event_t, link))
+
 /**
  * Initialize the fd_queue_t.
  */
@@ -489,6 +1060,44 @@ apr_status_t ap_queue_pop_something(fd_queue_t *queue,
     return apr_thread_mutex_unlock(queue->one_big_mutex);
 }
 
+/**
+ * Work stealing needs the lock-free shards, a plain queue is used here.
+ */
+apr_status_t ap_queue_create_sharded(fd_queue_t **pqueue, int capacity,
+                                     int nshards, apr_pool_t *p)
+{
+    return ap_queue_create(pqueue, capacity, p);
+}
+
+apr_status_t ap_queue_pop_something_ex(fd_queue_t *queue, unsigned int shard,
+                                       apr_socket_t **sd, void **sd_baton,
+                                       apr_pool_t **p, timer_event_t **te_out)
+{
+    return ap_queue_pop_something(queue, sd, sd_baton, p, te_out);
+}
+
+apr_status_t ap_queue_try_get_room(fd_queue_t *queue)
+{
+    return APR_ENOTIMPL;
+}
+
+apr_status_t ap_queue_wait_for_room(fd_queue_t *queue, int *had_to_block)
+{
+    return APR_ENOTIMPL;
+}
+
+apr_status_t ap_queue_interrupt_room(fd_queue_t *queue)
+{
+    return APR_SUCCESS;
+}
+
+apr_uint32_t ap_queue_num_idlers(fd_queue_t *queue)
+{
+    return 0;
+}
+
+#endif /* AP_FDQUEUE_LOCKFREE */
+
 static apr_status_t queue_interrupt(fd_queue_t *queue, int all, int term)
 {
     apr_status_t rv;
@@ -509,7 +1118,27 @@ static apr_status_t queue_interrupt(fd_queue_t *queue, int all, int term)
     else
         apr_thread_cond_signal(queue->not_empty);
 
-    return apr_thread_mutex_unlock(queue->one_big_mutex);
+    rv = apr_thread_mutex_unlock(queue->one_big_mutex);
+
+#ifdef AP_FDQUEUE_LOCKFREE
+    /* Work stealing workers are parked on their own shard */
+    if (rv == APR_SUCCESS && queue->nshards) {
+        unsigned int i;
+        if (!all) {
+            return shards_wakeup(queue, 0);
+        }
+        for (i = 0; i < queue->nshards && rv == APR_SUCCESS; ++i) {
+            fd_queue_t *shard = queue->shards[i];
+            if ((rv = apr_thread_mutex_lock(shard->one_big_mutex))
+                    == APR_SUCCESS) {
+                apr_thread_cond_broadcast(shard->not_empty);
+                rv = apr_thread_mutex_unlock(shard->one_big_mutex);
+            }
+        }
+    }
+#endif
+
+    return rv;
 }
 
 apr_status_t ap_queue_interrupt_all(fd_queue_t *queue)
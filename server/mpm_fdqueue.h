@@ -73,6 +73,45 @@ struct timer_event_t
 };
 typedef struct timer_event_t timer_event_t;
 
+#ifndef AP_FDQUEUE_CACHELINE
+#define AP_FDQUEUE_CACHELINE 64
+#endif
+
+#ifdef AP_FDQUEUE_LOCKFREE
+/* Lock-free variant (--enable-lockfree-fdqueue): sockets go through a
+ * bounded multi-producer/multi-consumer ring where each slot carries a
+ * sequence number, so push and pop only contend on one CAS each.  The
+ * mutex/condvar pair is used for timers and to park idle workers only.
+ * The producer and consumer indexes live on separate cache lines.
+ */
+struct fd_queue_t
+{
+    APR_RING_HEAD(timers_t, timer_event_t) timers;
+    fd_queue_elem_t *data;
+    unsigned int bounds;
+    apr_uint32_t mask;
+    apr_uint32_t volatile ntimers;
+    apr_uint32_t volatile waiters;
+    apr_thread_mutex_t *one_big_mutex;
+    apr_thread_cond_t *not_empty;
+    int terminated;
+    /* Work stealing (ap_queue_create_sharded()) */
+    struct fd_queue_t **shards;         /* local queues */
+    unsigned int nshards;
+    apr_uint32_t volatile next_shard;   /* round-robin push */
+    apr_uint32_t volatile nqueued;      /* sockets in all the shards */
+    apr_uint32_t volatile idlers;       /* workers popping from the shards */
+    apr_uint32_t capacity;              /* max nqueued for the listener */
+    apr_uint32_t volatile room_waiter;  /* listener in wait_for_room() */
+    apr_thread_cond_t *not_full;
+    int room_terminated;
+    char pad_in[AP_FDQUEUE_CACHELINE];
+    apr_uint32_t volatile in;
+    char pad_out[AP_FDQUEUE_CACHELINE - sizeof(apr_uint32_t)];
+    apr_uint32_t volatile out;
+    char pad_end[AP_FDQUEUE_CACHELINE - sizeof(apr_uint32_t)];
+};
+#else
 struct fd_queue_t
 {
     APR_RING_HEAD(timers_t, timer_event_t) timers;
@@ -85,10 +124,20 @@ struct fd_queue_t
     apr_thread_cond_t *not_empty;
     int terminated;
 };
+#endif /* AP_FDQUEUE_LOCKFREE */
 typedef struct fd_queue_t fd_queue_t;
 
 AP_DECLARE(apr_status_t) ap_queue_create(fd_queue_t **pqueue,
                                          int capacity, apr_pool_t *p);
+/* Create a queue made of nshards local queues, sockets are pushed to the
+ * one of a parked worker (or else in turn) and ap_queue_pop_something_ex()
+ * pops from the given shard first, then steals from the others.  Each shard
+ * must be popped by a single thread.  Timers are not sharded.  The shards
+ * are lock-free, so without AP_FDQUEUE_LOCKFREE this creates a plain queue.
+ */
+AP_DECLARE(apr_status_t) ap_queue_create_sharded(fd_queue_t **pqueue,
+                                                 int capacity, int nshards,
+                                                 apr_pool_t *p);
 AP_DECLARE(apr_status_t) ap_queue_push_socket(fd_queue_t *queue,
                                               apr_socket_t *sd, void *sd_baton,
                                               apr_pool_t *p);
@@ -97,6 +146,23 @@ AP_DECLARE(apr_status_t) ap_queue_push_timer(fd_queue_t *queue,
 AP_DECLARE(apr_status_t) ap_queue_pop_something(fd_queue_t *queue,
                                                 apr_socket_t **sd, void **sd_baton,
                                                 apr_pool_t **p, timer_event_t **te);
+AP_DECLARE(apr_status_t) ap_queue_pop_something_ex(fd_queue_t *queue,
+                                                   unsigned int shard,
+                                                   apr_socket_t **sd,
+                                                   void **sd_baton,
+                                                   apr_pool_t **p,
+                                                   timer_event_t **te);
+/* For a work stealing queue the (single) listener does not reserve an
+ * idler before pushing a socket, it only needs room in the shards, that
+ * is less than the capacity queued.  The idle workers are then those
+ * popping from the shards, less the sockets queued.  Without
+ * AP_FDQUEUE_LOCKFREE these are not implemented.
+ */
+AP_DECLARE(apr_status_t) ap_queue_try_get_room(fd_queue_t *queue);
+AP_DECLARE(apr_status_t) ap_queue_wait_for_room(fd_queue_t *queue,
+                                                int *had_to_block);
+AP_DECLARE(apr_status_t) ap_queue_interrupt_room(fd_queue_t *queue);
+AP_DECLARE(apr_uint32_t) ap_queue_num_idlers(fd_queue_t *queue);
 #define                  ap_queue_pop_socket(q_, s_, p_) \
                             ap_queue_pop_something((q_), (s_), NULL, (p_), NULL)
 
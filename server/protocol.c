@@ -1062,7 +1062,7 @@ AP_DECLARE(int) ap_check_request_header(request_rec *r)
 
     if ((!r->hostname && (r->proto_num >= HTTP_VERSION(1, 1)))
         || ((r->proto_num == HTTP_VERSION(1, 1))
-            && !apr_table_get(r->headers_in, "Host"))) {
+            && !ap_request_header_in(r, AP_HEADER_HOST))) {
         /*
          * Client sent us an HTTP/1.1 or later request without telling us the
          * hostname, either with a full URL or a Host: header. We therefore
@@ -1080,7 +1080,7 @@ AP_DECLARE(int) ap_check_request_header(request_rec *r)
     /* we may have switched to another server */
     conf = ap_get_core_module_config(r->server->module_config);
 
-    if (((expect = apr_table_get(r->headers_in, "Expect")) != NULL)
+    if (((expect = ap_request_header_in(r, AP_HEADER_EXPECT)) != NULL)
         && (expect[0] != '\0')) {
         /*
          * The Expect header field was added to HTTP/1.1 after RFC 2068
@@ -1379,6 +1379,9 @@ AP_DECLARE(void) ap_get_mime_headers_core(request_rec *r, apr_bucket_brigade *bb
 
     /* enforce LimitRequestFieldSize for merged headers */
     apr_table_do(table_do_fn_check_lengths, r, r->headers_in, NULL);
+
+    /* So that the lookups of (well known) headers are O(1) from now */
+    ap_request_table_index(r, r->headers_in);
 }
 
 AP_DECLARE(void) ap_get_mime_headers(request_rec *r)
@@ -1519,7 +1522,7 @@ request_rec *ap_read_request(conn_rec *conn)
             goto die_unusable_input;
         }
 
-        clen = apr_table_get(r->headers_in, "Content-Length");
+        clen = ap_request_header_in(r, AP_HEADER_CONTENT_LENGTH);
         if (clen) {
             apr_off_t cl;
 
@@ -1532,7 +1535,7 @@ request_rec *ap_read_request(conn_rec *conn)
             }
         }
 
-        tenc = apr_table_get(r->headers_in, "Transfer-Encoding");
+        tenc = ap_request_header_in(r, AP_HEADER_TRANSFER_ENCODING);
         if (tenc) {
             /* https://tools.ietf.org/html/rfc7230
              * Section 3.3.3.3: "If a Transfer-Encoding header field is
@@ -1686,8 +1689,8 @@ AP_DECLARE(void) ap_set_sub_req_protocol(request_rec *rnew,
     /* did the original request have a body?  (e.g. POST w/SSI tags)
      * if so, make sure the subrequest doesn't inherit body headers
      */
-    if (!r->kept_body && (apr_table_get(r->headers_in, "Content-Length")
-        || apr_table_get(r->headers_in, "Transfer-Encoding"))) {
+    if (!r->kept_body && (ap_request_header_in(r, AP_HEADER_CONTENT_LENGTH)
+        || ap_request_header_in(r, AP_HEADER_TRANSFER_ENCODING))) {
         strip_headers_request_body(rnew);
     }
     rnew->subprocess_env  = apr_table_copy(rnew->pool, r->subprocess_env);
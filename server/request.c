@@ -26,8 +26,13 @@
  */
 
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "apr_file_io.h"
 #include "apr_fnmatch.h"
+#include "apr_hash.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -501,6 +506,361 @@ static walk_cache_t *prep_walk_cache(apr_size_t t, request_rec *r)
     return cache;
 }
 
+/* Process-wide cache of the ap_merge_per_dir_configs() results
+ * (MergeConfigCache), shared by all the requests of a child.
+ *
+ * Merging is a pure function of its two configs, so it can be cached
+ * by their addresses provided that they stay valid for the lifetime of
+ * the cache (pconf) and are never reused for another config.  That's the
+ * case for the vhosts' defaults and <Directory>, <Location>, <Files> and
+ * <If> sections, and for the merged results themselves, which are allocated
+ * from the cache's pool.  Anything else (e.g. .htaccess configs, allocated
+ * from r->pool) is merged as usual, so are the merges derived from them.
+ */
+typedef struct merge_cache_key {
+    const ap_conf_vector_t *base;
+    const ap_conf_vector_t *new_conf;
+} merge_cache_key;
+
+typedef struct merge_cache_t {
+    apr_pool_t *pool;
+    apr_hash_t *merged;     /* merge_cache_key => merged ap_conf_vector_t */
+    apr_hash_t *stable;     /* long-lived ap_conf_vector_t set */
+#if APR_HAS_THREADS
+    apr_thread_rwlock_t *lock;
+#endif
+    int count;
+    int size;
+} merge_cache_t;
+
+static merge_cache_t *merge_cache = NULL;
+
+static apr_status_t merge_cache_cleanup(void *dummy)
+{
+    merge_cache = NULL;
+    return APR_SUCCESS;
+}
+
+static void merge_cache_add_stable(merge_cache_t *mc, ap_conf_vector_t *conf)
+{
+    core_dir_config *dconf;
+    int i;
+
+    if (!conf || apr_hash_get(mc->stable, &conf, sizeof(conf))) {
+        return;
+    }
+    apr_hash_set(mc->stable, apr_pmemdup(mc->pool, &conf, sizeof(conf)),
+                 sizeof(conf), conf);
+
+    /* Nested <If>s */
+    dconf = ap_get_core_module_config(conf);
+    if (dconf && dconf->sec_if) {
+        for (i = 0; i < dconf->sec_if->nelts; ++i) {
+            merge_cache_add_stable(mc, ((ap_conf_vector_t **)
+                                        dconf->sec_if->elts)[i]);
+        }
+    }
+}
+
+static void merge_cache_add_sections(merge_cache_t *mc,
+                                     apr_array_header_t *sec)
+{
+    int i;
+
+    if (sec) {
+        for (i = 0; i < sec->nelts; ++i) {
+            merge_cache_add_stable(mc, ((ap_conf_vector_t **)sec->elts)[i]);
+        }
+    }
+}
+
+AP_DECLARE(void) ap_setup_merge_cache(apr_pool_t *pconf, server_rec *s,
+                                      int size)
+{
+    merge_cache_t *mc;
+
+    merge_cache = NULL;
+    if (size <= 0) {
+        return;
+    }
+
+    mc = apr_pcalloc(pconf, sizeof(*mc));
+    apr_pool_create(&mc->pool, pconf);
+    apr_pool_tag(mc->pool, "merge_cache");
+#if APR_HAS_THREADS
+    if (apr_thread_rwlock_create(&mc->lock, pconf) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(10265)
+                     "MergeConfigCache: can't create the lock, disabled");
+        return;
+    }
+#endif
+    mc->merged = apr_hash_make(mc->pool);
+    mc->stable = apr_hash_make(mc->pool);
+    mc->size = size;
+
+    for (; s; s = s->next) {
+        core_server_config *sconf =
+            ap_get_core_module_config(s->module_config);
+
+        merge_cache_add_stable(mc, s->lookup_defaults);
+        merge_cache_add_sections(mc, sconf->sec_dir);
+        merge_cache_add_sections(mc, sconf->sec_url);
+        merge_cache_add_sections(mc, sconf->sec_file);
+    }
+
+    apr_pool_cleanup_register(pconf, NULL, merge_cache_cleanup,
+                              apr_pool_cleanup_null);
+    merge_cache = mc;
+}
+
+/* ap_merge_per_dir_configs(), through the MergeConfigCache if possible */
+static ap_conf_vector_t *merge_dir_configs(request_rec *r,
+                                           ap_conf_vector_t *base,
+                                           ap_conf_vector_t *new_conf)
+{
+    merge_cache_t *mc = merge_cache;
+    merge_cache_key key, *pkey;
+    ap_conf_vector_t *merged;
+    int cacheable;
+
+    if (!mc) {
+        return ap_merge_per_dir_configs(r->pool, base, new_conf);
+    }
+
+    key.base = base;
+    key.new_conf = new_conf;
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(mc->lock);
+#endif
+    merged = apr_hash_get(mc->merged, &key, sizeof(key));
+    cacheable = (!merged
+                 && mc->count < mc->size
+                 && apr_hash_get(mc->stable, &base, sizeof(base))
+                 && apr_hash_get(mc->stable, &new_conf, sizeof(new_conf)));
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(mc->lock);
+#endif
+    if (merged) {
+        return merged;
+    }
+    if (!cacheable) {
+        return ap_merge_per_dir_configs(r->pool, base, new_conf);
+    }
+
+    /* Merge into the cache's pool, under the write lock */
+#if APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(mc->lock);
+#endif
+    merged = apr_hash_get(mc->merged, &key, sizeof(key));
+    if (!merged) {
+        merged = ap_merge_per_dir_configs(mc->pool, base, new_conf);
+        pkey = apr_pmemdup(mc->pool, &key, sizeof(key));
+        apr_hash_set(mc->merged, pkey, sizeof(*pkey), merged);
+        merge_cache_add_stable(mc, merged);
+        mc->count++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(mc->lock);
+#endif
+
+    return merged;
+}
+
+/*****************************************************************
+ *
+ * Prefix trie of the <Location > sections of a server, so that
+ * ap_location_walk() finds the plain (non regex, non fnmatch) sections
+ * matching an URI in time proportional to the URI length rather than to
+ * the number of sections.  The other sections are still tested one by one,
+ * in configuration order with the matched ones, so the merge order is
+ * unchanged.
+ */
+
+/* Below this number of plain sections the linear scan is as fast */
+#define LOCATION_TRIE_MIN 16
+
+typedef struct location_trie_node location_trie_node;
+
+typedef struct {
+    char c;
+    location_trie_node *child;
+} location_trie_child;
+
+/* Like the filters' trie, children are kept sorted for binary search */
+struct location_trie_node {
+    location_trie_child *children;
+    int nchildren;
+    int size;
+    apr_array_header_t *secs;   /* indexes of the sections ending here */
+};
+
+struct ap_location_trie {
+    location_trie_node root;
+    apr_array_header_t *others; /* indexes of the sections to test */
+};
+
+static location_trie_node *location_trie_child_get(location_trie_node *node,
+                                                   char c)
+{
+    int lo = 0, hi = node->nchildren - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        char mc = node->children[mid].c;
+        if (c == mc) {
+            return node->children[mid].child;
+        }
+        if (c < mc) {
+            hi = mid - 1;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static location_trie_node *location_trie_child_add(apr_pool_t *p,
+                                                   location_trie_node *node,
+                                                   char c)
+{
+    location_trie_node *child;
+    int i;
+
+    if (node->nchildren == node->size) {
+        location_trie_child *children;
+        node->size = node->size ? node->size * 2 : 2;
+        children = apr_palloc(p, node->size * sizeof(*children));
+        if (node->nchildren) {
+            memcpy(children, node->children,
+                   node->nchildren * sizeof(*children));
+        }
+        node->children = children;
+    }
+    for (i = node->nchildren; i > 0 && node->children[i - 1].c > c; --i) {
+        node->children[i] = node->children[i - 1];
+    }
+    child = apr_pcalloc(p, sizeof(*child));
+    node->children[i].c = c;
+    node->children[i].child = child;
+    node->nchildren++;
+
+    return child;
+}
+
+AP_DECLARE(void) ap_setup_location_trie(apr_pool_t *pconf, server_rec *s)
+{
+    for (; s; s = s->next) {
+        core_server_config *sconf =
+            ap_get_core_module_config(s->module_config);
+        ap_conf_vector_t **sec_ent = (ap_conf_vector_t **)sconf->sec_url->elts;
+        int num_sec = sconf->sec_url->nelts;
+        struct ap_location_trie *trie;
+        int sec_idx, nplain = 0;
+
+        sconf->sec_url_trie = NULL;
+        for (sec_idx = 0; sec_idx < num_sec; ++sec_idx) {
+            core_dir_config *entry_core;
+            entry_core = ap_get_core_module_config(sec_ent[sec_idx]);
+            if (!entry_core->r && !entry_core->d_is_fnmatch) {
+                nplain++;
+            }
+        }
+        if (nplain < LOCATION_TRIE_MIN) {
+            continue;
+        }
+
+        trie = apr_pcalloc(pconf, sizeof(*trie));
+        trie->others = apr_array_make(pconf, num_sec - nplain + 1,
+                                      sizeof(int));
+        for (sec_idx = 0; sec_idx < num_sec; ++sec_idx) {
+            core_dir_config *entry_core;
+            location_trie_node *node, *child;
+            const char *d;
+
+            entry_core = ap_get_core_module_config(sec_ent[sec_idx]);
+            if (entry_core->r || entry_core->d_is_fnmatch) {
+                APR_ARRAY_PUSH(trie->others, int) = sec_idx;
+                continue;
+            }
+
+            node = &trie->root;
+            for (d = entry_core->d; *d; ++d) {
+                child = location_trie_child_get(node, *d);
+                if (!child) {
+                    child = location_trie_child_add(pconf, node, *d);
+                }
+                node = child;
+            }
+            if (!node->secs) {
+                node->secs = apr_array_make(pconf, 1, sizeof(int));
+            }
+            APR_ARRAY_PUSH(node->secs, int) = sec_idx;
+        }
+        sconf->sec_url_trie = trie;
+    }
+}
+
+/* Returns the indexes (in ascending order) of the plain sections matching
+ * the uri, merged with the ones of the sections to test.
+ */
+static int *location_trie_walk(request_rec *r, struct ap_location_trie *trie,
+                               const char *uri, int *nidx)
+{
+    apr_array_header_t *matched;
+    location_trie_node *node = &trie->root;
+    const int *others = (const int *)trie->others->elts;
+    int nothers = trie->others->nelts;
+    int *m, *idx, i, j, k, n;
+    apr_size_t len = 0;
+
+    matched = apr_array_make(r->pool, 8, sizeof(int));
+    for (;;) {
+        /* The same tests as ap_location_walk() for the sections ending at
+         * this depth: the uri must be slash terminated (or at its end)
+         * unless the section is.
+         */
+        if (node->secs
+                && (len == 0
+                    || uri[len - 1] == '/'
+                    || uri[len] == '/'
+                    || uri[len] == '\0')) {
+            for (i = 0; i < node->secs->nelts; ++i) {
+                APR_ARRAY_PUSH(matched, int) = APR_ARRAY_IDX(node->secs, i,
+                                                             int);
+            }
+        }
+        if (!uri[len] || !(node = location_trie_child_get(node, uri[len]))) {
+            break;
+        }
+        len++;
+    }
+
+    /* Shallower sections may come later in the config, sort (few) */
+    m = (int *)matched->elts;
+    n = matched->nelts;
+    for (i = 1; i < n; ++i) {
+        int v = m[i];
+        for (j = i; j > 0 && m[j - 1] > v; --j) {
+            m[j] = m[j - 1];
+        }
+        m[j] = v;
+    }
+
+    idx = apr_palloc(r->pool, (n + nothers + 1) * sizeof(int));
+    for (i = j = k = 0; i < n || j < nothers; ) {
+        if (j >= nothers || (i < n && m[i] < others[j])) {
+            idx[k++] = m[i++];
+        }
+        else {
+            idx[k++] = others[j++];
+        }
+    }
+    *nidx = k;
+    return idx;
+}
+
 /*****************************************************************
  *
  * Getting and checking directory configuration.  Also checks the
@@ -1052,9 +1412,8 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                 }
 
                 if (now_merged) {
-                    now_merged = ap_merge_per_dir_configs(r->pool,
-                                                          now_merged,
-                                                          sec_ent[sec_idx]);
+                    now_merged = merge_dir_configs(r, now_merged,
+                                                   sec_ent[sec_idx]);
                 }
                 else {
                     now_merged = sec_ent[sec_idx];
@@ -1122,9 +1481,8 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                 }
 
                 if (now_merged) {
-                    now_merged = ap_merge_per_dir_configs(r->pool,
-                                                          now_merged,
-                                                          htaccess_conf);
+                    now_merged = merge_dir_configs(r, now_merged,
+                                                   htaccess_conf);
                 }
                 else {
                     now_merged = htaccess_conf;
@@ -1361,9 +1719,8 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx]);
             }
             else {
                 now_merged = sec_ent[sec_idx];
@@ -1440,9 +1797,8 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1498,7 +1854,8 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
         /* We start now_merged from NULL since we want to build
          * a locations list that can be merged to any vhost.
          */
-        int len, sec_idx;
+        int len, sec_idx, idx_pos, num_idx = num_sec;
+        int *sec_idxs = NULL;
         int matches = cache->walked->nelts;
         int cached_matches = matches;
         walk_walked_t *last_walk = (walk_walked_t*)cache->walked->elts;
@@ -1507,13 +1864,22 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
         cached &= auth_internal_per_conf;
         cache->cached = apr_pstrdup(r->pool, entry_uri);
 
+        /* With many plain sections, get the ones matching from the trie,
+         * along with the ones we still have to test.
+         */
+        if (sconf->sec_url_trie) {
+            sec_idxs = location_trie_walk(r, sconf->sec_url_trie,
+                                          cache->cached, &num_idx);
+        }
+
         /* Go through the location entries, and check for matches.
          * We apply the directive sections in given order, we should
          * really try them with the most general first.
          */
-        for (sec_idx = 0; sec_idx < num_sec; ++sec_idx) {
+        for (idx_pos = 0; idx_pos < num_idx; ++idx_pos) {
 
             core_dir_config *entry_core;
+            sec_idx = sec_idxs ? sec_idxs[idx_pos] : idx_pos;
             entry_core = ap_get_core_module_config(sec_ent[sec_idx]);
 
             /* ### const strlen can be optimized in location config parsing */
@@ -1555,7 +1921,7 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
                 }
 
             }
-            else {
+            else if (!sec_idxs || entry_core->d_is_fnmatch) {
 
                 if ((entry_core->d_is_fnmatch
                    ? apr_fnmatch(entry_core->d, cache->cached, APR_FNM_PATHNAME)
@@ -1568,6 +1934,7 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
                 }
 
             }
+            /* else a plain section matched by the trie */
 
             /* If we merged this same section last time, reuse it
              */
@@ -1588,9 +1955,8 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx]);
             }
             else {
                 now_merged = sec_ent[sec_idx];
@@ -1631,9 +1997,8 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1785,9 +2150,8 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx]);
             }
             else {
                 now_merged = sec_ent[sec_idx];
@@ -1828,9 +2192,8 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1921,9 +2284,7 @@ static int ap_if_walk_sub(request_rec *r, core_dir_config* dconf)
         }
 
         if (now_merged) {
-            now_merged = ap_merge_per_dir_configs(r->pool,
-                                                  now_merged,
-                                                  sec_ent[sec_idx]);
+            now_merged = merge_dir_configs(r, now_merged, sec_ent[sec_idx]);
         }
         else {
             now_merged = sec_ent[sec_idx];
@@ -1959,9 +2320,8 @@ static int ap_if_walk_sub(request_rec *r, core_dir_config* dconf)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -2560,3 +2920,365 @@ AP_DECLARE(int) ap_is_initial_req(request_rec *r)
            && (r->prev == NULL);   /* otherwise, this is an internal redirect */
 }
 
+
+/*
+ * Per-request memo of the (header, environment) variables looked up by
+ * the expression and rewrite engines, and the core.
+ *
+ * The variable names are interned into ids, statically for the well known
+ * header names (ap_header_id_e) and at config time for the others, each
+ * request then has a lazily allocated vector of memo entries indexed by
+ * id.  An entry remembers where in the table the value was found, along
+ * with a snapshot of the table's array (base, count and last entry, which
+ * is where additions go), so that any change to the table since (add,
+ * set, merge, unset or clear) is noticed in O(1) and the value looked up
+ * again.
+ *
+ * Tables with many lookups (headers_in) can rather be indexed as a whole
+ * (ap_request_table_index()): one pass records where each variable of the
+ * table is, under a single snapshot, so that any variable is then found
+ * (or known to be missing) in O(1), and the pass is redone only when the
+ * table changed.
+ */
+typedef struct request_var_memo_entry request_var_memo_entry;
+struct request_var_memo_entry {
+    request_var_memo_entry *next;       /* the same variable in other tables */
+    const apr_table_t *t;
+    const apr_table_entry_t *elts;
+    int nelts;
+    const char *last_key;
+    const char *last_val;
+    int idx;                            /* where val was found, or -1 */
+    const char *key;
+    const char *val;
+};
+
+typedef struct {
+    const char *key;                    /* NULL if not in the table */
+    int idx;
+} request_table_slot;
+
+typedef struct request_table_index request_table_index;
+struct request_table_index {
+    request_table_index *next;
+    const apr_table_t *t;
+    const apr_table_entry_t *elts;
+    int nelts;
+    const char *last_key;
+    const char *last_val;
+    request_table_slot *slots;          /* by id, the first entry */
+};
+
+struct ap_request_var_memo {
+    int nids;
+    request_var_memo_entry **ids;
+    request_table_index *indexes;
+};
+
+#define REQUEST_VAR_NAME_MAX 128
+
+static apr_hash_t *request_var_ids;
+static int request_var_count = AP_HEADER__COUNT;
+
+/* The well known header names, by ap_header_id_e */
+static const struct {
+    const char *name;
+    apr_size_t len;
+} request_headers[AP_HEADER__COUNT] = {
+    { "Accept", 6 },
+    { "Accept-Charset", 14 },
+    { "Accept-Encoding", 15 },
+    { "Accept-Language", 15 },
+    { "Accept-Ranges", 13 },
+    { "Age", 3 },
+    { "Allow", 5 },
+    { "Authorization", 13 },
+    { "Cache-Control", 13 },
+    { "Connection", 10 },
+    { "Content-Disposition", 19 },
+    { "Content-Encoding", 16 },
+    { "Content-Language", 16 },
+    { "Content-Length", 14 },
+    { "Content-Location", 16 },
+    { "Content-Range", 13 },
+    { "Content-Type", 12 },
+    { "Cookie", 6 },
+    { "Date", 4 },
+    { "ETag", 4 },
+    { "Expect", 6 },
+    { "Expires", 7 },
+    { "Forwarded", 9 },
+    { "Host", 4 },
+    { "If-Match", 8 },
+    { "If-Modified-Since", 17 },
+    { "If-None-Match", 13 },
+    { "If-Range", 8 },
+    { "If-Unmodified-Since", 19 },
+    { "Keep-Alive", 10 },
+    { "Last-Modified", 13 },
+    { "Location", 8 },
+    { "Max-Forwards", 12 },
+    { "Origin", 6 },
+    { "Pragma", 6 },
+    { "Proxy-Authenticate", 18 },
+    { "Proxy-Authorization", 19 },
+    { "Range", 5 },
+    { "Referer", 7 },
+    { "Retry-After", 11 },
+    { "Server", 6 },
+    { "Set-Cookie", 10 },
+    { "TE", 2 },
+    { "Trailer", 7 },
+    { "Transfer-Encoding", 17 },
+    { "Upgrade", 7 },
+    { "User-Agent", 10 },
+    { "Vary", 4 },
+    { "Via", 3 },
+    { "WWW-Authenticate", 16 },
+    { "X-Forwarded-For", 15 },
+    { "X-Forwarded-Host", 16 },
+    { "X-Forwarded-Proto", 17 },
+    { "X-Requested-With", 16 },
+};
+
+/* Static perfect hash of request_headers: the slot of a name (not empty)
+ * is REQUEST_HEADER_HASH() of its first, middle and last characters and
+ * length, case insensitively, where request_header_slots has its id + 1
+ * (0 for none).  The multipliers were searched for these names, a new
+ * one may need others (the unit tests check the table).
+ */
+#define REQUEST_HEADER_FOLD(c) ((unsigned char)(c) | 0x20)
+#define REQUEST_HEADER_HASH(s, len) \
+    ((REQUEST_HEADER_FOLD((s)[0]) * 10 \
+      + REQUEST_HEADER_FOLD((s)[(len) / 2]) * 5 \
+      + REQUEST_HEADER_FOLD((s)[(len) - 1]) * 6 + (len)) & 0xff)
+
+static const unsigned char request_header_slots[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 24, 40, 50,  0, 37,
+     0, 42,  0,  0,  0,  0,  0,  0, 32,  0,  0,  0,  0,  0,  0,  0,
+    39,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  6,  0,
+     0, 46,  0,  0,  0,  0,  0,  0,  0, 47, 33,  0,  3, 14,  0,  0,
+     0,  0, 23,  0,  0, 20,  0,  0, 44,  0,  0,  0,  0,  0,  0, 53,
+     0, 12,  0,  4,  0,  0,  0,  0,  0, 18,  0,  0,  0,  0,  0,  0,
+     0,  0,  9,  0,  0, 28,  0,  0, 13,  0,  5, 10, 52,  0,  0,  0,
+     0,  0,  0,  0, 54,  0,  0, 25,  8,  0,  0, 30,  0,  0, 41,  2,
+     0,  1,  0,  0,  0,  0,  0,  0,  0, 29,  0,  0, 17, 16, 19,  0,
+    27,  0, 11,  0,  0,  0, 26,  0,  0,  0,  0,  0,  0,  0, 15,  0,
+     0,  0,  0,  0,  0, 51,  0,  0,  0, 21,  0,  0,  0,  0,  0, 35,
+    48,  0,  0,  0,  0,  7,  0,  0, 22,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0, 31,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0, 36,  0,  0,  0,  0,  0,  0,  0,
+     0, 43,  0,  0, 45,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0, 49, 34,  0,  0,  0,  0,  0,  0,  0,  0,  0, 38,  0,  0,
+};
+
+static int request_header_id(const char *name, apr_size_t len)
+{
+    int id;
+
+    if (!len) {
+        return -1;
+    }
+    id = (int)request_header_slots[REQUEST_HEADER_HASH(name, len)] - 1;
+    if (id < 0 || request_headers[id].len != len
+            || ap_cstr_casecmpn(request_headers[id].name, name, len)) {
+        return -1;
+    }
+    return id;
+}
+
+/* The id of name if any, without registering it */
+static int request_var_lookup(const char *name, apr_size_t len)
+{
+    char buf[REQUEST_VAR_NAME_MAX];
+    apr_size_t i;
+    int id, *dyn;
+
+    if ((id = request_header_id(name, len)) >= 0) {
+        return id;
+    }
+    if (!request_var_ids || len >= sizeof(buf)) {
+        return -1;
+    }
+    for (i = 0; i < len; ++i) {
+        buf[i] = apr_tolower(name[i]);
+    }
+    dyn = apr_hash_get(request_var_ids, buf, len);
+    return dyn ? *dyn : -1;
+}
+
+AP_DECLARE(int) ap_request_var_id(const char *name)
+{
+    char buf[REQUEST_VAR_NAME_MAX];
+    apr_size_t len = strlen(name), i;
+    int known, *id;
+
+    if ((known = request_header_id(name, len)) >= 0) {
+        return known;
+    }
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    for (i = 0; i < len; ++i) {
+        buf[i] = apr_tolower(name[i]);
+    }
+
+    id = request_var_ids ? apr_hash_get(request_var_ids, buf, len) : NULL;
+    if (id) {
+        return *id;
+    }
+
+    /* The ids are read-only once the MPM runs (e.g. for .htaccess) */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_RUN_MPM) {
+        return -1;
+    }
+    if (!request_var_ids) {
+        request_var_ids = apr_hash_make(ap_pglobal);
+    }
+    id = apr_palloc(ap_pglobal, sizeof(*id));
+    *id = request_var_count++;
+    apr_hash_set(request_var_ids, apr_pstrmemdup(ap_pglobal, buf, len), len,
+                 id);
+    return *id;
+}
+
+static struct ap_request_var_memo *request_var_memo(request_rec *r)
+{
+    struct ap_request_var_memo *memo;
+    core_request_config *req_cfg;
+
+    if (!r->request_config
+            || !(req_cfg = ap_get_core_module_config(r->request_config))) {
+        return NULL;
+    }
+
+    memo = req_cfg->var_memo;
+    if (!memo) {
+        memo = apr_palloc(r->pool, sizeof(*memo));
+        memo->nids = request_var_count;
+        memo->ids = apr_pcalloc(r->pool, memo->nids * sizeof(*memo->ids));
+        memo->indexes = NULL;
+        req_cfg->var_memo = memo;
+    }
+    return memo;
+}
+
+static void request_table_reindex(request_table_index *ix,
+                                  const apr_array_header_t *arr, int nids)
+{
+    const apr_table_entry_t *elts = (const apr_table_entry_t *)arr->elts;
+    int i, id;
+
+    memset(ix->slots, 0, nids * sizeof(*ix->slots));
+    for (i = 0; i < arr->nelts; ++i) {
+        if (!elts[i].key) {
+            continue;
+        }
+        id = request_var_lookup(elts[i].key, strlen(elts[i].key));
+        if (id >= 0 && id < nids && !ix->slots[id].key) {
+            ix->slots[id].key = elts[i].key;
+            ix->slots[id].idx = i;
+        }
+    }
+    ix->elts = elts;
+    ix->nelts = arr->nelts;
+    ix->last_key = arr->nelts ? elts[arr->nelts - 1].key : NULL;
+    ix->last_val = arr->nelts ? elts[arr->nelts - 1].val : NULL;
+}
+
+AP_DECLARE(const char *) ap_request_header_in(request_rec *r,
+                                              ap_header_id_e id)
+{
+    return ap_request_table_get(r, r->headers_in, id,
+                                request_headers[id].name);
+}
+
+AP_DECLARE(void) ap_request_table_index(request_rec *r, const apr_table_t *t)
+{
+    struct ap_request_var_memo *memo = request_var_memo(r);
+    request_table_index *ix;
+
+    if (!memo) {
+        return;
+    }
+    for (ix = memo->indexes; ix; ix = ix->next) {
+        if (ix->t == t) {
+            break;
+        }
+    }
+    if (!ix) {
+        ix = apr_palloc(r->pool, sizeof(*ix));
+        ix->t = t;
+        ix->slots = apr_palloc(r->pool, memo->nids * sizeof(*ix->slots));
+        ix->next = memo->indexes;
+        memo->indexes = ix;
+    }
+    request_table_reindex(ix, apr_table_elts(t), memo->nids);
+}
+
+AP_DECLARE(const char *) ap_request_table_get(request_rec *r,
+                                              const apr_table_t *t,
+                                              int id, const char *key)
+{
+    const apr_array_header_t *arr = apr_table_elts(t);
+    const apr_table_entry_t *elts = (const apr_table_entry_t *)arr->elts;
+    struct ap_request_var_memo *memo;
+    request_var_memo_entry *e;
+    request_table_index *ix;
+    int i;
+
+    if (id < 0 || !(memo = request_var_memo(r)) || id >= memo->nids) {
+        return apr_table_get(t, key);
+    }
+
+    for (ix = memo->indexes; ix; ix = ix->next) {
+        if (ix->t == t) {
+            const request_table_slot *slot = &ix->slots[id];
+
+            if (ix->elts != elts || ix->nelts != arr->nelts
+                    || (arr->nelts && (elts[arr->nelts - 1].key != ix->last_key
+                                       || elts[arr->nelts - 1].val
+                                              != ix->last_val))
+                    || (slot->key && elts[slot->idx].key != slot->key)) {
+                request_table_reindex(ix, arr, memo->nids);
+            }
+            return slot->key ? elts[slot->idx].val : NULL;
+        }
+    }
+
+    for (e = memo->ids[id]; e; e = e->next) {
+        if (e->t == t) {
+            break;
+        }
+    }
+    if (e && e->elts == elts && e->nelts == arr->nelts
+            && (!arr->nelts || (elts[arr->nelts - 1].key == e->last_key
+                                && elts[arr->nelts - 1].val == e->last_val))
+            && (e->idx < 0 || (elts[e->idx].key == e->key
+                               && elts[e->idx].val == e->val))) {
+        return e->val;
+    }
+
+    if (!e) {
+        e = apr_palloc(r->pool, sizeof(*e));
+        e->t = t;
+        e->next = memo->ids[id];
+        memo->ids[id] = e;
+    }
+    e->elts = elts;
+    e->nelts = arr->nelts;
+    e->last_key = arr->nelts ? elts[arr->nelts - 1].key : NULL;
+    e->last_val = arr->nelts ? elts[arr->nelts - 1].val : NULL;
+    e->idx = -1;
+    e->key = NULL;
+    e->val = NULL;
+    for (i = 0; i < arr->nelts; ++i) {
+        if (elts[i].key && !strcasecmp(elts[i].key, key)) {
+            e->idx = i;
+            e->key = elts[i].key;
+            e->val = elts[i].val;
+            break;
+        }
+    }
+    return e->val;
+}
@@ -76,6 +76,54 @@
  */
 #include "test_char.h"
 
+/* The HTTP field scanners below look at 16 (SSE2) or 32 (AVX2) bytes at a
+ * time where the compiler targets it.  Their loads are aligned and may read
+ * past the terminating NUL up to the end of its block, which never crosses
+ * a page but would upset AddressSanitizer, so it gets the scalar loops.
+ */
+#if !APR_CHARSET_EBCDIC && (defined(__SSE2__) || defined(_M_X64) \
+                            || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#if defined(__SANITIZE_ADDRESS__)
+#define AP_SCAN_NO_SIMD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define AP_SCAN_NO_SIMD
+#endif
+#endif
+#ifndef AP_SCAN_NO_SIMD
+#define AP_SCAN_SIMD 1
+#endif
+#endif
+
+#if AP_SCAN_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 32
+typedef __m256i scan_vec;
+#define scan_load(p)      _mm256_load_si256((const __m256i *)(p))
+#define scan_set1(c)      _mm256_set1_epi8(c)
+#define scan_eq(a, b)     _mm256_cmpeq_epi8(a, b)
+#define scan_min(a, b)    _mm256_min_epu8(a, b)
+#define scan_or(a, b)     _mm256_or_si256(a, b)
+#define scan_andnot(a, b) _mm256_andnot_si256(a, b)
+#define scan_mask(v)      ((apr_uint32_t)_mm256_movemask_epi8(v))
+#else
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+typedef __m128i scan_vec;
+#define scan_load(p)      _mm_load_si128((const __m128i *)(p))
+#define scan_set1(c)      _mm_set1_epi8(c)
+#define scan_eq(a, b)     _mm_cmpeq_epi8(a, b)
+#define scan_min(a, b)    _mm_min_epu8(a, b)
+#define scan_or(a, b)     _mm_or_si128(a, b)
+#define scan_andnot(a, b) _mm_andnot_si128(a, b)
+#define scan_mask(v)      ((apr_uint32_t)_mm_movemask_epi8(v))
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif /* AP_SCAN_SIMD */
+
 /* Win32/NetWare/OS2 need to check for both forward and back slashes
  * in ap_normalize_path() and ap_escape_url().
  */
@@ -1653,15 +1701,77 @@ AP_DECLARE(const char *) ap_parse_token_list_strict(apr_pool_t *p,
     return NULL;
 }
 
+#if AP_SCAN_SIMD
+static APR_INLINE unsigned int scan_ctz(apr_uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned int)__builtin_ctz(mask);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned int)i;
+#else
+    unsigned int i = 0;
+    for ( ; !(mask & 1); mask >>= 1) {
+        ++i;
+    }
+    return i;
+#endif
+}
+
+/* The bit mask of the bytes of v that stop the scan: the ASCII ctrls but
+ * HT (T_HTTP_CTRLS) if ctrls is set, otherwise anything but VCHAR and
+ * obs-text (!T_VCHAR_OBSTEXT).  NUL is part of both.
+ */
+static APR_INLINE apr_uint32_t scan_stop_mask(scan_vec v, int ctrls)
+{
+    scan_vec stop;
+
+    if (ctrls) {
+        /* unsigned c <= 0x1f, but HT */
+        stop = scan_eq(scan_min(v, scan_set1(0x1f)), v);
+        stop = scan_andnot(scan_eq(v, scan_set1('\t')), stop);
+    }
+    else {
+        /* unsigned c <= 0x20 */
+        stop = scan_eq(scan_min(v, scan_set1(0x20)), v);
+    }
+    return scan_mask(scan_or(stop, scan_eq(v, scan_set1(0x7f))));
+}
+
+static APR_INLINE const char *scan_simd(const char *ptr, int ctrls)
+{
+    /* Start from the aligned block containing ptr, ignoring the bytes
+     * before it, then go block by block until one has a stop byte (at
+     * worst the NUL).
+     */
+    const char *p = (const char *)((apr_uintptr_t)ptr
+                                   & ~(apr_uintptr_t)(SCAN_WIDTH - 1));
+    apr_uint32_t mask = scan_stop_mask(scan_load(p), ctrls) >> (ptr - p);
+
+    while (!mask) {
+        p += SCAN_WIDTH;
+        mask = scan_stop_mask(scan_load(p), ctrls);
+        ptr = p;
+    }
+
+    return ptr + scan_ctz(mask);
+}
+#endif /* AP_SCAN_SIMD */
+
 /* Scan a string for HTTP VCHAR/obs-text characters including HT and SP
  * (as used in header values, for example, in RFC 7230 section 3.2)
  * returning the pointer to the first non-HT ASCII ctrl character.
  */
 AP_DECLARE(const char *) ap_scan_http_field_content(const char *ptr)
 {
+#if AP_SCAN_SIMD
+    return scan_simd(ptr, 1);
+#else
     for ( ; !TEST_CHAR(*ptr, T_HTTP_CTRLS); ++ptr) ;
 
     return ptr;
+#endif
 }
 
 /* Scan a string for HTTP token characters, returning the pointer to
@@ -1679,9 +1789,13 @@ AP_DECLARE(const char *) ap_scan_http_token(const char *ptr)
  */
 AP_DECLARE(const char *) ap_scan_vchar_obstext(const char *ptr)
 {
+#if AP_SCAN_SIMD
+    return scan_simd(ptr, 0);
+#else
     for ( ; TEST_CHAR(*ptr, T_VCHAR_OBSTEXT); ++ptr) ;
 
     return ptr;
+#endif
 }
 
 /* Retrieve a token, spacing over it and returning a pointer to
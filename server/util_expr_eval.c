@@ -79,6 +79,10 @@ static const char *ap_expr_regexec(const char *subject,
 static apr_array_header_t *ap_expr_list_make(ap_expr_eval_ctx_t *ctx,
                                              const ap_expr_t *node);
 
+static const ap_expr_t *ap_expr_compile(ap_expr_parse_ctx_t *ctx,
+                                        const ap_expr_t *node);
+static int ap_expr_exec_program(ap_expr_eval_ctx_t *ctx, const void *prog);
+
 /* define AP_EXPR_DEBUG to log the parse tree when parsing an expression */
 #ifdef AP_EXPR_DEBUG
 static void expr_dump_tree(const ap_expr_t *e, const server_rec *s,
@@ -619,7 +623,7 @@ AP_DECLARE(const char *) ap_expr_parse(apr_pool_t *pool, apr_pool_t *ptemp,
         expr_dump_tree(ctx.expr, NULL, APLOG_NOTICE, 2);
 #endif
 
-    info->root_node = ctx.expr;
+    info->root_node = (ap_expr_t *)ap_expr_compile(&ctx, ctx.expr);
 
     return NULL;
 }
@@ -988,6 +992,12 @@ static void expr_dump_tree(const ap_expr_t *e, const server_rec *s,
     case op_Backref:
         DUMP_IP("op_Backref", e->node_arg1);
         break;
+    /* arg1: pointer, arg2: expr */
+    case op_Program:
+        ap_log_error(MARK, "%*s%s: %pp %pp", indent, " ", "op_Program",
+                     e->node_arg1, e->node_arg2);
+        expr_dump_tree(e->node_arg2, s, loglevel, indent + 2);
+        break;
     default:
         ap_log_error(MARK, "%*sERROR: INVALID OP %d", indent, " ", e->node_op);
         break;
@@ -1105,6 +1115,9 @@ static int ap_expr_eval_cond(ap_expr_eval_ctx_t *ctx, const ap_expr_t *node)
             else
                 result ^= ap_expr_eval_comp(ctx, e1);
             goto out;
+        case op_Program:
+            result ^= ap_expr_exec_program(ctx, e1);
+            goto out;
         default:
             *ctx->err = "Internal evaluation error: Unknown expression node";
             goto out;
@@ -1117,6 +1130,365 @@ out:
     return result;
 }
 
+/*
+ * Expression compiler
+ *
+ * Once parsed, the tree is constant folded: comparisons and concatenations
+ * of literals, and the conditions they make constant, are evaluated once
+ * at parse time.  A boolean expression is then lowered to a flat program
+ * for a single accumulator, where the conditions become jumps, so that
+ * evaluating it does not recurse through the and/or/not nodes.  The leaves
+ * (comparisons and operator calls) still evaluate their words with
+ * ap_expr_eval_word(), whose variable and function nodes already hold the
+ * provider's function and data resolved at parse time.
+ */
+
+typedef enum {
+    bc_True, bc_False, bc_Not,
+    bc_JmpTrue, bc_JmpFalse,    /* jump to insn if acc is true/false */
+    bc_Comp, bc_SSLComp,        /* acc = result of comparison node */
+    bc_UnaryOp, bc_BinaryOp,    /* acc = result of call node */
+    bc_Cond                     /* acc = result of the tree walker */
+} ap_expr_bc_e;
+
+typedef struct {
+    ap_expr_bc_e op;
+    int insn;
+    const ap_expr_t *node;
+} ap_expr_insn_t;
+
+typedef struct {
+    int ninsns;
+    const ap_expr_insn_t *insns;
+} ap_expr_program_t;
+
+static int is_const_word(const ap_expr_t *node)
+{
+    return node->node_op == op_String || node->node_op == op_Digit;
+}
+
+static const ap_expr_t *fold_cond(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node);
+static const ap_expr_t *fold_list(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node);
+
+static const ap_expr_t *fold_make(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node,
+                                  const void *a1, const void *a2)
+{
+    if (a1 == node->node_arg1 && a2 == node->node_arg2) {
+        return node;
+    }
+    return ap_expr_make(node->node_op, a1, a2, ctx);
+}
+
+static const ap_expr_t *fold_word(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node)
+{
+    const ap_expr_t *e1, *e2;
+
+    switch (node->node_op) {
+    case op_Word:
+        return fold_word(ctx, node->node_arg1);
+    case op_Bool:
+        e1 = fold_cond(ctx, node->node_arg1);
+        if (e1->node_op == op_True || e1->node_op == op_False) {
+            return ap_expr_make(op_String,
+                                e1->node_op == op_True ? "true" : "false",
+                                NULL, ctx);
+        }
+        return fold_make(ctx, node, e1, NULL);
+    case op_Concat:
+        e1 = fold_word(ctx, node->node_arg1);
+        e2 = fold_word(ctx, node->node_arg2);
+        if (is_const_word(e1) && is_const_word(e2)) {
+            return ap_expr_make(op_String,
+                                apr_pstrcat(ctx->pool, e1->node_arg1,
+                                            e2->node_arg1, NULL),
+                                NULL, ctx);
+        }
+        return fold_make(ctx, node, e1, e2);
+    case op_StringFuncCall:
+        return fold_make(ctx, node, node->node_arg1,
+                         fold_list(ctx, node->node_arg2));
+    case op_Join:
+        return fold_make(ctx, node, fold_list(ctx, node->node_arg1),
+                         node->node_arg2 ? fold_word(ctx, node->node_arg2)
+                                         : NULL);
+    case op_Sub:
+        return fold_make(ctx, node, fold_word(ctx, node->node_arg1),
+                         node->node_arg2);
+    default:
+        return node;
+    }
+}
+
+static const ap_expr_t *fold_list(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node)
+{
+    switch (node->node_op) {
+    case op_Split:
+        return fold_make(ctx, node, fold_list(ctx, node->node_arg1),
+                         node->node_arg2);
+    case op_ListElement:
+        return fold_make(ctx, node, fold_word(ctx, node->node_arg1),
+                         node->node_arg2 ? fold_list(ctx, node->node_arg2)
+                                         : NULL);
+    case op_ListFuncCall:
+        return fold_make(ctx, node, node->node_arg1,
+                         fold_word(ctx, node->node_arg2));
+    default:
+        return fold_word(ctx, node);
+    }
+}
+
+static const ap_expr_t *fold_comp(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node)
+{
+    const ap_expr_t *e1 = fold_word(ctx, node->node_arg1);
+    const ap_expr_t *e2 = node->node_arg2;
+    const char *s1, *s2;
+    int rc;
+
+    switch (node->node_op) {
+    case op_REG:
+    case op_NRE:
+        /* may set the backreferences, never constant */
+        return fold_make(ctx, node, e1, e2);
+    case op_IN:
+        return fold_make(ctx, node, e1, fold_list(ctx, e2));
+    default:
+        break;
+    }
+
+    e2 = fold_word(ctx, e2);
+    if (!is_const_word(e1) || !is_const_word(e2)) {
+        return fold_make(ctx, node, e1, e2);
+    }
+
+    s1 = e1->node_arg1;
+    s2 = e2->node_arg1;
+    if (ctx->flags & AP_EXPR_FLAG_SSL_EXPR_COMPAT) {
+        rc = strcmplex(s1, s2);
+    }
+    else if (node->node_op >= op_EQ && node->node_op <= op_GE) {
+        rc = intstrcmp(s1, s2);
+    }
+    else {
+        rc = strcmp(s1, s2);
+    }
+    switch (node->node_op) {
+    case op_EQ:
+    case op_STR_EQ:
+        rc = (rc == 0);
+        break;
+    case op_NE:
+    case op_STR_NE:
+        rc = (rc != 0);
+        break;
+    case op_LT:
+    case op_STR_LT:
+        rc = (rc < 0);
+        break;
+    case op_LE:
+    case op_STR_LE:
+        rc = (rc <= 0);
+        break;
+    case op_GT:
+    case op_STR_GT:
+        rc = (rc > 0);
+        break;
+    case op_GE:
+    case op_STR_GE:
+        rc = (rc >= 0);
+        break;
+    default:
+        return fold_make(ctx, node, e1, e2);
+    }
+    return ap_expr_make(rc ? op_True : op_False, NULL, NULL, ctx);
+}
+
+static const ap_expr_t *fold_cond(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *node)
+{
+    const ap_expr_t *e1, *e2;
+
+    switch (node->node_op) {
+    case op_Not:
+        e1 = fold_cond(ctx, node->node_arg1);
+        if (e1->node_op == op_True) {
+            return ap_expr_make(op_False, NULL, NULL, ctx);
+        }
+        if (e1->node_op == op_False) {
+            return ap_expr_make(op_True, NULL, NULL, ctx);
+        }
+        return fold_make(ctx, node, e1, NULL);
+    case op_And:
+    case op_Or:
+        /* Only the left side can be dropped from a constant right side,
+         * the other way around would skip the side effects (backrefs).
+         */
+        e1 = fold_cond(ctx, node->node_arg1);
+        if (e1->node_op == op_True || e1->node_op == op_False) {
+            if ((e1->node_op == op_True) == (node->node_op == op_Or)) {
+                return e1;
+            }
+            return fold_cond(ctx, node->node_arg2);
+        }
+        e2 = fold_cond(ctx, node->node_arg2);
+        if (e2->node_op == (node->node_op == op_And ? op_True : op_False)) {
+            return e1;
+        }
+        return fold_make(ctx, node, e1, e2);
+    case op_Comp:
+        e1 = fold_comp(ctx, node->node_arg1);
+        if (e1->node_op == op_True || e1->node_op == op_False) {
+            return e1;
+        }
+        return fold_make(ctx, node, e1, NULL);
+    case op_UnaryOpCall:
+        return fold_make(ctx, node, node->node_arg1,
+                         fold_word(ctx, node->node_arg2));
+    case op_BinaryOpCall:
+        e2 = node->node_arg2;
+        return fold_make(ctx, node, node->node_arg1,
+                         fold_make(ctx, e2, fold_word(ctx, e2->node_arg1),
+                                   fold_word(ctx, e2->node_arg2)));
+    default:
+        return node;
+    }
+}
+
+static void compile_cond(apr_array_header_t *code, unsigned int flags,
+                         const ap_expr_t *node)
+{
+    ap_expr_insn_t *insn;
+    int jmp;
+
+    switch (node->node_op) {
+    case op_Not:
+        compile_cond(code, flags, node->node_arg1);
+        insn = apr_array_push(code);
+        insn->op = bc_Not;
+        return;
+    case op_Or:
+    case op_And:
+        compile_cond(code, flags, node->node_arg1);
+        jmp = code->nelts;
+        insn = apr_array_push(code);
+        insn->op = (node->node_op == op_Or) ? bc_JmpTrue : bc_JmpFalse;
+        compile_cond(code, flags, node->node_arg2);
+        /* skip the right side with acc unchanged */
+        APR_ARRAY_IDX(code, jmp, ap_expr_insn_t).insn = code->nelts;
+        return;
+    default:
+        break;
+    }
+
+    insn = apr_array_push(code);
+    insn->node = node;
+    switch (node->node_op) {
+    case op_True:
+        insn->op = bc_True;
+        break;
+    case op_False:
+        insn->op = bc_False;
+        break;
+    case op_Comp:
+        insn->op = (flags & AP_EXPR_FLAG_SSL_EXPR_COMPAT) ? bc_SSLComp
+                                                          : bc_Comp;
+        insn->node = node->node_arg1;
+        break;
+    case op_UnaryOpCall:
+        insn->op = bc_UnaryOp;
+        break;
+    case op_BinaryOpCall:
+        insn->op = bc_BinaryOp;
+        break;
+    default:
+        insn->op = bc_Cond;
+        break;
+    }
+}
+
+static const ap_expr_t *ap_expr_compile(ap_expr_parse_ctx_t *ctx,
+                                        const ap_expr_t *node)
+{
+    apr_array_header_t *code;
+    ap_expr_program_t *prog;
+
+    if (!node) {
+        return NULL;
+    }
+    if (ctx->flags & AP_EXPR_FLAG_STRING_RESULT) {
+        return fold_word(ctx, node);
+    }
+
+    code = apr_array_make(ctx->ptemp, 16, sizeof(ap_expr_insn_t));
+    compile_cond(code, ctx->flags, fold_cond(ctx, node));
+
+    prog = apr_palloc(ctx->pool, sizeof(*prog));
+    prog->ninsns = code->nelts;
+    prog->insns = apr_pmemdup(ctx->pool, code->elts,
+                              code->nelts * sizeof(ap_expr_insn_t));
+    return ap_expr_make(op_Program, prog, node, ctx);
+}
+
+static int ap_expr_exec_program(ap_expr_eval_ctx_t *ctx, const void *p)
+{
+    const ap_expr_program_t *prog = p;
+    const ap_expr_insn_t *insn = prog->insns;
+    const ap_expr_insn_t *end = insn + prog->ninsns;
+    const ap_expr_t *node;
+    int acc = FALSE;
+
+    while (insn < end) {
+        node = insn->node;
+        switch (insn->op) {
+        case bc_True:
+            acc = TRUE;
+            break;
+        case bc_False:
+            acc = FALSE;
+            break;
+        case bc_Not:
+            acc = !acc;
+            break;
+        case bc_JmpTrue:
+            if (acc) {
+                insn = prog->insns + insn->insn;
+                continue;
+            }
+            break;
+        case bc_JmpFalse:
+            if (!acc) {
+                insn = prog->insns + insn->insn;
+                continue;
+            }
+            break;
+        case bc_Comp:
+            acc = ap_expr_eval_comp(ctx, node);
+            break;
+        case bc_SSLComp:
+            acc = ssl_expr_eval_comp(ctx, node);
+            break;
+        case bc_UnaryOp:
+            acc = ap_expr_eval_unary_op(ctx, node->node_arg1,
+                                        node->node_arg2);
+            break;
+        case bc_BinaryOp:
+            acc = ap_expr_eval_binary_op(ctx, node->node_arg1,
+                                         node->node_arg2);
+            break;
+        default:
+            acc = ap_expr_eval_cond(ctx, node);
+            break;
+        }
+        ++insn;
+    }
+    return acc;
+}
+
 AP_DECLARE(int) ap_expr_exec(request_rec *r, const ap_expr_info_t *info,
                              const char **err)
 {
@@ -1297,10 +1669,39 @@ static void add_vary(ap_expr_eval_ctx_t *ctx, const char *name)
     }
 }
 
+/* The data of the request table functions: the function name and, when
+ * the looked up name is constant, its id for ap_request_table_get().
+ */
+typedef struct {
+    const char *name;
+    const char *arg;
+    int id;
+} req_table_data;
+
+/* Intern the (constant) name looked up in the request tables, so that
+ * the lookups are memoized by ap_request_table_get().
+ */
+static int req_table_parse_arg(ap_expr_lookup_parms *parms)
+{
+    req_table_data *d = apr_palloc(parms->pool, sizeof(*d));
+
+    d->name = *parms->data;
+    d->arg = parms->arg;
+    d->id = parms->arg ? ap_request_var_id(parms->arg) : -1;
+    *parms->data = d;
+    return OK;
+}
+
+static APR_INLINE int req_table_id(const req_table_data *d, const char *arg)
+{
+    return d->arg ? d->id : ap_request_var_id(arg);
+}
+
 static const char *req_table_func(ap_expr_eval_ctx_t *ctx, const void *data,
                                   const char *arg)
 {
-    const char *name = (const char *)data;
+    const req_table_data *d = data;
+    const char *name = d->name;
     apr_table_t *t;
     if (!ctx->r)
         return "";
@@ -1328,7 +1729,7 @@ static const char *req_table_func(ap_expr_eval_ctx_t *ctx, const void *data,
             add_vary(ctx, arg);
         }
     }
-    return apr_table_get(t, arg);
+    return ap_request_table_get(ctx->r, t, req_table_id(d, arg), arg);
 }
 
 static const char *env_func(ap_expr_eval_ctx_t *ctx, const void *data,
@@ -1337,9 +1738,12 @@ static const char *env_func(ap_expr_eval_ctx_t *ctx, const void *data,
     const char *res;
     /* this order is for ssl_expr compatibility */
     if (ctx->r) {
-        if ((res = apr_table_get(ctx->r->notes, arg)) != NULL)
+        int id = req_table_id(data, arg);
+        if ((res = ap_request_table_get(ctx->r, ctx->r->notes, id,
+                                        arg)) != NULL)
             return res;
-        else if ((res = apr_table_get(ctx->r->subprocess_env, arg)) != NULL)
+        else if ((res = ap_request_table_get(ctx->r, ctx->r->subprocess_env,
+                                             id, arg)) != NULL)
             return res;
     }
     return getenv(arg);
@@ -1877,6 +2281,9 @@ static const char *const req_header_header_names[] = {
     "Accept"
 };
 
+/* ap_request_var_id() of req_header_header_names, see ap_expr_init() */
+static int req_header_ids[] = { -1, -1, -1, -1, -1, -1, -1 };
+
 static const char *req_header_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
 {
     const char **const varname = (const char **)data;
@@ -1894,7 +2301,8 @@ static const char *req_header_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
     if (strcasecmp(name, "Host")){
         add_vary(ctx, name);
     }
-    return apr_table_get(ctx->r->headers_in, name);
+    return ap_request_table_get(ctx->r, ctx->r->headers_in,
+                                req_header_ids[index], name);
 }
 
 static const char *const misc_var_names[] = {
@@ -2067,14 +2475,14 @@ static const struct expr_provider_multi var_providers[] = {
 
 static const struct expr_provider_single string_func_providers[] = {
     { osenv_func,           "osenv",          NULL, 0 },
-    { env_func,             "env",            NULL, 0 },
-    { req_table_func,       "resp",           NULL, 0 },
-    { req_table_func,       "req",            NULL, 0 },
+    { env_func,             "env",            req_table_parse_arg, 0 },
+    { req_table_func,       "resp",           req_table_parse_arg, 0 },
+    { req_table_func,       "req",            req_table_parse_arg, 0 },
     /* 'http' as alias for 'req' for compatibility with ssl_expr */
-    { req_table_func,       "http",           NULL, 0 },
-    { req_table_func,       "note",           NULL, 0 },
-    { req_table_func,       "reqenv",         NULL, 0 },
-    { req_table_func,       "req_novary",     NULL, 0 },
+    { req_table_func,       "http",           req_table_parse_arg, 0 },
+    { req_table_func,       "note",           req_table_parse_arg, 0 },
+    { req_table_func,       "reqenv",         req_table_parse_arg, 0 },
+    { req_table_func,       "req_novary",     req_table_parse_arg, 0 },
     { tolower_func,         "tolower",        NULL, 0 },
     { toupper_func,         "toupper",        NULL, 0 },
     { escape_func,          "escape",         NULL, 0 },
@@ -2172,13 +2580,11 @@ static int core_expr_lookup(ap_expr_lookup_parms *parms)
                         return !OK;
                     }
                     *parms->func = prov->func;
+                    *parms->data = prov->name;
                     if (prov->arg_parsing_func) {
                         return prov->arg_parsing_func(parms);
                     }
-                    else {
-                        *parms->data = prov->name;
-                        return OK;
-                    }
+                    return OK;
                 }
                 prov++;
             }
@@ -2236,6 +2642,12 @@ static int ap_expr_post_config(apr_pool_t *pconf, apr_pool_t *plog,
 
 void ap_expr_init(apr_pool_t *p)
 {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(req_header_ids) / sizeof(int)); ++i) {
+        req_header_ids[i] = ap_request_var_id(req_header_header_names[i]);
+    }
+
     ap_hook_expr_lookup(core_expr_lookup, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_expr_lookup(expr_lookup_not_found, NULL, NULL, APR_HOOK_REALLY_LAST);
     ap_hook_post_config(ap_expr_post_config, NULL, NULL, APR_HOOK_MIDDLE);
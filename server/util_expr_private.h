@@ -70,7 +70,13 @@ typedef enum {
     op_UnaryOpCall, op_UnaryOpInfo,
     op_BinaryOpCall, op_BinaryOpInfo, op_BinaryOpArgs,
     op_StringFuncCall, op_StringFuncInfo,
-    op_ListFuncCall, op_ListFuncInfo
+    op_ListFuncCall, op_ListFuncInfo,
+    /*
+     * The root of a boolean expression once compiled by ap_expr_parse().
+     * node_arg1 is the program evaluated in place of the tree, node_arg2
+     * the parse tree it was compiled from.
+     */
+    op_Program
 } ap_expr_node_op_e;
 
 /** The basic parse tree node */
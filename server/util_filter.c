@@ -71,6 +71,28 @@ struct spare_data {
 };
 APR_RING_HEAD(spare_ring, spare_data);
 
+/* The buffers of ap_acquire_buffer() are allocated from the connection's
+ * bucket allocator, preceded by this header which links them back to their
+ * spare_buffers (or the next spare buffer while they are unused).  Both
+ * can outlive c->pool (a bucket might be destroyed after it), so the
+ * spare_buffers are allocated from the bucket allocator too and freed
+ * once the connection is gone and all the buffers are back.
+ */
+struct spare_buffers {
+    apr_bucket_alloc_t *alloc;
+    struct buffer_header *first;
+    apr_size_t count;           /* spare buffers */
+    apr_size_t nout;            /* buffers in use */
+    int closed;                 /* c->pool cleaned up */
+};
+struct buffer_header {
+    struct spare_buffers *sb;
+    struct buffer_header *next;
+};
+#define BUFFER_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(struct buffer_header))
+#define BUFFER_SIZE (APR_BUCKET_BUFF_SIZE - BUFFER_HEADER_SIZE)
+#define BUFFER_MAX_SPARE 16
+
 struct ap_filter_conn_ctx {
     struct pending_ring *pending_input_filters;
     struct pending_ring *pending_output_filters;
@@ -79,6 +101,8 @@ struct ap_filter_conn_ctx {
                       *spare_brigades,
                       *spare_filters,
                       *dead_filters;
+
+    struct spare_buffers *spare_buffers;
 };
 
 typedef struct filter_trie_node filter_trie_node;
@@ -385,6 +409,113 @@ AP_DECLARE(void) ap_release_brigade(conn_rec *c, apr_bucket_brigade *bb)
     put_spare(c, bb, &x->spare_brigades);
 }
 
+static void spare_buffers_free(struct spare_buffers *sb)
+{
+    while (sb->first) {
+        struct buffer_header *h = sb->first;
+        sb->first = h->next;
+        apr_bucket_free(h);
+    }
+    sb->count = 0;
+    if (!sb->nout) {
+        apr_bucket_free(sb);
+    }
+}
+
+static apr_status_t spare_buffers_cleanup(void *arg)
+{
+    struct ap_filter_conn_ctx *x = arg;
+    struct spare_buffers *sb = x->spare_buffers;
+
+    /* Buffers still in use will be freed when released */
+    x->spare_buffers = NULL;
+    sb->closed = 1;
+    spare_buffers_free(sb);
+
+    return APR_SUCCESS;
+}
+
+static void put_buffer(struct buffer_header *h)
+{
+    struct spare_buffers *sb = h->sb;
+
+    AP_DEBUG_ASSERT(sb->nout > 0);
+    sb->nout--;
+    if (sb->closed || sb->count >= BUFFER_MAX_SPARE) {
+        apr_bucket_free(h);
+        if (sb->closed && !sb->nout) {
+            spare_buffers_free(sb);
+        }
+        return;
+    }
+    h->next = sb->first;
+    sb->first = h;
+    sb->count++;
+}
+
+static void buffer_bucket_free(void *data)
+{
+    put_buffer((struct buffer_header *)((char *)data - BUFFER_HEADER_SIZE));
+}
+
+AP_DECLARE(char *) ap_acquire_buffer(conn_rec *c, apr_size_t *size)
+{
+    struct ap_filter_conn_ctx *x = get_conn_ctx(c);
+    struct spare_buffers *sb = x->spare_buffers;
+    struct buffer_header *h;
+
+    if (!sb) {
+        sb = apr_bucket_alloc(sizeof(*sb), c->bucket_alloc);
+        memset(sb, 0, sizeof(*sb));
+        sb->alloc = c->bucket_alloc;
+        apr_pool_cleanup_register(c->pool, x, spare_buffers_cleanup,
+                                  apr_pool_cleanup_null);
+        x->spare_buffers = sb;
+    }
+
+    h = sb->first;
+    if (h) {
+        sb->first = h->next;
+        sb->count--;
+    }
+    else {
+        h = apr_bucket_alloc(APR_BUCKET_BUFF_SIZE, sb->alloc);
+        h->sb = sb;
+    }
+    h->next = NULL;
+    sb->nout++;
+
+    *size = BUFFER_SIZE;
+    return (char *)h + BUFFER_HEADER_SIZE;
+}
+
+AP_DECLARE(void) ap_release_buffer(conn_rec *c, char *buf)
+{
+    struct buffer_header *h;
+
+    h = (struct buffer_header *)(buf - BUFFER_HEADER_SIZE);
+    if (h->sb->alloc != c->bucket_alloc) {
+        /* Recycling it here would race with its own connection, which
+         * may be handled by another thread, so rather leak it.
+         */
+        ap_log_cerror(APLOG_MARK, APLOG_ERR, 0, c, APLOGNO(10379)
+                      "ap_release_buffer: buffer not acquired by this "
+                      "connection, leaked");
+        return;
+    }
+    put_buffer(h);
+}
+
+AP_DECLARE(apr_bucket *) ap_buffer_bucket_create(conn_rec *c, char *buf,
+                                                 apr_size_t len)
+{
+    AP_DEBUG_ASSERT(len <= BUFFER_SIZE);
+
+    /* A heap bucket does not copy the data, nor does its setaside */
+    return apr_bucket_heap_create(buf, len, buffer_bucket_free,
+                                  c->bucket_alloc);
+}
+
 static apr_status_t request_filter_cleanup(void *arg)
 {
     ap_filter_t *f = arg;
@@ -23,6 +23,7 @@
 #include "apr.h"
 #include "apr_strings.h"
 #include "apr_lib.h"
+#include "apr_hash.h"
 #include "apr_version.h"
 
 #define APR_WANT_STRFUNC
@@ -34,6 +35,7 @@
 #include "http_log.h"
 #include "http_vhost.h"
 #include "http_protocol.h"
+#include "http_request.h"
 #include "http_core.h"
 #include "http_main.h"
 
@@ -54,11 +56,47 @@
  * lists of name-vhosts.
  */
 typedef struct name_chain name_chain;
+typedef struct name_index name_index;
 struct name_chain {
     name_chain *next;
     server_addr_rec *sar;       /* the record causing it to be in
                                  * this chain (needed for port comparisons) */
     server_rec *server;         /* the server to use on a match */
+    name_index *index;          /* if non-NULL (first entry only), the
+                                 * lookup tables for this chain */
+};
+
+/* When more than a few name-vhosts share an address, walking the name_chain
+ * and comparing every ServerName/ServerAlias gets expensive, so the chain is
+ * indexed at config time.  The tables map the (lowercased) names to the
+ * positions in the chain where they appear, in ascending order, such that
+ * the lookup finds the same (first) match as the walk does.  Wildcard
+ * aliases of the form "*.domain" are indexed by their ".domain" suffix,
+ * which is looked up at each label boundary of the requested name, the
+ * other wildcards are still matched one by one.
+ */
+#ifndef NAME_INDEX_MIN
+#define NAME_INDEX_MIN 16
+#endif
+
+typedef struct name_index_entry name_index_entry;
+struct name_index_entry {
+    name_index_entry *next;
+    int pos;                    /* position in the name_chain */
+};
+
+typedef struct {
+    const char *pattern;
+    int pos;
+} name_index_wild;
+
+struct name_index {
+    name_chain **chain;         /* the name_chain entries, by position */
+    int nelts;
+    apr_hash_t *names;          /* ServerName and ServerAlias */
+    apr_hash_t *suffixes;       /* "*.domain" ServerAlias, by ".domain" */
+    apr_hash_t *virthosts;      /* names from the VirtualHost line */
+    apr_array_header_t *wild;   /* other wildcard ServerAlias, by position */
 };
 
 /* meta-list of ip addresses.  Each server_rec can be in possibly multiple
@@ -383,6 +421,7 @@ static name_chain *new_name_chain(apr_pool_t *p,
     new->server = s;
     new->sar = sar;
     new->next = NULL;
+    new->index = NULL;
     return new;
 }
 
@@ -561,6 +600,117 @@ static void add_name_vhost_config(apr_pool_t *p, server_rec *main_s,
    }
 }
 
+static void add_name_index_entry(apr_pool_t *p, apr_hash_t *ht,
+                                 const char *name, int pos)
+{
+    name_index_entry *e;
+    char *key;
+
+    key = apr_pstrdup(p, name);
+    ap_str_tolower(key);
+
+    /* Called by descending positions, prepend to keep the list sorted */
+    e = apr_hash_get(ht, key, APR_HASH_KEY_STRING);
+    if (e && e->pos == pos) {
+        return;
+    }
+    e = apr_pcalloc(p, sizeof(*e));
+    e->pos = pos;
+    e->next = apr_hash_get(ht, key, APR_HASH_KEY_STRING);
+    apr_hash_set(ht, key, APR_HASH_KEY_STRING, e);
+}
+
+/* Can this wildcard be looked up by its suffix? */
+static APR_INLINE int is_suffix_wildcard(const char *name)
+{
+    return name[0] == '*' && name[1] == '.' && !strpbrk(name + 1, "*?");
+}
+
+static void build_name_index(apr_pool_t *p, name_chain *names)
+{
+    name_index *ni;
+    name_chain *nc;
+    int i, pos, n = 0;
+
+    for (nc = names; nc; nc = nc->next) {
+        ++n;
+    }
+    if (n < NAME_INDEX_MIN) {
+        return;
+    }
+
+    ni = apr_pcalloc(p, sizeof(*ni));
+    ni->chain = apr_palloc(p, n * sizeof(name_chain *));
+    ni->nelts = n;
+    ni->names = apr_hash_make(p);
+    ni->suffixes = apr_hash_make(p);
+    ni->virthosts = apr_hash_make(p);
+    ni->wild = apr_array_make(p, 0, sizeof(name_index_wild));
+
+    for (pos = 0, nc = names; nc; nc = nc->next, ++pos) {
+        apr_array_header_t *wild_names = nc->server->wild_names;
+
+        ni->chain[pos] = nc;
+        if (wild_names) {
+            char **name = (char **)wild_names->elts;
+            for (i = 0; i < wild_names->nelts; ++i) {
+                if (name[i] && !is_suffix_wildcard(name[i])) {
+                    name_index_wild *w = apr_array_push(ni->wild);
+                    w->pattern = name[i];
+                    w->pos = pos;
+                }
+            }
+        }
+    }
+
+    for (pos = n - 1; pos >= 0; --pos) {
+        server_rec *s = ni->chain[pos]->server;
+        apr_array_header_t *aliases = s->names;
+        apr_array_header_t *wild_names = s->wild_names;
+
+        add_name_index_entry(p, ni->virthosts,
+                             ni->chain[pos]->sar->virthost, pos);
+        add_name_index_entry(p, ni->names, s->server_hostname, pos);
+        if (aliases) {
+            char **name = (char **)aliases->elts;
+            for (i = 0; i < aliases->nelts; ++i) {
+                if (name[i]) {
+                    add_name_index_entry(p, ni->names, name[i], pos);
+                }
+            }
+        }
+        if (wild_names) {
+            char **name = (char **)wild_names->elts;
+            for (i = 0; i < wild_names->nelts; ++i) {
+                if (name[i] && is_suffix_wildcard(name[i])) {
+                    add_name_index_entry(p, ni->suffixes, name[i] + 1, pos);
+                }
+            }
+        }
+    }
+
+    names->index = ni;
+}
+
+static void build_name_indexes(apr_pool_t *p)
+{
+    ipaddr_chain *ic;
+    int i;
+
+    for (i = 0; i < IPHASH_TABLE_SIZE; ++i) {
+        for (ic = iphash_table[i]; ic; ic = ic->next) {
+            if (ic->names) {
+                build_name_index(p, ic->names);
+            }
+        }
+    }
+    for (ic = default_list; ic; ic = ic->next) {
+        if (ic->names) {
+            build_name_index(p, ic->names);
+        }
+    }
+}
+
 /* compile the tables and such we need to do the run-time vhost lookups */
 AP_DECLARE(void) ap_fini_vhost_config(apr_pool_t *p, server_rec *main_s)
 {
@@ -677,6 +827,11 @@ AP_DECLARE(void) ap_fini_vhost_config(apr_pool_t *p, server_rec *main_s)
         }
     }
 
+    /* Now that every vhost has a ServerName, index the large name-vhost
+     * chains.
+     */
+    build_name_indexes(p);
+
 #ifdef IPHASH_STATISTICS
     dump_iphash_statistics(main_s);
 #endif
@@ -929,6 +1084,72 @@ static int matches_aliases(server_rec *s, const char *host)
 }
 
 
+/* return the first position below best of the name in ht with a port
+ * matching, or best if none
+ */
+static APR_INLINE int name_index_first(const name_index *ni, apr_hash_t *ht,
+                                       const char *key, apr_ssize_t klen,
+                                       apr_port_t port, int best)
+{
+    name_index_entry *e = apr_hash_get(ht, key, klen);
+
+    for (; e && e->pos < best; e = e->next) {
+        server_addr_rec *sar = ni->chain[e->pos]->sar;
+        if (sar->host_port == 0 || port == sar->host_port) {
+            return e->pos;
+        }
+    }
+    return best;
+}
+
+/* The indexed equivalent of walking the name_chain with matches_aliases()
+ * and, if asked to, with the VirtualHost names as fallback.
+ */
+static server_rec *name_index_lookup(const name_index *ni, apr_pool_t *p,
+                                     const char *host, apr_port_t port,
+                                     int with_virthost)
+{
+    char buf[256], *lhost;
+    apr_size_t len = strlen(host), i;
+    int best = ni->nelts;
+
+    lhost = (len < sizeof(buf)) ? buf : apr_palloc(p, len + 1);
+    for (i = 0; i <= len; ++i) {
+        lhost[i] = apr_tolower(host[i]);
+    }
+
+    best = name_index_first(ni, ni->names, lhost, len, port, best);
+    for (i = 0; i < len; ++i) {
+        if (lhost[i] == '.') {
+            best = name_index_first(ni, ni->suffixes, lhost + i, len - i,
+                                    port, best);
+        }
+    }
+    if (ni->wild->nelts) {
+        name_index_wild *w = (name_index_wild *)ni->wild->elts;
+        for (i = 0; i < (apr_size_t)ni->wild->nelts && w[i].pos < best; ++i) {
+            server_addr_rec *sar = ni->chain[w[i].pos]->sar;
+            if ((sar->host_port == 0 || port == sar->host_port)
+                && !ap_strcasecmp_match(lhost, w[i].pattern)) {
+                best = w[i].pos;
+                break;
+            }
+        }
+    }
+    if (best < ni->nelts) {
+        return ni->chain[best]->server;
+    }
+
+    if (with_virthost) {
+        best = name_index_first(ni, ni->virthosts, lhost, len, port, best);
+        if (best < ni->nelts) {
+            return ni->chain[best]->server;
+        }
+    }
+    return NULL;
+}
+
+
 /* Suppose a request came in on the same socket as this r, and included
  * a header "Host: host:port", would it map to r->server?  It's more
  * than just that though.  When we do the normal matches for each request
@@ -1010,6 +1231,15 @@ static int update_server_from_aliases(request_rec *r)
 
     port = r->connection->local_addr->port;
 
+    src = r->connection->vhost_lookup_data;
+    if (src && src->index) {
+        s = name_index_lookup(src->index, r->pool, host, port, 1);
+        if (s) {
+            goto found;
+        }
+        return HTTP_BAD_REQUEST;
+    }
+
     /* Recall that the name_chain is a list of server_addr_recs, some of
      * whose ports may not match.  Also each server may appear more than
      * once in the chain -- specifically, it will appear once for each
@@ -1019,7 +1249,7 @@ static int update_server_from_aliases(request_rec *r)
      * a single server are adjacent to each other.
      */
 
-    for (src = r->connection->vhost_lookup_data; src; src = src->next) {
+    for (; src; src = src->next) {
         server_addr_rec *sar;
 
         /* We only consider addresses on the name_chain which have a matching
@@ -1160,7 +1390,7 @@ AP_DECLARE(void) ap_update_vhost_from_headers(request_rec *r)
 AP_DECLARE(int) ap_update_vhost_from_headers_ex(request_rec *r, int require_match)
 {
     core_server_config *conf = ap_get_core_module_config(r->server->module_config);
-    const char *host_header = apr_table_get(r->headers_in, "Host");
+    const char *host_header = ap_request_header_in(r, AP_HEADER_HOST);
     int is_v6literal = 0;
     int have_hostname_from_url = 0;
     int rc = HTTP_OK;
@@ -1261,6 +1491,42 @@ AP_DECLARE(int) ap_vhost_iterate_given_conn(conn_rec *conn,
     return rv;
 }
 
+AP_DECLARE(server_rec *) ap_vhost_lookup_name(conn_rec *conn,
+                                              const char *name)
+{
+    server_rec *s;
+    server_rec *last_s;
+    name_chain *src;
+    apr_port_t port;
+
+    src = conn->vhost_lookup_data;
+    if (!src) {
+        return matches_aliases(conn->base_server, name) ? conn->base_server
+                                                        : NULL;
+    }
+
+    port = conn->local_addr->port;
+    if (src->index) {
+        return name_index_lookup(src->index, conn->pool, name, port, 0);
+    }
+
+    last_s = NULL;
+    for (; src; src = src->next) {
+        server_addr_rec *sar = src->sar;
+
+        if (sar->host_port != 0 && port != sar->host_port) {
+            continue;
+        }
+
+        s = src->server;
+        if (s != last_s && matches_aliases(s, name)) {
+            return s;
+        }
+        last_s = s;
+    }
+    return NULL;
+}
+
 /* Called for a new connection which has a known local_addr.  Note that the
  * new connection is assumed to have conn->server == main server.
  */
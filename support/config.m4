@@ -7,6 +7,7 @@ ab_LTFLAGS=""
 checkgid_LTFLAGS=""
 htcacheclean_LTFLAGS=""
 httxt2dbm_LTFLAGS=""
+httxt2idx_LTFLAGS=""
 fcgistarter_LTFLAGS=""
 firehose_LTFLAGS=""
 
@@ -21,6 +22,7 @@ if test "$enableval" = "yes" ; then
   APR_ADDTO(checkgid_LTFLAGS, [-static])
   APR_ADDTO(htcacheclean_LTFLAGS, [-static])
   APR_ADDTO(httxt2dbm_LTFLAGS, [-static])
+  APR_ADDTO(httxt2idx_LTFLAGS, [-static])
   APR_ADDTO(fcgistarter_LTFLAGS, [-static])
   APR_ADDTO(firehose_LTFLAGS, [-static])
 fi
@@ -107,6 +109,15 @@ fi
 ])
 APACHE_SUBST(httxt2dbm_LTFLAGS)
 
+AC_ARG_ENABLE(static-httxt2idx,APACHE_HELP_STRING(--enable-static-httxt2idx,Build a statically linked version of httxt2idx),[
+if test "$enableval" = "yes" ; then
+  APR_ADDTO(httxt2idx_LTFLAGS, [-static])
+else
+  APR_REMOVEFROM(httxt2idx_LTFLAGS, [-static])
+fi
+])
+APACHE_SUBST(httxt2idx_LTFLAGS)
+
 AC_ARG_ENABLE(static-fcgistarter,APACHE_HELP_STRING(--enable-static-fcgistarter,Build a statically linked version of fcgistarter),[
 if test "$enableval" = "yes" ; then
   APR_ADDTO(fcgistarter_LTFLAGS, [-static])
@@ -0,0 +1,386 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * httxt2idx.c: simple program for compiling RewriteMap text files to the
+ * indexed (idx:) format of the Apache HTTP server, see
+ * modules/mappers/rewrite_idx_common.h
+ *
+ */
+
+#include "apr.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_pools.h"
+#include "apr_hash.h"
+#include "apr_tables.h"
+#include "apr_getopt.h"
+
+#define APR_WANT_STRFUNC
+#define APR_WANT_MEMFUNC
+#include "apr_want.h"
+
+#include "../modules/mappers/rewrite_idx_common.h"
+
+#if APR_HAVE_STDLIB_H
+#include <stdlib.h> /* for atexit() */
+#endif
+
+static const char *input;
+static const char *output;
+static const char *shortname;
+static apr_file_t *errfile;
+static int verbose;
+
+/* From mod_rewrite.c */
+#ifndef REWRITE_MAX_TXT_MAP_LINE
+#define REWRITE_MAX_TXT_MAP_LINE 1024
+#endif
+
+#define NL APR_EOL_STR
+
+typedef struct {
+    const char *key;
+    const char *val;
+    apr_uint32_t klen;
+    apr_uint32_t vlen;
+    apr_uint32_t hash;
+} record_t;
+
+static void usage(void)
+{
+    apr_file_printf(errfile,
+    "%s -- Program to Create Indexed Files for use by RewriteMap" NL
+    "Usage: %s [-v] -i SOURCE_TXT -o OUTPUT_IDX" NL
+    NL
+    "Options: " NL
+    " -v    More verbose output" NL
+    NL
+    " -i    Source Text File. If '-', use stdin." NL
+    NL
+    " -o    Output File, replaced atomically." NL
+    NL,
+    shortname,
+    shortname);
+}
+
+/* Parse the text map like mod_rewrite does, the first value of a key wins */
+static apr_status_t read_txt(apr_array_header_t *records, apr_file_t *fp,
+                             apr_pool_t *pool)
+{
+    char line[REWRITE_MAX_TXT_MAP_LINE + 1]; /* +1 for \0 */
+    apr_hash_t *seen = apr_hash_make(pool);
+    apr_status_t rv;
+
+    while ((rv = apr_file_gets(line, sizeof(line), fp)) == APR_SUCCESS) {
+        char *c, *key, *value;
+        record_t *rec;
+
+        if (*line == '#' || apr_isspace(*line)) {
+            continue;
+        }
+
+        c = line;
+
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (!*c) {
+            /* no value. solid line of data. */
+            continue;
+        }
+
+        key = line;
+        *c++ = '\0';
+
+        while (apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (!*c) {
+            continue;
+        }
+
+        value = c;
+
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (apr_hash_get(seen, key, APR_HASH_KEY_STRING)) {
+            if (verbose) {
+                apr_file_printf(errfile, "    '%s' ignored (duplicate)" NL,
+                                key);
+            }
+            continue;
+        }
+
+        rec = apr_array_push(records);
+        rec->klen = (apr_uint32_t)strlen(key);
+        rec->vlen = (apr_uint32_t)(c - value);
+        rec->key = apr_pstrmemdup(pool, key, rec->klen);
+        rec->val = apr_pstrmemdup(pool, value, rec->vlen);
+        rec->hash = rewrite_idx_hash(rec->key, rec->klen);
+        apr_hash_set(seen, rec->key, rec->klen, rec);
+
+        if (verbose) {
+            apr_file_printf(errfile, "    '%s' -> '%s'" NL,
+                            rec->key, rec->val);
+        }
+    }
+
+    return APR_STATUS_IS_EOF(rv) ? APR_SUCCESS : rv;
+}
+
+static apr_status_t write_idx(apr_array_header_t *records, apr_file_t *fp,
+                              apr_pool_t *pool)
+{
+    record_t *recs = (record_t *)records->elts;
+    unsigned char *buckets, header[REWRITE_IDX_HEADER_LEN];
+    apr_uint32_t nbuckets = 2, mask, i;
+    apr_uint64_t offset;
+    apr_size_t len;
+    apr_status_t rv;
+
+    /* at most half full */
+    while (nbuckets < (apr_uint32_t)records->nelts * 2) {
+        if (nbuckets > 0x40000000U / REWRITE_IDX_BUCKET_LEN) {
+            return APR_ENOSPC;
+        }
+        nbuckets <<= 1;
+    }
+    mask = nbuckets - 1;
+    len = (apr_size_t)nbuckets * REWRITE_IDX_BUCKET_LEN;
+    buckets = apr_pcalloc(pool, len);
+
+    offset = REWRITE_IDX_HEADER_LEN + (apr_uint64_t)len;
+    for (i = 0; i < (apr_uint32_t)records->nelts; ++i) {
+        apr_uint32_t b = recs[i].hash & mask;
+
+        while (rewrite_idx_get32(buckets + b * REWRITE_IDX_BUCKET_LEN + 4)) {
+            b = (b + 1) & mask;
+        }
+        if (offset > APR_UINT32_MAX) {
+            /* offsets are 32bit */
+            return APR_ENOSPC;
+        }
+        rewrite_idx_put32(buckets + b * REWRITE_IDX_BUCKET_LEN,
+                          recs[i].hash);
+        rewrite_idx_put32(buckets + b * REWRITE_IDX_BUCKET_LEN + 4,
+                          (apr_uint32_t)offset);
+        offset += REWRITE_IDX_RECORD_LEN + recs[i].klen + recs[i].vlen;
+    }
+
+    memcpy(header, REWRITE_IDX_MAGIC, REWRITE_IDX_MAGIC_LEN);
+    rewrite_idx_put32(header + REWRITE_IDX_MAGIC_LEN, nbuckets);
+    rewrite_idx_put32(header + REWRITE_IDX_MAGIC_LEN + 4,
+                      (apr_uint32_t)records->nelts);
+    if ((rv = apr_file_write_full(fp, header, sizeof(header),
+                                  NULL)) != APR_SUCCESS
+            || (rv = apr_file_write_full(fp, buckets, len,
+                                         NULL)) != APR_SUCCESS) {
+        return rv;
+    }
+
+    for (i = 0; i < (apr_uint32_t)records->nelts; ++i) {
+        unsigned char rec[REWRITE_IDX_RECORD_LEN];
+
+        rewrite_idx_put32(rec, recs[i].klen);
+        rewrite_idx_put32(rec + 4, recs[i].vlen);
+        if ((rv = apr_file_write_full(fp, rec, sizeof(rec),
+                                      NULL)) != APR_SUCCESS
+                || (rv = apr_file_write_full(fp, recs[i].key, recs[i].klen,
+                                             NULL)) != APR_SUCCESS
+                || (rv = apr_file_write_full(fp, recs[i].val, recs[i].vlen,
+                                             NULL)) != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    return apr_file_flush(fp);
+}
+
+int main(int argc, const char *const argv[])
+{
+    apr_pool_t *pool;
+    apr_status_t rv = APR_SUCCESS;
+    apr_getopt_t *opt;
+    const char *opt_arg;
+    char ch;
+    apr_file_t *infile, *outfile;
+    apr_array_header_t *records;
+    char *tmpname;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+
+    verbose = 0;
+    input = NULL;
+    output = NULL;
+
+    apr_pool_create(&pool, NULL);
+
+    if (argc) {
+        shortname = apr_filepath_name_get(argv[0]);
+    }
+    else {
+        shortname = "httxt2idx";
+    }
+
+    apr_file_open_stderr(&errfile, pool);
+    rv = apr_getopt_init(&opt, pool, argc, argv);
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile, "Error: apr_getopt_init failed." NL NL);
+        return 1;
+    }
+
+    if (argc <= 1) {
+        usage();
+        return 1;
+    }
+
+    while ((rv = apr_getopt(opt, "vi::o::", &ch, &opt_arg)) == APR_SUCCESS) {
+        switch (ch) {
+        case 'v':
+            if (verbose) {
+                apr_file_printf(errfile, "Error: -v can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            verbose = 1;
+            break;
+        case 'i':
+            if (input) {
+                apr_file_printf(errfile, "Error: -i can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            input = apr_pstrdup(pool, opt_arg);
+            break;
+        case 'o':
+            if (output) {
+                apr_file_printf(errfile, "Error: -o can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            output = apr_pstrdup(pool, opt_arg);
+            break;
+        }
+    }
+
+    if (rv != APR_EOF) {
+        apr_file_printf(errfile, "Error: Parsing Arguments Failed" NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!input) {
+        apr_file_printf(errfile, "Error: No input file specified." NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!output) {
+        apr_file_printf(errfile, "Error: No output file specified." NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!strcmp(input, "-")) {
+        rv = apr_file_open_stdin(&infile, pool);
+    }
+    else {
+        rv = apr_file_open(&infile, input, APR_READ|APR_BUFFERED,
+                           APR_OS_DEFAULT, pool);
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Cannot open input file '%s': (%d) %pm" NL NL,
+                         input, rv, &rv);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Input File: %s" NL, input);
+    }
+
+    records = apr_array_make(pool, 1024, sizeof(record_t));
+    rv = read_txt(records, infile, pool);
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Reading input file '%s': (%d) %pm" NL NL,
+                         input, rv, &rv);
+        return 1;
+    }
+
+    /* Written aside then renamed over the output, so that the server
+     * never maps a partial file and picks up the new one as a whole.
+     */
+    tmpname = apr_pstrcat(pool, output, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&outfile, tmpname,
+                         APR_CREATE|APR_WRITE|APR_EXCL|APR_BUFFERED|APR_BINARY,
+                         pool);
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Cannot create temporary file '%s': (%d) %pm"
+                        NL NL, tmpname, rv, &rv);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Temporary File: %s" NL, tmpname);
+    }
+
+    rv = write_idx(records, outfile, pool);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_close(outfile);
+    }
+    else {
+        apr_file_close(outfile);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_perms_set(tmpname, APR_FPROT_UREAD | APR_FPROT_UWRITE
+                                         | APR_FPROT_GREAD | APR_FPROT_WREAD);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmpname, output, pool);
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Writing output file '%s': (%d) %pm" NL NL,
+                         output, rv, &rv);
+        apr_file_remove(tmpname, pool);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Output File: %s (%d keys)" NL
+                        "Conversion Complete." NL, output, records->nelts);
+    }
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+time-expr.c measures the evaluation time of boolean ap_expr expressions,
+as compiled by ap_expr_parse() (constant folded and lowered to a flat
+program) and as plain parse trees walked recursively like before, and
+checks that both give the same results.
+
+argv[1] is the #iterations over the set of expressions below, or over
+the single expression given as argv[2].  The request they are evaluated
+against is built by hand (see make_request()), so only the variables
+and functions using the fields set there are meaningful.
+
+build it from a configured build tree with:
+
+make test/time-expr
+
+then eg.
+
+./test/time-expr 1000000
+./test/time-expr 1000000 "%{REQUEST_URI} =~ m#^/api/# && -n req('Cookie')"
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr.h"
+#include "apr_hooks.h"
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_time.h"
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_main.h"
+#include "ap_expr.h"
+
+#include "../server/util_expr_private.h"
+
+static const char *expressions[] = {
+    "%{HTTP_HOST} == 'www.example.com' && %{REQUEST_METHOD} in {'GET', 'HEAD'}",
+    "!(req('X-User') == 'admin' || req('X-User') == 'root') "
+        "&& %{REQUEST_URI} =~ m#^/private/#",
+    "%{REQUEST_METHOD} == 'POST' "
+        "|| (-n req('Authorization') && %{REQUEST_URI} -strmatch '/api/*')",
+    "'1' -eq '1' && %{REQUEST_URI} != '/' "
+        "&& ('a' . 'b' == 'ab' || %{HTTP_HOST} == 'example.org')",
+    "tolower(req('Accept')) =~ /json/ "
+        "|| %{REQUEST_URI} in {'/a', '/b', '/c', '/d'}",
+    NULL
+};
+
+static request_rec *make_request(apr_pool_t *p)
+{
+    request_rec *r = apr_pcalloc(p, sizeof(*r));
+
+    r->pool = p;
+    r->server = apr_pcalloc(p, sizeof(server_rec));
+    r->connection = apr_pcalloc(p, sizeof(conn_rec));
+    r->connection->pool = p;
+    r->connection->base_server = r->server;
+    r->method = "GET";
+    r->uri = "/api/v1/items";
+    r->unparsed_uri = r->uri;
+    r->headers_in = apr_table_make(p, 8);
+    r->headers_out = apr_table_make(p, 8);
+    r->subprocess_env = apr_table_make(p, 8);
+    apr_table_setn(r->headers_in, "Host", "www.example.com");
+    apr_table_setn(r->headers_in, "Accept", "Application/JSON");
+    apr_table_setn(r->headers_in, "Authorization", "Basic Zm9vOmJhcg==");
+    apr_table_setn(r->headers_in, "X-User", "guest");
+    return r;
+}
+
+static apr_time_t run(request_rec *r, const ap_expr_info_t *info, int n,
+                      int *result)
+{
+    apr_pool_t *p;
+    apr_time_t start = apr_time_now();
+    const char *err;
+    int i;
+
+    apr_pool_create(&p, r->pool);
+    r->pool = p;
+    for (i = 0; i < n; ++i) {
+        *result = ap_expr_exec(r, info, &err);
+        if (*result < 0) {
+            fprintf(stderr, "evaluation failed: %s\n", err);
+            exit(1);
+        }
+        apr_pool_clear(p);
+    }
+    r->pool = apr_pool_parent_get(p);
+    apr_pool_destroy(p);
+
+    return apr_time_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    apr_pool_t *pool;
+    request_rec *r;
+    const char **exprs, *single[2];
+    int iterations, i;
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s #iterations [expression]\n", argv[0]);
+        return 1;
+    }
+    iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        fprintf(stderr, "#iterations must be positive\n");
+        return 1;
+    }
+    if (argc > 2) {
+        single[0] = argv[2];
+        single[1] = NULL;
+        exprs = single;
+    }
+    else {
+        exprs = expressions;
+    }
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+    apr_hook_global_pool = ap_pglobal = pool;
+    ap_expr_init(pool);
+    r = make_request(pool);
+
+    for (i = 0; exprs[i]; ++i) {
+        ap_expr_info_t compiled, tree;
+        apr_time_t t_compiled, t_tree;
+        int rc_compiled, rc_tree;
+        const char *err;
+
+        memset(&compiled, 0, sizeof(compiled));
+        compiled.flags = AP_EXPR_FLAG_DONT_VARY;
+        err = ap_expr_parse(pool, pool, &compiled, exprs[i], NULL);
+        if (err) {
+            fprintf(stderr, "failed to parse \"%s\": %s\n", exprs[i], err);
+            return 1;
+        }
+        /* the parse tree the program was compiled from */
+        tree = compiled;
+        tree.root_node = (ap_expr_t *)compiled.root_node->node_arg2;
+
+        t_tree = run(r, &tree, iterations, &rc_tree);
+        t_compiled = run(r, &compiled, iterations, &rc_compiled);
+        if (rc_tree != rc_compiled) {
+            fprintf(stderr, "results differ for \"%s\": %d (tree) != %d\n",
+                    exprs[i], rc_tree, rc_compiled);
+            return 1;
+        }
+        printf("%s\n    => %d, tree: %.0f ns/eval, compiled: %.0f ns/eval "
+               "(%.2fx)\n", exprs[i], rc_compiled,
+               (double)t_tree * 1000 / iterations,
+               (double)t_compiled * 1000 / iterations,
+               t_compiled ? (double)t_tree / t_compiled : 0.0);
+    }
+
+    apr_pool_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+time-fdqueue.c measures the push/pop throughput of the fd queue used by
+the event and worker MPMs (server/mpm_fdqueue.c), the same way the MPMs
+use it: the producer (listener) reserves an idle worker with
+ap_queue_info_wait_for_idler() before pushing, consumers (workers) mark
+themselves idle with ap_queue_info_set_idle() before popping.  As in the
+MPMs there is a single producer, ap_queue_info_wait_for_idler() is not
+meant to be called concurrently.
+
+argv[1] is the #consumers and argv[2] is the #iterations.  Run it over
+1..128 consumers and pick #iter such that each run lasts at least a
+second.  With a non-zero optional argv[3] the queue is a work stealing
+one (ap_queue_create_sharded(), as with EventWorkStealing) with a shard
+per consumer, each shard being popped by a single thread, and the
+producer only waits for room in the shards (ap_queue_wait_for_room())
+instead of reserving an idle worker; this needs the lock-free queue.
+
+build it from a configured build tree with:
+
+make test/time-fdqueue
+
+which uses the queue selected by configure, that is the lock-free one with
+--enable-lockfree-fdqueue and the mutex one otherwise.  To compare both,
+copy it as time-fdqueue-mutex and time-fdqueue-lockfree from two build
+trees, or compile them by hand with:
+
+gcc -o time-fdqueue-mutex -O2 -I../include -I../os/unix \
+    `apr-1-config --includes --cppflags` \
+    time-fdqueue.c ../server/mpm_fdqueue.c `apr-1-config --link-ld --libs`
+gcc -o time-fdqueue-lockfree -O2 -DAP_FDQUEUE_LOCKFREE -I../include \
+    -I../os/unix `apr-1-config --includes --cppflags` \
+    time-fdqueue.c ../server/mpm_fdqueue.c `apr-1-config --link-ld --libs`
+
+then compare eg.
+
+for n in 1 2 4 8 16 32 64 128; do ./time-fdqueue-mutex $n 1000000; done
+for n in 1 2 4 8 16 32 64 128; do ./time-fdqueue-lockfree $n 1000000; done
+for n in 1 2 4 8 16 32 64 128; do ./time-fdqueue-lockfree $n 1000000 1; done
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apr.h"
+#include "apr_atomic.h"
+#include "apr_errno.h"
+#include "apr_pools.h"
+#include "apr_thread_proc.h"
+#include "apr_time.h"
+
+#include "mpm_fdqueue.h"
+
+#if !APR_HAS_THREADS
+#error "time-fdqueue requires APR thread support"
+#endif
+
+static fd_queue_t *queue;
+static fd_queue_info_t *queue_info;
+static apr_pool_t *dummy_pool;
+static int iterations;
+static int nshards;
+static apr_uint32_t volatile consumed;
+
+static void * APR_THREAD_FUNC producer(apr_thread_t *thd, void *data)
+{
+    int i;
+
+    for (i = 0; i < iterations; ++i) {
+        if (nshards > 1) {
+            if (ap_queue_wait_for_room(queue, NULL) != APR_SUCCESS) {
+                fprintf(stderr, "ap_queue_wait_for_room failed\n");
+                exit(1);
+            }
+        }
+        else if (ap_queue_info_wait_for_idler(queue_info,
+                                              NULL) != APR_SUCCESS) {
+            fprintf(stderr, "ap_queue_info_wait_for_idler failed\n");
+            exit(1);
+        }
+        if (ap_queue_push_socket(queue, NULL, NULL,
+                                 dummy_pool) != APR_SUCCESS) {
+            fprintf(stderr, "ap_queue_push_socket failed\n");
+            exit(1);
+        }
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static void * APR_THREAD_FUNC consumer(apr_thread_t *thd, void *data)
+{
+    unsigned int shard = (unsigned int)(apr_uintptr_t)data;
+    apr_socket_t *sd;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    for (;;) {
+        /* Counted idle by a work stealing queue */
+        if (nshards == 1) {
+            ap_queue_info_set_idle(queue_info, NULL);
+        }
+        do {
+            /* Still idle when interrupted, like the MPMs' workers */
+            rv = ap_queue_pop_something_ex(queue, shard, &sd, NULL, &p, NULL);
+        } while (APR_STATUS_IS_EINTR(rv));
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+        apr_atomic_inc32(&consumed);
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    apr_pool_t *pool;
+    apr_thread_t *producer_thd, **consumers;
+    apr_status_t rv;
+    apr_time_t start, elapsed;
+    int nconsumers, i;
+    apr_uint64_t total;
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s #consumers #iterations [sharded]\n",
+                argv[0]);
+        return 1;
+    }
+    nconsumers = atoi(argv[1]);
+    iterations = atoi(argv[2]);
+    if (nconsumers <= 0 || iterations <= 0) {
+        fprintf(stderr, "#consumers and #iterations must be positive\n");
+        return 1;
+    }
+    /* A shard must be popped by a single thread */
+    nshards = (argc > 3 && atoi(argv[3])) ? nconsumers : 1;
+#ifndef AP_FDQUEUE_LOCKFREE
+    if (nshards > 1) {
+        fprintf(stderr, "a sharded queue needs the lock-free queue\n");
+        return 1;
+    }
+#endif
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+    dummy_pool = pool;
+
+    /* Sized like the MPMs do, one slot per worker */
+    if ((rv = ap_queue_create_sharded(&queue, nconsumers, nshards,
+                                      pool)) != APR_SUCCESS
+            || (rv = ap_queue_info_create(&queue_info, pool, nconsumers,
+                                          -1)) != APR_SUCCESS) {
+        fprintf(stderr, "failed to create the queue (%d)\n", rv);
+        return 1;
+    }
+
+    consumers = apr_palloc(pool, nconsumers * sizeof(*consumers));
+
+    start = apr_time_now();
+    for (i = 0; i < nconsumers; ++i) {
+        apr_thread_create(&consumers[i], NULL, consumer,
+                          (void *)(apr_uintptr_t)(i % nshards), pool);
+    }
+    apr_thread_create(&producer_thd, NULL, producer, NULL, pool);
+    apr_thread_join(&rv, producer_thd);
+    ap_queue_term(queue);
+    for (i = 0; i < nconsumers; ++i) {
+        apr_thread_join(&rv, consumers[i]);
+    }
+    elapsed = apr_time_now() - start;
+
+    total = iterations;
+    if (apr_atomic_read32(&consumed) != total) {
+        fprintf(stderr, "lost elements: pushed %" APR_UINT64_T_FMT
+                ", popped %u\n", total, apr_atomic_read32(&consumed));
+        return 1;
+    }
+    printf("%d consumers, %d shards: %" APR_UINT64_T_FMT " ops in "
+           "%" APR_TIME_T_FMT " usecs, %.0f ops/sec\n",
+           nconsumers, nshards, total, elapsed,
+           elapsed ? (double)total * APR_USEC_PER_SEC / elapsed : 0.0);
+
+    apr_pool_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,314 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../httpdunit.h"
+
+#include "httpd.h"
+#include "http_core.h"
+#include "http_main.h"
+#include "http_request.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static request_rec *g_request;
+
+static void request_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+
+    /* Where ap_request_var_id() registers the names (for good) */
+    if (!ap_pglobal && apr_pool_create(&ap_pglobal, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+
+    /* Stub out just enough of a request_rec for the memo of
+     * ap_request_table_get(), which lives in the core's request config.
+     */
+    g_request = apr_pcalloc(g_pool, sizeof(*g_request));
+    g_request->pool = g_pool;
+    g_request->headers_in = apr_table_make(g_pool, 2);
+    g_request->notes = apr_table_make(g_pool, 2);
+    g_request->request_config = apr_pcalloc(g_pool, sizeof(void *));
+    core_module.module_index = 0; /* for AP_DEBUG's AP_CORE_MODULE_INDEX */
+    ap_set_core_module_config(g_request->request_config,
+                              apr_pcalloc(g_pool,
+                                          sizeof(core_request_config)));
+}
+
+static void request_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * ap_request_var_id() of the well known header names
+ */
+
+struct header_id_case {
+    const char *name;
+    int id;
+};
+
+static const struct header_id_case header_id_cases[] = {
+    { "Accept", AP_HEADER_ACCEPT },
+    { "Accept-Charset", AP_HEADER_ACCEPT_CHARSET },
+    { "Accept-Encoding", AP_HEADER_ACCEPT_ENCODING },
+    { "Accept-Language", AP_HEADER_ACCEPT_LANGUAGE },
+    { "Accept-Ranges", AP_HEADER_ACCEPT_RANGES },
+    { "Age", AP_HEADER_AGE },
+    { "Allow", AP_HEADER_ALLOW },
+    { "Authorization", AP_HEADER_AUTHORIZATION },
+    { "Cache-Control", AP_HEADER_CACHE_CONTROL },
+    { "Connection", AP_HEADER_CONNECTION },
+    { "Content-Disposition", AP_HEADER_CONTENT_DISPOSITION },
+    { "Content-Encoding", AP_HEADER_CONTENT_ENCODING },
+    { "Content-Language", AP_HEADER_CONTENT_LANGUAGE },
+    { "Content-Length", AP_HEADER_CONTENT_LENGTH },
+    { "Content-Location", AP_HEADER_CONTENT_LOCATION },
+    { "Content-Range", AP_HEADER_CONTENT_RANGE },
+    { "Content-Type", AP_HEADER_CONTENT_TYPE },
+    { "Cookie", AP_HEADER_COOKIE },
+    { "Date", AP_HEADER_DATE },
+    { "ETag", AP_HEADER_ETAG },
+    { "Expect", AP_HEADER_EXPECT },
+    { "Expires", AP_HEADER_EXPIRES },
+    { "Forwarded", AP_HEADER_FORWARDED },
+    { "Host", AP_HEADER_HOST },
+    { "If-Match", AP_HEADER_IF_MATCH },
+    { "If-Modified-Since", AP_HEADER_IF_MODIFIED_SINCE },
+    { "If-None-Match", AP_HEADER_IF_NONE_MATCH },
+    { "If-Range", AP_HEADER_IF_RANGE },
+    { "If-Unmodified-Since", AP_HEADER_IF_UNMODIFIED_SINCE },
+    { "Keep-Alive", AP_HEADER_KEEP_ALIVE },
+    { "Last-Modified", AP_HEADER_LAST_MODIFIED },
+    { "Location", AP_HEADER_LOCATION },
+    { "Max-Forwards", AP_HEADER_MAX_FORWARDS },
+    { "Origin", AP_HEADER_ORIGIN },
+    { "Pragma", AP_HEADER_PRAGMA },
+    { "Proxy-Authenticate", AP_HEADER_PROXY_AUTHENTICATE },
+    { "Proxy-Authorization", AP_HEADER_PROXY_AUTHORIZATION },
+    { "Range", AP_HEADER_RANGE },
+    { "Referer", AP_HEADER_REFERER },
+    { "Retry-After", AP_HEADER_RETRY_AFTER },
+    { "Server", AP_HEADER_SERVER },
+    { "Set-Cookie", AP_HEADER_SET_COOKIE },
+    { "TE", AP_HEADER_TE },
+    { "Trailer", AP_HEADER_TRAILER },
+    { "Transfer-Encoding", AP_HEADER_TRANSFER_ENCODING },
+    { "Upgrade", AP_HEADER_UPGRADE },
+    { "User-Agent", AP_HEADER_USER_AGENT },
+    { "Vary", AP_HEADER_VARY },
+    { "Via", AP_HEADER_VIA },
+    { "WWW-Authenticate", AP_HEADER_WWW_AUTHENTICATE },
+    { "X-Forwarded-For", AP_HEADER_X_FORWARDED_FOR },
+    { "X-Forwarded-Host", AP_HEADER_X_FORWARDED_HOST },
+    { "X-Forwarded-Proto", AP_HEADER_X_FORWARDED_PROTO },
+    { "X-Requested-With", AP_HEADER_X_REQUESTED_WITH },
+};
+
+static const size_t header_id_cases_len = sizeof(header_id_cases) /
+                                          sizeof(header_id_cases[0]);
+
+START_TEST(all_well_known_headers_have_an_id)
+{
+    ck_assert_int_eq(header_id_cases_len, AP_HEADER__COUNT);
+}
+END_TEST
+
+HTTPD_START_LOOP_TEST(well_known_header_ids_are_case_insensitive, header_id_cases_len)
+{
+    const struct header_id_case *c = &header_id_cases[_i];
+    char lower[32], upper[32];
+    size_t i;
+
+    for (i = 0; c->name[i]; ++i) {
+        lower[i] = apr_tolower(c->name[i]);
+        upper[i] = apr_toupper(c->name[i]);
+    }
+    lower[i] = upper[i] = '\0';
+
+    ck_assert_int_eq(ap_request_var_id(c->name), c->id);
+    ck_assert_int_eq(ap_request_var_id(lower), c->id);
+    ck_assert_int_eq(ap_request_var_id(upper), c->id);
+}
+END_TEST
+
+/*
+ * ap_request_table_index() and ap_request_table_get() after changes to
+ * the table
+ */
+
+static const char *header_in(ap_header_id_e id, const char *name)
+{
+    return ap_request_table_get(g_request, g_request->headers_in, id, name);
+}
+
+#define HOST()      header_in(AP_HEADER_HOST, "Host")
+#define ACCEPT()    header_in(AP_HEADER_ACCEPT, "Accept")
+#define RANGE()     header_in(AP_HEADER_RANGE, "Range")
+
+static void index_headers_in(void)
+{
+    apr_table_setn(g_request->headers_in, "Host", "a");
+    apr_table_setn(g_request->headers_in, "Accept", "b");
+    ap_request_table_index(g_request, g_request->headers_in);
+
+    ck_assert_str_eq(HOST(), "a");
+    ck_assert_str_eq(ACCEPT(), "b");
+    ck_assert_ptr_eq(RANGE(), NULL);
+}
+
+START_TEST(indexed_table_sees_set)
+{
+    index_headers_in();
+
+    /* in place */
+    apr_table_setn(g_request->headers_in, "Host", "c");
+    ck_assert_str_eq(HOST(), "c");
+
+    /* added */
+    apr_table_setn(g_request->headers_in, "Range", "r");
+    ck_assert_str_eq(RANGE(), "r");
+    ck_assert_str_eq(HOST(), "c");
+    ck_assert_str_eq(ACCEPT(), "b");
+}
+END_TEST
+
+START_TEST(indexed_table_sees_unset)
+{
+    index_headers_in();
+
+    apr_table_unset(g_request->headers_in, "Host");
+    ck_assert_ptr_eq(HOST(), NULL);
+    ck_assert_str_eq(ACCEPT(), "b");
+
+    apr_table_unset(g_request->headers_in, "Accept");
+    ck_assert_ptr_eq(ACCEPT(), NULL);
+
+    apr_table_setn(g_request->headers_in, "Host", "c");
+    ck_assert_str_eq(HOST(), "c");
+
+    apr_table_clear(g_request->headers_in);
+    ck_assert_ptr_eq(HOST(), NULL);
+}
+END_TEST
+
+START_TEST(indexed_table_sees_merge)
+{
+    index_headers_in();
+
+    apr_table_merge(g_request->headers_in, "Host", "c");
+    ck_assert_str_eq(HOST(), "a, c");
+
+    apr_table_mergen(g_request->headers_in, "Accept", "d");
+    ck_assert_str_eq(ACCEPT(), "b, d");
+
+    apr_table_merge(g_request->headers_in, "Range", "r");
+    ck_assert_str_eq(RANGE(), "r");
+}
+END_TEST
+
+START_TEST(indexed_table_sees_reallocated_elts)
+{
+    const apr_array_header_t *arr;
+    const char *elts;
+    int i;
+
+    index_headers_in();
+    arr = apr_table_elts(g_request->headers_in);
+    elts = arr->elts;
+
+    /* Grow the table beyond its initial size (2), then get back to the
+     * same entries in the new array.
+     */
+    for (i = 0; arr->elts == elts; ++i) {
+        apr_table_addn(g_request->headers_in,
+                       apr_psprintf(g_pool, "X-Filler-%d", i), "f");
+    }
+    for (; i >= 0; --i) {
+        apr_table_unset(g_request->headers_in,
+                        apr_psprintf(g_pool, "X-Filler-%d", i));
+    }
+    ck_assert_int_eq(arr->nelts, 2);
+    ck_assert_ptr_ne(arr->elts, elts);
+    ck_assert_str_eq(HOST(), "a");
+    ck_assert_str_eq(ACCEPT(), "b");
+
+    apr_table_setn(g_request->headers_in, "Host", "c");
+    ck_assert_str_eq(HOST(), "c");
+}
+END_TEST
+
+START_TEST(indexed_table_sees_replaced_last_entry)
+{
+    index_headers_in();
+
+    /* Same count, different last key */
+    apr_table_unset(g_request->headers_in, "Accept");
+    apr_table_setn(g_request->headers_in, "Range", "r");
+    ck_assert_ptr_eq(ACCEPT(), NULL);
+    ck_assert_str_eq(RANGE(), "r");
+
+    /* Same last key, different value */
+    apr_table_setn(g_request->headers_in, "Range", "s");
+    ck_assert_str_eq(RANGE(), "s");
+
+    /* Same name (another string), same count */
+    apr_table_unset(g_request->headers_in, "Range");
+    apr_table_addn(g_request->headers_in, apr_pstrdup(g_pool, "range"), "t");
+    ck_assert_str_eq(RANGE(), "t");
+}
+END_TEST
+
+START_TEST(memoized_table_sees_changes)
+{
+    apr_table_t *t = g_request->notes;
+    int id = ap_request_var_id("X-Unit-Test-Note");
+
+    ck_assert_int_ge(id, AP_HEADER__COUNT);
+
+    apr_table_setn(t, "X-Unit-Test-Note", "a");
+    apr_table_setn(t, "Other", "o");
+    ck_assert_str_eq(ap_request_table_get(g_request, t, id,
+                                          "X-Unit-Test-Note"), "a");
+
+    apr_table_setn(t, "X-Unit-Test-Note", "b");
+    ck_assert_str_eq(ap_request_table_get(g_request, t, id,
+                                          "X-Unit-Test-Note"), "b");
+
+    apr_table_unset(t, "X-Unit-Test-Note");
+    ck_assert_ptr_eq(ap_request_table_get(g_request, t, id,
+                                          "X-Unit-Test-Note"), NULL);
+
+    apr_table_setn(t, "x-unit-test-note", "c");
+    ck_assert_str_eq(ap_request_table_get(g_request, t, id,
+                                          "X-Unit-Test-Note"), "c");
+}
+END_TEST
+
+/*
+ * Test Case Boilerplate
+ */
+HTTPD_BEGIN_TEST_CASE_WITH_FIXTURE(request, request_setup, request_teardown)
+#include "test/unit/request.tests"
+HTTPD_END_TEST_CASE
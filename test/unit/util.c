@@ -17,6 +17,7 @@
 #include "../httpdunit.h"
 
 #include "httpd.h"
+#include "apr_lib.h"
 
 /*
  * Test Fixture -- runs once per test
@@ -79,6 +80,85 @@ HTTPD_START_LOOP_TEST(find_token_correctly_parses_token_list, ap_test_token_case
 }
 END_TEST
 
+/*
+ * ap_scan_http_field_content(), ap_scan_vchar_obstext(), ap_scan_http_token()
+ *
+ * These may be vectorized, check them against the byte-at-a-time definitions
+ * over random strings of any length and alignment.
+ */
+
+static const char *scan_http_field_content(const char *ptr)
+{
+    for ( ; ; ++ptr) {
+        unsigned char c = *ptr;
+        if (!c || (c < 0x20 && c != '\t') || c == 0x7f) {
+            return ptr;
+        }
+    }
+}
+
+static const char *scan_vchar_obstext(const char *ptr)
+{
+    for ( ; ; ++ptr) {
+        unsigned char c = *ptr;
+        if (c <= 0x20 || c == 0x7f) {
+            return ptr;
+        }
+    }
+}
+
+static const char *scan_http_token(const char *ptr)
+{
+    for ( ; *ptr; ++ptr) {
+        if (!apr_isalnum(*ptr) && !strchr("!#$%&'*+-.^_`|~", *ptr)) {
+            break;
+        }
+    }
+    return ptr;
+}
+
+#define SCAN_TEST_ITERATIONS 64
+
+HTTPD_START_LOOP_TEST(scan_functions_match_bytewise_definitions, SCAN_TEST_ITERATIONS)
+{
+    /* the stop bytes, or not, more likely than the others */
+    static const unsigned char edges[] = {
+        0x00, 0x09, 0x0a, 0x0d, 0x1f, 0x20, 0x21, ':', 0x7e, 0x7f, 0x80, 0xff
+    };
+    char buf[256];
+    const char *str;
+    unsigned int seed = 0x5eed + _i;
+    int n;
+
+    for (n = 0; n < 1000; ++n) {
+        apr_size_t off, len, i;
+
+        seed = seed * 1103515245 + 12345;
+        off = (seed >> 8) % 64;
+        seed = seed * 1103515245 + 12345;
+        len = (seed >> 8) % (sizeof(buf) - 64);
+        for (i = 0; i < len; ++i) {
+            seed = seed * 1103515245 + 12345;
+            if (!((seed >> 16) & 7)) {
+                buf[off + i] = edges[(seed >> 20) % sizeof(edges)];
+            }
+            else {
+                buf[off + i] = (char)(0x21 + (seed >> 20) % 0x5e);
+            }
+        }
+        buf[off + len] = '\0';
+
+        str = buf + off;
+        ck_assert_int_eq(ap_scan_http_field_content(str) - str,
+                         scan_http_field_content(str) - str);
+        ck_assert_int_eq(ap_scan_vchar_obstext(str) - str,
+                         scan_vchar_obstext(str) - str);
+        ck_assert_int_eq(ap_scan_http_token(str) - str,
+                         scan_http_token(str) - str);
+    }
+}
+END_TEST
+
 /*
  * Test Case Boilerplate
  */
@@ -0,0 +1,173 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../httpdunit.h"
+
+#include "httpd.h"
+#include "util_filter.h"
+#include "apr_buckets.h"
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static apr_bucket_alloc_t *g_alloc;
+static conn_rec *g_conn;
+
+static void util_filter_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_alloc = apr_bucket_alloc_create(g_pool);
+
+    g_conn = apr_pcalloc(g_pool, sizeof(*g_conn));
+    if (apr_pool_create(&g_conn->pool, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_conn->bucket_alloc = g_alloc;
+}
+
+static void util_filter_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * ap_acquire_buffer(), ap_release_buffer() and ap_buffer_bucket_create()
+ */
+
+START_TEST(released_buffers_are_reused)
+{
+    apr_size_t size1, size2;
+    char *buf1, *buf2;
+
+    buf1 = ap_acquire_buffer(g_conn, &size1);
+    ck_assert_ptr_ne(buf1, NULL);
+    ck_assert_uint_gt(size1, 0);
+    memset(buf1, 'x', size1);
+
+    /* A buffer in use is not handed out twice */
+    buf2 = ap_acquire_buffer(g_conn, &size2);
+    ck_assert_ptr_ne(buf2, buf1);
+    ck_assert_uint_eq(size2, size1);
+
+    ap_release_buffer(g_conn, buf2);
+    ap_release_buffer(g_conn, buf1);
+
+    ck_assert_ptr_eq(ap_acquire_buffer(g_conn, &size1), buf1);
+    ck_assert_ptr_eq(ap_acquire_buffer(g_conn, &size2), buf2);
+}
+END_TEST
+
+START_TEST(buffer_of_another_connection_is_refused)
+{
+    conn_rec *c2;
+    apr_size_t size;
+    char *buf;
+
+    c2 = apr_pcalloc(g_pool, sizeof(*c2));
+    ck_assert_int_eq(apr_pool_create(&c2->pool, g_pool), APR_SUCCESS);
+    c2->bucket_alloc = apr_bucket_alloc_create(g_pool);
+
+    buf = ap_acquire_buffer(g_conn, &size);
+    ap_release_buffer(c2, buf);
+
+    /* Not recycled by either connection */
+    ck_assert_ptr_ne(ap_acquire_buffer(c2, &size), buf);
+    ck_assert_ptr_ne(ap_acquire_buffer(g_conn, &size), buf);
+}
+END_TEST
+
+START_TEST(buffer_bucket_is_not_copied)
+{
+    apr_bucket *b;
+    apr_pool_t *p;
+    const char *data;
+    apr_size_t size, len;
+    char *buf;
+
+    buf = ap_acquire_buffer(g_conn, &size);
+    memcpy(buf, "hello", 5);
+    b = ap_buffer_bucket_create(g_conn, buf, 5);
+
+    ck_assert(APR_BUCKET_IS_HEAP(b));
+    ck_assert_int_eq(apr_bucket_read(b, &data, &len, APR_BLOCK_READ),
+                     APR_SUCCESS);
+    ck_assert_ptr_eq(data, buf);
+    ck_assert_uint_eq(len, 5);
+
+    /* Setting aside (e.g. in the core output filter) keeps the buffer */
+    apr_pool_create(&p, g_pool);
+    ck_assert_int_eq(apr_bucket_setaside(b, p), APR_SUCCESS);
+    apr_pool_destroy(p);
+    ck_assert_int_eq(apr_bucket_read(b, &data, &len, APR_BLOCK_READ),
+                     APR_SUCCESS);
+    ck_assert_ptr_eq(data, buf);
+    ck_assert_mem_eq(data, "hello", 5);
+}
+END_TEST
+
+START_TEST(buffer_is_released_with_its_bucket)
+{
+    apr_bucket *b, *e;
+    apr_size_t size;
+    char *buf;
+
+    buf = ap_acquire_buffer(g_conn, &size);
+    b = ap_buffer_bucket_create(g_conn, buf, size);
+
+    /* Still in use while a split part of the bucket is alive */
+    ck_assert_int_eq(apr_bucket_split(b, 1), APR_SUCCESS);
+    e = APR_BUCKET_NEXT(b);
+    apr_bucket_destroy(b);
+    ck_assert_ptr_ne(ap_acquire_buffer(g_conn, &size), buf);
+
+    apr_bucket_destroy(e);
+    ck_assert_ptr_eq(ap_acquire_buffer(g_conn, &size), buf);
+}
+END_TEST
+
+START_TEST(buffer_can_outlive_the_connection_pool)
+{
+    apr_bucket *b;
+    const char *data;
+    apr_size_t size, len;
+    char *buf;
+
+    buf = ap_acquire_buffer(g_conn, &size);
+    memcpy(buf, "hello", 5);
+    b = ap_buffer_bucket_create(g_conn, buf, 5);
+
+    /* The bucket allocator outlives c->pool */
+    apr_pool_destroy(g_conn->pool);
+    g_conn->pool = NULL;
+
+    ck_assert_int_eq(apr_bucket_read(b, &data, &len, APR_BLOCK_READ),
+                     APR_SUCCESS);
+    ck_assert_mem_eq(data, "hello", 5);
+    apr_bucket_destroy(b);
+}
+END_TEST
+
+/*
+ * Test Case Boilerplate
+ */
+HTTPD_BEGIN_TEST_CASE_WITH_FIXTURE(util_filter, util_filter_setup,
+                                   util_filter_teardown)
+#include "test/unit/util_filter.tests"
+HTTPD_END_TEST_CASE